@@ -0,0 +1,339 @@
+// Microbenchmarks for the compositor's hot paths. tinywl.c is compiled in
+// directly so its static functions can be called; everything runs against a
+// display and scene that are never attached to a backend.
+//
+//   ./bench/bench                   print results
+//   ./bench/bench -c baseline.txt   also compare p50 against a baseline
+//   ./bench/bench -w baseline.txt   record a new baseline
+#define main tinywl_main
+#include "../tinywl.c"
+#undef main
+
+#define BENCH_MAX_SAMPLES 2000
+#define BENCH_MAX_RESULTS 64
+#define BENCH_REGRESSION_PCT 10.0
+
+struct bench_result {
+	char name[64];
+	uint64_t p50, p90, p99, max;
+};
+
+static struct bench_result bench_results[BENCH_MAX_RESULTS];
+static int bench_n_results;
+static uint64_t bench_samples[BENCH_MAX_SAMPLES];
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_record(const char *name, int n) {
+	qsort(bench_samples, n, sizeof(bench_samples[0]), compare_u64);
+	struct bench_result *result = &bench_results[bench_n_results++];
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->p50 = bench_samples[n * 50 / 100];
+	result->p90 = bench_samples[n * 90 / 100];
+	result->p99 = bench_samples[n * 99 / 100];
+	result->max = bench_samples[n - 1];
+}
+
+// -------------------------------------------------------------------------
+// Thumbnail: a whole-frame update, as update_thumbnail and its worker do it:
+// the copy out of a client buffer with the given row padding, then the
+// pyramid build. Only the wlr_buffer access around it is left out.
+// -------------------------------------------------------------------------
+static void bench_thumbnail(int width, int height, int padding, int samples) {
+	size_t stride = (size_t)width * 4 + padding;
+	uint8_t *buffer = malloc(stride * height);
+	for (size_t i = 0; i < stride * height; i++) {
+		buffer[i] = i * 2654435761u >> 24;
+	}
+	struct tinywl_toplevel toplevel = {0};
+	thumb_layout(&toplevel, width, height);
+	struct tinywl_thumb_job job = {0};
+	pixman_region32_init(&job.damage);
+	job.shift = toplevel.thumb_shift;
+	for (int i = 0; i < TINYWL_THUMB_LEVELS && toplevel.thumb_levels[i].width != 0; i++) {
+		job.levels[i] = toplevel.thumb_levels[i];
+		job.levels[i].pixels = malloc((size_t)job.levels[i].width * job.levels[i].height * 4);
+		job.deepest = i;
+	}
+
+	for (int s = 0; s < samples; s++) {
+		// Every pixel changed, as with video
+		job.src_valid = false;
+		uint64_t start = monotonic_ns();
+		thumb_copy_src(&job, buffer, stride, width, height);
+		thumb_job_run(&job);
+		bench_samples[s] = monotonic_ns() - start;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "thumbnail_%dx%d_pad%d", width, height, padding);
+	bench_record(name, samples);
+	for (int i = 0; i <= job.deepest; i++) {
+		free(job.levels[i].pixels);
+	}
+	pixman_region32_fini(&job.damage);
+	free(job.src);
+	free(buffer);
+}
+
+// -------------------------------------------------------------------------
+// Fake windows: enough of an xdg toplevel for the state writer and IPC
+// -------------------------------------------------------------------------
+static void bench_add_toplevels(struct tinywl_server *server, int count) {
+	for (int i = 0; i < count; i++) {
+		struct wlr_xdg_toplevel *xdg_toplevel = calloc(1, sizeof(*xdg_toplevel));
+		xdg_toplevel->app_id = strdup("org.example.Bench");
+		char title[64];
+		snprintf(title, sizeof(title), "Bench window %d", i);
+		xdg_toplevel->title = strdup(title);
+
+		struct tinywl_toplevel *toplevel = calloc(1, sizeof(*toplevel));
+		toplevel->server = server;
+		toplevel->xdg_toplevel = xdg_toplevel;
+		toplevel->session_slot = -1;
+		toplevel->docked_side = i % 3;
+		toplevel->maximized = i % 2;
+		wl_list_init(&toplevel->popups);
+		wl_list_init(&toplevel->mru_link);
+		wl_list_init(&toplevel->txn_link);
+		thumb_layout(toplevel, 1280, 720);
+		wl_list_insert(server->toplevels.prev, &toplevel->link);
+	}
+}
+
+static void bench_clear_toplevels(struct tinywl_server *server) {
+	struct tinywl_toplevel *toplevel, *tmp;
+	wl_list_for_each_safe(toplevel, tmp, &server->toplevels, link) {
+		wl_list_remove(&toplevel->link);
+		free(toplevel->xdg_toplevel->app_id);
+		free(toplevel->xdg_toplevel->title);
+		free(toplevel->xdg_toplevel);
+		free(toplevel);
+	}
+}
+
+static void bench_workspace_state(struct tinywl_server *server, int windows, int samples) {
+	bench_add_toplevels(server, windows);
+	for (int s = 0; s < samples; s++) {
+		uint64_t start = monotonic_ns();
+		update_workspace_state(server);
+		bench_samples[s] = monotonic_ns() - start;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "workspace_state_%d", windows);
+	bench_record(name, samples);
+	bench_clear_toplevels(server);
+}
+
+// Writing the action file is not timed; picking it up, parsing and
+// dispatching it is
+static void bench_dock_ipc(struct tinywl_server *server, const char *name,
+		const char *action, int windows, int samples) {
+	bench_add_toplevels(server, windows);
+	struct tinywl_toplevel *last = wl_container_of(server->toplevels.prev, last, link);
+	char line[128];
+	snprintf(line, sizeof(line), action, (void *)last);
+
+	for (int s = 0; s < samples; s++) {
+		FILE *f = runtime_fopen(server, TINYWL_IPC_DIR "/bench", true);
+		fprintf(f, "%s\n", line);
+		fclose(f);
+		uint64_t start = monotonic_ns();
+		handle_dock_ipc(server);
+		bench_samples[s] = monotonic_ns() - start;
+	}
+	bench_record(name, samples);
+	bench_clear_toplevels(server);
+}
+
+// -------------------------------------------------------------------------
+// Hit testing: windows as nested trees with a buffer at the bottom
+// -------------------------------------------------------------------------
+static void bench_buffer_destroy(struct wlr_buffer *buffer) {
+	free(buffer);
+}
+
+static const struct wlr_buffer_impl bench_buffer_impl = {
+	.destroy = bench_buffer_destroy,
+};
+
+static void bench_hit_test(struct tinywl_server *server, int windows, int depth, int samples) {
+	struct wlr_scene_tree *root = wlr_scene_tree_create(server->toplevel_layer);
+	for (int i = 0; i < windows; i++) {
+		struct wlr_scene_tree *tree = wlr_scene_tree_create(root);
+		wlr_scene_node_set_position(&tree->node, (i * 37) % 1120, (i * 53) % 480);
+		for (int d = 1; d < depth; d++) {
+			tree = wlr_scene_tree_create(tree);
+		}
+		struct wlr_buffer *buffer = calloc(1, sizeof(*buffer));
+		wlr_buffer_init(buffer, &bench_buffer_impl, 800, 600);
+		wlr_scene_buffer_create(tree, buffer);
+		wlr_buffer_drop(buffer);
+	}
+
+	uint32_t seed = 1;
+	for (int s = 0; s < samples; s++) {
+		seed = seed * 1103515245 + 12345;
+		double x = seed % 1920;
+		seed = seed * 1103515245 + 12345;
+		double y = seed % 1080;
+		struct wlr_surface *surface = NULL;
+		double sx, sy;
+		uint64_t start = monotonic_ns();
+		desktop_toplevel_at(server, x, y, &surface, &sx, &sy);
+		bench_samples[s] = monotonic_ns() - start;
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "hit_test_%dx%d", windows, depth);
+	bench_record(name, samples);
+	wlr_scene_node_destroy(&root->node);
+}
+
+// -------------------------------------------------------------------------
+// Baselines: one "name p50 p90 p99 max" line per benchmark. A baseline
+// that is missing or unreadable fails the comparison like a regression, and
+// so does every benchmark it has no line for.
+// -------------------------------------------------------------------------
+static int bench_compare(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot read baseline %s: %s; record one with -w\n", path, strerror(errno));
+		return -1;
+	}
+	int regressions = 0, lines = 0;
+	bool compared[BENCH_MAX_RESULTS] = {0};
+	char name[64];
+	unsigned long long p50, p90, p99, max;
+	while (fscanf(f, "%63s %llu %llu %llu %llu", name, &p50, &p90, &p99, &max) == 5) {
+		lines++;
+		for (int i = 0; i < bench_n_results; i++) {
+			if (strcmp(bench_results[i].name, name) != 0) continue;
+			double delta = p50 ? 100.0 * ((double)bench_results[i].p50 - p50) / p50 : 0;
+			bool regressed = delta > BENCH_REGRESSION_PCT;
+			printf("%-32s p50 %+6.1f%% vs baseline%s\n", name, delta, regressed ? "  REGRESSION" : "");
+			regressions += regressed;
+			compared[i] = true;
+		}
+	}
+	bool truncated = !feof(f);
+	fclose(f);
+	if (lines == 0 || truncated) {
+		fprintf(stderr, "Baseline %s is %s\n", path, lines == 0 ? "empty" : "malformed");
+		return -1;
+	}
+	for (int i = 0; i < bench_n_results; i++) {
+		if (!compared[i]) {
+			printf("%-32s not in baseline  MISSING; record it with -w\n", bench_results[i].name);
+			regressions++;
+		}
+	}
+	return regressions;
+}
+
+static int bench_write(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (int i = 0; i < bench_n_results; i++) {
+		struct bench_result *r = &bench_results[i];
+		fprintf(f, "%s %llu %llu %llu %llu\n", r->name, (unsigned long long)r->p50,
+			(unsigned long long)r->p90, (unsigned long long)r->p99, (unsigned long long)r->max);
+	}
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char *compare_path = NULL, *write_path = NULL;
+	int c;
+	while ((c = getopt(argc, argv, "c:w:h")) != -1) {
+		switch (c) {
+		case 'c':
+			compare_path = optarg;
+			break;
+		case 'w':
+			write_path = optarg;
+			break;
+		default:
+			printf("Usage: %s [-c baseline to compare] [-w baseline to write]\n", argv[0]);
+			return 0;
+		}
+	}
+	wlr_log_init(WLR_SILENT, NULL);
+
+	struct tinywl_server server = {0};
+	server.runtime_fd = -1;
+	server.ready_fd = -1;
+	server.startup_watch_fd = -1;
+	char runtime_dir[] = "/tmp/tinywl-bench-XXXXXX";
+	if (mkdtemp(runtime_dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	server.runtime_fd = open(runtime_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	mkdirat(server.runtime_fd, TINYWL_IPC_DIR, 0700);
+	server.wl_display = wl_display_create();
+	server.scene = wlr_scene_create();
+	server.toplevel_layer = wlr_scene_tree_create(&server.scene->tree);
+	server.animation_layer = wlr_scene_tree_create(&server.scene->tree);
+	wl_list_init(&server.animations);
+	wl_list_init(&server.transaction);
+	server.output_layout = wlr_output_layout_create(server.wl_display);
+	server.cursor = wlr_cursor_create();
+	wl_list_init(&server.toplevels);
+	wl_list_init(&server.focus_history);
+	wl_list_init(&server.outputs);
+	server.dock_ipc_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.wl_display),
+		handle_dock_ipc, &server);
+
+	static const int sizes[][3] = {
+		{ 1280, 720, 0 }, { 1280, 720, 256 }, { 1920, 1080, 0 }, { 2560, 1440, 64 }, { 3840, 2160, 0 },
+	};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench_thumbnail(sizes[i][0], sizes[i][1], sizes[i][2], 200);
+	}
+
+	static const int window_counts[] = { 1, 10, 50, 100, 500 };
+	for (size_t i = 0; i < sizeof(window_counts) / sizeof(window_counts[0]); i++) {
+		bench_workspace_state(&server, window_counts[i], window_counts[i] >= 100 ? 200 : 1000);
+	}
+
+	bench_dock_ipc(&server, "dock_ipc_miss_100", "UNDOCK 0x1", 100, 1000);
+	bench_dock_ipc(&server, "dock_ipc_thumb_100", "THUMB %p 290x200", 100, 1000);
+	bench_dock_ipc(&server, "dock_ipc_launch", "LAUNCH", 0, 1000);
+
+	bench_hit_test(&server, 10, 2, 2000);
+	bench_hit_test(&server, 100, 4, 2000);
+	bench_hit_test(&server, 500, 8, 2000);
+
+	printf("%-32s %10s %10s %10s %10s\n", "benchmark (ns)", "p50", "p90", "p99", "max");
+	for (int i = 0; i < bench_n_results; i++) {
+		struct bench_result *r = &bench_results[i];
+		printf("%-32s %10llu %10llu %10llu %10llu\n", r->name, (unsigned long long)r->p50,
+			(unsigned long long)r->p90, (unsigned long long)r->p99, (unsigned long long)r->max);
+	}
+
+	int regressions = compare_path ? bench_compare(compare_path) : 0;
+	if (write_path && bench_write(write_path) != 0) {
+		regressions = -1;
+	}
+
+	wl_event_source_remove(server.dock_ipc_timer);
+	wlr_cursor_destroy(server.cursor);
+	wlr_output_layout_destroy(server.output_layout);
+	wlr_scene_node_destroy(&server.scene->tree.node);
+	wl_display_destroy(server.wl_display);
+	runtime_dir_clear(&server);
+	close(server.runtime_fd);
+	rmdir(runtime_dir);
+	return regressions != 0;
+}
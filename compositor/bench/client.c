@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <xkbcommon/xkbcommon.h>
+#include "client.h"
+
+uint64_t now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+void print_samples(const char *name, uint64_t *samples, int n) {
+	if (n == 0) {
+		printf("%-24s no samples\n", name);
+		return;
+	}
+	qsort(samples, n, sizeof(samples[0]), compare_u64);
+	printf("%-24s n=%-5d p50 %8.1fus  p90 %8.1fus  p99 %8.1fus  max %8.1fus\n", name, n,
+		samples[n * 50 / 100] / 1e3, samples[n * 90 / 100] / 1e3,
+		samples[n * 99 / 100] / 1e3, samples[n - 1] / 1e3);
+}
+
+// -------------------------------------------------------------------------
+// Wayland odds and ends
+// -------------------------------------------------------------------------
+struct wl_buffer *create_buffer(struct wl_shm *shm, int width, int height, uint32_t color) {
+	int stride = width * 4;
+	size_t size = (size_t)stride * height;
+	int fd = memfd_create("bench-shm", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		perror("shm");
+		exit(1);
+	}
+	uint32_t *pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	for (size_t i = 0; i < size / 4; i++) {
+		pixels[i] = color;
+	}
+	munmap(pixels, size);
+	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
+	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, WL_SHM_FORMAT_XRGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	return buffer;
+}
+
+void upload_keymap(struct zwp_virtual_keyboard_v1 *virtual_keyboard) {
+	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = xkb_keymap_new_from_names(context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	char *text = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+	size_t size = strlen(text) + 1;
+
+	int fd = memfd_create("bench-keymap", MFD_CLOEXEC);
+	if (fd < 0 || write(fd, text, size) != (ssize_t)size) {
+		perror("keymap");
+		exit(1);
+	}
+	zwp_virtual_keyboard_v1_keymap(virtual_keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, size);
+	close(fd);
+	free(text);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(context);
+}
+
+static void wm_base_handle_ping(void *data, struct xdg_wm_base *wm_base, uint32_t serial) {
+	xdg_wm_base_pong(wm_base, serial);
+}
+
+const struct xdg_wm_base_listener wm_base_listener = {
+	.ping = wm_base_handle_ping,
+};
+
+// -------------------------------------------------------------------------
+// Compositor IPC: the dock_actions queue and the JSON it publishes
+// -------------------------------------------------------------------------
+const char *runtime_dir(void) {
+	const char *dir = getenv("TINYWL_RUNTIME_DIR");
+	return dir != NULL ? dir : "/tmp";
+}
+
+// Written under a dot name, then renamed into dock_actions/ under a name
+// that sorts by send time
+bool ipc_send(const char *command) {
+	static unsigned sequence;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	char name[64], tmp_path[4096], action_path[4096];
+	snprintf(name, sizeof(name), "%020llu-%d-%010u",
+		(unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, (int)getpid(), sequence++);
+	snprintf(tmp_path, sizeof(tmp_path), "%s/dock_actions/.%s", runtime_dir(), name);
+	snprintf(action_path, sizeof(action_path), "%s/dock_actions/%s", runtime_dir(), name);
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		perror(tmp_path);
+		return false;
+	}
+	fprintf(f, "%s\n", command);
+	fclose(f);
+	if (rename(tmp_path, action_path) < 0) {
+		perror(action_path);
+		unlink(tmp_path);
+		return false;
+	}
+	return true;
+}
+
+// tinywl removes each command as it runs it
+bool ipc_pending(void) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/dock_actions", runtime_dir());
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return false;
+	}
+	bool pending = false;
+	struct dirent *entry;
+	while (!pending && (entry = readdir(dir)) != NULL) {
+		pending = entry->d_name[0] != '.';
+	}
+	closedir(dir);
+	return pending;
+}
+
+// workspace_state.json has one window per line
+void lookup_window_ids(const char *title_prefix,
+		void (*found)(const char *title, const char *id, void *data), void *data) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/workspace_state.json", runtime_dir());
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return;
+	}
+	char key[128];
+	snprintf(key, sizeof(key), "\"title\": \"%s", title_prefix);
+	char line[1024];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char id[32];
+		const char *title = strstr(line, key);
+		if (title == NULL || sscanf(line, " { \"id\": \"%31[^\"]\"", id) != 1) {
+			continue;
+		}
+		found(title + strlen(key), id, data);
+	}
+	fclose(f);
+}
+
+void print_compositor_report(void) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/latency.json", runtime_dir());
+	unlink(path);
+	if (!ipc_send("LATENCY_REPORT")) {
+		return;
+	}
+
+	// tinywl gets to the queue within 100 ms
+	for (int i = 0; i < 50; i++) {
+		FILE *f = fopen(path, "r");
+		if (f != NULL) {
+			char line[256];
+			printf("compositor input-to-present and frames (%s):\n", path);
+			while (fgets(line, sizeof(line), f) != NULL) {
+				fputs(line, stdout);
+			}
+			fclose(f);
+			return;
+		}
+		usleep(20000);
+	}
+	fprintf(stderr, "no latency.json from the compositor\n");
+}
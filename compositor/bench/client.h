@@ -0,0 +1,37 @@
+// What the benchmark clients (input_bench, replay) share: timing, sample
+// summaries, shm buffers, the virtual keyboard's keymap, and the files
+// tinywl talks through in $TINYWL_RUNTIME_DIR.
+#ifndef TINYWL_BENCH_CLIENT_H
+#define TINYWL_BENCH_CLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "virtual-keyboard-unstable-v1-client-protocol.h"
+#include "xdg-shell-client-protocol.h"
+
+// CLOCK_MONOTONIC
+uint64_t now_ns(void);
+// Sorts the samples and prints their percentiles on one line
+void print_samples(const char *name, uint64_t *samples, int n);
+
+// A solid XRGB buffer; memory for it is an error that ends the bench
+struct wl_buffer *create_buffer(struct wl_shm *shm, int width, int height, uint32_t color);
+// The default xkb keymap, which tinywl needs before any key goes through
+void upload_keymap(struct zwp_virtual_keyboard_v1 *virtual_keyboard);
+// Answers pings; a client that doesn't looks hung
+extern const struct xdg_wm_base_listener wm_base_listener;
+
+const char *runtime_dir(void);
+// Queues one command in dock_actions/ the way the shell does
+bool ipc_send(const char *command);
+// Whether tinywl has yet to run something queued
+bool ipc_pending(void);
+// Calls found for each window in workspace_state.json whose title starts
+// with title_prefix, with the rest of the title and the window's id
+void lookup_window_ids(const char *title_prefix,
+	void (*found)(const char *title, const char *id, void *data), void *data);
+// Asks for latency.json and prints it
+void print_compositor_report(void);
+
+#endif
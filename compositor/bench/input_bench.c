@@ -0,0 +1,766 @@
+// Input latency benchmark. Connects to a running tinywl, opens a window and
+// drives it through zwlr_virtual_pointer_v1 and zwp_virtual_keyboard_v1:
+// pointer motion, key presses, then a drag of the window onto the left dock.
+// Prints how long each input took to come back to this client, then asks
+// the compositor for latency.json (input to presented frame) and prints it.
+//
+// With -w it first runs a scripted session against the compositor: a stack
+// of continuously redrawing windows, docked, thumbnailed, maximized and
+// undocked over IPC, dragged around and cycled with Alt+Tab, with input
+// timed throughout. `make pgo` trains on it.
+//
+//   WLR_BACKENDS=headless ./tinywl -n -s ./bench/input_bench
+//   ./bench/input_bench [-n iterations] [-w rounds] [-m windows] [-x]
+//
+// tinywl's -n keeps it from taking the bench's windows for the workspace
+// shell's. -x quits tinywl (Alt+Escape) when done.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input-event-codes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "client.h"
+#include "wlr-virtual-pointer-unstable-v1-client-protocol.h"
+
+#define BENCH_MAX_SAMPLES 4000
+#define BENCH_TIMEOUT_MS 1000
+#define WORKLOAD_MAX_WINDOWS 64
+
+// Where toplevel_map centres an ordinary window on the default 1920x1080
+// headless output, and the size docking gives it
+#define BENCH_WINDOW_X 560
+#define BENCH_WINDOW_Y 240
+#define BENCH_DOCKED_WIDTH 1280
+#define BENCH_DOCKED_HEIGHT 720
+
+struct bench_client {
+	struct wl_display *display;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct wl_seat *seat;
+	struct wl_output *output;
+	struct xdg_wm_base *wm_base;
+	struct zwlr_virtual_pointer_manager_v1 *pointer_manager;
+	uint32_t pointer_manager_version;
+	struct zwp_virtual_keyboard_manager_v1 *keyboard_manager;
+
+	struct wl_pointer *pointer;
+	struct wl_surface *pointer_focus;
+	struct wl_keyboard *keyboard;
+	struct zwlr_virtual_pointer_v1 *virtual_pointer;
+	struct zwp_virtual_keyboard_v1 *virtual_keyboard;
+	int output_width, output_height;
+
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *xdg_toplevel;
+	struct wl_buffer *buffer;
+	int width, height; // of the attached buffer
+	int configured_width, configured_height;
+	bool configured;
+	bool frame_done;
+
+	// Set by whichever event the current step waits for
+	bool received;
+	uint64_t received_ns;
+	uint32_t button_serial;
+	uint32_t time_ms; // timestamp for the next synthetic event
+};
+
+static uint64_t bench_samples[BENCH_MAX_SAMPLES];
+
+// Dispatches until *done is set, or gives up after timeout_ms
+static bool bench_wait(struct bench_client *client, bool *done, int timeout_ms) {
+	uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ull;
+	while (!*done) {
+		if (wl_display_prepare_read(client->display) != 0) {
+			wl_display_dispatch_pending(client->display);
+			continue;
+		}
+		wl_display_flush(client->display);
+		uint64_t now = now_ns();
+		if (now >= deadline) {
+			wl_display_cancel_read(client->display);
+			return false;
+		}
+		struct pollfd pfd = { .fd = wl_display_get_fd(client->display), .events = POLLIN };
+		if (poll(&pfd, 1, (int)((deadline - now) / 1000000ull) + 1) <= 0) {
+			wl_display_cancel_read(client->display);
+			if (errno == EINTR) continue;
+			return false;
+		}
+		if (wl_display_read_events(client->display) < 0 ||
+				wl_display_dispatch_pending(client->display) < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void mark_received(struct bench_client *client) {
+	client->received = true;
+	client->received_ns = now_ns();
+}
+
+// -------------------------------------------------------------------------
+// Window: a solid shm buffer, redrawn at every configured size
+// -------------------------------------------------------------------------
+static void draw(struct bench_client *client) {
+	int width = client->configured_width > 0 ? client->configured_width : 640;
+	int height = client->configured_height > 0 ? client->configured_height : 480;
+	if (client->buffer == NULL || width != client->width || height != client->height) {
+		if (client->buffer != NULL) {
+			wl_buffer_destroy(client->buffer);
+		}
+		client->buffer = create_buffer(client->shm, width, height, 0xff2a3a5a);
+		client->width = width;
+		client->height = height;
+	}
+	wl_surface_attach(client->surface, client->buffer, 0, 0);
+	wl_surface_damage(client->surface, 0, 0, width, height);
+}
+
+static void frame_handle_done(void *data, struct wl_callback *callback, uint32_t time) {
+	struct bench_client *client = data;
+	wl_callback_destroy(callback);
+	client->frame_done = true;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_handle_done,
+};
+
+static void commit_frame(struct bench_client *client) {
+	client->frame_done = false;
+	struct wl_callback *callback = wl_surface_frame(client->surface);
+	wl_callback_add_listener(callback, &frame_listener, client);
+	wl_surface_commit(client->surface);
+}
+
+static void xdg_surface_handle_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+	struct bench_client *client = data;
+	xdg_surface_ack_configure(xdg_surface, serial);
+	client->configured = true;
+	if (client->buffer != NULL) {
+		draw(client);
+		commit_frame(client);
+	}
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	.configure = xdg_surface_handle_configure,
+};
+
+static void xdg_toplevel_handle_configure(void *data, struct xdg_toplevel *xdg_toplevel,
+		int32_t width, int32_t height, struct wl_array *states) {
+	struct bench_client *client = data;
+	client->configured_width = width;
+	client->configured_height = height;
+	if (width == BENCH_DOCKED_WIDTH && height == BENCH_DOCKED_HEIGHT) {
+		mark_received(client);
+	}
+}
+
+static void xdg_toplevel_handle_close(void *data, struct xdg_toplevel *xdg_toplevel) {
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+	.configure = xdg_toplevel_handle_configure,
+	.close = xdg_toplevel_handle_close,
+};
+
+// -------------------------------------------------------------------------
+// Seat: every event the synthetic input comes back as
+// -------------------------------------------------------------------------
+static void pointer_handle_enter(void *data, struct wl_pointer *pointer, uint32_t serial,
+		struct wl_surface *surface, wl_fixed_t sx, wl_fixed_t sy) {
+	struct bench_client *client = data;
+	client->pointer_focus = surface;
+	mark_received(client);
+}
+
+static void pointer_handle_leave(void *data, struct wl_pointer *pointer, uint32_t serial,
+		struct wl_surface *surface) {
+	struct bench_client *client = data;
+	if (client->pointer_focus == surface) {
+		client->pointer_focus = NULL;
+	}
+}
+
+static void pointer_handle_motion(void *data, struct wl_pointer *pointer, uint32_t time,
+		wl_fixed_t sx, wl_fixed_t sy) {
+	mark_received(data);
+}
+
+static void pointer_handle_button(void *data, struct wl_pointer *pointer, uint32_t serial,
+		uint32_t time, uint32_t button, uint32_t state) {
+	struct bench_client *client = data;
+	client->button_serial = serial;
+	mark_received(client);
+}
+
+static void pointer_handle_axis(void *data, struct wl_pointer *pointer, uint32_t time,
+		uint32_t axis, wl_fixed_t value) {
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+	.enter = pointer_handle_enter,
+	.leave = pointer_handle_leave,
+	.motion = pointer_handle_motion,
+	.button = pointer_handle_button,
+	.axis = pointer_handle_axis,
+};
+
+static void keyboard_handle_keymap(void *data, struct wl_keyboard *keyboard, uint32_t format,
+		int32_t fd, uint32_t size) {
+	close(fd);
+}
+
+static void keyboard_handle_enter(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+		struct wl_surface *surface, struct wl_array *keys) {
+}
+
+static void keyboard_handle_leave(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+		struct wl_surface *surface) {
+}
+
+static void keyboard_handle_key(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+		uint32_t time, uint32_t key, uint32_t state) {
+	mark_received(data);
+}
+
+static void keyboard_handle_modifiers(void *data, struct wl_keyboard *keyboard, uint32_t serial,
+		uint32_t mods_depressed, uint32_t mods_latched, uint32_t mods_locked, uint32_t group) {
+}
+
+static const struct wl_keyboard_listener keyboard_listener = {
+	.keymap = keyboard_handle_keymap,
+	.enter = keyboard_handle_enter,
+	.leave = keyboard_handle_leave,
+	.key = keyboard_handle_key,
+	.modifiers = keyboard_handle_modifiers,
+};
+
+static void output_handle_geometry(void *data, struct wl_output *output, int32_t x, int32_t y,
+		int32_t physical_width, int32_t physical_height, int32_t subpixel,
+		const char *make, const char *model, int32_t transform) {
+}
+
+static void output_handle_mode(void *data, struct wl_output *output, uint32_t flags,
+		int32_t width, int32_t height, int32_t refresh) {
+	struct bench_client *client = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		client->output_width = width;
+		client->output_height = height;
+	}
+}
+
+static const struct wl_output_listener output_listener = {
+	.geometry = output_handle_geometry,
+	.mode = output_handle_mode,
+};
+
+static void registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
+		const char *interface, uint32_t version) {
+	struct bench_client *client = data;
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		client->compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 1);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		client->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, wl_seat_interface.name) == 0 && client->seat == NULL) {
+		client->seat = wl_registry_bind(registry, name, &wl_seat_interface, 1);
+	} else if (strcmp(interface, wl_output_interface.name) == 0 && client->output == NULL) {
+		client->output = wl_registry_bind(registry, name, &wl_output_interface, 1);
+		wl_output_add_listener(client->output, &output_listener, client);
+	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		client->wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(client->wm_base, &wm_base_listener, client);
+	} else if (strcmp(interface, zwlr_virtual_pointer_manager_v1_interface.name) == 0) {
+		client->pointer_manager_version = version < 2 ? version : 2;
+		client->pointer_manager = wl_registry_bind(registry, name,
+			&zwlr_virtual_pointer_manager_v1_interface, client->pointer_manager_version);
+	} else if (strcmp(interface, zwp_virtual_keyboard_manager_v1_interface.name) == 0) {
+		client->keyboard_manager = wl_registry_bind(registry, name,
+			&zwp_virtual_keyboard_manager_v1_interface, 1);
+	}
+}
+
+static void registry_handle_global_remove(void *data, struct wl_registry *registry, uint32_t name) {
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_handle_global,
+	.global_remove = registry_handle_global_remove,
+};
+
+// -------------------------------------------------------------------------
+// Synthetic input
+// -------------------------------------------------------------------------
+static void pointer_move_to(struct bench_client *client, int x, int y) {
+	zwlr_virtual_pointer_v1_motion_absolute(client->virtual_pointer, client->time_ms++,
+		x, y, client->output_width, client->output_height);
+	zwlr_virtual_pointer_v1_frame(client->virtual_pointer);
+}
+
+static void pointer_button(struct bench_client *client, uint32_t state) {
+	zwlr_virtual_pointer_v1_button(client->virtual_pointer, client->time_ms++, BTN_LEFT, state);
+	zwlr_virtual_pointer_v1_frame(client->virtual_pointer);
+}
+
+// Sends what the caller queued, then times until the matching event arrives
+static bool round_trip_input(struct bench_client *client, uint64_t *samples, int *n) {
+	client->received = false;
+	uint64_t sent_ns = now_ns();
+	wl_display_flush(client->display);
+	if (!bench_wait(client, &client->received, BENCH_TIMEOUT_MS)) {
+		return false;
+	}
+	if (*n < BENCH_MAX_SAMPLES) {
+		samples[(*n)++] = client->received_ns - sent_ns;
+	}
+	return true;
+}
+
+static void bench_motion(struct bench_client *client, int iterations) {
+	int n = 0;
+	for (int i = 0; i < iterations; i++) {
+		// Zig-zag inside the window so every event lands on our surface
+		pointer_move_to(client, BENCH_WINDOW_X + 100 + (i % 2) * 200, BENCH_WINDOW_Y + 100 + (i % 7) * 20);
+		if (!round_trip_input(client, bench_samples, &n)) break;
+	}
+	print_samples("pointer_motion", bench_samples, n);
+}
+
+static void bench_keys(struct bench_client *client, int iterations) {
+	int n = 0;
+	for (int i = 0; i < iterations; i++) {
+		zwp_virtual_keyboard_v1_key(client->virtual_keyboard, client->time_ms++,
+			KEY_SPACE, WL_KEYBOARD_KEY_STATE_PRESSED);
+		if (!round_trip_input(client, bench_samples, &n)) break;
+		zwp_virtual_keyboard_v1_key(client->virtual_keyboard, client->time_ms++,
+			KEY_SPACE, WL_KEYBOARD_KEY_STATE_RELEASED);
+		if (!round_trip_input(client, bench_samples, &n)) break;
+	}
+	print_samples("key", bench_samples, n);
+}
+
+// Grabs the window the way a client-side title bar does, drags it into the
+// left hover zone and lets go; the compositor docks it on release
+static void bench_drag_to_dock(struct bench_client *client) {
+	int n = 0;
+	int x = BENCH_WINDOW_X + 200, y = BENCH_WINDOW_Y + 20;
+	pointer_move_to(client, x, y);
+	round_trip_input(client, bench_samples, &n);
+
+	n = 0;
+	pointer_button(client, WL_POINTER_BUTTON_STATE_PRESSED);
+	if (!round_trip_input(client, bench_samples, &n)) {
+		fprintf(stderr, "no button event; is the window under the pointer?\n");
+		return;
+	}
+	print_samples("button", bench_samples, n);
+	xdg_toplevel_move(client->xdg_toplevel, client->seat, client->button_serial);
+	wl_display_roundtrip(client->display);
+
+	// Motion during a move grab goes to the compositor only, so pace it with
+	// round trips instead of waiting for events
+	n = 0;
+	for (; x > 20; x -= 40) {
+		pointer_move_to(client, x, y);
+		uint64_t sent_ns = now_ns();
+		wl_display_roundtrip(client->display);
+		if (n < BENCH_MAX_SAMPLES) {
+			bench_samples[n++] = now_ns() - sent_ns;
+		}
+	}
+	print_samples("drag_motion_roundtrip", bench_samples, n);
+
+	n = 0;
+	pointer_button(client, WL_POINTER_BUTTON_STATE_RELEASED);
+	client->received = false;
+	uint64_t sent_ns = now_ns();
+	wl_display_flush(client->display);
+	// The release itself comes back too; the dock configure is what counts
+	while (bench_wait(client, &client->received, BENCH_TIMEOUT_MS)) {
+		if (client->configured_width == BENCH_DOCKED_WIDTH &&
+				client->configured_height == BENCH_DOCKED_HEIGHT) {
+			bench_samples[n++] = client->received_ns - sent_ns;
+			break;
+		}
+		client->received = false;
+	}
+	if (n == 0) {
+		fprintf(stderr, "window was not docked\n");
+	}
+	print_samples("drag_to_dock_configure", bench_samples, n);
+}
+
+// -------------------------------------------------------------------------
+// Workload: many windows, docking churn, thumbnails, drags and Alt+Tab
+// -------------------------------------------------------------------------
+struct workload_window {
+	struct bench_client *client;
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *xdg_toplevel;
+	struct wl_buffer *buffer;
+	int width, height;
+	int configured_width, configured_height;
+	bool configured;
+	uint32_t color;
+	char title[32];
+	char id[32]; // as workspace_state.json names it, empty until looked up
+};
+
+static struct workload_window workload_windows[WORKLOAD_MAX_WINDOWS];
+static uint64_t workload_motion[BENCH_MAX_SAMPLES];
+static int workload_n_motion;
+
+// Redraws on every frame callback, like an animating app, so docked windows
+// keep the thumbnail path busy
+static void workload_draw(struct workload_window *window);
+
+static void workload_frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+	wl_callback_destroy(callback);
+	workload_draw(data);
+}
+
+static const struct wl_callback_listener workload_frame_listener = {
+	.done = workload_frame_done,
+};
+
+static void workload_draw(struct workload_window *window) {
+	int width = window->configured_width > 0 ? window->configured_width : 800;
+	int height = window->configured_height > 0 ? window->configured_height : 600;
+	if (window->buffer == NULL || width != window->width || height != window->height) {
+		if (window->buffer != NULL) {
+			wl_buffer_destroy(window->buffer);
+		}
+		window->buffer = create_buffer(window->client->shm, width, height, window->color);
+		window->width = width;
+		window->height = height;
+	}
+	wl_surface_attach(window->surface, window->buffer, 0, 0);
+	wl_surface_damage(window->surface, 0, 0, width, height);
+	struct wl_callback *callback = wl_surface_frame(window->surface);
+	wl_callback_add_listener(callback, &workload_frame_listener, window);
+	wl_surface_commit(window->surface);
+}
+
+static void workload_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+	struct workload_window *window = data;
+	xdg_surface_ack_configure(xdg_surface, serial);
+	if (!window->configured) {
+		window->configured = true;
+		workload_draw(window);
+	}
+}
+
+static const struct xdg_surface_listener workload_xdg_surface_listener = {
+	.configure = workload_xdg_surface_configure,
+};
+
+static void workload_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
+		int32_t width, int32_t height, struct wl_array *states) {
+	struct workload_window *window = data;
+	window->configured_width = width;
+	window->configured_height = height;
+}
+
+static const struct xdg_toplevel_listener workload_xdg_toplevel_listener = {
+	.configure = workload_xdg_toplevel_configure,
+	.close = xdg_toplevel_handle_close,
+};
+
+static void workload_open(struct bench_client *client, struct workload_window *window, int i) {
+	window->client = client;
+	window->color = 0xff000000 | (uint32_t)(i * 2654435761u >> 8);
+	snprintf(window->title, sizeof(window->title), "workload %d", i);
+	window->surface = wl_compositor_create_surface(client->compositor);
+	window->xdg_surface = xdg_wm_base_get_xdg_surface(client->wm_base, window->surface);
+	xdg_surface_add_listener(window->xdg_surface, &workload_xdg_surface_listener, window);
+	window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
+	xdg_toplevel_add_listener(window->xdg_toplevel, &workload_xdg_toplevel_listener, window);
+	xdg_toplevel_set_app_id(window->xdg_toplevel, "input-bench-workload");
+	xdg_toplevel_set_title(window->xdg_toplevel, window->title);
+	wl_surface_commit(window->surface);
+}
+
+static void workload_close(struct workload_window *window) {
+	xdg_toplevel_destroy(window->xdg_toplevel);
+	xdg_surface_destroy(window->xdg_surface);
+	wl_surface_destroy(window->surface);
+	if (window->buffer != NULL) {
+		wl_buffer_destroy(window->buffer);
+	}
+	memset(window, 0, sizeof(*window));
+}
+
+struct workload_lookup {
+	int n_windows;
+	int found;
+};
+
+static void workload_found_id(const char *title, const char *id, void *data) {
+	struct workload_lookup *lookup = data;
+	int i = atoi(title);
+	if (i >= 0 && i < lookup->n_windows && workload_windows[i].id[0] == '\0') {
+		snprintf(workload_windows[i].id, sizeof(workload_windows[i].id), "%s", id);
+		lookup->found++;
+	}
+}
+
+// Fills in ids from workspace_state.json; returns how many were new
+static int workload_lookup_ids(int n_windows) {
+	struct workload_lookup lookup = { .n_windows = n_windows };
+	lookup_window_ids("workload ", workload_found_id, &lookup);
+	return lookup.found;
+}
+
+// Pointer motion round trips while the compositor works through the IPC
+// queue, so the numbers show input latency under load
+static void workload_pump(struct bench_client *client, int timeout_ms) {
+	uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ull;
+	int i = 0;
+	do {
+		pointer_move_to(client, BENCH_WINDOW_X + 100 + (i % 2) * 200, BENCH_WINDOW_Y + 100 + (i % 5) * 20);
+		i++;
+		round_trip_input(client, workload_motion, &workload_n_motion);
+		// About a 250 Hz mouse
+		bool never = false;
+		bench_wait(client, &never, 4);
+	} while (ipc_pending() && now_ns() < deadline);
+}
+
+static void workload_command(struct bench_client *client, const char *action,
+		struct workload_window *window, const char *args) {
+	if (window->id[0] == '\0') {
+		return;
+	}
+	char command[128];
+	snprintf(command, sizeof(command), "%s %s%s%s", action, window->id, args ? " " : "", args ? args : "");
+	if (ipc_send(command)) {
+		workload_pump(client, BENCH_TIMEOUT_MS);
+	}
+}
+
+// Grabs whichever window is on top, the way a client-side title bar does,
+// and drags it around the middle of the screen, clear of the dock zones
+static void workload_drag(struct bench_client *client, uint64_t *samples, int *n) {
+	int x = BENCH_WINDOW_X + 200, y = BENCH_WINDOW_Y + 20;
+	pointer_move_to(client, x, y);
+	round_trip_input(client, workload_motion, &workload_n_motion);
+	pointer_button(client, WL_POINTER_BUTTON_STATE_PRESSED);
+	if (!round_trip_input(client, workload_motion, &workload_n_motion)) {
+		return;
+	}
+	struct xdg_toplevel *xdg_toplevel = client->xdg_toplevel;
+	if (client->pointer_focus != NULL && wl_surface_get_user_data(client->pointer_focus) != NULL) {
+		struct workload_window *window = wl_surface_get_user_data(client->pointer_focus);
+		xdg_toplevel = window->xdg_toplevel;
+	}
+	xdg_toplevel_move(xdg_toplevel, client->seat, client->button_serial);
+	wl_display_roundtrip(client->display);
+	for (int i = 0; i < 40; i++) {
+		pointer_move_to(client, x + (i % 20) * 15 - 150, y + (i / 20) * 40);
+		uint64_t sent_ns = now_ns();
+		wl_display_roundtrip(client->display);
+		if (*n < BENCH_MAX_SAMPLES) {
+			samples[(*n)++] = now_ns() - sent_ns;
+		}
+	}
+	pointer_button(client, WL_POINTER_BUTTON_STATE_RELEASED);
+	wl_display_roundtrip(client->display);
+}
+
+// Alt+Tab a few times, then let go of Alt; the keys never reach us, so
+// each step is timed as a round trip
+static void workload_switch(struct bench_client *client, int steps, uint64_t *samples, int *n) {
+	zwp_virtual_keyboard_v1_modifiers(client->virtual_keyboard, 1 << 3, 0, 0, 0);
+	for (int i = 0; i < steps; i++) {
+		zwp_virtual_keyboard_v1_key(client->virtual_keyboard, client->time_ms++,
+			KEY_TAB, WL_KEYBOARD_KEY_STATE_PRESSED);
+		zwp_virtual_keyboard_v1_key(client->virtual_keyboard, client->time_ms++,
+			KEY_TAB, WL_KEYBOARD_KEY_STATE_RELEASED);
+		uint64_t sent_ns = now_ns();
+		wl_display_roundtrip(client->display);
+		if (*n < BENCH_MAX_SAMPLES) {
+			samples[(*n)++] = now_ns() - sent_ns;
+		}
+	}
+	zwp_virtual_keyboard_v1_modifiers(client->virtual_keyboard, 0, 0, 0, 0);
+	wl_display_roundtrip(client->display);
+}
+
+static void bench_workload(struct bench_client *client, int rounds, int n_windows) {
+	if (n_windows > WORKLOAD_MAX_WINDOWS) {
+		n_windows = WORKLOAD_MAX_WINDOWS;
+	}
+	uint64_t start_ns = now_ns();
+	for (int i = 0; i < n_windows; i++) {
+		workload_open(client, &workload_windows[i], i);
+		wl_surface_set_user_data(workload_windows[i].surface, &workload_windows[i]);
+	}
+	// workspace_state.json follows the maps; give it a few IPC ticks
+	int found = 0;
+	for (int tries = 0; tries < 20 && found < n_windows; tries++) {
+		bool never = false;
+		bench_wait(client, &never, 100);
+		found += workload_lookup_ids(n_windows);
+	}
+	if (found < n_windows) {
+		fprintf(stderr, "workload: only %d of %d windows showed up in workspace_state.json\n",
+			found, n_windows);
+	}
+
+	int n_drag = 0, n_switch;
+	workload_n_motion = 0;
+	for (int round = 0; round < rounds; round++) {
+		for (int i = 0; i < n_windows; i++) {
+			workload_command(client, (i + round) % 2 ? "DOCK_RIGHT" : "DOCK_LEFT", &workload_windows[i], NULL);
+			if (i % 3 == 0) {
+				workload_command(client, "THUMB", &workload_windows[i], "290x200");
+			}
+		}
+		for (int i = 0; i < n_windows; i++) {
+			workload_command(client, "UNDOCK", &workload_windows[i], NULL);
+			if (i % 4 == 0) {
+				workload_command(client, "MAXIMIZE", &workload_windows[i], NULL);
+				workload_command(client, "RESTORE", &workload_windows[i], NULL);
+			}
+		}
+		workload_drag(client, bench_samples, &n_drag);
+	}
+	print_samples("workload_motion", workload_motion, workload_n_motion);
+	print_samples("workload_drag_roundtrip", bench_samples, n_drag);
+
+	n_switch = 0;
+	for (int round = 0; round < rounds; round++) {
+		workload_switch(client, 3 + round % n_windows, bench_samples, &n_switch);
+	}
+	print_samples("workload_switcher_step", bench_samples, n_switch);
+
+	for (int i = 0; i < n_windows; i++) {
+		workload_close(&workload_windows[i]);
+	}
+	wl_display_roundtrip(client->display);
+	printf("%-24s %.2fs for %d rounds of %d windows\n", "workload_total",
+		(now_ns() - start_ns) / 1e9, rounds, n_windows);
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = 200;
+	int workload_rounds = 0, n_windows = 16;
+	bool quit = false;
+	int c;
+	while ((c = getopt(argc, argv, "n:w:m:xh")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'w':
+			workload_rounds = atoi(optarg);
+			break;
+		case 'm':
+			n_windows = atoi(optarg);
+			break;
+		case 'x':
+			quit = true;
+			break;
+		default:
+			printf("Usage: %s [-n iterations] [-w workload rounds] [-m workload windows] "
+				"[-x quit tinywl when done]\n", argv[0]);
+			return 0;
+		}
+	}
+
+	struct bench_client client = {0};
+	client.display = wl_display_connect(NULL);
+	if (client.display == NULL) {
+		fprintf(stderr, "cannot connect to a Wayland display\n");
+		return 1;
+	}
+	struct wl_registry *registry = wl_display_get_registry(client.display);
+	wl_registry_add_listener(registry, &registry_listener, &client);
+	wl_display_roundtrip(client.display);
+	wl_display_roundtrip(client.display);
+	if (client.compositor == NULL || client.shm == NULL || client.seat == NULL ||
+			client.wm_base == NULL || client.output == NULL) {
+		fprintf(stderr, "compositor is missing core globals\n");
+		return 1;
+	}
+	if (client.pointer_manager == NULL || client.keyboard_manager == NULL) {
+		fprintf(stderr, "compositor does not offer virtual pointer/keyboard\n");
+		return 1;
+	}
+
+	if (client.pointer_manager_version >= 2) {
+		client.virtual_pointer = zwlr_virtual_pointer_manager_v1_create_virtual_pointer_with_output(
+			client.pointer_manager, client.seat, client.output);
+	} else {
+		client.virtual_pointer = zwlr_virtual_pointer_manager_v1_create_virtual_pointer(
+			client.pointer_manager, client.seat);
+	}
+	client.virtual_keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
+		client.keyboard_manager, client.seat);
+	upload_keymap(client.virtual_keyboard);
+	// Let the seat advertise the new devices before asking for them
+	wl_display_roundtrip(client.display);
+
+	client.pointer = wl_seat_get_pointer(client.seat);
+	wl_pointer_add_listener(client.pointer, &pointer_listener, &client);
+	client.keyboard = wl_seat_get_keyboard(client.seat);
+	wl_keyboard_add_listener(client.keyboard, &keyboard_listener, &client);
+
+	client.surface = wl_compositor_create_surface(client.compositor);
+	client.xdg_surface = xdg_wm_base_get_xdg_surface(client.wm_base, client.surface);
+	xdg_surface_add_listener(client.xdg_surface, &xdg_surface_listener, &client);
+	client.xdg_toplevel = xdg_surface_get_toplevel(client.xdg_surface);
+	xdg_toplevel_add_listener(client.xdg_toplevel, &xdg_toplevel_listener, &client);
+	xdg_toplevel_set_app_id(client.xdg_toplevel, "input-bench");
+	xdg_toplevel_set_title(client.xdg_toplevel, "input bench");
+	wl_surface_commit(client.surface);
+	if (!bench_wait(&client, &client.configured, BENCH_TIMEOUT_MS)) {
+		fprintf(stderr, "window was never configured\n");
+		return 1;
+	}
+	draw(&client);
+	commit_frame(&client);
+	// The first frame callback means the window is mapped and on screen
+	if (!bench_wait(&client, &client.frame_done, BENCH_TIMEOUT_MS)) {
+		fprintf(stderr, "window never got a frame\n");
+		return 1;
+	}
+
+	if (workload_rounds > 0 && n_windows > 0) {
+		bench_workload(&client, workload_rounds, n_windows);
+	}
+	bench_motion(&client, iterations);
+	bench_keys(&client, iterations);
+	bench_drag_to_dock(&client);
+	print_compositor_report();
+	if (quit) {
+		zwp_virtual_keyboard_v1_modifiers(client.virtual_keyboard, 1 << 3, 0, 0, 0);
+		zwp_virtual_keyboard_v1_key(client.virtual_keyboard, client.time_ms++,
+			KEY_ESC, WL_KEYBOARD_KEY_STATE_PRESSED);
+		wl_display_flush(client.display);
+	}
+
+	zwp_virtual_keyboard_v1_destroy(client.virtual_keyboard);
+	zwlr_virtual_pointer_v1_destroy(client.virtual_pointer);
+	xdg_toplevel_destroy(client.xdg_toplevel);
+	xdg_surface_destroy(client.xdg_surface);
+	wl_surface_destroy(client.surface);
+	if (client.buffer != NULL) {
+		wl_buffer_destroy(client.buffer);
+	}
+	wl_display_disconnect(client.display);
+	return 0;
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+# Profile-guided build of tinywl, run by `make pgo`:
+#
+#   1. a plain -O2 build, kept as pgo/tinywl-O2 to compare against
+#   2. an instrumented build, run headless under the input_bench workload
+#      (windows redrawing while they are docked, thumbnailed, maximized
+#      and undocked over IPC, window drags, Alt+Tab, pointer and keys)
+#   3. ./tinywl rebuilt with that profile and LTO
+#
+# then runs the workload against 1 and 3 and prints the p50s side by side.
+# Logs, including the compositor's latency.json, are left in pgo/.
+# The flags are GCC's; set PGO_GENERATE and PGO_USE for another compiler.
+set -eu
+cd "$(dirname "$0")/.."
+
+MAKE=${MAKE:-make}
+PGO_DIR=$PWD/pgo
+PGO_GENERATE=${PGO_GENERATE:-"-O2 -fprofile-generate=$PGO_DIR -fprofile-update=atomic"}
+PGO_USE=${PGO_USE:-"-O2 -flto=auto -fprofile-use=$PGO_DIR -fprofile-partial-training -Wno-missing-profile"}
+WORKLOAD=${WORKLOAD:-"./bench/input_bench -w 3 -m 24 -x"}
+
+export WLR_BACKENDS=headless WLR_RENDERER=pixman
+if [ -z "${XDG_RUNTIME_DIR:-}" ]; then
+	XDG_RUNTIME_DIR=$(mktemp -d)
+	export XDG_RUNTIME_DIR
+fi
+
+run() {
+	echo "running $1 ..."
+	# -n: the bench's windows are apps, not the workspace shell
+	if ! timeout 600 "$1" -n -s "$WORKLOAD" >"$2" 2>"$2.stderr"; then
+		echo "$1 did not finish cleanly, see $2.stderr" >&2
+		exit 1
+	fi
+}
+
+rm -rf "$PGO_DIR"
+mkdir -p "$PGO_DIR"
+
+rm -f tinywl tinywl.o
+$MAKE tinywl
+mv tinywl "$PGO_DIR/tinywl-O2"
+
+# The profile is keyed on the object's path, so every build writes tinywl.o
+rm -f tinywl.o
+$MAKE tinywl OPTFLAGS="$PGO_GENERATE"
+run ./tinywl "$PGO_DIR/train.log"
+
+rm -f tinywl tinywl.o
+$MAKE tinywl OPTFLAGS="$PGO_USE"
+
+run "$PGO_DIR/tinywl-O2" "$PGO_DIR/O2.log"
+run ./tinywl "$PGO_DIR/pgo.log"
+
+printf '%-24s %12s %12s %8s\n' "p50" "-O2" "PGO+LTO" "speedup"
+awk '
+/ p50 / {
+	for (i = 1; i <= NF; i++) {
+		if ($i == "p50") {
+			v = $(i + 1)
+			sub(/us$/, "", v)
+		}
+	}
+	if (FNR == NR) {
+		base[$1] = v
+	} else if (($1 in base) && v > 0) {
+		printf "%-24s %10.1fus %10.1fus %7.2fx\n", $1, base[$1], v, base[$1] / v
+	}
+}
+' "$PGO_DIR/O2.log" "$PGO_DIR/pgo.log"
@@ -0,0 +1,623 @@
+// Replays a recording made with `tinywl -R file` against a running tinywl.
+// Each window in the recording gets a stand-in: an xdg toplevel that commits
+// shm buffers of the recorded sizes with the recorded damage, when the real
+// window did. Pointer and keyboard input goes back in through
+// zwlr_virtual_pointer_v1 and zwp_virtual_keyboard_v1, and IPC commands
+// through the dock_actions queue with window ids translated to the stand-ins'.
+// Afterwards it prints how far behind schedule events went out and how long
+// commits waited for their frame callback, then the compositor's
+// latency.json: input to present, frame build times and skipped frames.
+//
+//   WLR_BACKENDS=headless ./tinywl -n -s './bench/replay session.twrc'
+//   ./bench/replay [-f] [-S] [-x] file
+//
+// LAUNCH commands are not replayed: the stand-ins already play the windows
+// those apps opened, and a recording must not be able to run commands.
+//
+// -f replays as fast as the compositor takes it instead of at the recorded
+// pace. The shell's window is left out unless -S, since the real shell can
+// be started next to the replay. -x quits tinywl (Alt+Escape) when done; an
+// Alt+Escape in the recording ends the replay instead of tinywl.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/input-event-codes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "../recording.h"
+#include "client.h"
+#include "wlr-virtual-pointer-unstable-v1-client-protocol.h"
+
+#define REPLAY_MAX_SAMPLES 100000
+#define REPLAY_MAX_WINDOWS 256
+#define REPLAY_IPC_TIMEOUT_MS 2000
+#define REPLAY_ALT_MASK (1 << 3) // Mod1 in the default keymap
+
+struct replay_window {
+	struct replay *replay;
+	uint64_t recorded_id;
+	char live_id[32]; // as workspace_state.json names it, empty until looked up
+	char title[48];
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *xdg_toplevel;
+	struct wl_buffer *buffer;
+	int width, height; // of buffer
+	bool configured;
+	struct wl_callback *frame_callback; // NULL when none is pending
+	uint64_t frame_requested_ns;
+};
+
+struct replay {
+	struct wl_display *display;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct wl_seat *seat;
+	struct xdg_wm_base *wm_base;
+	struct zwlr_virtual_pointer_manager_v1 *pointer_manager;
+	struct zwp_virtual_keyboard_manager_v1 *keyboard_manager;
+	struct zwlr_virtual_pointer_v1 *virtual_pointer;
+	struct zwp_virtual_keyboard_v1 *virtual_keyboard;
+	uint32_t time_ms; // timestamp for the next synthetic event
+	uint32_t modifiers; // depressed, as last replayed
+
+	struct tinywl_rec_header header;
+	struct replay_window windows[REPLAY_MAX_WINDOWS];
+	int n_windows;
+	bool with_shell;
+};
+
+static uint64_t lag_samples[REPLAY_MAX_SAMPLES];
+static int n_lag;
+static uint64_t frame_samples[REPLAY_MAX_SAMPLES];
+static int n_frame;
+
+static void add_sample(uint64_t *samples, int *n, uint64_t value) {
+	if (*n < REPLAY_MAX_SAMPLES) {
+		samples[(*n)++] = value;
+	}
+}
+
+// Dispatches until deadline_ns, or until *done is set if given
+static bool replay_wait_until(struct replay *replay, bool *done, uint64_t deadline_ns) {
+	while (done == NULL || !*done) {
+		if (wl_display_prepare_read(replay->display) != 0) {
+			wl_display_dispatch_pending(replay->display);
+			continue;
+		}
+		wl_display_flush(replay->display);
+		uint64_t now = now_ns();
+		if (now >= deadline_ns) {
+			wl_display_cancel_read(replay->display);
+			return done == NULL;
+		}
+		struct pollfd pfd = { .fd = wl_display_get_fd(replay->display), .events = POLLIN };
+		int ret = poll(&pfd, 1, (int)((deadline_ns - now) / 1000000ull) + 1);
+		if (ret <= 0) {
+			wl_display_cancel_read(replay->display);
+			if (ret < 0 && errno != EINTR) return false;
+			continue;
+		}
+		if (wl_display_read_events(replay->display) < 0 ||
+				wl_display_dispatch_pending(replay->display) < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// -------------------------------------------------------------------------
+// Stand-in windows: shm buffers of the recorded sizes
+// -------------------------------------------------------------------------
+static void window_frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+	struct replay_window *window = data;
+	wl_callback_destroy(callback);
+	window->frame_callback = NULL;
+	add_sample(frame_samples, &n_frame, now_ns() - window->frame_requested_ns);
+}
+
+static const struct wl_callback_listener window_frame_listener = {
+	.done = window_frame_done,
+};
+
+static void window_xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+	struct replay_window *window = data;
+	xdg_surface_ack_configure(xdg_surface, serial);
+	window->configured = true;
+}
+
+static const struct xdg_surface_listener window_xdg_surface_listener = {
+	.configure = window_xdg_surface_configure,
+};
+
+// The recorded commits decide the sizes, not the configures
+static void window_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
+		int32_t width, int32_t height, struct wl_array *states) {
+}
+
+static void window_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel) {
+}
+
+static const struct xdg_toplevel_listener window_xdg_toplevel_listener = {
+	.configure = window_xdg_toplevel_configure,
+	.close = window_xdg_toplevel_close,
+};
+
+static struct replay_window *window_find(struct replay *replay, uint64_t recorded_id) {
+	for (int i = 0; i < replay->n_windows; i++) {
+		if (replay->windows[i].recorded_id == recorded_id) {
+			return &replay->windows[i];
+		}
+	}
+	return NULL;
+}
+
+static void window_open(struct replay *replay, const struct tinywl_rec_window *rec,
+		const char *app_id, size_t app_id_len) {
+	if (((rec->flags & TINYWL_REC_WINDOW_SHELL) && !replay->with_shell) ||
+			window_find(replay, rec->id) != NULL) {
+		return;
+	}
+	if (replay->n_windows == REPLAY_MAX_WINDOWS) {
+		fprintf(stderr, "more than %d windows at once, ignoring the rest\n", REPLAY_MAX_WINDOWS);
+		return;
+	}
+	struct replay_window *window = &replay->windows[replay->n_windows++];
+	*window = (struct replay_window){ .replay = replay, .recorded_id = rec->id };
+	// The title is how we find the stand-in in workspace_state.json
+	snprintf(window->title, sizeof(window->title), "replay %p", (void *)(uintptr_t)rec->id);
+	char app[128];
+	snprintf(app, sizeof(app), "%.*s", (int)app_id_len, app_id);
+
+	window->surface = wl_compositor_create_surface(replay->compositor);
+	window->xdg_surface = xdg_wm_base_get_xdg_surface(replay->wm_base, window->surface);
+	xdg_surface_add_listener(window->xdg_surface, &window_xdg_surface_listener, window);
+	window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
+	xdg_toplevel_add_listener(window->xdg_toplevel, &window_xdg_toplevel_listener, window);
+	xdg_toplevel_set_app_id(window->xdg_toplevel, app[0] != '\0' ? app : "replay");
+	xdg_toplevel_set_title(window->xdg_toplevel, window->title);
+	wl_surface_commit(window->surface);
+	// The recorded client waited for its configure too
+	replay_wait_until(replay, &window->configured, now_ns() + 1000000000ull);
+}
+
+static void window_close(struct replay *replay, uint64_t recorded_id) {
+	struct replay_window *window = window_find(replay, recorded_id);
+	if (window == NULL) {
+		return;
+	}
+	if (window->frame_callback != NULL) {
+		wl_callback_destroy(window->frame_callback);
+	}
+	xdg_toplevel_destroy(window->xdg_toplevel);
+	xdg_surface_destroy(window->xdg_surface);
+	wl_surface_destroy(window->surface);
+	if (window->buffer != NULL) {
+		wl_buffer_destroy(window->buffer);
+	}
+	// Keep the array packed, pointing the moved window's listeners at its
+	// new slot
+	struct replay_window *last = &replay->windows[--replay->n_windows];
+	if (window != last) {
+		*window = *last;
+		xdg_surface_set_user_data(window->xdg_surface, window);
+		xdg_toplevel_set_user_data(window->xdg_toplevel, window);
+		if (window->frame_callback != NULL) {
+			wl_callback_set_user_data(window->frame_callback, window);
+		}
+	}
+}
+
+static void window_commit(struct replay *replay, const struct tinywl_rec_commit *rec) {
+	struct replay_window *window = window_find(replay, rec->id);
+	// Before the first configure a buffer would be a protocol error
+	if (window == NULL || !window->configured || rec->width <= 0 || rec->height <= 0) {
+		return;
+	}
+	if (window->buffer == NULL || window->width != rec->width || window->height != rec->height) {
+		if (window->buffer != NULL) {
+			wl_buffer_destroy(window->buffer);
+		}
+		uint32_t color = 0xff000000 | (uint32_t)(rec->id * 2654435761u >> 8);
+		window->buffer = create_buffer(replay->shm, rec->width, rec->height, color);
+		window->width = rec->width;
+		window->height = rec->height;
+	}
+	wl_surface_attach(window->surface, window->buffer, 0, 0);
+	if (rec->damage_width > 0 && rec->damage_height > 0) {
+		wl_surface_damage_buffer(window->surface, rec->damage_x, rec->damage_y,
+			rec->damage_width, rec->damage_height);
+	}
+	// Timed from the first commit that has to wait for it
+	if (window->frame_callback == NULL) {
+		window->frame_requested_ns = now_ns();
+		window->frame_callback = wl_surface_frame(window->surface);
+		wl_callback_add_listener(window->frame_callback, &window_frame_listener, window);
+	}
+	wl_surface_commit(window->surface);
+}
+
+// -------------------------------------------------------------------------
+// Compositor IPC: commands naming windows by their stand-ins
+// -------------------------------------------------------------------------
+// Keeps the stand-ins drawing while the compositor works through a command
+static void ipc_wait(struct replay *replay) {
+	uint64_t deadline = now_ns() + REPLAY_IPC_TIMEOUT_MS * 1000000ull;
+	while (ipc_pending() && now_ns() < deadline) {
+		replay_wait_until(replay, NULL, now_ns() + 5000000ull);
+	}
+}
+
+static void found_id(const char *title, const char *id, void *data) {
+	struct replay_window *window = window_find(data, strtoull(title, NULL, 16));
+	if (window != NULL) {
+		snprintf(window->live_id, sizeof(window->live_id), "%s", id);
+	}
+}
+
+// Fills in live ids from workspace_state.json
+static void lookup_ids(struct replay *replay) {
+	lookup_window_ids("replay ", found_id, replay);
+}
+
+// Swaps every recorded window id on the line for its stand-in's. Returns
+// false when a window it names has no stand-in (yet).
+static bool ipc_translate(struct replay *replay, const char *line, char *out, size_t size) {
+	size_t len = 0;
+	out[0] = '\0';
+	const char *p = line;
+	while (*p != '\0') {
+		size_t span = strcspn(p, " ");
+		char token[64];
+		snprintf(token, sizeof(token), "%.*s", (int)(span < sizeof(token) ? span : sizeof(token) - 1), p);
+		char *end;
+		uint64_t id = strncmp(token, "0x", 2) == 0 ? strtoull(token, &end, 16) : 0;
+		struct replay_window *window = NULL;
+		if (id != 0 && *end == '\0' && span < sizeof(token)) {
+			window = window_find(replay, id);
+			if (window == NULL) {
+				return false;
+			}
+			if (window->live_id[0] == '\0') {
+				// It mapped moments ago; workspace_state.json has caught up by now
+				lookup_ids(replay);
+				if (window->live_id[0] == '\0') return false;
+			}
+		}
+		int n = window != NULL ?
+			snprintf(out + len, size - len, "%s", window->live_id) :
+			snprintf(out + len, size - len, "%.*s", (int)span, p);
+		if (n < 0 || (size_t)n >= size - len) return false;
+		len += n;
+		p += span;
+		while (*p == ' ') {
+			if (len + 1 < size) out[len++] = ' ';
+			p++;
+		}
+		out[len] = '\0';
+	}
+	return true;
+}
+
+// -------------------------------------------------------------------------
+// Input: through the virtual pointer and keyboard
+// -------------------------------------------------------------------------
+// Positions are relative to the recorded layout, so a differently sized
+// one gets the same motion scaled to fit
+static void replay_motion(struct replay *replay, const struct tinywl_rec_motion *rec) {
+	struct tinywl_rec_header *header = &replay->header;
+	int64_t x = rec->x - (int64_t)header->layout_x * TINYWL_REC_FIXED;
+	int64_t y = rec->y - (int64_t)header->layout_y * TINYWL_REC_FIXED;
+	uint32_t width = (uint32_t)header->layout_width * TINYWL_REC_FIXED;
+	uint32_t height = (uint32_t)header->layout_height * TINYWL_REC_FIXED;
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x >= width) x = width - 1;
+	if (y >= height) y = height - 1;
+	zwlr_virtual_pointer_v1_motion_absolute(replay->virtual_pointer, replay->time_ms++,
+		(uint32_t)x, (uint32_t)y, width, height);
+	zwlr_virtual_pointer_v1_frame(replay->virtual_pointer);
+}
+
+static void replay_axis(struct replay *replay, const struct tinywl_rec_axis *rec) {
+	zwlr_virtual_pointer_v1_axis_source(replay->virtual_pointer, rec->source);
+	wl_fixed_t value = wl_fixed_from_double((double)rec->delta / TINYWL_REC_FIXED);
+	if (rec->delta_discrete != 0) {
+		zwlr_virtual_pointer_v1_axis_discrete(replay->virtual_pointer, replay->time_ms++,
+			rec->orientation, value, rec->delta_discrete);
+	} else {
+		zwlr_virtual_pointer_v1_axis(replay->virtual_pointer, replay->time_ms++,
+			rec->orientation, value);
+	}
+	zwlr_virtual_pointer_v1_frame(replay->virtual_pointer);
+}
+
+// -------------------------------------------------------------------------
+// The recording
+// -------------------------------------------------------------------------
+static void registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
+		const char *interface, uint32_t version) {
+	struct replay *replay = data;
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		// damage_buffer is version 4
+		replay->compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		replay->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, wl_seat_interface.name) == 0 && replay->seat == NULL) {
+		replay->seat = wl_registry_bind(registry, name, &wl_seat_interface, 1);
+	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		replay->wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(replay->wm_base, &wm_base_listener, replay);
+	} else if (strcmp(interface, zwlr_virtual_pointer_manager_v1_interface.name) == 0) {
+		replay->pointer_manager = wl_registry_bind(registry, name,
+			&zwlr_virtual_pointer_manager_v1_interface, 1);
+	} else if (strcmp(interface, zwp_virtual_keyboard_manager_v1_interface.name) == 0) {
+		replay->keyboard_manager = wl_registry_bind(registry, name,
+			&zwp_virtual_keyboard_manager_v1_interface, 1);
+	}
+}
+
+static void registry_handle_global_remove(void *data, struct wl_registry *registry, uint32_t name) {
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_handle_global,
+	.global_remove = registry_handle_global_remove,
+};
+
+static char *read_file(const char *path, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *data = len > 0 ? malloc(len) : NULL;
+	if (data == NULL || fread(data, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "%s: cannot read\n", path);
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*size = len;
+	return data;
+}
+
+// Returns false when the recording asked to quit the compositor
+static bool replay_event(struct replay *replay, const struct tinywl_rec_event *event, const char *payload) {
+	switch (event->type) {
+	case TINYWL_REC_MOTION:
+		if (event->size >= sizeof(struct tinywl_rec_motion)) {
+			replay_motion(replay, (const struct tinywl_rec_motion *)payload);
+		}
+		break;
+	case TINYWL_REC_BUTTON:
+		if (event->size >= sizeof(struct tinywl_rec_button)) {
+			const struct tinywl_rec_button *rec = (const void *)payload;
+			zwlr_virtual_pointer_v1_button(replay->virtual_pointer, replay->time_ms++,
+				rec->button, rec->state);
+			zwlr_virtual_pointer_v1_frame(replay->virtual_pointer);
+		}
+		break;
+	case TINYWL_REC_AXIS:
+		if (event->size >= sizeof(struct tinywl_rec_axis)) {
+			replay_axis(replay, (const struct tinywl_rec_axis *)payload);
+		}
+		break;
+	case TINYWL_REC_KEY:
+		if (event->size >= sizeof(struct tinywl_rec_key)) {
+			const struct tinywl_rec_key *rec = (const void *)payload;
+			if (rec->keycode == KEY_ESC && rec->state == WL_KEYBOARD_KEY_STATE_PRESSED &&
+					(replay->modifiers & REPLAY_ALT_MASK)) {
+				return false;
+			}
+			zwp_virtual_keyboard_v1_key(replay->virtual_keyboard, replay->time_ms++,
+				rec->keycode, rec->state);
+		}
+		break;
+	case TINYWL_REC_MODIFIERS:
+		if (event->size >= sizeof(struct tinywl_rec_modifiers)) {
+			const struct tinywl_rec_modifiers *rec = (const void *)payload;
+			replay->modifiers = rec->depressed;
+			zwp_virtual_keyboard_v1_modifiers(replay->virtual_keyboard,
+				rec->depressed, rec->latched, rec->locked, rec->group);
+		}
+		break;
+	case TINYWL_REC_MAP:
+		if (event->size >= sizeof(struct tinywl_rec_window)) {
+			window_open(replay, (const struct tinywl_rec_window *)payload,
+				payload + sizeof(struct tinywl_rec_window),
+				event->size - sizeof(struct tinywl_rec_window));
+		}
+		break;
+	case TINYWL_REC_UNMAP:
+		if (event->size >= sizeof(struct tinywl_rec_window)) {
+			window_close(replay, ((const struct tinywl_rec_window *)payload)->id);
+		}
+		break;
+	case TINYWL_REC_COMMIT:
+		if (event->size >= sizeof(struct tinywl_rec_commit)) {
+			window_commit(replay, (const struct tinywl_rec_commit *)payload);
+		}
+		break;
+	case TINYWL_REC_IPC: {
+		char line[1024], command[1024];
+		snprintf(line, sizeof(line), "%.*s", (int)event->size, payload);
+		// Ours comes at the end, covering the whole replay
+		if (strcmp(line, "LATENCY_REPORT") == 0) {
+			break;
+		}
+		// What the app did is in the recording already, as a stand-in.
+		// Parsed the way tinywl parses it, so nothing slips past
+		char action[32];
+		if (sscanf(line, "%31s", action) == 1 && strcmp(action, "LAUNCH") == 0) {
+			break;
+		}
+		// The mapping of a window the command names may still be in flight
+		wl_display_roundtrip(replay->display);
+		if (!ipc_translate(replay, line, command, sizeof(command))) {
+			fprintf(stderr, "skipping IPC for a window without a stand-in: %s\n", line);
+			break;
+		}
+		ipc_wait(replay);
+		if (ipc_send(command)) {
+			ipc_wait(replay);
+		}
+		break;
+	}
+	default:
+		// From a newer tinywl; the size lets us step over it
+		break;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	struct replay replay = {0};
+	bool fast = false, quit = false;
+	int c;
+	while ((c = getopt(argc, argv, "fSxh")) != -1) {
+		switch (c) {
+		case 'f':
+			fast = true;
+			break;
+		case 'S':
+			replay.with_shell = true;
+			break;
+		case 'x':
+			quit = true;
+			break;
+		default:
+			printf("Usage: %s [-f as fast as possible] [-S include the shell's window] "
+				"[-x quit tinywl when done] recording\n", argv[0]);
+			return 0;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "no recording given\n");
+		return 1;
+	}
+
+	size_t size;
+	char *data = read_file(argv[optind], &size);
+	if (data == NULL) {
+		return 1;
+	}
+	if (size < sizeof(replay.header)) {
+		fprintf(stderr, "%s: too short for a recording\n", argv[optind]);
+		return 1;
+	}
+	memcpy(&replay.header, data, sizeof(replay.header));
+	if (replay.header.magic != TINYWL_REC_MAGIC || replay.header.version != TINYWL_REC_VERSION) {
+		fprintf(stderr, "%s: not a version %d tinywl recording\n", argv[optind], TINYWL_REC_VERSION);
+		return 1;
+	}
+	if (replay.header.layout_width <= 0 || replay.header.layout_height <= 0) {
+		// Recorded before any output was up: assume the usual headless size
+		replay.header.layout_width = 1920;
+		replay.header.layout_height = 1080;
+	}
+
+	replay.display = wl_display_connect(NULL);
+	if (replay.display == NULL) {
+		fprintf(stderr, "cannot connect to a Wayland display\n");
+		return 1;
+	}
+	struct wl_registry *registry = wl_display_get_registry(replay.display);
+	wl_registry_add_listener(registry, &registry_listener, &replay);
+	wl_display_roundtrip(replay.display);
+	if (replay.compositor == NULL || replay.shm == NULL || replay.seat == NULL ||
+			replay.wm_base == NULL) {
+		fprintf(stderr, "compositor is missing core globals\n");
+		return 1;
+	}
+	if (replay.pointer_manager == NULL || replay.keyboard_manager == NULL) {
+		fprintf(stderr, "compositor does not offer virtual pointer/keyboard\n");
+		return 1;
+	}
+	// Not tied to an output, so absolute motion spans the whole layout
+	replay.virtual_pointer = zwlr_virtual_pointer_manager_v1_create_virtual_pointer(
+		replay.pointer_manager, replay.seat);
+	replay.virtual_keyboard = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(
+		replay.keyboard_manager, replay.seat);
+	upload_keymap(replay.virtual_keyboard);
+	wl_display_roundtrip(replay.display);
+
+	// Start the compositor's counters from here
+	if (ipc_send("LATENCY_REPORT")) {
+		ipc_wait(&replay);
+	}
+
+	uint64_t start_ns = now_ns(), recorded_ns = 0;
+	int n_events = 0;
+	bool quit_recorded = false;
+	size_t offset = sizeof(replay.header);
+	while (offset + sizeof(struct tinywl_rec_event) <= size) {
+		struct tinywl_rec_event event;
+		memcpy(&event, data + offset, sizeof(event));
+		offset += sizeof(event);
+		if (offset + event.size > size) {
+			fprintf(stderr, "recording cut short after %d events\n", n_events);
+			break;
+		}
+		// Payloads are packed back to back; copy out to keep them aligned
+		char payload[UINT16_MAX + 1] __attribute__((aligned(8)));
+		memcpy(payload, data + offset, event.size);
+		offset += event.size;
+
+		recorded_ns += (uint64_t)event.delta_us * 1000;
+		if (!fast) {
+			uint64_t due_ns = start_ns + recorded_ns;
+			replay_wait_until(&replay, NULL, due_ns);
+			// How far the compositor (or we) held events back
+			uint64_t now = now_ns();
+			add_sample(lag_samples, &n_lag, now > due_ns ? now - due_ns : 0);
+		}
+		if (!replay_event(&replay, &event, payload)) {
+			quit_recorded = true;
+			break;
+		}
+		n_events++;
+		if (fast) {
+			wl_display_flush(replay.display);
+			wl_display_dispatch_pending(replay.display);
+		}
+	}
+	// Let the last frames come back
+	wl_display_roundtrip(replay.display);
+	replay_wait_until(&replay, NULL, now_ns() + 100000000ull);
+
+	printf("%-24s %d events, %.2fs recorded, %.2fs replayed%s\n", "replay", n_events,
+		recorded_ns / 1e9, (now_ns() - start_ns) / 1e9,
+		quit_recorded ? " (stopped at the recorded Alt+Escape)" : "");
+	if (!fast) {
+		print_samples("schedule_lag", lag_samples, n_lag);
+	}
+	print_samples("commit_to_frame_done", frame_samples, n_frame);
+	print_compositor_report();
+
+	if (quit) {
+		zwp_virtual_keyboard_v1_modifiers(replay.virtual_keyboard, REPLAY_ALT_MASK, 0, 0, 0);
+		zwp_virtual_keyboard_v1_key(replay.virtual_keyboard, replay.time_ms++,
+			KEY_ESC, WL_KEYBOARD_KEY_STATE_PRESSED);
+		wl_display_flush(replay.display);
+	}
+	while (replay.n_windows > 0) {
+		window_close(&replay, replay.windows[0].recorded_id);
+	}
+	zwp_virtual_keyboard_v1_destroy(replay.virtual_keyboard);
+	zwlr_virtual_pointer_v1_destroy(replay.virtual_pointer);
+	wl_display_disconnect(replay.display);
+	free(data);
+	return 0;
+}
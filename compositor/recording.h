@@ -0,0 +1,81 @@
+// Recording file (tinywl -R, replayed by bench/replay): a header, then one
+// variable-size event after another, each an 8-byte tinywl_rec_event and
+// `size` bytes of payload. Little-endian, as written by the host.
+#ifndef TINYWL_RECORDING_H
+#define TINYWL_RECORDING_H
+
+#include <stdint.h>
+
+#define TINYWL_REC_MAGIC 0x43525754 /* "TWRC" */
+#define TINYWL_REC_VERSION 1
+// Pointer positions and scroll deltas are fixed point with 8 fraction bits
+#define TINYWL_REC_FIXED 256
+
+struct tinywl_rec_header {
+	uint32_t magic;
+	uint32_t version;
+	int32_t layout_x, layout_y; // the output layout when recording started
+	int32_t layout_width, layout_height;
+};
+
+enum tinywl_rec_type {
+	TINYWL_REC_MOTION, // tinywl_rec_motion: where the cursor ended up
+	TINYWL_REC_BUTTON, // tinywl_rec_button
+	TINYWL_REC_AXIS, // tinywl_rec_axis
+	TINYWL_REC_KEY, // tinywl_rec_key
+	TINYWL_REC_MODIFIERS, // tinywl_rec_modifiers
+	TINYWL_REC_MAP, // tinywl_rec_window, then the app id (not terminated)
+	TINYWL_REC_UNMAP, // tinywl_rec_window
+	TINYWL_REC_COMMIT, // tinywl_rec_commit
+	TINYWL_REC_IPC, // one command line as dispatched (not terminated)
+};
+
+struct tinywl_rec_event {
+	uint32_t delta_us; // since the previous event; longer gaps are cut short
+	uint16_t type; // enum tinywl_rec_type
+	uint16_t size; // of the payload that follows
+};
+
+struct tinywl_rec_motion {
+	int32_t x, y; // layout coordinates, TINYWL_REC_FIXED
+};
+
+struct tinywl_rec_button {
+	uint32_t button; // linux/input-event-codes.h
+	uint32_t state; // enum wl_pointer_button_state
+};
+
+struct tinywl_rec_axis {
+	uint32_t orientation; // enum wl_pointer_axis
+	uint32_t source; // enum wl_pointer_axis_source
+	int32_t delta; // TINYWL_REC_FIXED
+	int32_t delta_discrete;
+};
+
+struct tinywl_rec_key {
+	uint32_t keycode; // evdev, without the xkb offset of 8
+	uint32_t state; // enum wl_keyboard_key_state
+};
+
+struct tinywl_rec_modifiers {
+	uint32_t depressed, latched, locked, group;
+};
+
+// Windows are named by the id workspace_state.json and IPC commands use
+struct tinywl_rec_window {
+	uint64_t id;
+	uint32_t flags; // TINYWL_REC_WINDOW_*
+	uint32_t reserved;
+};
+
+#define TINYWL_REC_WINDOW_SHELL 1u
+#define TINYWL_REC_WINDOW_X11 2u
+
+struct tinywl_rec_commit {
+	uint64_t id;
+	int32_t width, height; // of the buffer, 0 when the window has none
+	// Bounding box of the commit's buffer damage, empty when nothing changed
+	int32_t damage_x, damage_y, damage_width, damage_height;
+};
+
+#endif
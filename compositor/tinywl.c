@@ -1,31 +1,91 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dirent.h>
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
 #include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
+#include <wlr/config.h>
+#include <wlr/interfaces/wlr_buffer.h>
 #include <wlr/render/allocator.h>
+#include <wlr/render/swapchain.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_data_device.h>
+#include <wlr/types/wlr_fractional_scale_v1.h>
+#include <wlr/types/wlr_idle_inhibit_v1.h>
+#include <wlr/types/wlr_idle_notify_v1.h>
 #include <wlr/types/wlr_input_device.h>
 #include <wlr/types/wlr_keyboard.h>
+#include <wlr/types/wlr_layer_shell_v1.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/types/wlr_pointer.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_subcompositor.h>
+#include <wlr/types/wlr_viewporter.h>
+#include <wlr/types/wlr_virtual_keyboard_v1.h>
+#include <wlr/types/wlr_virtual_pointer_v1.h>
 #include <wlr/types/wlr_xcursor_manager.h>
+#include <wlr/types/wlr_xdg_activation_v1.h>
+#include <wlr/types/wlr_xdg_output_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/types/wlr_buffer.h>
 #include <wlr/util/log.h>
+#if WLR_HAS_XWAYLAND
+#include <wlr/xwayland.h>
+#endif
 #include <xkbcommon/xkbcommon.h>
+#include "recording.h"
+// Built with FLUTTER_ENGINE set, -E runs the shell inside tinywl
+#ifndef TINYWL_HAS_FLUTTER
+#define TINYWL_HAS_FLUTTER 0
+#endif
+#if TINYWL_HAS_FLUTTER
+#include <flutter_embedder.h>
+#include <linux/input-event-codes.h>
+#endif
+
+// Window layout, in logical pixels like the output layout itself, so the
+// same on any output scale
+#define TINYWL_FALLBACK_WIDTH 1920 // layout size before any output is up
+#define TINYWL_FALLBACK_HEIGHT 1080
+#define TINYWL_WINDOW_WIDTH 800 // new and restored floating windows; see server_window_box
+#define TINYWL_WINDOW_HEIGHT 600
+#define TINYWL_DOCKED_WIDTH 1280 // docked windows keep rendering at this size
+#define TINYWL_DOCKED_HEIGHT 720
+#define TINYWL_DOCK_HOVER_MARGIN 60 // dragging this close to a side edge docks there
+// Docked windows are only seen as previews, so they render at this
+// fraction of their output's scale
+#define TINYWL_DOCKED_SCALE 0.5f
+// Output scales -S accepts
+#define TINYWL_SCALE_MIN 0.5f
+#define TINYWL_SCALE_MAX 4.0f
 
 enum tinywl_cursor_mode {
 	TINYWL_CURSOR_PASSTHROUGH,
@@ -33,6 +93,211 @@ enum tinywl_cursor_mode {
 	TINYWL_CURSOR_RESIZE,
 };
 
+// Session file: a fixed header followed by fixed-size records, so it can be
+// mmap'd and updated one record at a time without rewriting the whole file.
+#define TINYWL_SESSION_MAGIC 0x53535754 /* "TWSS" */
+#define TINYWL_SESSION_VERSION 1
+#define TINYWL_SESSION_SLOTS 64
+
+struct tinywl_session_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t slots;
+};
+
+struct tinywl_session_record {
+	uint32_t in_use; // written last, so a half-written record is never restored
+	int32_t docked_side;
+	uint32_t maximized;
+	int32_t saved_x;
+	int32_t saved_y;
+	int32_t saved_width;
+	int32_t saved_height;
+	uint32_t reserved;
+	char app_id[64];
+	char title[160];
+};
+
+enum tinywl_startup_phase {
+	TINYWL_PHASE_PROCESS_START,
+	TINYWL_PHASE_BACKEND_START,
+	TINYWL_PHASE_FIRST_OUTPUT_COMMIT,
+	TINYWL_PHASE_CLIENT_CONNECT,
+	TINYWL_PHASE_FIRST_COMMIT,
+	TINYWL_PHASE_FIRST_MAP,
+	TINYWL_PHASE_SHELL_FIRST_FRAME,
+	TINYWL_PHASE_COUNT,
+};
+
+// Input whose effect is timed until the frame showing it is presented
+enum tinywl_input_kind {
+	TINYWL_INPUT_MOTION,
+	TINYWL_INPUT_BUTTON,
+	TINYWL_INPUT_KEY,
+	TINYWL_INPUT_DOCK, // the button release that docked a dragged window
+	TINYWL_INPUT_COUNT,
+};
+
+#define TINYWL_LATENCY_SAMPLES 256
+
+struct tinywl_latency {
+	uint32_t samples_us[TINYWL_LATENCY_SAMPLES]; // ring, newest overwrite oldest
+	uint32_t count; // total recorded since the last report
+};
+
+// The wallpaper scaled and cropped to one output size, shared by every
+// output of that size. Freed by wlroots when the last scene buffer lets go.
+struct tinywl_wallpaper {
+	struct wlr_buffer base;
+	struct wl_list link; // tinywl_server.wallpapers
+	uint32_t *data; // XRGB8888, stride width * 4
+};
+
+#define TINYWL_WALLPAPER_SIZES 8 // output sizes one job scales for
+
+// Decoding and scaling, on a thread of its own. The event loop fills it in,
+// then leaves it alone until done_fd fires.
+struct tinywl_wallpaper_job {
+	pthread_t thread;
+	bool threaded; // false when it had to run on the event loop
+	int done_fd; // the server's completion eventfd
+	char *path; // the image to decode, or NULL to scale the current one
+	GdkPixbuf *source; // decoded, or a reference to the current image
+	char *error; // why decoding failed
+	int n_sizes;
+	struct {
+		int width, height;
+		uint32_t *data; // NULL if the allocation failed
+	} sizes[TINYWL_WALLPAPER_SIZES];
+};
+
+#define TINYWL_HUD_FRAMES 60 // frame time history per output
+#define TINYWL_HUD_TOPLEVELS 8 // commit-rate bars
+
+// Performance overlay for one output, built from plain scene rects so it
+// needs no font or renderer of its own. tree is NULL while the HUD is off.
+struct tinywl_hud {
+	struct wlr_scene_tree *tree;
+	struct wlr_scene_rect *frame_bars[TINYWL_HUD_FRAMES];
+	struct wlr_scene_rect *budget_line;
+	struct wlr_scene_rect *skipped_bar;
+	struct wlr_scene_rect *commit_bars[TINYWL_HUD_TOPLEVELS];
+	struct wlr_scene_rect *thumb_bar;
+	struct wlr_scene_rect *thumb_queue_bar;
+	struct wlr_scene_rect *ipc_bar;
+};
+
+// Ordered so that a process with several windows takes its best one
+enum tinywl_sched_class {
+	TINYWL_SCHED_PARKED, // every window docked
+	TINYWL_SCHED_BACKGROUND, // on screen, not the focused window
+	TINYWL_SCHED_FOREGROUND, // owns the most recently focused window: left as it was
+	TINYWL_SCHED_COUNT,
+};
+
+// One thread's priorities from before we first touched its process
+struct tinywl_sched_thread {
+	pid_t tid;
+	int nice, ioprio;
+};
+
+// A client process we have moved or reniced
+struct tinywl_sched_proc {
+	struct wl_list link;
+	pid_t pid;
+	enum tinywl_sched_class applied;
+	int wanted; // during a pass; -1 once it has no windows left
+	bool saved; // cgroup and threads hold what to go back to
+	bool moved; // out of `cgroup` into one of our leaves
+	bool reniced; // threads changed from what `threads` holds
+	char cgroup[256]; // original cgroup v2 path, "" if unknown
+	struct wl_array threads; // tinywl_sched_thread
+};
+
+enum tinywl_easing {
+	TINYWL_EASE_OUT_CUBIC,
+	TINYWL_EASE_IN_OUT_CUBIC,
+};
+
+// A window in flight between two boxes. The real scene node jumps to its
+// destination at once and stays hidden; a scene buffer holding the window's
+// last frame is scaled and faded in its place until the transition ends.
+struct tinywl_animation {
+	struct wl_list link; // tinywl_server.animations, only while running
+	struct wlr_scene_buffer *snapshot; // NULL when not running
+	struct wlr_box from, to; // window geometry in layout coordinates
+	int offset_x, offset_y; // buffer origin relative to the geometry at the from size
+	int buffer_width, buffer_height;
+	float from_opacity, to_opacity;
+	uint64_t start_ns, duration_ns;
+	enum tinywl_easing easing;
+};
+
+#define TINYWL_THUMB_WORKERS 2
+#define TINYWL_QUEUE_SIZE 64 // power of two
+
+// Single-producer single-consumer ring: one thread only pushes, the other
+// only pops, so the two indices are all the synchronization it needs
+struct tinywl_spsc {
+	_Atomic size_t head, tail;
+	void *slots[TINYWL_QUEUE_SIZE];
+};
+
+struct tinywl_thumb_worker {
+	pthread_t thread;
+	int wake_fd; // eventfd: jobs queued, or time to stop
+	int done_fd; // the server's completion eventfd
+	atomic_bool stop;
+	struct tinywl_spsc jobs; // event loop -> worker
+	struct tinywl_spsc done; // worker -> event loop
+	int outstanding; // event loop only: pushed and not yet collected
+};
+
+// Growable byte buffer, owned by the server and reused between documents
+struct tinywl_buf {
+	char *data;
+	size_t len, cap;
+	bool failed; // an allocation failed; the contents are incomplete
+};
+
+#if TINYWL_HAS_FLUTTER
+#define TINYWL_FLUTTER_BUFFERS 2
+
+struct tinywl_flutter_buffer {
+	struct wlr_buffer base;
+	void *data; // ARGB8888, width * 4 bytes a row
+};
+
+struct tinywl_flutter_task {
+	FlutterTask task;
+	uint64_t target_ns; // FlutterEngineGetCurrentTime() clock
+};
+
+// The embedded shell (-E)
+struct tinywl_flutter {
+	char *bundle; // `flutter build linux` bundle directory
+	FlutterEngine engine; // NULL when not embedding
+	FlutterEngineAOTData aot_data;
+	pthread_t thread; // ours; the engine's platform and render thread
+	struct wlr_scene_tree *tree; // between the bottom layer and the windows
+	struct wlr_scene_buffer *view;
+	struct tinywl_flutter_buffer *buffers[TINYWL_FLUTTER_BUFFERS];
+	struct wlr_box box; // layout coordinates it covers
+	float scale;
+
+	pthread_mutex_t lock; // tasks are posted from the engine's threads
+	struct tinywl_flutter_task *tasks;
+	size_t task_count, task_cap;
+	int wake_fd;
+	struct wl_event_source *wake_source;
+	struct wl_event_source *timer; // for the earliest task not yet due
+
+	bool pointer_added;
+	int64_t buttons; // FlutterPointerMouseButtons held on the shell
+};
+#endif
+
 struct tinywl_server {
 	struct wl_display *wl_display;
 	struct wlr_backend *backend;
@@ -40,11 +305,33 @@ struct tinywl_server {
 	struct wlr_allocator *allocator;
 	struct wlr_scene *scene;
 	struct wlr_scene_output_layout *scene_layout;
+	struct wlr_compositor *compositor;
+	// Stacking: background, bottom, toplevels, top, overlay
+	struct wlr_scene_tree *layers[4]; // indexed by zwlr_layer_shell_v1_layer
+	struct wlr_scene_tree *toplevel_layer;
+	struct wlr_scene_tree *animation_layer; // window snapshots in flight
+	struct wl_list animations; // tinywl_animation.link
+	struct wl_list transaction; // tinywl_toplevel.txn_link, waiting for their clients
+	int transaction_depth; // open transaction_begin() calls
+	bool transaction_waiting; // the timeout is armed
+	struct wl_event_source *transaction_timer;
 
 	struct wlr_xdg_shell *xdg_shell;
 	struct wl_listener new_xdg_toplevel;
 	struct wl_listener new_xdg_popup;
 	struct wl_list toplevels;
+	struct wl_list focus_history; // tinywl_toplevel.mru_link, most recently focused first
+
+	struct wlr_layer_shell_v1 *layer_shell;
+	struct wl_listener new_layer_surface;
+	struct wl_list layer_surfaces;
+	struct tinywl_layer_surface *focused_layer;
+
+#if WLR_HAS_XWAYLAND
+	struct wlr_xwayland *xwayland;
+	struct wl_listener xwayland_ready;
+	struct wl_listener new_xwayland_surface;
+#endif
 
 	struct wlr_cursor *cursor;
 	struct wlr_xcursor_manager *cursor_mgr;
@@ -66,27 +353,190 @@ struct tinywl_server {
 	uint32_t resize_edges;
 
 	struct wlr_output_layout *output_layout;
+	float output_scale; // -S, or 0 to pick per output
 	struct wl_listener layout_change; 
 	struct wl_list outputs;
 	struct wl_listener new_output;
     
 	struct wl_event_source *dock_ipc_timer;
+	int ipc_watch_fd; // embedded: the queue is watched rather than polled
+	struct wl_event_source *ipc_watch_source;
 	int last_hover; 
+
+	char runtime_dir[256];
+	int runtime_fd;
+
+	int session_fd;
+	struct tinywl_session_header *session_map;
+	struct tinywl_session_record *session_records;
+	uint64_t session_pending; // records left by a previous run, not yet claimed
+	uint64_t session_claimed; // records owned by a live toplevel
+	bool session_closing;
+
+	uint64_t startup[TINYWL_PHASE_COUNT]; // CLOCK_MONOTONIC ns, 0 = not reached
+	enum tinywl_startup_phase startup_ready_phase;
+	int ready_fd; // -r: gets "READY\n" once startup_ready_phase is reached
+	int startup_watch_fd;
+	struct wl_event_source *startup_watch_source;
+	struct wl_listener client_created;
+	pid_t shell_pid; // the -s process; 0 takes the first window, -1 means no shell
+
+	struct wlr_xdg_activation_v1 *xdg_activation;
+	struct wl_listener request_activate;
+	struct wl_list launches; // tinywl_launch, waiting for their window
+	struct wl_list launch_stats; // tinywl_launch_stats, most recent first
+	struct wl_array children; // pid_t of processes we spawned
+	struct wl_event_source *sigchld_source;
+
+	struct tinywl_buf json; // scratch for every JSON document we publish
+	struct tinywl_buf state_published; // last workspace_state.json written
+
+	size_t thumb_bytes; // pixels held by every thumbnail pyramid
+	struct tinywl_thumb_worker thumb_workers[TINYWL_THUMB_WORKERS];
+	int n_thumb_workers;
+	int thumb_next_worker;
+	int thumb_done_fd;
+	struct wl_event_source *thumb_done_source;
+	int popups;
+
+	struct wlr_idle_notifier_v1 *idle_notifier;
+	struct wlr_idle_inhibit_manager_v1 *idle_inhibit;
+	struct wl_listener new_idle_inhibitor;
+	int idle_inhibitors;
+	int idle_timeout_ms; // -i, 0 never goes idle
+	bool idle_outputs_off; // -d: also power outputs down while idle
+	bool idle;
+	uint64_t last_activity_ns;
+	struct wl_event_source *idle_timer;
+	struct wl_event_source *idle_frame_timer;
+
+	struct wlr_virtual_pointer_manager_v1 *virtual_pointer;
+	struct wl_listener new_virtual_pointer;
+	struct wlr_virtual_keyboard_manager_v1 *virtual_keyboard;
+	struct wl_listener new_virtual_keyboard;
+	uint64_t input_pending_ns[TINYWL_INPUT_COUNT]; // oldest input no frame has shown yet
+	struct tinywl_latency latency[TINYWL_INPUT_COUNT];
+	struct tinywl_latency frame_times; // building and committing damaged frames
+	uint32_t frames_skipped; // on any output, since the last LATENCY_REPORT
+
+	FILE *record; // -R, NULL when not recording
+	uint64_t record_last_ns; // when the last event was written
+	struct wl_event_source *record_flush_timer; // armed while events are buffered
+	bool record_flush_pending;
+
+	struct wlr_scene_tree *hud_layer; // above the overlay layer, never hit-tested (server_node_at)
+	bool hud_enabled;
+	struct wl_event_source *hud_timer;
+	uint32_t hud_thumb_jobs; // thumbnail jobs finished since the last HUD update
+	uint32_t hud_ipc_commands; // IPC commands handled since the last HUD update
+
+	int sched_cgroup_fd; // our delegated cgroup, one leaf per class; -1 without
+	bool sched_renice; // allowed to lower nice again, so the fallback can renice
+	bool sched_running;
+	struct wl_list sched_procs; // tinywl_sched_proc.link
+	struct wl_event_source *sched_idle;
+
+	struct wlr_scene_tree *switcher_layer; // between the overlay layer and the HUD
+	struct wlr_scene_tree *switcher; // NULL while closed
+	struct wlr_scene_rect *switcher_highlight;
+	struct tinywl_toplevel *switcher_selected;
+
+	struct wlr_scene_tree *wallpaper_layer; // below the background layer
+	char *wallpaper_path; // NULL without a wallpaper
+	GdkPixbuf *wallpaper_source; // decoded once, scaled for each output size
+	struct wl_list wallpapers; // tinywl_wallpaper.link
+	struct tinywl_wallpaper_job *wallpaper_job; // in flight, NULL when idle
+	char *wallpaper_next; // WALLPAPER that came in while a job was out
+	bool wallpaper_scale_failed; // don't retry a size that just failed
+	int wallpaper_done_fd;
+	struct wl_event_source *wallpaper_done_source;
+
+#if TINYWL_HAS_FLUTTER
+	struct tinywl_flutter flutter;
+#endif
+};
+
+struct tinywl_idle_inhibitor {
+	struct tinywl_server *server;
+	struct wl_listener destroy;
+};
+
+#define TINYWL_THUMB_LEVELS 4
+#define TINYWL_THUMB_REQUESTS 4
+#define TINYWL_THUMB_MAX_EDGE 1024
+#define TINYWL_THUMB_MIN_EDGE 16
+#define TINYWL_THUMB_BUDGET (16u << 20) // bytes of level pixels across all windows
+#define TINYWL_THUMB_DAMAGE_RECTS 16 // past this, pending damage collapses to its extents
+
+struct tinywl_thumb_level {
+	int width, height; // 0 when the window is too small for this level
+	uint32_t *pixels; // NULL until built, or after eviction
+	uint64_t last_used;
+};
+
+struct tinywl_thumb_request {
+	int width, height; // as asked for; 0 marks a free slot
+	int level;
+};
+
+// One thumbnail refresh. The event loop fills it in, then leaves it alone
+// until a worker hands it back; only `damage` is kept up while it is out.
+struct tinywl_thumb_job {
+	struct tinywl_toplevel *toplevel; // NULL once the window is destroyed
+	bool busy; // out with a worker
+	bool cancelled; // thumbnails were released while it was out
+	const void *id; // the toplevel's address, for file names
+	int runtime_fd;
+	uint8_t *src; // packed copy of the client buffer, reused between frames
+	size_t src_size;
+	int src_width, src_height;
+	bool src_valid; // src matches the client buffer outside `damage`
+	pixman_region32_t damage; // buffer damage committed since src was copied
+	int shift, deepest;
+	struct tinywl_thumb_level levels[TINYWL_THUMB_LEVELS]; // 0..deepest on loan from the toplevel
+	struct tinywl_thumb_request requests[TINYWL_THUMB_REQUESTS];
+};
+
+struct tinywl_launch {
+	struct wl_list link;
+	pid_t pid;
+	char token[64]; // xdg-activation token handed to the child
+	char name[64];
+	uint64_t start_ns;
+};
+
+struct tinywl_launch_stats {
+	struct wl_list link;
+	char app_id[64];
+	uint32_t launches;
+	uint32_t last_first_commit_ms;
+	uint32_t last_map_ms;
+	uint32_t max_map_ms;
+	uint64_t total_map_ms;
 };
 
 struct tinywl_output {
 	struct wl_list link;
 	struct tinywl_server *server;
 	struct wlr_output *wlr_output;
+	struct wlr_box usable_area; // output box minus layer-shell exclusive zones
 	struct wl_listener frame;
+	struct wl_listener present;
 	struct wl_listener request_state;
 	struct wl_listener destroy;
+	uint64_t input_committed_ns[TINYWL_INPUT_COUNT]; // input in the frame awaiting present
+
+	uint32_t frame_us[TINYWL_HUD_FRAMES]; // time spent building and committing each frame
+	int frame_index;
+	uint32_t frames_skipped; // failed commits and unpresented frames since the last HUD update
+	struct tinywl_hud hud;
+	struct wlr_scene_buffer *wallpaper;
 };
 
 struct tinywl_toplevel {
 	struct wl_list link;
 	struct tinywl_server *server;
-	struct wlr_xdg_toplevel *xdg_toplevel;
+	struct wlr_xdg_toplevel *xdg_toplevel; // NULL for X11 windows
 	struct wlr_scene_tree *scene_tree;
 	struct wl_listener map;
 	struct wl_listener unmap;
@@ -103,9 +553,66 @@ struct tinywl_toplevel {
 	double saved_x;
 	double saved_y;
 	struct wlr_box saved_geometry;
+
+	int session_slot; // -1 when the toplevel is not persisted
+	bool session_restored;
+	bool is_shell; // the workspace shell's own window, not a user app
+	pid_t pid; // client process from the socket credentials; 0 when unknown and for X11
+
+	uint64_t launch_ns; // set while matched to a LAUNCH whose latency is pending
+	uint64_t first_commit_ns;
+	uint64_t map_ns;
+
+	struct tinywl_thumb_level thumb_levels[TINYWL_THUMB_LEVELS];
+	struct tinywl_thumb_request thumb_requests[TINYWL_THUMB_REQUESTS];
+	uint32_t thumb_wanted; // bit per level some request resolves to
+	int thumb_shift; // level 0 is the buffer scaled down by 1 << thumb_shift
+	struct tinywl_thumb_job *thumb_job;
+	bool thumb_dirty; // committed while the job was out
+
+	struct wl_list popups; // tinywl_popup.link, nested popups included
+
+	struct tinywl_animation animation;
+	uint32_t commits; // since the last HUD update
+
+	struct wl_list mru_link; // tinywl_server.focus_history; empty for the shell and docked windows
+	struct wlr_scene_buffer *switcher_preview; // only while the switcher is open
+	struct wlr_scene_buffer *dock_preview; // in the shell's tree, while it reserves a rect
+	struct wlr_box dock_preview_box; // shell-local, as the shell sent it
+
+	struct wl_list txn_link; // tinywl_server.transaction; empty when not in one
+	uint32_t txn_serial; // configure the transaction waits on; 0 once committed
+	bool txn_moved;
+	int txn_x, txn_y; // where the node goes when the transaction applies
+	struct wlr_scene_tree *txn_saved; // the last frame of every surface, shown until then
+
+#if WLR_HAS_XWAYLAND
+	struct wlr_xwayland_surface *xwayland_surface;
+	struct wlr_scene_tree *surface_tree; // only while mapped
+	struct wl_listener associate;
+	struct wl_listener dissociate;
+	struct wl_listener request_configure;
+	struct wl_listener request_activate;
+	struct wl_listener set_geometry;
+#endif
+};
+
+struct tinywl_layer_surface {
+	struct wl_list link;
+	struct tinywl_server *server;
+	struct wlr_layer_surface_v1 *layer_surface;
+	struct wlr_scene_layer_surface_v1 *scene;
+	struct wl_listener map;
+	struct wl_listener unmap;
+	struct wl_listener commit;
+	struct wl_listener destroy;
+	struct wl_listener new_popup;
 };
 
 struct tinywl_popup {
+	struct tinywl_server *server;
+	struct tinywl_toplevel *toplevel; // owning window, NULL for layer-surface popups
+	struct wl_list link; // tinywl_toplevel.popups
 	struct wlr_xdg_popup *xdg_popup;
 	struct wl_listener commit;
 	struct wl_listener destroy;
@@ -122,30 +629,242 @@ struct tinywl_keyboard {
 };
 
 static void update_workspace_state(struct tinywl_server *server);
+static void session_update_toplevel(struct tinywl_toplevel *toplevel);
+static void startup_mark(struct tinywl_server *server, enum tinywl_startup_phase phase);
+static void focus_layer_surface(struct tinywl_layer_surface *layer);
+static void server_notify_activity(struct tinywl_server *server);
+static void thumb_subscribe(struct tinywl_toplevel *toplevel, int width, int height);
+static bool animations_tick(struct tinywl_server *server, uint64_t now_ns);
+static void latency_frame_committed(struct tinywl_output *output);
+static void latency_frame_presented(struct tinywl_output *output, struct wlr_output_event_present *event);
+static void toplevel_dock(struct tinywl_toplevel *toplevel, int side, int out_w, int out_h);
+static void dock_preview_clear(struct tinywl_toplevel *toplevel);
+static void transaction_add(struct tinywl_toplevel *toplevel);
+static void transaction_begin(struct tinywl_server *server);
+static void transaction_commit(struct tinywl_server *server);
+static void transaction_send_frame_done(struct tinywl_server *server, struct timespec *now);
+static void latency_mark_input(struct tinywl_server *server, enum tinywl_input_kind kind);
+static void latency_sample(struct tinywl_latency *latency, uint64_t us);
+static void record_event(struct tinywl_server *server, enum tinywl_rec_type type,
+	const void *payload, size_t size, const char *text);
+static void record_motion(struct tinywl_server *server);
+static void record_commit(struct tinywl_toplevel *toplevel);
+static void record_window(struct tinywl_toplevel *toplevel, enum tinywl_rec_type type);
+static uint64_t monotonic_ns(void);
+static void hud_set_enabled(struct tinywl_server *server, bool enabled);
+static void hud_output_destroy(struct tinywl_output *output);
+static void damage_debug_toggle(struct tinywl_server *server);
+static void wallpaper_arrange(struct tinywl_output *output);
+static void focus_history_touch(struct tinywl_toplevel *toplevel);
+static void focus_history_remove(struct tinywl_toplevel *toplevel);
+static void switcher_step(struct tinywl_server *server, bool forward);
+static void switcher_close(struct tinywl_server *server, bool commit);
+static void switcher_handle_key(struct tinywl_server *server, xkb_keysym_t sym);
+#if TINYWL_HAS_FLUTTER
+static void flutter_send_state(struct tinywl_server *server, struct tinywl_buf *json);
+static void flutter_arrange(struct tinywl_server *server);
+static bool flutter_pointer_motion(struct tinywl_server *server);
+static bool flutter_pointer_button(struct tinywl_server *server, uint32_t button,
+	enum wl_pointer_button_state state);
+static bool flutter_pointer_axis(struct tinywl_server *server, struct wlr_pointer_axis_event *event);
+#endif
+
+// -------------------------------------------------------------------------
+// Window shims: everything below manages xdg-shell and X11 windows alike
+// -------------------------------------------------------------------------
+static struct wlr_surface *toplevel_surface(struct tinywl_toplevel *toplevel) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		return toplevel->xwayland_surface->surface;
+	}
+#endif
+	return toplevel->xdg_toplevel->base->surface;
+}
+
+static const char *toplevel_app_id(struct tinywl_toplevel *toplevel, const char *fallback) {
+	const char *app_id;
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		app_id = toplevel->xwayland_surface->class;
+		return app_id ? app_id : fallback;
+	}
+#endif
+	app_id = toplevel->xdg_toplevel->app_id;
+	return app_id ? app_id : fallback;
+}
+
+static const char *toplevel_title(struct tinywl_toplevel *toplevel, const char *fallback) {
+	const char *title;
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		title = toplevel->xwayland_surface->title;
+		return title ? title : fallback;
+	}
+#endif
+	title = toplevel->xdg_toplevel->title;
+	return title ? title : fallback;
+}
+
+static struct wlr_box toplevel_geometry(struct tinywl_toplevel *toplevel) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		return (struct wlr_box){
+			.width = toplevel->xwayland_surface->width,
+			.height = toplevel->xwayland_surface->height,
+		};
+	}
+#endif
+	return toplevel->xdg_toplevel->base->geometry;
+}
+
+static bool toplevel_is_fullscreen(struct tinywl_toplevel *toplevel) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		return toplevel->xwayland_surface->fullscreen;
+	}
+#endif
+	return toplevel->xdg_toplevel->current.fullscreen;
+}
+
+static bool toplevel_wants_fullscreen(struct tinywl_toplevel *toplevel) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		return toplevel->xwayland_surface->fullscreen;
+	}
+#endif
+	return toplevel->xdg_toplevel->requested.fullscreen;
+}
+
+static void toplevel_set_size(struct tinywl_toplevel *toplevel, int width, int height) {
+#if WLR_HAS_XWAYLAND
+	// X11 has no configure/ack cycle: position and size go out together
+	if (toplevel->xwayland_surface != NULL) {
+		wlr_xwayland_surface_configure(toplevel->xwayland_surface,
+			toplevel->scene_tree->node.x, toplevel->scene_tree->node.y, width, height);
+		return;
+	}
+#endif
+	wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, width, height);
+}
+
+static void toplevel_set_position(struct tinywl_toplevel *toplevel, int x, int y) {
+	// Inside a transaction the node only moves once the new buffer is in
+	if (toplevel->server->transaction_depth > 0 && toplevel->xdg_toplevel != NULL &&
+			toplevel->xdg_toplevel->base->surface->mapped) {
+		toplevel->txn_moved = true;
+		toplevel->txn_x = x;
+		toplevel->txn_y = y;
+		transaction_add(toplevel);
+		return;
+	}
+	wlr_scene_node_set_position(&toplevel->scene_tree->node, x, y);
+#if WLR_HAS_XWAYLAND
+	// X clients place override-redirect popups from their own idea of where
+	// the window is, so keep the X server in sync
+	if (toplevel->xwayland_surface != NULL) {
+		wlr_xwayland_surface_configure(toplevel->xwayland_surface, x, y,
+			toplevel->xwayland_surface->width, toplevel->xwayland_surface->height);
+	}
+#endif
+}
+
+static void toplevel_set_activated(struct tinywl_toplevel *toplevel, bool activated) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		wlr_xwayland_surface_activate(toplevel->xwayland_surface, activated);
+		if (activated) {
+			wlr_xwayland_surface_restack(toplevel->xwayland_surface, NULL, XCB_STACK_MODE_ABOVE);
+		}
+		return;
+	}
+#endif
+	wlr_xdg_toplevel_set_activated(toplevel->xdg_toplevel, activated);
+}
+
+static void toplevel_set_maximized(struct tinywl_toplevel *toplevel, bool maximized) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		wlr_xwayland_surface_set_maximized(toplevel->xwayland_surface, maximized, maximized);
+		return;
+	}
+#endif
+	wlr_xdg_toplevel_set_maximized(toplevel->xdg_toplevel, maximized);
+}
+
+static void toplevel_set_fullscreen(struct tinywl_toplevel *toplevel, bool fullscreen) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		wlr_xwayland_surface_set_fullscreen(toplevel->xwayland_surface, fullscreen);
+		return;
+	}
+#endif
+	wlr_xdg_toplevel_set_fullscreen(toplevel->xdg_toplevel, fullscreen);
+}
+
+static void toplevel_schedule_configure(struct tinywl_toplevel *toplevel) {
+	// X11 windows were already configured by the setters above
+	if (toplevel->xdg_toplevel != NULL && toplevel->xdg_toplevel->base->initialized) {
+		uint32_t serial = wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
+		if (toplevel->server->transaction_depth > 0 && toplevel->xdg_toplevel->base->surface->mapped) {
+			toplevel->txn_serial = serial;
+			transaction_add(toplevel);
+		}
+	}
+}
+
+static void toplevel_close(struct tinywl_toplevel *toplevel) {
+#if WLR_HAS_XWAYLAND
+	if (toplevel->xwayland_surface != NULL) {
+		wlr_xwayland_surface_close(toplevel->xwayland_surface);
+		return;
+	}
+#endif
+	wlr_xdg_toplevel_send_close(toplevel->xdg_toplevel);
+}
+
+static void surface_deactivate(struct wlr_surface *surface) {
+	struct wlr_xdg_toplevel *xdg_toplevel = wlr_xdg_toplevel_try_from_wlr_surface(surface);
+	if (xdg_toplevel != NULL) {
+		wlr_xdg_toplevel_set_activated(xdg_toplevel, false);
+		return;
+	}
+#if WLR_HAS_XWAYLAND
+	struct wlr_xwayland_surface *xwayland_surface =
+		wlr_xwayland_surface_try_from_wlr_surface(surface);
+	if (xwayland_surface != NULL) {
+		wlr_xwayland_surface_activate(xwayland_surface, false);
+	}
+#endif
+}
 
 static void focus_toplevel(struct tinywl_toplevel *toplevel) {
 	if (toplevel == NULL) {
 		return;
 	}
+	focus_history_touch(toplevel);
 	struct tinywl_server *server = toplevel->server;
 	struct wlr_seat *seat = server->seat;
 	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
-	struct wlr_surface *surface = toplevel->xdg_toplevel->base->surface;
+	struct wlr_surface *surface = toplevel_surface(toplevel);
 	if (prev_surface == surface) {
 		return;
 	}
 	if (prev_surface) {
-		struct wlr_xdg_toplevel *prev_toplevel =
-			wlr_xdg_toplevel_try_from_wlr_surface(prev_surface);
-		if (prev_toplevel != NULL) {
-			wlr_xdg_toplevel_set_activated(prev_toplevel, false);
-		}
+		surface_deactivate(prev_surface);
 	}
 	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
 	wlr_scene_node_raise_to_top(&toplevel->scene_tree->node);
 	wl_list_remove(&toplevel->link);
 	wl_list_insert(&server->toplevels, &toplevel->link);
-	wlr_xdg_toplevel_set_activated(toplevel->xdg_toplevel, true);
+	toplevel_set_activated(toplevel, true);
+	// A layer surface holding the keyboard exclusively (lock screen, prompt)
+	// keeps it until it unmaps or gives it up
+	if (server->focused_layer != NULL &&
+			server->focused_layer->layer_surface->current.keyboard_interactive ==
+			ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_EXCLUSIVE) {
+		return;
+	}
+	server->focused_layer = NULL;
 	if (keyboard != NULL) {
 		wlr_seat_keyboard_notify_enter(seat, surface,
 			keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
@@ -154,9 +873,20 @@ static void focus_toplevel(struct tinywl_toplevel *toplevel) {
 
 static void keyboard_handle_modifiers(struct wl_listener *listener, void *data) {
 	struct tinywl_keyboard *keyboard = wl_container_of(listener, keyboard, modifiers);
+	struct wlr_keyboard_modifiers *modifiers = &keyboard->wlr_keyboard->modifiers;
+	record_event(keyboard->server, TINYWL_REC_MODIFIERS, &(struct tinywl_rec_modifiers){
+		.depressed = modifiers->depressed,
+		.latched = modifiers->latched,
+		.locked = modifiers->locked,
+		.group = modifiers->group,
+	}, sizeof(struct tinywl_rec_modifiers), NULL);
 	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->wlr_keyboard);
-	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
-		&keyboard->wlr_keyboard->modifiers);
+	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat, modifiers);
+	// Letting go of Alt picks the highlighted window
+	if (keyboard->server->switcher != NULL &&
+			!(wlr_keyboard_get_modifiers(keyboard->wlr_keyboard) & WLR_MODIFIER_ALT)) {
+		switcher_close(keyboard->server, true);
+	}
 }
 
 static bool handle_keybinding(struct tinywl_server *server, xkb_keysym_t sym) {
@@ -164,13 +894,18 @@ static bool handle_keybinding(struct tinywl_server *server, xkb_keysym_t sym) {
 	case XKB_KEY_Escape:
 		wl_display_terminate(server->wl_display);
 		break;
+	case XKB_KEY_Tab:
 	case XKB_KEY_F1:
-		if (wl_list_length(&server->toplevels) < 2) {
-			break;
-		}
-		struct tinywl_toplevel *next_toplevel =
-			wl_container_of(server->toplevels.prev, next_toplevel, link);
-		focus_toplevel(next_toplevel);
+		switcher_step(server, true);
+		break;
+	case XKB_KEY_ISO_Left_Tab:
+		switcher_step(server, false);
+		break;
+	case XKB_KEY_F2:
+		hud_set_enabled(server, !server->hud_enabled);
+		break;
+	case XKB_KEY_F3:
+		damage_debug_toggle(server);
 		break;
 	default:
 		return false;
@@ -183,6 +918,12 @@ static void keyboard_handle_key(struct wl_listener *listener, void *data) {
 	struct tinywl_server *server = keyboard->server;
 	struct wlr_keyboard_key_event *event = data;
 	struct wlr_seat *seat = server->seat;
+	server_notify_activity(server);
+	latency_mark_input(server, TINYWL_INPUT_KEY);
+	record_event(server, TINYWL_REC_KEY, &(struct tinywl_rec_key){
+		.keycode = event->keycode,
+		.state = event->state,
+	}, sizeof(struct tinywl_rec_key), NULL);
 
 	uint32_t keycode = event->keycode + 8;
 	const xkb_keysym_t *syms;
@@ -190,7 +931,14 @@ static void keyboard_handle_key(struct wl_listener *listener, void *data) {
 
 	bool handled = false;
 	uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->wlr_keyboard);
-	if ((modifiers & WLR_MODIFIER_ALT) && event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+	if (server->switcher != NULL && event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+		// The switcher eats key presses until Alt comes up; releases still go
+		// through so clients never see a key stuck down
+		for (int i = 0; i < nsyms; i++) {
+			switcher_handle_key(server, syms[i]);
+		}
+		handled = true;
+	} else if ((modifiers & WLR_MODIFIER_ALT) && event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		for (int i = 0; i < nsyms; i++) {
 			handled = handle_keybinding(server, syms[i]);
 		}
@@ -218,14 +966,6 @@ static void server_new_keyboard(struct tinywl_server *server, struct wlr_input_d
 	keyboard->server = server;
 	keyboard->wlr_keyboard = wlr_keyboard;
 
-	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	struct xkb_keymap *keymap = xkb_keymap_new_from_names(context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
-
-	wlr_keyboard_set_keymap(wlr_keyboard, keymap);
-	xkb_keymap_unref(keymap);
-	xkb_context_unref(context);
-	wlr_keyboard_set_repeat_info(wlr_keyboard, 25, 600);
-
 	keyboard->modifiers.notify = keyboard_handle_modifiers;
 	wl_signal_add(&wlr_keyboard->events.modifiers, &keyboard->modifiers);
 	keyboard->key.notify = keyboard_handle_key;
@@ -237,15 +977,34 @@ static void server_new_keyboard(struct tinywl_server *server, struct wlr_input_d
 	wl_list_insert(&server->keyboards, &keyboard->link);
 }
 
+static void keyboard_set_default_keymap(struct wlr_keyboard *wlr_keyboard) {
+	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = xkb_keymap_new_from_names(context, NULL, XKB_KEYMAP_COMPILE_NO_FLAGS);
+
+	wlr_keyboard_set_keymap(wlr_keyboard, keymap);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(context);
+	wlr_keyboard_set_repeat_info(wlr_keyboard, 25, 600);
+}
+
 static void server_new_pointer(struct tinywl_server *server, struct wlr_input_device *device) {
 	wlr_cursor_attach_input_device(server->cursor, device);
 }
 
+static void server_update_capabilities(struct tinywl_server *server) {
+	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
+	if (!wl_list_empty(&server->keyboards)) {
+		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
+	}
+	wlr_seat_set_capabilities(server->seat, caps);
+}
+
 static void server_new_input(struct wl_listener *listener, void *data) {
 	struct tinywl_server *server = wl_container_of(listener, server, new_input);
 	struct wlr_input_device *device = data;
 	switch (device->type) {
 	case WLR_INPUT_DEVICE_KEYBOARD:
+		keyboard_set_default_keymap(wlr_keyboard_from_input_device(device));
 		server_new_keyboard(server, device);
 		break;
 	case WLR_INPUT_DEVICE_POINTER:
@@ -254,11 +1013,28 @@ static void server_new_input(struct wl_listener *listener, void *data) {
 	default:
 		break;
 	}
-	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
-	if (!wl_list_empty(&server->keyboards)) {
-		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
+	server_update_capabilities(server);
+}
+
+// Synthetic input from clients (benchmarks, tests, remote desktop) enters
+// through the same cursor and seat paths as hardware
+static void server_new_virtual_pointer(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, new_virtual_pointer);
+	struct wlr_virtual_pointer_v1_new_pointer_event *event = data;
+	struct wlr_input_device *device = &event->new_pointer->pointer.base;
+	server_new_pointer(server, device);
+	if (event->suggested_output != NULL) {
+		wlr_cursor_map_input_to_output(server->cursor, device, event->suggested_output);
 	}
-	wlr_seat_set_capabilities(server->seat, caps);
+	server_update_capabilities(server);
+}
+
+static void server_new_virtual_keyboard(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, new_virtual_keyboard);
+	struct wlr_virtual_keyboard_v1 *keyboard = data;
+	// The client uploads its own keymap, so leave it alone
+	server_new_keyboard(server, &keyboard->keyboard.base);
+	server_update_capabilities(server);
 }
 
 static void seat_request_cursor(struct wl_listener *listener, void *data) {
@@ -276,10 +1052,25 @@ static void seat_request_set_selection(struct wl_listener *listener, void *data)
 	wlr_seat_set_selection(server->seat, event->source, event->serial);
 }
 
+// wlr_scene_node_at for input: every layer but the HUD, which only shows
+// numbers and must not take the pointer from whatever is under it
+static struct wlr_scene_node *server_node_at(struct tinywl_server *server,
+		double lx, double ly, double *sx, double *sy) {
+	struct wlr_scene_node *layer;
+	wl_list_for_each_reverse(layer, &server->scene->tree.children, link) {
+		if (server->hud_layer != NULL && layer == &server->hud_layer->node) continue;
+		struct wlr_scene_node *node = wlr_scene_node_at(layer, lx, ly, sx, sy);
+		if (node != NULL) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
 static struct tinywl_toplevel *desktop_toplevel_at(
 		struct tinywl_server *server, double lx, double ly,
 		struct wlr_surface **surface, double *sx, double *sy) {
-	struct wlr_scene_node *node = wlr_scene_node_at(&server->scene->tree.node, lx, ly, sx, sy);
+	struct wlr_scene_node *node = server_node_at(server, lx, ly, sx, sy);
 	if (node == NULL || node->type != WLR_SCENE_NODE_BUFFER) {
 		return NULL;
 	}
@@ -294,7 +1085,8 @@ static struct tinywl_toplevel *desktop_toplevel_at(
 	while (tree != NULL && tree->node.data == NULL) {
 		tree = tree->node.parent;
 	}
-	return tree->node.data;
+	// Layer surfaces are not toplevels; the walk ends at the scene root
+	return tree != NULL ? tree->node.data : NULL;
 }
 
 static void reset_cursor_mode(struct tinywl_server *server) {
@@ -304,18 +1096,17 @@ static void reset_cursor_mode(struct tinywl_server *server) {
 
 static void process_cursor_move(struct tinywl_server *server) {
 	struct tinywl_toplevel *toplevel = server->grabbed_toplevel;
-	wlr_scene_node_set_position(&toplevel->scene_tree->node,
+	toplevel_set_position(toplevel,
 		server->cursor->x - server->grab_x,
 		server->cursor->y - server->grab_y);
 
 	struct wlr_box box;
 	wlr_output_layout_get_box(server->output_layout, NULL, &box);
-	int out_width = box.width > 0 ? box.width : 1920;
+	int out_width = box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH;
 
 	int current_hover = 0;
-	// Increased margin to 60px for a more reliable hit box
-	if (server->cursor->x < 60) current_hover = 1;      
-	else if (server->cursor->x > out_width - 60) current_hover = 2; 
+	if (server->cursor->x < box.x + TINYWL_DOCK_HOVER_MARGIN) current_hover = 1;
+	else if (server->cursor->x > box.x + out_width - TINYWL_DOCK_HOVER_MARGIN) current_hover = 2;
 
 	if (server->last_hover != current_hover) {
 		server->last_hover = current_hover;
@@ -347,13 +1138,13 @@ static void process_cursor_resize(struct tinywl_server *server) {
 		if (new_right <= new_left) new_right = new_left + 1;
 	}
 
-	struct wlr_box *geo_box = &toplevel->xdg_toplevel->base->geometry;
-	wlr_scene_node_set_position(&toplevel->scene_tree->node,
-		new_left - geo_box->x, new_top - geo_box->y);
+	struct wlr_box geo_box = toplevel_geometry(toplevel);
+	toplevel_set_position(toplevel,
+		new_left - geo_box.x, new_top - geo_box.y);
 
 	int new_width = new_right - new_left;
 	int new_height = new_bottom - new_top;
-	wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, new_width, new_height);
+	toplevel_set_size(toplevel, new_width, new_height);
 }
 
 static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
@@ -367,6 +1158,13 @@ static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
 
 	double sx, sy;
 	struct wlr_seat *seat = server->seat;
+#if TINYWL_HAS_FLUTTER
+	if (flutter_pointer_motion(server)) {
+		wlr_cursor_set_xcursor(server->cursor, server->cursor_mgr, "default");
+		wlr_seat_pointer_clear_focus(seat);
+		return;
+	}
+#endif
 	struct wlr_surface *surface = NULL;
 	struct tinywl_toplevel *toplevel = desktop_toplevel_at(server,
 			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
@@ -384,20 +1182,38 @@ static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
 static void server_cursor_motion(struct wl_listener *listener, void *data) {
 	struct tinywl_server *server = wl_container_of(listener, server, cursor_motion);
 	struct wlr_pointer_motion_event *event = data;
+	server_notify_activity(server);
+	latency_mark_input(server, TINYWL_INPUT_MOTION);
 	wlr_cursor_move(server->cursor, &event->pointer->base, event->delta_x, event->delta_y);
+	record_motion(server);
 	process_cursor_motion(server, event->time_msec);
 }
 
 static void server_cursor_motion_absolute(struct wl_listener *listener, void *data) {
 	struct tinywl_server *server = wl_container_of(listener, server, cursor_motion_absolute);
 	struct wlr_pointer_motion_absolute_event *event = data;
+	server_notify_activity(server);
+	latency_mark_input(server, TINYWL_INPUT_MOTION);
 	wlr_cursor_warp_absolute(server->cursor, &event->pointer->base, event->x, event->y);
+	record_motion(server);
 	process_cursor_motion(server, event->time_msec);
 }
 
 static void server_cursor_button(struct wl_listener *listener, void *data) {
 	struct tinywl_server *server = wl_container_of(listener, server, cursor_button);
 	struct wlr_pointer_button_event *event = data;
+	server_notify_activity(server);
+	latency_mark_input(server, TINYWL_INPUT_BUTTON);
+	record_event(server, TINYWL_REC_BUTTON, &(struct tinywl_rec_button){
+		.button = event->button,
+		.state = event->state,
+	}, sizeof(struct tinywl_rec_button), NULL);
+#if TINYWL_HAS_FLUTTER
+	if (server->cursor_mode == TINYWL_CURSOR_PASSTHROUGH &&
+			flutter_pointer_button(server, event->button, event->state)) {
+		return;
+	}
+#endif
     
 	wlr_seat_pointer_notify_button(server->seat, event->time_msec, event->button, event->state);
             
@@ -407,26 +1223,16 @@ static void server_cursor_button(struct wl_listener *listener, void *data) {
 			
 			struct wlr_box box;
 			wlr_output_layout_get_box(server->output_layout, NULL, &box);
-			int out_w = box.width > 0 ? box.width : 1920;
-			int out_h = box.height > 0 ? box.height : 1080;
+			int out_w = box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH;
+			int out_h = box.height > 0 ? box.height : TINYWL_FALLBACK_HEIGHT;
             
-			if (server->last_hover == 1) { 
-				toplevel->docked_side = 1;
-				wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 1280, 720); 
-				wlr_scene_node_set_position(&toplevel->scene_tree->node, out_w - 1, out_h - 1); 
-				wlr_scene_node_lower_to_bottom(&toplevel->scene_tree->node); 
-				wlr_xdg_toplevel_set_activated(toplevel->xdg_toplevel, false);
-                wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
-			} else if (server->last_hover == 2) { 
-				toplevel->docked_side = 2;
-				wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 1280, 720);
-				wlr_scene_node_set_position(&toplevel->scene_tree->node, out_w - 1, out_h - 1);
-				wlr_scene_node_lower_to_bottom(&toplevel->scene_tree->node);
-				wlr_xdg_toplevel_set_activated(toplevel->xdg_toplevel, false);
-                wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
+			if (server->last_hover == 1 || server->last_hover == 2) { 
+				latency_mark_input(server, TINYWL_INPUT_DOCK);
+				toplevel_dock(toplevel, server->last_hover, out_w, out_h);
 			}
             
 			server->last_hover = 0;
+			session_update_toplevel(toplevel);
 			update_workspace_state(server);
 		}
 		reset_cursor_mode(server);
@@ -434,13 +1240,34 @@ static void server_cursor_button(struct wl_listener *listener, void *data) {
 		double sx, sy;
 		struct wlr_surface *surface = NULL;
 		struct tinywl_toplevel *toplevel = desktop_toplevel_at(server, server->cursor->x, server->cursor->y, &surface, &sx, &sy);
-		focus_toplevel(toplevel);
+		struct wlr_layer_surface_v1 *layer_surface =
+			surface ? wlr_layer_surface_v1_try_from_wlr_surface(surface) : NULL;
+		if (layer_surface != NULL && layer_surface->data != NULL) {
+			if (layer_surface->current.keyboard_interactive !=
+					ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE) {
+				focus_layer_surface(layer_surface->data);
+			}
+		} else {
+			focus_toplevel(toplevel);
+		}
 	}
 }
 
 static void server_cursor_axis(struct wl_listener *listener, void *data) {
 	struct tinywl_server *server = wl_container_of(listener, server, cursor_axis);
 	struct wlr_pointer_axis_event *event = data;
+	server_notify_activity(server);
+	record_event(server, TINYWL_REC_AXIS, &(struct tinywl_rec_axis){
+		.orientation = event->orientation,
+		.source = event->source,
+		.delta = (int32_t)(event->delta * TINYWL_REC_FIXED),
+		.delta_discrete = event->delta_discrete,
+	}, sizeof(struct tinywl_rec_axis), NULL);
+#if TINYWL_HAS_FLUTTER
+	if (flutter_pointer_axis(server, event)) {
+		return;
+	}
+#endif
 	wlr_seat_pointer_notify_axis(server->seat, event->time_msec, event->orientation, event->delta,
 			event->delta_discrete, event->source, event->relative_direction);
 }
@@ -450,33 +1277,149 @@ static void server_cursor_frame(struct wl_listener *listener, void *data) {
 	wlr_seat_pointer_notify_frame(server->seat);
 }
 
-static void server_layout_change(struct wl_listener *listener, void *data) {
-	struct tinywl_server *server = wl_container_of(listener, server, layout_change);
-	
+// Area a maximized window may cover: the output under the cursor minus the
+// exclusive zones of its layer surfaces, or the whole layout before any
+// output has been arranged.
+static void server_usable_box(struct tinywl_server *server, struct wlr_box *box) {
+	struct wlr_output *wlr_output = wlr_output_layout_output_at(server->output_layout,
+		server->cursor->x, server->cursor->y);
+	struct tinywl_output *output = wlr_output ? wlr_output->data : NULL;
+	if (output != NULL && !wlr_box_empty(&output->usable_area)) {
+		*box = output->usable_area;
+		return;
+	}
+	wlr_output_layout_get_box(server->output_layout, NULL, box);
+	if (box->width <= 0) box->width = TINYWL_FALLBACK_WIDTH;
+	if (box->height <= 0) box->height = TINYWL_FALLBACK_HEIGHT;
+}
+
+// Where new and undocked floating windows go: centred in the usable area,
+// and shrunk to fit it where a small or highly scaled output leaves less
+// than TINYWL_WINDOW_WIDTH x TINYWL_WINDOW_HEIGHT logical pixels
+static struct wlr_box server_window_box(struct tinywl_server *server) {
+	struct wlr_box usable;
+	server_usable_box(server, &usable);
+	struct wlr_box box = {
+		.width = usable.width < TINYWL_WINDOW_WIDTH ? usable.width : TINYWL_WINDOW_WIDTH,
+		.height = usable.height < TINYWL_WINDOW_HEIGHT ? usable.height : TINYWL_WINDOW_HEIGHT,
+	};
+	box.x = usable.x + (usable.width - box.width) / 2;
+	box.y = usable.y + (usable.height - box.height) / 2;
+	return box;
+}
+
+static void server_fit_toplevels(struct tinywl_server *server) {
 	struct wlr_box box;
 	wlr_output_layout_get_box(server->output_layout, NULL, &box);
-	int out_w = box.width > 0 ? box.width : 1920;
-	int out_h = box.height > 0 ? box.height : 1080;
+	int out_w = box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH;
+	int out_h = box.height > 0 ? box.height : TINYWL_FALLBACK_HEIGHT;
+	struct wlr_box usable;
+	server_usable_box(server, &usable);
 
+	// The shell and every maximized window resize together
+	transaction_begin(server);
 	struct tinywl_toplevel *toplevel;
 	wl_list_for_each(toplevel, &server->toplevels, link) {
-		const char *app_id = toplevel->xdg_toplevel->app_id;
-		if ((app_id && strstr(app_id, "workspace") != NULL) || toplevel->maximized || toplevel->xdg_toplevel->current.fullscreen) {
-			wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, out_w, out_h);
-			wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
+		if (toplevel->is_shell || toplevel_is_fullscreen(toplevel)) {
+			toplevel_set_size(toplevel, out_w, out_h);
+			toplevel_schedule_configure(toplevel);
+		} else if (toplevel->maximized && toplevel->docked_side == 0) {
+			toplevel_set_size(toplevel, usable.width, usable.height);
+			toplevel_set_position(toplevel, usable.x, usable.y);
+			toplevel_schedule_configure(toplevel);
+		}
+	}
+	transaction_commit(server);
+}
+
+// Place every layer surface of an output. Surfaces that reserve space go
+// first so the rest are laid out inside what is left. Returns true when the
+// usable area changed and maximized windows need refitting.
+static bool arrange_layers(struct tinywl_output *output) {
+	struct tinywl_server *server = output->server;
+	struct wlr_box full_area;
+	wlr_output_layout_get_box(server->output_layout, output->wlr_output, &full_area);
+	struct wlr_box usable_area = full_area;
+
+	for (int exclusive = 1; exclusive >= 0; exclusive--) {
+		for (int i = ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY; i >= ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND; i--) {
+			struct tinywl_layer_surface *layer;
+			wl_list_for_each(layer, &server->layer_surfaces, link) {
+				struct wlr_layer_surface_v1 *layer_surface = layer->layer_surface;
+				if (layer_surface->output != output->wlr_output ||
+						!layer_surface->initialized ||
+						(int)layer_surface->current.layer != i ||
+						(layer_surface->current.exclusive_zone > 0) != exclusive) {
+					continue;
+				}
+				wlr_scene_layer_surface_v1_configure(layer->scene, &full_area, &usable_area);
+			}
 		}
 	}
+
+	if (wlr_box_equal(&usable_area, &output->usable_area)) {
+		return false;
+	}
+	output->usable_area = usable_area;
+	return true;
+}
+
+static void server_layout_change(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, layout_change);
+
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		arrange_layers(output);
+		wallpaper_arrange(output);
+	}
+	server_fit_toplevels(server);
+#if TINYWL_HAS_FLUTTER
+	flutter_arrange(server);
+#endif
 }
 
 static void output_frame(struct wl_listener *listener, void *data) {
 	struct tinywl_output *output = wl_container_of(listener, output, frame);
 	struct wlr_scene *scene = output->server->scene;
 	struct wlr_scene_output *scene_output = wlr_scene_get_scene_output(scene, output->wlr_output);
-	wlr_scene_output_commit(scene_output, NULL);
 
+	// Same clock the presentation feedback reports, sampled once per frame
 	struct timespec now;
 	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+	if (animations_tick(output->server, now_ns)) {
+		wlr_output_schedule_frame(output->wlr_output);
+	}
+	bool damaged = wlr_scene_output_needs_frame(scene_output);
+	if (wlr_scene_output_commit(scene_output, NULL)) {
+		startup_mark(output->server, TINYWL_PHASE_FIRST_OUTPUT_COMMIT);
+		if (damaged) {
+			latency_frame_committed(output);
+			uint64_t us = (monotonic_ns() - now_ns) / 1000;
+			output->frame_us[output->frame_index] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+			output->frame_index = (output->frame_index + 1) % TINYWL_HUD_FRAMES;
+			latency_sample(&output->server->frame_times, us);
+		}
+	} else {
+		output->frames_skipped++;
+		output->server->frames_skipped++;
+	}
+
+	// While idle, handle_idle_frame_timer paces the callbacks instead
+	if (output->server->idle) return;
+
 	wlr_scene_output_send_frame_done(scene_output, &now);
+	transaction_send_frame_done(output->server, &now);
+}
+
+static void output_present(struct wl_listener *listener, void *data) {
+	struct tinywl_output *output = wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
+	if (!event->presented) {
+		output->frames_skipped++;
+		output->server->frames_skipped++;
+	}
+	latency_frame_presented(output, event);
 }
 
 static void output_request_state(struct wl_listener *listener, void *data) {
@@ -487,16 +1430,55 @@ static void output_request_state(struct wl_listener *listener, void *data) {
 
 static void output_destroy(struct wl_listener *listener, void *data) {
 	struct tinywl_output *output = wl_container_of(listener, output, destroy);
+	hud_output_destroy(output);
+	if (output->wallpaper != NULL) {
+		wlr_scene_node_destroy(&output->wallpaper->node);
+	}
+
+	struct tinywl_layer_surface *layer, *tmp;
+	wl_list_for_each_safe(layer, tmp, &output->server->layer_surfaces, link) {
+		if (layer->layer_surface->output == output->wlr_output) {
+			layer->layer_surface->output = NULL;
+			wlr_layer_surface_v1_destroy(layer->layer_surface);
+		}
+	}
+	output->wlr_output->data = NULL;
+
 	wl_list_remove(&output->frame.link);
+	wl_list_remove(&output->present.link);
 	wl_list_remove(&output->request_state.link);
 	wl_list_remove(&output->destroy.link);
 	wl_list_remove(&output->link);
 	free(output);
 }
 
-static void server_new_output(struct wl_listener *listener, void *data) {
-	struct tinywl_server *server = wl_container_of(listener, server, new_output);
-	struct wlr_output *wlr_output = data;
+// -S applies to every output. Otherwise 96 dpi is 1x, rounded to a quarter
+// so fractional-scale clients can draw exactly the pixels shown; outputs
+// with no or implausible physical size (projectors, headless) stay at 1x.
+static float output_pick_scale(struct tinywl_server *server, struct wlr_output *wlr_output,
+		struct wlr_output_mode *mode) {
+	if (server->output_scale > 0.0f) {
+		return server->output_scale;
+	}
+	int width = mode != NULL ? mode->width : wlr_output->width;
+	int height = mode != NULL ? mode->height : wlr_output->height;
+	if (width <= 0 || height <= 0 || wlr_output->phys_width < 100 || wlr_output->phys_height < 50) {
+		return 1.0f;
+	}
+	float dpi = width * 25.4f / wlr_output->phys_width;
+	float dpi_y = height * 25.4f / wlr_output->phys_height;
+	if (dpi > dpi_y * 1.2f || dpi_y > dpi * 1.2f) {
+		return 1.0f;
+	}
+	float scale = (int)(dpi / 96.0f * 4.0f + 0.5f) / 4.0f;
+	if (scale < 1.0f) scale = 1.0f;
+	if (scale > 3.0f) scale = 3.0f;
+	return scale;
+}
+
+static void server_new_output(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, new_output);
+	struct wlr_output *wlr_output = data;
 
 	wlr_output_init_render(wlr_output, server->allocator, server->renderer);
 
@@ -508,6 +1490,9 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 	if (mode != NULL) {
 		wlr_output_state_set_mode(&state, mode);
 	}
+	float scale = output_pick_scale(server, wlr_output, mode);
+	wlr_output_state_set_scale(&state, scale);
+	wlr_log(WLR_INFO, "Output %s at scale %.2f", wlr_output->name, scale);
 
 	wlr_output_commit_state(wlr_output, &state);
 	wlr_output_state_finish(&state);
@@ -515,9 +1500,12 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 	struct tinywl_output *output = calloc(1, sizeof(*output));
 	output->wlr_output = wlr_output;
 	output->server = server;
+	wlr_output->data = output;
 
 	output->frame.notify = output_frame;
 	wl_signal_add(&wlr_output->events.frame, &output->frame);
+	output->present.notify = output_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
 	output->request_state.notify = output_request_state;
 	wl_signal_add(&wlr_output->events.request_state, &output->request_state);
 	output->destroy.notify = output_destroy;
@@ -530,199 +1518,4466 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 	wlr_scene_output_layout_add_output(server->scene_layout, l_output, scene_output);
 }
 
-static void update_workspace_state(struct tinywl_server *server) {
-	// ATOMIC WRITE: Write to a .tmp file first so Flutter doesn't parse a halfway-written JSON file
-	FILE *f = fopen("/tmp/workspace_state.tmp", "w");
-	if (!f) return;
+// -------------------------------------------------------------------------
+// Wallpaper: decoded once and pre-scaled per output size, both on a thread
+// of their own, and kept under everything
+// -------------------------------------------------------------------------
+static void wallpaper_buffer_destroy(struct wlr_buffer *buffer) {
+	struct tinywl_wallpaper *wallpaper = wl_container_of(buffer, wallpaper, base);
+	wl_list_remove(&wallpaper->link);
+	free(wallpaper->data);
+	free(wallpaper);
+}
 
-	fprintf(f, "{\n  \"hover\": %d,\n", server->last_hover);
-    
-	fprintf(f, "  \"active\": [\n");
-	bool first = true;
-	struct tinywl_toplevel *toplevel;
-	wl_list_for_each(toplevel, &server->toplevels, link) {
-		const char *app_id = toplevel->xdg_toplevel->app_id ? toplevel->xdg_toplevel->app_id : "Unknown";
-		if (strstr(app_id, "workspace") != NULL || toplevel->docked_side != 0) continue;
-		if (!first) fprintf(f, ",\n");
-		const char *title = toplevel->xdg_toplevel->title ? toplevel->xdg_toplevel->title : "Unknown Window";
-		fprintf(f, "    { \"id\": \"%p\", \"name\": \"%s\", \"title\": \"%s\", \"maximized\": %s }", 
-            (void*)toplevel, app_id, title, toplevel->maximized ? "true" : "false");
-		first = false;
+static bool wallpaper_buffer_begin_data_ptr_access(struct wlr_buffer *buffer, uint32_t flags,
+		void **data, uint32_t *format, size_t *stride) {
+	struct tinywl_wallpaper *wallpaper = wl_container_of(buffer, wallpaper, base);
+	if (flags & WLR_BUFFER_DATA_PTR_ACCESS_WRITE) {
+		return false;
 	}
-	fprintf(f, "\n  ],\n");
+	*data = wallpaper->data;
+	*format = DRM_FORMAT_XRGB8888;
+	*stride = (size_t)buffer->width * 4;
+	return true;
+}
 
-	fprintf(f, "  \"docked_left\": [\n");
-	first = true;
-	wl_list_for_each(toplevel, &server->toplevels, link) {
-		if (toplevel->docked_side != 1) continue;
-		const char *app_id = toplevel->xdg_toplevel->app_id ? toplevel->xdg_toplevel->app_id : "Unknown";
-		const char *title = toplevel->xdg_toplevel->title ? toplevel->xdg_toplevel->title : "Unknown Window";
-		if (!first) fprintf(f, ",\n");
-		fprintf(f, "    { \"id\": \"%p\", \"name\": \"%s\", \"title\": \"%s\", \"maximized\": %s }", 
-            (void*)toplevel, app_id, title, toplevel->maximized ? "true" : "false");
-		first = false;
+static void wallpaper_buffer_end_data_ptr_access(struct wlr_buffer *buffer) {
+}
+
+static const struct wlr_buffer_impl wallpaper_buffer_impl = {
+	.destroy = wallpaper_buffer_destroy,
+	.begin_data_ptr_access = wallpaper_buffer_begin_data_ptr_access,
+	.end_data_ptr_access = wallpaper_buffer_end_data_ptr_access,
+};
+
+// Scales to width x height the way the shell's BoxFit.cover did: scaled to
+// fill, centred, the overflow cropped. Runs on the wallpaper thread.
+static uint32_t *wallpaper_scale(GdkPixbuf *source, int width, int height) {
+	int source_width = gdk_pixbuf_get_width(source);
+	int source_height = gdk_pixbuf_get_height(source);
+	double scale_x = (double)width / source_width;
+	double scale_y = (double)height / source_height;
+	double scale = scale_x > scale_y ? scale_x : scale_y;
+	GdkPixbuf *scaled = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+		gdk_pixbuf_get_has_alpha(source), 8, width, height);
+	uint32_t *data = malloc((size_t)width * height * 4);
+	if (scaled == NULL || data == NULL) {
+		if (scaled != NULL) g_object_unref(scaled);
+		free(data);
+		return NULL;
 	}
-	fprintf(f, "\n  ],\n");
+	gdk_pixbuf_scale(source, scaled, 0, 0, width, height,
+		(width - source_width * scale) / 2, (height - source_height * scale) / 2,
+		scale, scale, GDK_INTERP_BILINEAR);
 
-	fprintf(f, "  \"docked_right\": [\n");
-	first = true;
-	wl_list_for_each(toplevel, &server->toplevels, link) {
-		if (toplevel->docked_side != 2) continue;
-		const char *app_id = toplevel->xdg_toplevel->app_id ? toplevel->xdg_toplevel->app_id : "Unknown";
-		const char *title = toplevel->xdg_toplevel->title ? toplevel->xdg_toplevel->title : "Unknown Window";
-		if (!first) fprintf(f, ",\n");
-		fprintf(f, "    { \"id\": \"%p\", \"name\": \"%s\", \"title\": \"%s\", \"maximized\": %s }", 
-            (void*)toplevel, app_id, title, toplevel->maximized ? "true" : "false");
-		first = false;
+	const guint8 *pixels = gdk_pixbuf_read_pixels(scaled);
+	int rowstride = gdk_pixbuf_get_rowstride(scaled);
+	int channels = gdk_pixbuf_get_n_channels(scaled);
+	for (int y = 0; y < height; y++) {
+		const guint8 *row = pixels + (size_t)y * rowstride;
+		uint32_t *out = data + (size_t)y * width;
+		for (int x = 0; x < width; x++) {
+			const guint8 *p = row + x * channels;
+			out[x] = 0xff000000u | (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+		}
+	}
+	g_object_unref(scaled);
+	return data;
+}
+
+// Returns a locked buffer of that size if one has been scaled, else NULL
+static struct wlr_buffer *wallpaper_get(struct tinywl_server *server, int width, int height) {
+	struct tinywl_wallpaper *wallpaper;
+	wl_list_for_each(wallpaper, &server->wallpapers, link) {
+		if (wallpaper->base.width == width && wallpaper->base.height == height) {
+			return wlr_buffer_lock(&wallpaper->base);
+		}
+	}
+	return NULL;
+}
+
+static void wallpaper_job_start(struct tinywl_server *server, const char *path);
+
+static void wallpaper_arrange(struct tinywl_output *output) {
+	struct tinywl_server *server = output->server;
+	struct wlr_box box;
+	wlr_output_layout_get_box(server->output_layout, output->wlr_output, &box);
+	if (server->wallpaper_source == NULL || wlr_box_empty(&box)) {
+		if (output->wallpaper != NULL) {
+			wlr_scene_node_destroy(&output->wallpaper->node);
+			output->wallpaper = NULL;
+		}
+		return;
+	}
+
+	// Rendered at the output's pixel size, so HiDPI outputs stay sharp
+	int width, height;
+	wlr_output_transformed_resolution(output->wlr_output, &width, &height);
+	struct wlr_buffer *current = output->wallpaper ? output->wallpaper->buffer : NULL;
+	if (current == NULL || current->width != width || current->height != height) {
+		struct wlr_buffer *buffer = wallpaper_get(server, width, height);
+		if (buffer == NULL) {
+			// Scaled off the event loop; until then the old copy, if
+			// any, is stretched to fit
+			wallpaper_job_start(server, NULL);
+			if (output->wallpaper == NULL) return;
+		} else if (output->wallpaper == NULL) {
+			output->wallpaper = wlr_scene_buffer_create(server->wallpaper_layer, buffer);
+		} else {
+			wlr_scene_buffer_set_buffer(output->wallpaper, buffer);
+		}
+		if (buffer != NULL) {
+			wlr_buffer_unlock(buffer);
+		}
+		if (output->wallpaper == NULL) return;
+	}
+	wlr_scene_buffer_set_dest_size(output->wallpaper, box.width, box.height);
+	wlr_scene_node_set_position(&output->wallpaper->node, box.x, box.y);
+}
+
+static void *wallpaper_job_run(void *data) {
+	struct tinywl_wallpaper_job *job = data;
+	if (job->path != NULL) {
+		GError *error = NULL;
+		GdkPixbuf *decoded = gdk_pixbuf_new_from_file(job->path, &error);
+		if (decoded == NULL) {
+			job->error = strdup(error->message);
+			g_error_free(error);
+		} else {
+			// Photos straight off a camera are often stored sideways
+			job->source = gdk_pixbuf_apply_embedded_orientation(decoded);
+			g_object_unref(decoded);
+		}
+	}
+	for (int i = 0; i < job->n_sizes && job->source != NULL; i++) {
+		job->sizes[i].data = wallpaper_scale(job->source, job->sizes[i].width, job->sizes[i].height);
+	}
+	uint64_t one = 1;
+	if (write(job->done_fd, &one, sizeof(one)) < 0) {
+		// Counter saturated, so the event loop is awake anyway
+	}
+	return NULL;
+}
+
+static void wallpaper_job_free(struct tinywl_wallpaper_job *job) {
+	for (int i = 0; i < job->n_sizes; i++) {
+		free(job->sizes[i].data);
+	}
+	if (job->source != NULL) {
+		g_object_unref(job->source);
+	}
+	free(job->path);
+	free(job->error);
+	free(job);
+}
+
+static int handle_wallpaper_done(int fd, uint32_t mask, void *data);
+
+// Decodes path, or with NULL scales the current image for the output sizes
+// that have no copy yet. One job at a time: a newer WALLPAPER waits for
+// the one in flight, and outputs that change size meanwhile are caught by
+// the arrange that follows it.
+static void wallpaper_job_start(struct tinywl_server *server, const char *path) {
+	if (server->wallpaper_job != NULL) {
+		if (path != NULL) {
+			free(server->wallpaper_next);
+			server->wallpaper_next = strdup(path);
+		}
+		return;
+	}
+	if (path == NULL && (server->wallpaper_source == NULL || server->wallpaper_scale_failed)) return;
+	if (server->wallpaper_done_fd < 0) {
+		server->wallpaper_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (server->wallpaper_done_fd < 0) {
+			wlr_log_errno(WLR_ERROR, "Failed to create wallpaper eventfd");
+			return;
+		}
+		server->wallpaper_done_source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+			server->wallpaper_done_fd, WL_EVENT_READABLE, handle_wallpaper_done, server);
+	}
+
+	struct tinywl_wallpaper_job *job = calloc(1, sizeof(*job));
+	if (job == NULL) return;
+	job->done_fd = server->wallpaper_done_fd;
+	if (path != NULL) {
+		job->path = strdup(path);
+	} else {
+		job->source = g_object_ref(server->wallpaper_source);
+	}
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct wlr_box box;
+		wlr_output_layout_get_box(server->output_layout, output->wlr_output, &box);
+		if (wlr_box_empty(&box) || job->n_sizes == TINYWL_WALLPAPER_SIZES) continue;
+		int width, height;
+		wlr_output_transformed_resolution(output->wlr_output, &width, &height);
+		struct wlr_buffer *cached = path == NULL ? wallpaper_get(server, width, height) : NULL;
+		if (cached != NULL) {
+			wlr_buffer_unlock(cached);
+			continue;
+		}
+		bool seen = false;
+		for (int i = 0; i < job->n_sizes; i++) {
+			seen |= job->sizes[i].width == width && job->sizes[i].height == height;
+		}
+		if (!seen) {
+			job->sizes[job->n_sizes].width = width;
+			job->sizes[job->n_sizes].height = height;
+			job->n_sizes++;
+		}
+	}
+	if (path == NULL && job->n_sizes == 0) {
+		wallpaper_job_free(job);
+		return;
+	}
+
+	server->wallpaper_job = job;
+	// Signals belong to the event loop
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	job->threaded = pthread_create(&job->thread, NULL, wallpaper_job_run, job) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!job->threaded) {
+		wlr_log(WLR_ERROR, "Failed to start the wallpaper thread, decoding here");
+		wallpaper_job_run(job);
+	}
+}
+
+// Main thread: swap the new image in, or add the sizes scaled for it
+static void wallpaper_job_finish(struct tinywl_server *server, struct tinywl_wallpaper_job *job) {
+	if (job->path != NULL) {
+		if (job->source == NULL) {
+			wlr_log(WLR_ERROR, "Failed to load wallpaper %s: %s", job->path,
+				job->error ? job->error : "out of memory");
+			return;
+		}
+		// Let go of every copy of the old image, so the size cache only
+		// ever holds the current wallpaper
+		struct tinywl_output *output;
+		wl_list_for_each(output, &server->outputs, link) {
+			if (output->wallpaper != NULL) {
+				wlr_scene_node_destroy(&output->wallpaper->node);
+				output->wallpaper = NULL;
+			}
+		}
+		if (server->wallpaper_source != NULL) {
+			g_object_unref(server->wallpaper_source);
+		}
+		server->wallpaper_source = g_object_ref(job->source);
+		free(server->wallpaper_path);
+		server->wallpaper_path = strdup(job->path);
+	} else if (job->source != server->wallpaper_source) {
+		return; // scaled for an image that has since been replaced
+	}
+
+	// Held until the outputs have taken theirs; the last unlock frees it
+	struct wlr_buffer *buffers[TINYWL_WALLPAPER_SIZES];
+	int n_buffers = 0;
+	bool failed = false;
+	for (int i = 0; i < job->n_sizes; i++) {
+		struct tinywl_wallpaper *wallpaper = job->sizes[i].data ? calloc(1, sizeof(*wallpaper)) : NULL;
+		if (wallpaper == NULL) {
+			wlr_log(WLR_ERROR, "Failed to allocate a %dx%d wallpaper", job->sizes[i].width, job->sizes[i].height);
+			failed = true;
+			continue;
+		}
+		wallpaper->data = job->sizes[i].data;
+		job->sizes[i].data = NULL;
+		wlr_buffer_init(&wallpaper->base, &wallpaper_buffer_impl, job->sizes[i].width, job->sizes[i].height);
+		wl_list_insert(&server->wallpapers, &wallpaper->link);
+		buffers[n_buffers++] = wlr_buffer_lock(&wallpaper->base);
+		wlr_buffer_drop(&wallpaper->base);
+	}
+	server->wallpaper_scale_failed = failed && job->path == NULL;
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		wallpaper_arrange(output);
+	}
+	server->wallpaper_scale_failed = false;
+	for (int i = 0; i < n_buffers; i++) {
+		wlr_buffer_unlock(buffers[i]);
+	}
+	if (job->path != NULL) {
+		update_workspace_state(server);
+	}
+}
+
+static int handle_wallpaper_done(int fd, uint32_t mask, void *data) {
+	struct tinywl_server *server = data;
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		wlr_log_errno(WLR_ERROR, "Failed to read wallpaper completion");
+	}
+	struct tinywl_wallpaper_job *job = server->wallpaper_job;
+	if (job == NULL) return 0;
+	if (job->threaded) {
+		pthread_join(job->thread, NULL);
+	}
+	server->wallpaper_job = NULL;
+	if (server->wallpaper_next == NULL) {
+		wallpaper_job_finish(server, job);
+	} else {
+		// Superseded before it was shown
+		char *next = server->wallpaper_next;
+		server->wallpaper_next = NULL;
+		wallpaper_job_start(server, next);
+		free(next);
+	}
+	wallpaper_job_free(job);
+	return 0;
+}
+
+static void wallpaper_finish(struct tinywl_server *server) {
+	struct tinywl_wallpaper_job *job = server->wallpaper_job;
+	if (job != NULL) {
+		if (job->threaded) {
+			pthread_join(job->thread, NULL);
+		}
+		wallpaper_job_free(job);
+		server->wallpaper_job = NULL;
+	}
+	free(server->wallpaper_next);
+	server->wallpaper_next = NULL;
+	if (server->wallpaper_done_fd >= 0) {
+		wl_event_source_remove(server->wallpaper_done_source);
+		close(server->wallpaper_done_fd);
+		server->wallpaper_done_fd = -1;
+	}
+}
+
+// The wallpaper the shell used to show: the last image in Plasma's applet
+// config, if there is one
+static char *wallpaper_from_plasma(void) {
+	const char *home = getenv("HOME");
+	if (home == NULL) return NULL;
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/.config/plasma-org.kde.plasma.desktop-appletsrc", home);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return NULL;
+
+	char *found = NULL;
+	char line[4096];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *p = line + strspn(line, " \t");
+		p[strcspn(p, "\r\n")] = '\0';
+		const char *image = NULL;
+		if (strncmp(p, "Image=file://", 13) == 0) {
+			image = p + 13;
+		} else if (strncmp(p, "Image=/", 7) == 0) {
+			image = p + 6;
+		}
+		if (image != NULL) {
+			free(found);
+			found = strdup(image);
+		}
+	}
+	fclose(f);
+	return found;
+}
+
+// Runs once the loop is up; the decoding itself is on the wallpaper thread
+static void handle_wallpaper_load(void *data) {
+	struct tinywl_server *server = data;
+	char *path = server->wallpaper_path;
+	server->wallpaper_path = NULL;
+	if (path == NULL) {
+		path = wallpaper_from_plasma();
+	}
+	if (path != NULL) {
+		wallpaper_job_start(server, path);
+		free(path);
+	}
+}
+
+static size_t wallpaper_bytes(struct tinywl_server *server) {
+	size_t bytes = server->wallpaper_source ? gdk_pixbuf_get_byte_length(server->wallpaper_source) : 0;
+	struct tinywl_wallpaper *wallpaper;
+	wl_list_for_each(wallpaper, &server->wallpapers, link) {
+		bytes += (size_t)wallpaper->base.width * wallpaper->base.height * 4;
+	}
+	return bytes;
+}
+
+// -------------------------------------------------------------------------
+// Layer shell: docks, panels and backgrounds as independent surfaces
+// -------------------------------------------------------------------------
+static void focus_layer_surface(struct tinywl_layer_surface *layer) {
+	struct tinywl_server *server = layer->server;
+	struct wlr_seat *seat = server->seat;
+	struct wlr_surface *surface = layer->layer_surface->surface;
+	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
+	if (prev_surface == surface) {
+		return;
+	}
+	if (prev_surface) {
+		surface_deactivate(prev_surface);
+	}
+	server->focused_layer = layer;
+	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
+	if (keyboard != NULL) {
+		wlr_seat_keyboard_notify_enter(seat, surface,
+			keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+	}
+}
+
+static void unfocus_layer_surface(struct tinywl_layer_surface *layer) {
+	struct tinywl_server *server = layer->server;
+	if (server->focused_layer != layer) {
+		return;
+	}
+	server->focused_layer = NULL;
+	wlr_seat_keyboard_notify_clear_focus(server->seat);
+	// Hand the keyboard back to the most recently focused window
+	if (!wl_list_empty(&server->toplevels)) {
+		struct tinywl_toplevel *toplevel =
+			wl_container_of(server->toplevels.next, toplevel, link);
+		focus_toplevel(toplevel);
+	}
+}
+
+static void layer_surface_rearrange(struct tinywl_layer_surface *layer) {
+	struct wlr_output *wlr_output = layer->layer_surface->output;
+	if (wlr_output != NULL && wlr_output->data != NULL && arrange_layers(wlr_output->data)) {
+		server_fit_toplevels(layer->server);
+	}
+}
+
+static void layer_surface_map(struct wl_listener *listener, void *data) {
+	struct tinywl_layer_surface *layer = wl_container_of(listener, layer, map);
+	struct wlr_layer_surface_v1 *layer_surface = layer->layer_surface;
+
+	// Its exclusive zone only counts once it is mapped
+	layer_surface_rearrange(layer);
+	if (layer_surface->current.keyboard_interactive != ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE &&
+			layer_surface->current.layer >= ZWLR_LAYER_SHELL_V1_LAYER_TOP) {
+		focus_layer_surface(layer);
+	}
+}
+
+static void layer_surface_unmap(struct wl_listener *listener, void *data) {
+	struct tinywl_layer_surface *layer = wl_container_of(listener, layer, unmap);
+	unfocus_layer_surface(layer);
+	layer_surface_rearrange(layer);
+}
+
+static void layer_surface_commit(struct wl_listener *listener, void *data) {
+	struct tinywl_layer_surface *layer = wl_container_of(listener, layer, commit);
+	struct wlr_layer_surface_v1 *layer_surface = layer->layer_surface;
+	if (!layer_surface->initialized) {
+		return;
+	}
+
+	struct wlr_scene_tree *tree = layer->server->layers[layer_surface->current.layer];
+	if (layer->scene->tree->node.parent != tree) {
+		wlr_scene_node_reparent(&layer->scene->tree->node, tree);
+	}
+	if ((layer_surface->current.committed & WLR_LAYER_SURFACE_V1_STATE_KEYBOARD_INTERACTIVITY) &&
+			layer_surface->current.keyboard_interactive == ZWLR_LAYER_SURFACE_V1_KEYBOARD_INTERACTIVITY_NONE) {
+		unfocus_layer_surface(layer);
+	}
+
+	// Plain buffer commits, which is every frame of an animating panel, need
+	// no relayout: the scene graph only damages this surface's own region.
+	if (layer_surface->initial_commit || layer_surface->current.committed != 0) {
+		layer_surface_rearrange(layer);
+	}
+}
+
+static void layer_surface_new_popup(struct wl_listener *listener, void *data) {
+	struct tinywl_layer_surface *layer = wl_container_of(listener, layer, new_popup);
+	struct wlr_xdg_popup *xdg_popup = data;
+	xdg_popup->base->data = wlr_scene_xdg_surface_create(layer->scene->tree, xdg_popup->base);
+}
+
+static void layer_surface_destroy(struct wl_listener *listener, void *data) {
+	struct tinywl_layer_surface *layer = wl_container_of(listener, layer, destroy);
+	struct tinywl_server *server = layer->server;
+	if (server->focused_layer == layer) {
+		server->focused_layer = NULL;
+	}
+	wl_list_remove(&layer->map.link);
+	wl_list_remove(&layer->unmap.link);
+	wl_list_remove(&layer->commit.link);
+	wl_list_remove(&layer->destroy.link);
+	wl_list_remove(&layer->new_popup.link);
+	wl_list_remove(&layer->link);
+
+	struct wlr_output *wlr_output = layer->layer_surface->output;
+	free(layer);
+	if (wlr_output != NULL && wlr_output->data != NULL && arrange_layers(wlr_output->data)) {
+		server_fit_toplevels(server);
+	}
+}
+
+static void server_new_layer_surface(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, new_layer_surface);
+	struct wlr_layer_surface_v1 *layer_surface = data;
+
+	// Clients that leave the output to us get the one the user is looking at
+	if (layer_surface->output == NULL) {
+		layer_surface->output = wlr_output_layout_output_at(server->output_layout,
+			server->cursor->x, server->cursor->y);
+	}
+	if (layer_surface->output == NULL && !wl_list_empty(&server->outputs)) {
+		struct tinywl_output *output = wl_container_of(server->outputs.next, output, link);
+		layer_surface->output = output->wlr_output;
+	}
+	if (layer_surface->output == NULL) {
+		wlr_log(WLR_ERROR, "No output for layer surface '%s'", layer_surface->namespace);
+		wlr_layer_surface_v1_destroy(layer_surface);
+		return;
+	}
+
+	struct tinywl_layer_surface *layer = calloc(1, sizeof(*layer));
+	layer->server = server;
+	layer->layer_surface = layer_surface;
+	layer->scene = wlr_scene_layer_surface_v1_create(
+		server->layers[layer_surface->pending.layer], layer_surface);
+	layer_surface->data = layer;
+
+	layer->map.notify = layer_surface_map;
+	wl_signal_add(&layer_surface->surface->events.map, &layer->map);
+	layer->unmap.notify = layer_surface_unmap;
+	wl_signal_add(&layer_surface->surface->events.unmap, &layer->unmap);
+	layer->commit.notify = layer_surface_commit;
+	wl_signal_add(&layer_surface->surface->events.commit, &layer->commit);
+	layer->destroy.notify = layer_surface_destroy;
+	wl_signal_add(&layer_surface->events.destroy, &layer->destroy);
+	layer->new_popup.notify = layer_surface_new_popup;
+	wl_signal_add(&layer_surface->events.new_popup, &layer->new_popup);
+
+	wl_list_insert(&server->layer_surfaces, &layer->link);
+}
+
+// -------------------------------------------------------------------------
+// Per-instance runtime directory holding all IPC files
+// -------------------------------------------------------------------------
+// Commands queue up as one file each in here; see ipc_drain
+#define TINYWL_IPC_DIR "dock_actions"
+
+static void dir_clear(int dirfd) {
+	// fdopendir() takes ownership of the descriptor, so hand it a duplicate
+	int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dir == NULL) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		if (unlinkat(dirfd, entry->d_name, 0) < 0 && errno == EISDIR) {
+			int sub = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub >= 0) {
+				dir_clear(sub);
+				close(sub);
+			}
+			unlinkat(dirfd, entry->d_name, AT_REMOVEDIR);
+		}
+	}
+	closedir(dir);
+}
+
+static void runtime_dir_clear(struct tinywl_server *server) {
+	dir_clear(server->runtime_fd);
+}
+
+static bool runtime_dir_init(struct tinywl_server *server, const char *socket) {
+	// Named after the Wayland socket so parallel compositors never share files
+	const char *xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (xdg_runtime_dir && xdg_runtime_dir[0] == '/') {
+		snprintf(server->runtime_dir, sizeof(server->runtime_dir), "%s/tinywl-%s",
+			xdg_runtime_dir, socket);
+	} else {
+		snprintf(server->runtime_dir, sizeof(server->runtime_dir), "/tmp/tinywl-%s-%d",
+			socket, (int)getuid());
+	}
+
+	if (mkdir(server->runtime_dir, 0700) != 0 && errno != EEXIST) {
+		wlr_log_errno(WLR_ERROR, "Failed to create runtime directory %s", server->runtime_dir);
+		return false;
+	}
+	server->runtime_fd = open(server->runtime_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	struct stat st;
+	if (server->runtime_fd < 0 || fstat(server->runtime_fd, &st) != 0 || st.st_uid != getuid()) {
+		wlr_log(WLR_ERROR, "Runtime directory %s is not usable", server->runtime_dir);
+		if (server->runtime_fd >= 0) close(server->runtime_fd);
+		server->runtime_fd = -1;
+		return false;
+	}
+
+	// Leftovers from a previous instance on the same socket
+	runtime_dir_clear(server);
+	if (mkdirat(server->runtime_fd, TINYWL_IPC_DIR, 0700) != 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to create %s/%s", server->runtime_dir, TINYWL_IPC_DIR);
+	}
+	setenv("TINYWL_RUNTIME_DIR", server->runtime_dir, true);
+	return true;
+}
+
+static void runtime_dir_finish(struct tinywl_server *server) {
+	if (server->runtime_fd < 0) return;
+	runtime_dir_clear(server);
+	close(server->runtime_fd);
+	server->runtime_fd = -1;
+	rmdir(server->runtime_dir);
+}
+
+static FILE *runtime_fopen(struct tinywl_server *server, const char *name, bool write) {
+	int flags = write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+	int fd = openat(server->runtime_fd, name, flags | O_CLOEXEC, 0600);
+	if (fd < 0) return NULL;
+	FILE *f = fdopen(fd, write ? "w" : "r");
+	if (f == NULL) close(fd);
+	return f;
+}
+
+// -------------------------------------------------------------------------
+// JSON documents: built in a reusable buffer, published with one write()
+// -------------------------------------------------------------------------
+static bool buf_reserve(struct tinywl_buf *buf, size_t extra) {
+	if (buf->len + extra <= buf->cap) return true;
+	size_t cap = buf->cap ? buf->cap : 4096;
+	while (cap < buf->len + extra) cap *= 2;
+	char *data = realloc(buf->data, cap);
+	if (data == NULL) {
+		buf->failed = true;
+		return false;
+	}
+	buf->data = data;
+	buf->cap = cap;
+	return true;
+}
+
+static void buf_append(struct tinywl_buf *buf, const char *str) {
+	size_t len = strlen(str);
+	if (!buf_reserve(buf, len)) return;
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void buf_printf(struct tinywl_buf *buf, const char *fmt, ...) {
+	va_list args;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		size_t room = buf->cap - buf->len;
+		va_start(args, fmt);
+		int len = vsnprintf(buf->data ? buf->data + buf->len : NULL, room, fmt, args);
+		va_end(args);
+		if (len < 0) {
+			buf->failed = true;
+			return;
+		}
+		if ((size_t)len < room) {
+			buf->len += len;
+			return;
+		}
+		if (!buf_reserve(buf, len + 1)) return;
+	}
+}
+
+// Length of the well-formed UTF-8 sequence at s, or 0 if it is not one
+// (overlongs, surrogates and code points past U+10FFFF included)
+static int utf8_sequence_length(const unsigned char *s) {
+	int len;
+	unsigned char lo = 0x80, hi = 0xbf;
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		len = 2;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		len = 3;
+		if (s[0] == 0xe0) lo = 0xa0;
+		if (s[0] == 0xed) hi = 0x9f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		len = 4;
+		if (s[0] == 0xf0) lo = 0x90;
+		if (s[0] == 0xf4) hi = 0x8f;
+	} else {
+		return 0;
+	}
+	if (s[1] < lo || s[1] > hi) return 0;
+	for (int i = 2; i < len; i++) {
+		if (s[i] < 0x80 || s[i] > 0xbf) return 0;
+	}
+	return len;
+}
+
+// Quoted and escaped; invalid UTF-8 becomes U+FFFD so the shell's
+// jsonDecode never rejects the whole document over one bad title
+static void buf_json_string(struct tinywl_buf *buf, const char *str) {
+	const unsigned char *s = (const unsigned char *)str;
+	// Worst case is \u00XX for every byte
+	if (!buf_reserve(buf, strlen(str) * 6 + 2)) return;
+	char *out = buf->data + buf->len;
+	*out++ = '"';
+	while (*s) {
+		if (*s >= 0x80) {
+			int len = utf8_sequence_length(s);
+			if (len == 0) {
+				memcpy(out, "\xef\xbf\xbd", 3);
+				out += 3;
+				s++;
+			} else {
+				memcpy(out, s, len);
+				out += len;
+				s += len;
+			}
+			continue;
+		}
+		switch (*s) {
+		case '"': *out++ = '\\'; *out++ = '"'; break;
+		case '\\': *out++ = '\\'; *out++ = '\\'; break;
+		case '\n': *out++ = '\\'; *out++ = 'n'; break;
+		case '\r': *out++ = '\\'; *out++ = 'r'; break;
+		case '\t': *out++ = '\\'; *out++ = 't'; break;
+		default:
+			if (*s < 0x20) {
+				out += sprintf(out, "\\u%04x", *s);
+			} else {
+				*out++ = *s;
+			}
+		}
+		s++;
+	}
+	*out++ = '"';
+	buf->len = out - buf->data;
+}
+
+// Replace name in the runtime dir with the buffer's contents. With O_TMPFILE
+// the data is written before the file has any name, so readers only ever
+// see a complete document.
+static bool runtime_publish(struct tinywl_server *server, const char *name, const struct tinywl_buf *buf) {
+	if (buf->failed) return false;
+
+	char tmp_name[128];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+	bool anonymous = true;
+	int fd = openat(server->runtime_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		// Filesystems without O_TMPFILE support
+		anonymous = false;
+		fd = openat(server->runtime_fd, tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd < 0) return false;
+	}
+
+	size_t done = 0;
+	while (done < buf->len) {
+		ssize_t n = write(fd, buf->data + done, buf->len - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		done += n;
+	}
+	bool ok = done == buf->len;
+	if (ok && anonymous) {
+		char proc_path[64];
+		snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+		unlinkat(server->runtime_fd, tmp_name, 0);
+		ok = linkat(AT_FDCWD, proc_path, server->runtime_fd, tmp_name, AT_SYMLINK_FOLLOW) == 0;
+	}
+	close(fd);
+	if (ok) {
+		ok = renameat(server->runtime_fd, tmp_name, server->runtime_fd, name) == 0;
+	}
+	if (!ok) {
+		wlr_log_errno(WLR_ERROR, "Failed to publish %s", name);
+		unlinkat(server->runtime_fd, tmp_name, 0);
+	}
+	return ok;
+}
+
+// -------------------------------------------------------------------------
+// Startup timeline: monotonic timestamps for each boot phase
+// -------------------------------------------------------------------------
+static const char *const startup_phase_names[TINYWL_PHASE_COUNT] = {
+	[TINYWL_PHASE_PROCESS_START] = "process_start",
+	[TINYWL_PHASE_BACKEND_START] = "backend_start",
+	[TINYWL_PHASE_FIRST_OUTPUT_COMMIT] = "first_output_commit",
+	[TINYWL_PHASE_CLIENT_CONNECT] = "client_connect",
+	[TINYWL_PHASE_FIRST_COMMIT] = "first_commit",
+	[TINYWL_PHASE_FIRST_MAP] = "first_map",
+	[TINYWL_PHASE_SHELL_FIRST_FRAME] = "shell_first_frame",
+};
+
+static uint64_t monotonic_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void startup_publish(struct tinywl_server *server) {
+	uint64_t t0 = server->startup[TINYWL_PHASE_PROCESS_START];
+
+	struct tinywl_buf *json = &server->json;
+	json->len = 0;
+	json->failed = false;
+	buf_append(json, "{\n  \"clock\": \"monotonic\",\n  \"phases\": {\n");
+	for (int i = 0; i < TINYWL_PHASE_COUNT; i++) {
+		buf_printf(json, "    \"%s\": %llu%s\n", startup_phase_names[i],
+			(unsigned long long)server->startup[i], i + 1 < TINYWL_PHASE_COUNT ? "," : "");
+	}
+	buf_printf(json, "  },\n  \"time_to_ready_ms\": %.3f\n}\n",
+		(server->startup[server->startup_ready_phase] - t0) / 1e6);
+	runtime_publish(server, "startup.json", json);
+
+	char line[512];
+	int len = 0;
+	for (int i = 1; i < TINYWL_PHASE_COUNT && len < (int)sizeof(line); i++) {
+		if (server->startup[i] == 0) continue;
+		len += snprintf(line + len, sizeof(line) - len, " %s=+%.1fms",
+			startup_phase_names[i], (server->startup[i] - t0) / 1e6);
+	}
+	wlr_log(WLR_INFO, "Startup timeline:%s", line);
+
+	if (server->ready_fd >= 0) {
+		if (write(server->ready_fd, "READY\n", 6) < 0) {
+			wlr_log_errno(WLR_ERROR, "Failed to write readiness notification");
+		}
+		close(server->ready_fd);
+		server->ready_fd = -1;
+	}
+}
+
+static void startup_mark_at(struct tinywl_server *server,
+		enum tinywl_startup_phase phase, uint64_t when_ns) {
+	if (server->startup[phase] != 0) return;
+	server->startup[phase] = when_ns;
+	if (phase == server->startup_ready_phase) {
+		startup_publish(server);
+	}
+}
+
+static void startup_mark(struct tinywl_server *server, enum tinywl_startup_phase phase) {
+	if (server->startup[phase] != 0) return;
+	startup_mark_at(server, phase, monotonic_ns());
+}
+
+static void startup_watch_finish(struct tinywl_server *server) {
+	if (server->startup_watch_source) {
+		wl_event_source_remove(server->startup_watch_source);
+		server->startup_watch_source = NULL;
+	}
+	if (server->startup_watch_fd >= 0) {
+		close(server->startup_watch_fd);
+		server->startup_watch_fd = -1;
+	}
+}
+
+// The shell drops "shell_ready" (its own CLOCK_MONOTONIC time in ns) after
+// its first Flutter frame.
+static void startup_check_shell_ready(struct tinywl_server *server) {
+	if (server->shell_pid <= 0 || server->startup[TINYWL_PHASE_SHELL_FIRST_FRAME] != 0) return;
+
+	FILE *f = runtime_fopen(server, "shell_ready", false);
+	if (f == NULL) return;
+	unsigned long long when_ns = 0;
+	if (fscanf(f, "%llu", &when_ns) != 1 || when_ns == 0) {
+		when_ns = monotonic_ns();
+	}
+	fclose(f);
+
+	startup_watch_finish(server);
+	startup_mark_at(server, TINYWL_PHASE_SHELL_FIRST_FRAME, when_ns);
+}
+
+static int handle_startup_watch(int fd, uint32_t mask, void *data) {
+	struct tinywl_server *server = data;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		// Drain; the only name we care about is checked below
+	}
+	startup_check_shell_ready(server);
+	return 0;
+}
+
+static void startup_watch_init(struct tinywl_server *server) {
+	// Only needed until the shell reports in, so the IPC timer's 100 ms
+	// granularity doesn't leak into the readiness signal.
+	server->startup_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (server->startup_watch_fd < 0) return;
+	if (inotify_add_watch(server->startup_watch_fd, server->runtime_dir,
+			IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+		close(server->startup_watch_fd);
+		server->startup_watch_fd = -1;
+		return;
+	}
+	server->startup_watch_source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), server->startup_watch_fd,
+		WL_EVENT_READABLE, handle_startup_watch, server);
+}
+
+static void server_client_created(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, client_created);
+	startup_mark(server, TINYWL_PHASE_CLIENT_CONNECT);
+	// Only the first connection is interesting
+	wl_list_remove(&server->client_created.link);
+	wl_list_init(&server->client_created.link);
+}
+
+extern char **environ;
+
+static pid_t spawn_process(struct tinywl_server *server, char *const argv[], char *const envp[]) {
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	pid_t pid = -1;
+	int ret = posix_spawnp(&pid, argv[0], NULL, &attr, argv, envp);
+	posix_spawnattr_destroy(&attr);
+
+	if (ret != 0) {
+		wlr_log(WLR_ERROR, "Failed to spawn '%s': %s", argv[0], strerror(ret));
+		return -1;
+	}
+	// Remembered so handle_sigchld reaps our children and nobody else's
+	pid_t *slot = wl_array_add(&server->children, sizeof(pid_t));
+	if (slot != NULL) {
+		*slot = pid;
+	}
+	return pid;
+}
+
+static int handle_sigchld(int signal, void *data) {
+	struct tinywl_server *server = data;
+	pid_t *pids = server->children.data;
+	size_t count = server->children.size / sizeof(pid_t);
+	for (size_t i = 0; i < count; ) {
+		if (waitpid(pids[i], NULL, WNOHANG) != 0) {
+			pids[i] = pids[--count];
+		} else {
+			i++;
+		}
+	}
+	server->children.size = count * sizeof(pid_t);
+	return 0;
+}
+
+// Starts a command without /bin/sh when it is a plain "program arg..." line
+static pid_t spawn_command(struct tinywl_server *server, const char *cmd) {
+	if (strpbrk(cmd, "|&;<>()$`\\\"'*?[]#~=%{}\n") != NULL) {
+		char *const argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+		return spawn_process(server, argv, environ);
+	}
+
+	char *copy = strdup(cmd);
+	char *argv[64];
+	int argc = 0;
+	char *save = NULL;
+	for (char *tok = strtok_r(copy, " \t", &save); tok && argc < 63;
+			tok = strtok_r(NULL, " \t", &save)) {
+		argv[argc++] = tok;
+	}
+	argv[argc] = NULL;
+	pid_t pid = argc > 0 ? spawn_process(server, argv, environ) : -1;
+	free(copy);
+	return pid;
+}
+
+// -------------------------------------------------------------------------
+// Idle: nobody at the seat means no thumbnails and 1 Hz frame callbacks
+// -------------------------------------------------------------------------
+#define TINYWL_IDLE_TIMEOUT_MS (5 * 60 * 1000)
+#define TINYWL_IDLE_FRAME_INTERVAL_MS 1000
+#define TINYWL_IDLE_IPC_INTERVAL_MS 1000
+
+static void idle_set_outputs_enabled(struct tinywl_server *server, bool enabled) {
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct wlr_output_state state;
+		wlr_output_state_init(&state);
+		wlr_output_state_set_enabled(&state, enabled);
+		wlr_output_commit_state(output->wlr_output, &state);
+		wlr_output_state_finish(&state);
+	}
+}
+
+static void idle_enter(struct tinywl_server *server) {
+	server->idle = true;
+	wlr_log(WLR_INFO, "Idle after %d ms without input", server->idle_timeout_ms);
+	if (server->idle_outputs_off) {
+		idle_set_outputs_enabled(server, false);
+	}
+	wl_event_source_timer_update(server->idle_frame_timer, TINYWL_IDLE_FRAME_INTERVAL_MS);
+	update_workspace_state(server);
+}
+
+static void idle_wake(struct tinywl_server *server) {
+	server->idle = false;
+	wlr_log(WLR_INFO, "Leaving idle");
+	if (server->idle_outputs_off) {
+		idle_set_outputs_enabled(server, true);
+	}
+	wl_event_source_timer_update(server->idle_frame_timer, 0);
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		wlr_output_schedule_frame(output->wlr_output);
+	}
+	update_workspace_state(server);
+}
+
+// Called for every input event, so it only stamps the time; the timer
+// works out on its own whether the timeout has really passed
+static void server_notify_activity(struct tinywl_server *server) {
+	wlr_idle_notifier_v1_notify_activity(server->idle_notifier, server->seat);
+	server->last_activity_ns = monotonic_ns();
+	if (server->idle) {
+		idle_wake(server);
+		wl_event_source_timer_update(server->idle_timer, server->idle_timeout_ms);
+	}
+}
+
+static int handle_idle_timer(void *data) {
+	struct tinywl_server *server = data;
+	// Inhibited: re-armed once the last inhibitor goes away
+	if (server->idle_inhibitors > 0 || server->idle_timeout_ms <= 0) return 0;
+
+	uint64_t quiet_ms = (monotonic_ns() - server->last_activity_ns) / 1000000;
+	if (quiet_ms < (uint64_t)server->idle_timeout_ms) {
+		wl_event_source_timer_update(server->idle_timer, server->idle_timeout_ms - quiet_ms);
+	} else if (!server->idle) {
+		idle_enter(server);
+	}
+	return 0;
+}
+
+// Output frames stop sending callbacks while idle; this keeps clients
+// ticking slowly instead of freezing them outright
+static int handle_idle_frame_timer(void *data) {
+	struct tinywl_server *server = data;
+	if (!server->idle) return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct wlr_scene_output *scene_output =
+			wlr_scene_get_scene_output(server->scene, output->wlr_output);
+		if (scene_output != NULL) {
+			wlr_scene_output_send_frame_done(scene_output, &now);
+		}
+	}
+	wl_event_source_timer_update(server->idle_frame_timer, TINYWL_IDLE_FRAME_INTERVAL_MS);
+	return 0;
+}
+
+static void idle_inhibitor_destroy(struct wl_listener *listener, void *data) {
+	struct tinywl_idle_inhibitor *inhibitor = wl_container_of(listener, inhibitor, destroy);
+	struct tinywl_server *server = inhibitor->server;
+	if (--server->idle_inhibitors == 0) {
+		wlr_idle_notifier_v1_set_inhibited(server->idle_notifier, false);
+		server->last_activity_ns = monotonic_ns();
+		if (server->idle_timeout_ms > 0) {
+			wl_event_source_timer_update(server->idle_timer, server->idle_timeout_ms);
+		}
+	}
+	wl_list_remove(&inhibitor->destroy.link);
+	free(inhibitor);
+}
+
+// A video player holding an inhibitor keeps the whole session awake
+static void server_new_idle_inhibitor(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, new_idle_inhibitor);
+	struct wlr_idle_inhibitor_v1 *wlr_inhibitor = data;
+
+	struct tinywl_idle_inhibitor *inhibitor = calloc(1, sizeof(*inhibitor));
+	inhibitor->server = server;
+	inhibitor->destroy.notify = idle_inhibitor_destroy;
+	wl_signal_add(&wlr_inhibitor->events.destroy, &inhibitor->destroy);
+
+	if (server->idle_inhibitors++ == 0) {
+		wlr_idle_notifier_v1_set_inhibited(server->idle_notifier, true);
+	}
+	if (server->idle) {
+		idle_wake(server);
+	}
+}
+
+// -------------------------------------------------------------------------
+// Animations: dock, undock and maximize transitions on the frame clock
+// -------------------------------------------------------------------------
+#define TINYWL_ANIM_DOCK_NS (220ull * 1000000ull)
+#define TINYWL_ANIM_UNDOCK_NS (200ull * 1000000ull)
+#define TINYWL_ANIM_MAXIMIZE_NS (180ull * 1000000ull)
+
+static double animation_ease(enum tinywl_easing easing, double t) {
+	double u;
+	switch (easing) {
+	case TINYWL_EASE_OUT_CUBIC:
+		u = 1.0 - t;
+		return 1.0 - u * u * u;
+	case TINYWL_EASE_IN_OUT_CUBIC:
+		if (t < 0.5) {
+			return 4.0 * t * t * t;
+		}
+		u = 2.0 - 2.0 * t;
+		return 1.0 - u * u * u / 2.0;
+	}
+	return t;
+}
+
+static int animation_lerp(int from, int to, double k) {
+	return from + (int)((to - from) * k);
+}
+
+// Runs every frame, so it only moves, scales and fades the existing node
+static void animation_apply(struct tinywl_animation *anim, double t) {
+	double k = animation_ease(anim->easing, t);
+	int x = animation_lerp(anim->from.x, anim->to.x, k);
+	int y = animation_lerp(anim->from.y, anim->to.y, k);
+	double scale_x = (double)animation_lerp(anim->from.width, anim->to.width, k) / anim->from.width;
+	double scale_y = (double)animation_lerp(anim->from.height, anim->to.height, k) / anim->from.height;
+
+	int width = (int)(anim->buffer_width * scale_x);
+	int height = (int)(anim->buffer_height * scale_y);
+	wlr_scene_node_set_position(&anim->snapshot->node,
+		x + (int)(anim->offset_x * scale_x), y + (int)(anim->offset_y * scale_y));
+	wlr_scene_buffer_set_dest_size(anim->snapshot, width > 0 ? width : 1, height > 0 ? height : 1);
+	wlr_scene_buffer_set_opacity(anim->snapshot,
+		anim->from_opacity + (anim->to_opacity - anim->from_opacity) * (float)k);
+}
+
+static void animation_finish(struct tinywl_toplevel *toplevel) {
+	struct tinywl_animation *anim = &toplevel->animation;
+	if (anim->snapshot == NULL) return;
+
+	wlr_scene_node_destroy(&anim->snapshot->node);
+	anim->snapshot = NULL;
+	wl_list_remove(&anim->link);
+	wl_list_init(&anim->link);
+	wlr_scene_node_set_enabled(&toplevel->scene_tree->node, true);
+}
+
+static bool snapshot_accepts_input(struct wlr_scene_buffer *buffer, double *sx, double *sy) {
+	// Clicks during a transition go to whatever is underneath
+	return false;
+}
+
+// The caller has already moved the real window; this only covers the jump
+static void animation_start(struct tinywl_toplevel *toplevel,
+		struct wlr_box from, struct wlr_box to, float from_opacity, float to_opacity,
+		uint64_t duration_ns, enum tinywl_easing easing) {
+	struct tinywl_server *server = toplevel->server;
+	struct tinywl_animation *anim = &toplevel->animation;
+	animation_finish(toplevel);
+
+	// With the outputs off no frame would ever come to finish it
+	if (server->idle || from.width <= 0 || from.height <= 0) return;
+	struct wlr_surface *surface = toplevel_surface(toplevel);
+	if (surface == NULL || surface->buffer == NULL) return;
+
+	anim->snapshot = wlr_scene_buffer_create(server->animation_layer, &surface->buffer->base);
+	if (anim->snapshot == NULL) return;
+	anim->snapshot->point_accepts_input = snapshot_accepts_input;
+	// The transition stands in for the window until its transaction lands
+	if (toplevel->txn_saved != NULL) {
+		wlr_scene_node_destroy(&toplevel->txn_saved->node);
+		toplevel->txn_saved = NULL;
+	}
+
+	// xdg surfaces may draw shadows outside their window geometry
+	struct wlr_box geometry = toplevel_geometry(toplevel);
+	anim->offset_x = -geometry.x;
+	anim->offset_y = -geometry.y;
+	anim->buffer_width = surface->current.width;
+	anim->buffer_height = surface->current.height;
+	anim->from = from;
+	anim->to = to;
+	anim->from_opacity = from_opacity;
+	anim->to_opacity = to_opacity;
+	anim->start_ns = monotonic_ns();
+	anim->duration_ns = duration_ns;
+	anim->easing = easing;
+	wl_list_insert(&server->animations, &anim->link);
+
+	wlr_scene_node_set_enabled(&toplevel->scene_tree->node, false);
+	animation_apply(anim, 0.0);
+
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		wlr_output_schedule_frame(output->wlr_output);
+	}
+}
+
+// Called from output_frame before the scene is committed. Returns whether
+// anything is still moving, so the output keeps asking for frames.
+static bool animations_tick(struct tinywl_server *server, uint64_t now_ns) {
+	struct tinywl_animation *anim, *tmp;
+	wl_list_for_each_safe(anim, tmp, &server->animations, link) {
+		uint64_t elapsed = now_ns > anim->start_ns ? now_ns - anim->start_ns : 0;
+		if (elapsed >= anim->duration_ns) {
+			struct tinywl_toplevel *toplevel = wl_container_of(anim, toplevel, animation);
+			if (!wl_list_empty(&toplevel->txn_link)) {
+				// The client hasn't drawn the new size yet: hold the last
+				// frame, without asking for more, until the transaction applies
+				animation_apply(anim, 1.0);
+				wl_list_remove(&anim->link);
+				wl_list_init(&anim->link);
+				continue;
+			}
+			animation_finish(toplevel);
+			continue;
+		}
+		animation_apply(anim, (double)elapsed / anim->duration_ns);
+	}
+	return !wl_list_empty(&server->animations);
+}
+
+// -------------------------------------------------------------------------
+// Transactions: layout changes across windows land in a single frame
+// -------------------------------------------------------------------------
+// Between transaction_begin() and transaction_commit(), moves are recorded
+// instead of applied and every configure sent is remembered. Each window
+// then shows its last frame (or its animation, held on the final frame)
+// until all clients have acked and committed, or the timeout passes, and
+// everything moves at once. Only xdg windows take part: X11 has no
+// configure serial to wait on.
+#define TINYWL_TRANSACTION_TIMEOUT_MS 200
+
+static void transaction_begin(struct tinywl_server *server) {
+	server->transaction_depth++;
+}
+
+static void transaction_add(struct tinywl_toplevel *toplevel) {
+	if (wl_list_empty(&toplevel->txn_link)) {
+		wl_list_insert(toplevel->server->transaction.prev, &toplevel->txn_link);
+	}
+}
+
+// One buffer per surface, as the scene shows it: subsurfaces (video, GL)
+// and popups included, at their offsets from the main surface
+static void transaction_save_surface(struct wlr_surface *surface, int sx, int sy, void *data) {
+	struct wlr_scene_tree *tree = data;
+	if (surface->buffer == NULL) {
+		return;
+	}
+	struct wlr_scene_buffer *saved = wlr_scene_buffer_create(tree, &surface->buffer->base);
+	if (saved == NULL) {
+		return;
+	}
+	saved->point_accepts_input = snapshot_accepts_input;
+	struct wlr_fbox src;
+	wlr_surface_get_buffer_source_box(surface, &src);
+	wlr_scene_buffer_set_source_box(saved, &src);
+	wlr_scene_buffer_set_dest_size(saved, surface->current.width, surface->current.height);
+	wlr_scene_buffer_set_transform(saved, surface->current.transform);
+	wlr_scene_node_set_position(&saved->node, sx, sy);
+}
+
+// Puts a copy of what the window shows now where the window is now, in its
+// place in the stack, and hides the live tree so commits before the
+// transaction applies stay off screen
+static void transaction_save(struct tinywl_toplevel *toplevel) {
+	if (toplevel->txn_saved != NULL || toplevel->animation.snapshot != NULL) {
+		return;
+	}
+	struct wlr_surface *surface = toplevel_surface(toplevel);
+	if (surface == NULL || surface->buffer == NULL || toplevel->docked_side != 0) {
+		return;
+	}
+	struct wlr_scene_node *node = &toplevel->scene_tree->node;
+	toplevel->txn_saved = wlr_scene_tree_create(node->parent);
+	if (toplevel->txn_saved == NULL) {
+		return;
+	}
+	if (toplevel->xdg_toplevel != NULL) {
+		wlr_xdg_surface_for_each_surface(toplevel->xdg_toplevel->base,
+			transaction_save_surface, toplevel->txn_saved);
+	} else {
+		wlr_surface_for_each_surface(surface, transaction_save_surface, toplevel->txn_saved);
+	}
+	struct wlr_box geometry = toplevel_geometry(toplevel);
+	wlr_scene_node_set_position(&toplevel->txn_saved->node, node->x - geometry.x, node->y - geometry.y);
+	wlr_scene_node_place_above(&toplevel->txn_saved->node, node);
+	wlr_scene_node_set_enabled(node, false);
+}
+
+static void transaction_leave(struct tinywl_toplevel *toplevel) {
+	struct tinywl_animation *anim = &toplevel->animation;
+	wl_list_remove(&toplevel->txn_link);
+	wl_list_init(&toplevel->txn_link);
+	toplevel->txn_serial = 0;
+	if (toplevel->txn_moved) {
+		toplevel->txn_moved = false;
+		toplevel_set_position(toplevel, toplevel->txn_x, toplevel->txn_y);
+	}
+	if (toplevel->txn_saved != NULL) {
+		wlr_scene_node_destroy(&toplevel->txn_saved->node);
+		toplevel->txn_saved = NULL;
+	}
+	if (anim->snapshot == NULL) {
+		wlr_scene_node_set_enabled(&toplevel->scene_tree->node, true);
+	} else if (wl_list_empty(&anim->link)) {
+		// Held on its last frame for us
+		animation_finish(toplevel);
+	}
+}
+
+// All scene changes happen here, back to back, so no frame sees half of them
+static void transaction_apply(struct tinywl_server *server) {
+	if (server->transaction_waiting) {
+		server->transaction_waiting = false;
+		wl_event_source_timer_update(server->transaction_timer, 0);
+	}
+	struct tinywl_toplevel *toplevel, *tmp;
+	wl_list_for_each_safe(toplevel, tmp, &server->transaction, txn_link) {
+		transaction_leave(toplevel);
+	}
+}
+
+static void transaction_check(struct tinywl_server *server) {
+	if (server->transaction_depth > 0 || wl_list_empty(&server->transaction)) {
+		return;
+	}
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->transaction, txn_link) {
+		if (toplevel->txn_serial != 0) {
+			return;
+		}
+	}
+	transaction_apply(server);
+}
+
+static int handle_transaction_timeout(void *data) {
+	struct tinywl_server *server = data;
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->transaction, txn_link) {
+		if (toplevel->txn_serial != 0) {
+			wlr_log(WLR_DEBUG, "Transaction timed out waiting on %s",
+				toplevel_app_id(toplevel, "unknown"));
+		}
+	}
+	transaction_apply(server);
+	return 0;
+}
+
+// A later transaction committed while one is still waiting joins it; the
+// deadline stays that of the first
+static void transaction_commit(struct tinywl_server *server) {
+	if (--server->transaction_depth > 0 || wl_list_empty(&server->transaction)) {
+		return;
+	}
+	bool waiting = false;
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->transaction, txn_link) {
+		transaction_save(toplevel);
+		waiting = waiting || toplevel->txn_serial != 0;
+	}
+	if (!waiting) {
+		transaction_apply(server);
+		return;
+	}
+	if (!server->transaction_waiting) {
+		server->transaction_waiting = true;
+		wl_event_source_timer_update(server->transaction_timer, TINYWL_TRANSACTION_TIMEOUT_MS);
+	}
+}
+
+// From the commit handler: the transaction is waiting for a buffer at or
+// after the serial it configured
+static void transaction_toplevel_commit(struct tinywl_toplevel *toplevel) {
+	if (toplevel->txn_serial == 0 || toplevel->xdg_toplevel == NULL) {
+		return;
+	}
+	uint32_t acked = toplevel->xdg_toplevel->base->current.configure_serial;
+	if ((int32_t)(acked - toplevel->txn_serial) >= 0) {
+		toplevel->txn_serial = 0;
+		transaction_check(toplevel->server);
+	}
+}
+
+// The scene only sends frame callbacks to what is on screen; waiting
+// windows are hidden but still need them to draw the new size
+static void transaction_frame_done_iterator(struct wlr_surface *surface, int sx, int sy, void *data) {
+	wlr_surface_send_frame_done(surface, data);
+}
+
+static void transaction_send_frame_done(struct tinywl_server *server, struct timespec *now) {
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->transaction, txn_link) {
+		if (toplevel->txn_serial != 0) {
+			wlr_xdg_surface_for_each_surface(toplevel->xdg_toplevel->base,
+				transaction_frame_done_iterator, now);
+		}
+	}
+}
+
+static void transaction_remove(struct tinywl_toplevel *toplevel) {
+	if (wl_list_empty(&toplevel->txn_link)) {
+		return;
+	}
+	// Going away: nowhere left to move it
+	toplevel->txn_moved = false;
+	transaction_leave(toplevel);
+	transaction_check(toplevel->server);
+}
+
+static struct wlr_box toplevel_box(struct tinywl_toplevel *toplevel) {
+	struct wlr_box geometry = toplevel_geometry(toplevel);
+	return (struct wlr_box){
+		.x = toplevel->scene_tree->node.x,
+		.y = toplevel->scene_tree->node.y,
+		.width = geometry.width,
+		.height = geometry.height,
+	};
+}
+
+// Where the shell draws the first thumbnail of a dock side; mirrors the
+// paddings in the_workspaces/lib/side_container.dart
+#define TINYWL_DOCK_PANEL_WIDTH 340
+#define TINYWL_DOCK_CARD_INSET 24
+#define TINYWL_DOCK_CARD_TOP 96
+#define TINYWL_DOCK_CARD_WIDTH 290
+#define TINYWL_DOCK_CARD_HEIGHT 200
+
+static struct wlr_box dock_card_box(int side, int out_w) {
+	if (side != 1 && side != 2) {
+		return (struct wlr_box){0};
+	}
+	return (struct wlr_box){
+		.x = side == 1 ? TINYWL_DOCK_CARD_INSET : out_w - TINYWL_DOCK_PANEL_WIDTH + TINYWL_DOCK_CARD_INSET,
+		.y = TINYWL_DOCK_CARD_TOP,
+		.width = TINYWL_DOCK_CARD_WIDTH,
+		.height = TINYWL_DOCK_CARD_HEIGHT,
+	};
+}
+
+static void toplevel_dock(struct tinywl_toplevel *toplevel, int side, int out_w, int out_h) {
+	struct wlr_box from = toplevel_box(toplevel);
+	transaction_begin(toplevel->server);
+
+	// Docked windows keep rendering at a fixed size, parked one pixel on screen
+	toplevel->docked_side = side;
+	focus_history_remove(toplevel);
+	dock_preview_clear(toplevel); // the shell reserves a new rect on its new side
+	toplevel_set_size(toplevel, TINYWL_DOCKED_WIDTH, TINYWL_DOCKED_HEIGHT);
+	toplevel_set_position(toplevel, out_w - 1, out_h - 1);
+	wlr_scene_node_lower_to_bottom(&toplevel->scene_tree->node);
+	toplevel_set_activated(toplevel, false);
+	toplevel_schedule_configure(toplevel);
+
+	animation_start(toplevel, from, dock_card_box(side, out_w), 1.0f, 0.0f,
+		TINYWL_ANIM_DOCK_NS, TINYWL_EASE_IN_OUT_CUBIC);
+	transaction_commit(toplevel->server);
+}
+
+static void toplevel_scale_iterator(struct wlr_surface *surface, int sx, int sy, void *data) {
+	float scale = *(float *)data;
+	wlr_fractional_scale_v1_notify_scale(surface, scale);
+	int buffer_scale = (int)scale;
+	if (buffer_scale < scale) buffer_scale++;
+	wlr_surface_set_preferred_buffer_scale(surface, buffer_scale > 0 ? buffer_scale : 1);
+}
+
+// The scene tells surfaces the scale of the outputs they enter. Docked
+// windows are asked for less on every commit, since the scene may have
+// just told them otherwise, and get their output's scale back on undock:
+// parked and placed on the same output, the scene has nothing to report.
+// X11 clients have no way to hear it.
+static void toplevel_update_scale(struct tinywl_toplevel *toplevel) {
+	if (toplevel->xdg_toplevel == NULL) {
+		return;
+	}
+	struct wlr_box box = toplevel_box(toplevel);
+	if (toplevel->txn_moved) {
+		box.x = toplevel->txn_x;
+		box.y = toplevel->txn_y;
+	}
+	struct wlr_output *wlr_output = wlr_output_layout_output_at(toplevel->server->output_layout,
+		box.x + box.width / 2.0, box.y + box.height / 2.0);
+	if (wlr_output == NULL) {
+		wlr_output = wlr_output_layout_output_at(toplevel->server->output_layout, box.x, box.y);
+	}
+	float scale = wlr_output != NULL ? wlr_output->scale : 1.0f;
+	if (toplevel->docked_side != 0) {
+		scale *= TINYWL_DOCKED_SCALE;
+	}
+	wlr_xdg_surface_for_each_surface(toplevel->xdg_toplevel->base, toplevel_scale_iterator, &scale);
+}
+
+// -------------------------------------------------------------------------
+// Performance HUD (Alt+F2, or HUD over IPC) and damage highlighting (Alt+F3)
+// -------------------------------------------------------------------------
+// Redrawing the HUD damages the output, so it refreshes a few times a second
+// rather than every frame; otherwise it would keep the outputs busy itself
+#define TINYWL_HUD_INTERVAL_MS 250
+#define TINYWL_HUD_PER_SECOND (1000 / TINYWL_HUD_INTERVAL_MS)
+#define TINYWL_HUD_GRAPH_HEIGHT 64
+#define TINYWL_HUD_GRAPH_US 25000 // frame time at the top of the graph
+#define TINYWL_HUD_BAR_WIDTH 240
+
+static const float hud_background[4] = { 0.0f, 0.0f, 0.0f, 0.6f };
+static const float hud_white[4] = { 0.5f, 0.5f, 0.5f, 0.5f };
+static const float hud_green[4] = { 0.2f, 0.8f, 0.3f, 1.0f };
+static const float hud_yellow[4] = { 0.9f, 0.8f, 0.2f, 1.0f };
+static const float hud_red[4] = { 0.9f, 0.2f, 0.2f, 1.0f };
+static const float hud_blue[4] = { 0.3f, 0.5f, 0.9f, 1.0f };
+static const float hud_purple[4] = { 0.6f, 0.4f, 0.9f, 1.0f };
+static const float hud_orange[4] = { 0.9f, 0.5f, 0.1f, 1.0f };
+static const float hud_magenta[4] = { 0.8f, 0.3f, 0.7f, 1.0f };
+static const float hud_cyan[4] = { 0.2f, 0.8f, 0.8f, 1.0f };
+
+static struct wlr_scene_rect *hud_rect(struct tinywl_hud *hud, int x, int y, const float color[4]) {
+	struct wlr_scene_rect *rect = wlr_scene_rect_create(hud->tree, 0, 0, color);
+	wlr_scene_node_set_position(&rect->node, x, y);
+	return rect;
+}
+
+static void hud_bar(struct wlr_scene_rect *rect, uint32_t length) {
+	wlr_scene_rect_set_size(rect, length < TINYWL_HUD_BAR_WIDTH ? (int)length : TINYWL_HUD_BAR_WIDTH, 8);
+}
+
+// Top to bottom: frame time graph against the refresh budget, skipped
+// frames, commits per second of each window (the shell in purple),
+// thumbnails per second, thumbnail queue depth, IPC commands per second
+static void hud_output_create(struct tinywl_server *server, struct tinywl_output *output) {
+	struct tinywl_hud *hud = &output->hud;
+	hud->tree = wlr_scene_tree_create(server->hud_layer);
+	if (hud->tree == NULL) return;
+
+	struct wlr_scene_rect *background = hud_rect(hud, 0, 0, hud_background);
+	wlr_scene_rect_set_size(background, 16 + TINYWL_HUD_BAR_WIDTH, 120 + TINYWL_HUD_TOPLEVELS * 10);
+	for (int i = 0; i < TINYWL_HUD_FRAMES; i++) {
+		hud->frame_bars[i] = hud_rect(hud, 8 + i * 4, 8, hud_green);
+	}
+	hud->budget_line = hud_rect(hud, 8, 8, hud_white);
+	hud->skipped_bar = hud_rect(hud, 8, 80, hud_red);
+	for (int i = 0; i < TINYWL_HUD_TOPLEVELS; i++) {
+		hud->commit_bars[i] = hud_rect(hud, 8, 96 + i * 10, hud_blue);
+	}
+	int y = 96 + TINYWL_HUD_TOPLEVELS * 10;
+	hud->thumb_bar = hud_rect(hud, 8, y, hud_orange);
+	hud->thumb_queue_bar = hud_rect(hud, 8, y + 10, hud_magenta);
+	hud->ipc_bar = hud_rect(hud, 8, y + 20, hud_cyan);
+}
+
+static void hud_output_destroy(struct tinywl_output *output) {
+	if (output->hud.tree == NULL) return;
+	wlr_scene_node_destroy(&output->hud.tree->node);
+	memset(&output->hud, 0, sizeof(output->hud));
+}
+
+static void hud_output_update(struct tinywl_server *server, struct tinywl_output *output) {
+	struct tinywl_hud *hud = &output->hud;
+	struct wlr_box box;
+	wlr_output_layout_get_box(server->output_layout, output->wlr_output, &box);
+	wlr_scene_node_set_position(&hud->tree->node, box.x + 16, box.y + 16);
+
+	int refresh = output->wlr_output->refresh > 0 ? output->wlr_output->refresh : 60000;
+	uint32_t budget_us = 1000000000u / refresh;
+	for (int i = 0; i < TINYWL_HUD_FRAMES; i++) {
+		// Oldest on the left
+		uint32_t us = output->frame_us[(output->frame_index + i) % TINYWL_HUD_FRAMES];
+		int height = us >= TINYWL_HUD_GRAPH_US ? TINYWL_HUD_GRAPH_HEIGHT :
+			(int)(us * TINYWL_HUD_GRAPH_HEIGHT / TINYWL_HUD_GRAPH_US);
+		struct wlr_scene_rect *bar = hud->frame_bars[i];
+		wlr_scene_node_set_position(&bar->node, bar->node.x, 8 + TINYWL_HUD_GRAPH_HEIGHT - height);
+		wlr_scene_rect_set_size(bar, 3, height);
+		wlr_scene_rect_set_color(bar, us <= budget_us ? hud_green : us <= 2 * budget_us ? hud_yellow : hud_red);
+	}
+	int budget_y = budget_us >= TINYWL_HUD_GRAPH_US ? 0 :
+		TINYWL_HUD_GRAPH_HEIGHT - (int)(budget_us * TINYWL_HUD_GRAPH_HEIGHT / TINYWL_HUD_GRAPH_US);
+	wlr_scene_node_set_position(&hud->budget_line->node, 8, 8 + budget_y);
+	wlr_scene_rect_set_size(hud->budget_line, TINYWL_HUD_BAR_WIDTH, 1);
+	hud_bar(hud->skipped_bar, output->frames_skipped * 8);
+
+	int i = 0;
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (i == TINYWL_HUD_TOPLEVELS) break;
+		// One pixel per commit per second
+		hud_bar(hud->commit_bars[i], toplevel->commits * TINYWL_HUD_PER_SECOND);
+		wlr_scene_rect_set_color(hud->commit_bars[i], toplevel->is_shell ? hud_purple : hud_blue);
+		i++;
+	}
+	for (; i < TINYWL_HUD_TOPLEVELS; i++) {
+		hud_bar(hud->commit_bars[i], 0);
+	}
+
+	uint32_t queued = 0;
+	for (int w = 0; w < server->n_thumb_workers; w++) {
+		queued += server->thumb_workers[w].outstanding;
+	}
+	hud_bar(hud->thumb_bar, server->hud_thumb_jobs * TINYWL_HUD_PER_SECOND * 4);
+	hud_bar(hud->thumb_queue_bar, queued * 16);
+	hud_bar(hud->ipc_bar, server->hud_ipc_commands * TINYWL_HUD_PER_SECOND * 16);
+}
+
+static int handle_hud_timer(void *data) {
+	struct tinywl_server *server = data;
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		if (output->hud.tree == NULL) {
+			hud_output_create(server, output);
+			if (output->hud.tree == NULL) continue;
+		}
+		hud_output_update(server, output);
+		output->frames_skipped = 0;
+	}
+
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		toplevel->commits = 0;
+	}
+	server->hud_thumb_jobs = 0;
+	server->hud_ipc_commands = 0;
+	wl_event_source_timer_update(server->hud_timer, TINYWL_HUD_INTERVAL_MS);
+	return 0;
+}
+
+static void hud_set_enabled(struct tinywl_server *server, bool enabled) {
+	server->hud_enabled = enabled;
+	if (enabled) {
+		if (server->hud_timer == NULL) {
+			server->hud_timer = wl_event_loop_add_timer(
+				wl_display_get_event_loop(server->wl_display), handle_hud_timer, server);
+		}
+		// Outputs get their overlay on the first tick, including ones added later
+		handle_hud_timer(server);
+		return;
+	}
+	if (server->hud_timer != NULL) {
+		wl_event_source_timer_update(server->hud_timer, 0);
+	}
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		hud_output_destroy(output);
+	}
+}
+
+// wlroots tints every region each commit repaints, so a client damaging
+// more than it changes (say, the whole fullscreen shell) stands out
+static void damage_debug_toggle(struct tinywl_server *server) {
+	server->scene->debug_damage_option =
+		server->scene->debug_damage_option == WLR_SCENE_DEBUG_DAMAGE_HIGHLIGHT ?
+		WLR_SCENE_DEBUG_DAMAGE_NONE : WLR_SCENE_DEBUG_DAMAGE_HIGHLIGHT;
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		wlr_output_schedule_frame(output->wlr_output);
+	}
+}
+
+// -------------------------------------------------------------------------
+// Scheduling: the focused app's process ahead of background and docked ones
+// -------------------------------------------------------------------------
+// With a delegated cgroup v2 subtree (e.g. systemd-run --user --scope -p
+// Delegate=yes) each class is a leaf with its own cpu.weight and io.weight.
+// Clients living outside our subtree, or systems without delegation, get
+// nice and I/O priority per thread instead.
+#define TINYWL_IOPRIO_WHO_PROCESS 1
+#define TINYWL_IOPRIO_CLASS_BE 2
+#define TINYWL_IOPRIO_CLASS_IDLE 3
+#define TINYWL_IOPRIO(class, level) (((class) << 13) | (level))
+
+// The foreground class has no entry: it puts the process back where it was,
+// in its own cgroup with its own nice and ioprio
+static const struct {
+	const char *name;
+	unsigned cpu_weight, io_weight;
+	int nice, ioprio;
+} sched_classes[TINYWL_SCHED_FOREGROUND] = {
+	[TINYWL_SCHED_PARKED] = { "parked", 20, 10, 10, TINYWL_IOPRIO(TINYWL_IOPRIO_CLASS_IDLE, 0) },
+	[TINYWL_SCHED_BACKGROUND] = { "background", 100, 100, 5, TINYWL_IOPRIO(TINYWL_IOPRIO_CLASS_BE, 7) },
+};
+
+static bool cgroup_write(int dirfd, const char *file, const char *value) {
+	int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	size_t len = strlen(value);
+	ssize_t n = write(fd, value, len);
+	int err = errno;
+	close(fd);
+	errno = err;
+	return n == (ssize_t)len;
+}
+
+static void cgroup_write_weights(int dirfd, const char *leaf, unsigned cpu_weight, unsigned io_weight) {
+	char path[64], value[32];
+	snprintf(path, sizeof(path), "%s/cpu.weight", leaf);
+	snprintf(value, sizeof(value), "%u", cpu_weight);
+	cgroup_write(dirfd, path, value);
+	snprintf(path, sizeof(path), "%s/io.weight", leaf);
+	snprintf(value, sizeof(value), "default %u", io_weight);
+	cgroup_write(dirfd, path, value);
+}
+
+// Moves everything in our cgroup into a "compositor" leaf, since cgroup v2
+// only hands controllers down from cgroups without processes of their own
+static int sched_cgroup_open(void) {
+	FILE *f = fopen("/proc/self/cgroup", "re");
+	if (f == NULL) {
+		return -1;
+	}
+	char line[512], dir[512] = "";
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(dir, sizeof(dir), "/sys/fs/cgroup%s", line + 3);
+			break;
+		}
+	}
+	fclose(f);
+	if (dir[0] == '\0') {
+		return -1;
+	}
+
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (mkdirat(fd, "compositor", 0755) < 0 && errno != EEXIST) {
+		wlr_log(WLR_DEBUG, "cgroup %s is not delegated to us: %s", dir, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	int procs_fd = openat(fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+	FILE *procs = procs_fd >= 0 ? fdopen(procs_fd, "r") : NULL;
+	if (procs != NULL) {
+		while (fgets(line, sizeof(line), procs) != NULL) {
+			cgroup_write(fd, "compositor/cgroup.procs", line);
+		}
+		fclose(procs);
+	}
+	if (!cgroup_write(fd, "cgroup.subtree_control", "+cpu")) {
+		wlr_log_errno(WLR_INFO, "Cannot enable the cpu controller in %s", dir);
+		close(fd);
+		return -1;
+	}
+	// Not every kernel has an io controller that honours weights
+	cgroup_write(fd, "cgroup.subtree_control", "+io");
+
+	// The compositor, the shell and freshly launched apps stay in front
+	cgroup_write_weights(fd, "compositor", 1000, 1000);
+	for (int i = 0; i < TINYWL_SCHED_FOREGROUND; i++) {
+		if (mkdirat(fd, sched_classes[i].name, 0755) < 0 && errno != EEXIST) {
+			wlr_log_errno(WLR_INFO, "Cannot create cgroup %s/%s", dir, sched_classes[i].name);
+			close(fd);
+			return -1;
+		}
+		cgroup_write_weights(fd, sched_classes[i].name,
+			sched_classes[i].cpu_weight, sched_classes[i].io_weight);
+	}
+	wlr_log(WLR_INFO, "Scheduling clients through cgroup %s", dir);
+	return fd;
+}
+
+// Runs before anything is spawned, so children start in our leaf
+static void sched_init(struct tinywl_server *server) {
+	server->sched_cgroup_fd = sched_cgroup_open();
+
+	// Without CAP_SYS_NICE going back from nice 10 to 0 needs RLIMIT_NICE
+	// of 20; without it, renicing would be one-way and only ioprio is used
+	struct rlimit limit;
+	server->sched_renice = geteuid() == 0 ||
+		(getrlimit(RLIMIT_NICE, &limit) == 0 && limit.rlim_cur >= 20);
+	if (server->sched_cgroup_fd < 0) {
+		wlr_log(WLR_INFO, "No delegated cgroup, scheduling clients with %s",
+			server->sched_renice ? "nice and ioprio" : "ioprio only (RLIMIT_NICE below 20)");
+	}
+	server->sched_running = true;
+}
+
+// Remembers the process's cgroup and every thread's nice and ioprio, once,
+// before the first change
+static void sched_save(struct tinywl_sched_proc *proc) {
+	proc->saved = true;
+	char path[64], line[512];
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)proc->pid);
+	FILE *f = fopen(path, "re");
+	while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(proc->cgroup, sizeof(proc->cgroup), "%s", line + 3);
+			break;
+		}
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)proc->pid);
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		int tid = atoi(entry->d_name);
+		if (tid <= 0) {
+			continue;
+		}
+		errno = 0;
+		int nice = getpriority(PRIO_PROCESS, tid);
+		long ioprio = syscall(SYS_ioprio_get, TINYWL_IOPRIO_WHO_PROCESS, tid);
+		if (errno != 0 || ioprio < 0) {
+			continue;
+		}
+		struct tinywl_sched_thread *thread = wl_array_add(&proc->threads, sizeof(*thread));
+		if (thread == NULL) {
+			break;
+		}
+		thread->tid = tid;
+		thread->nice = nice;
+		thread->ioprio = ioprio;
+	}
+	closedir(dir);
+}
+
+// Threads started after sched_save inherited our values; they go back to
+// what the main thread had
+static const struct tinywl_sched_thread *sched_saved_thread(struct tinywl_sched_proc *proc, pid_t tid) {
+	const struct tinywl_sched_thread *thread, *main_thread = NULL;
+	wl_array_for_each(thread, &proc->threads) {
+		if (thread->tid == tid) {
+			return thread;
+		}
+		if (thread->tid == proc->pid) {
+			main_thread = thread;
+		}
+	}
+	return main_thread;
+}
+
+// Both are per thread, so walk every thread of the process. class is
+// TINYWL_SCHED_FOREGROUND to put back the saved values.
+static void sched_renice_threads(struct tinywl_server *server, struct tinywl_sched_proc *proc,
+		enum tinywl_sched_class class) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)proc->pid);
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		int tid = atoi(entry->d_name);
+		if (tid <= 0) {
+			continue;
+		}
+		int nice, ioprio;
+		if (class == TINYWL_SCHED_FOREGROUND) {
+			const struct tinywl_sched_thread *saved = sched_saved_thread(proc, tid);
+			if (saved == NULL) {
+				continue;
+			}
+			nice = saved->nice;
+			ioprio = saved->ioprio;
+		} else {
+			nice = sched_classes[class].nice;
+			ioprio = sched_classes[class].ioprio;
+		}
+		if (server->sched_renice) {
+			setpriority(PRIO_PROCESS, tid, nice);
+		}
+		syscall(SYS_ioprio_set, TINYWL_IOPRIO_WHO_PROCESS, tid, ioprio);
+	}
+	closedir(dir);
+}
+
+static void sched_apply(struct tinywl_server *server, struct tinywl_sched_proc *proc,
+		enum tinywl_sched_class class) {
+	proc->applied = class;
+	if (class == TINYWL_SCHED_FOREGROUND) {
+		if (proc->moved) {
+			// Back to where it was found, written by absolute path since
+			// that may be outside our subtree
+			char path[512], value[32];
+			snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cgroup.procs", proc->cgroup);
+			snprintf(value, sizeof(value), "%d", (int)proc->pid);
+			if (!cgroup_write(AT_FDCWD, path, value)) {
+				wlr_log_errno(WLR_DEBUG, "Cannot move %d back to %s", (int)proc->pid, proc->cgroup);
+			}
+			proc->moved = false;
+		}
+		if (proc->reniced) {
+			sched_renice_threads(server, proc, class);
+			proc->reniced = false;
+		}
+		wlr_log(WLR_DEBUG, "Scheduling %d as it was", (int)proc->pid);
+		return;
+	}
+
+	if (!proc->saved) {
+		sched_save(proc);
+	}
+	if (server->sched_cgroup_fd >= 0 && proc->cgroup[0] != '\0') {
+		char path[64], value[32];
+		snprintf(path, sizeof(path), "%s/cgroup.procs", sched_classes[class].name);
+		snprintf(value, sizeof(value), "%d", (int)proc->pid);
+		if (cgroup_write(server->sched_cgroup_fd, path, value)) {
+			proc->moved = true;
+			wlr_log(WLR_DEBUG, "Scheduling %d as %s", (int)proc->pid, sched_classes[class].name);
+			return;
+		}
+		// Started outside our subtree; fall through to nice and ioprio
+	}
+
+	sched_renice_threads(server, proc, class);
+	proc->reniced = true;
+	wlr_log(WLR_DEBUG, "Scheduling %d as %s (nice/ioprio)", (int)proc->pid, sched_classes[class].name);
+}
+
+static void sched_proc_destroy(struct tinywl_sched_proc *proc) {
+	wl_list_remove(&proc->link);
+	wl_array_release(&proc->threads);
+	free(proc);
+}
+
+static struct tinywl_sched_proc *sched_proc_get(struct tinywl_server *server, pid_t pid) {
+	struct tinywl_sched_proc *proc;
+	wl_list_for_each(proc, &server->sched_procs, link) {
+		if (proc->pid == pid) {
+			return proc;
+		}
+	}
+	proc = calloc(1, sizeof(*proc));
+	if (proc == NULL) {
+		return NULL;
+	}
+	// Untouched processes are as good as foreground: left alone
+	proc->pid = pid;
+	proc->applied = TINYWL_SCHED_FOREGROUND;
+	proc->wanted = -1;
+	wl_array_init(&proc->threads);
+	wl_list_insert(&server->sched_procs, &proc->link);
+	return proc;
+}
+
+static void handle_sched_update(void *data) {
+	struct tinywl_server *server = data;
+	server->sched_idle = NULL;
+
+	struct tinywl_sched_proc *proc, *tmp;
+	wl_list_for_each(proc, &server->sched_procs, link) {
+		proc->wanted = -1;
+	}
+	struct tinywl_toplevel *front = NULL;
+	if (!wl_list_empty(&server->focus_history)) {
+		front = wl_container_of(server->focus_history.next, front, mru_link);
+	}
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->is_shell || toplevel->pid <= 0 || toplevel->pid == getpid()) {
+			continue;
+		}
+		enum tinywl_sched_class class = toplevel == front ? TINYWL_SCHED_FOREGROUND :
+			toplevel->docked_side != 0 ? TINYWL_SCHED_PARKED : TINYWL_SCHED_BACKGROUND;
+		proc = sched_proc_get(server, toplevel->pid);
+		if (proc != NULL && (int)class > proc->wanted) {
+			proc->wanted = class;
+		}
+	}
+
+	wl_list_for_each_safe(proc, tmp, &server->sched_procs, link) {
+		if (proc->wanted < 0) {
+			// No windows left: back to how it was, and forget it
+			if (proc->applied != TINYWL_SCHED_FOREGROUND) {
+				sched_apply(server, proc, TINYWL_SCHED_FOREGROUND);
+			}
+			sched_proc_destroy(proc);
+		} else if ((enum tinywl_sched_class)proc->wanted != proc->applied) {
+			sched_apply(server, proc, proc->wanted);
+		}
+	}
+}
+
+// Focus and dock changes come in bursts; one pass once the loop is idle
+static void sched_schedule(struct tinywl_server *server) {
+	if (!server->sched_running || server->sched_idle != NULL) {
+		return;
+	}
+	server->sched_idle = wl_event_loop_add_idle(
+		wl_display_get_event_loop(server->wl_display), handle_sched_update, server);
+}
+
+// Clients may outlive us; leave them as we found them
+static void sched_finish(struct tinywl_server *server) {
+	server->sched_running = false;
+	if (server->sched_idle != NULL) {
+		wl_event_source_remove(server->sched_idle);
+		server->sched_idle = NULL;
+	}
+	struct tinywl_sched_proc *proc, *tmp;
+	wl_list_for_each_safe(proc, tmp, &server->sched_procs, link) {
+		if (proc->applied != TINYWL_SCHED_FOREGROUND) {
+			sched_apply(server, proc, TINYWL_SCHED_FOREGROUND);
+		}
+		sched_proc_destroy(proc);
+	}
+	if (server->sched_cgroup_fd >= 0) {
+		// Leaves still holding processes stay behind; the kernel says EBUSY
+		for (int i = 0; i < TINYWL_SCHED_FOREGROUND; i++) {
+			unlinkat(server->sched_cgroup_fd, sched_classes[i].name, AT_REMOVEDIR);
+		}
+		close(server->sched_cgroup_fd);
+		server->sched_cgroup_fd = -1;
+	}
+}
+
+// -------------------------------------------------------------------------
+// Window switcher (Alt+Tab): focus history and the overlay drawn over it
+// -------------------------------------------------------------------------
+#define TINYWL_SWITCHER_CARD_WIDTH 240
+#define TINYWL_SWITCHER_CARD_HEIGHT 150
+#define TINYWL_SWITCHER_GAP 16
+#define TINYWL_SWITCHER_COLUMNS 6
+
+static const float switcher_background[4] = { 0.0f, 0.0f, 0.0f, 0.7f };
+static const float switcher_highlight[4] = { 0.3f, 0.5f, 0.9f, 0.9f };
+
+static void switcher_build(struct tinywl_server *server);
+
+// The shell and parked windows are never switched to
+static bool toplevel_switchable(struct tinywl_toplevel *toplevel) {
+	return !toplevel->is_shell && toplevel->docked_side == 0;
+}
+
+static void focus_history_touch(struct tinywl_toplevel *toplevel) {
+	struct tinywl_server *server = toplevel->server;
+	if (!toplevel_switchable(toplevel)) {
+		return;
+	}
+	if (server->focus_history.next == &toplevel->mru_link) {
+		return;
+	}
+	wl_list_remove(&toplevel->mru_link);
+	wl_list_insert(&server->focus_history, &toplevel->mru_link);
+	sched_schedule(server);
+	if (server->switcher != NULL) {
+		switcher_build(server);
+	}
+}
+
+static void focus_history_remove(struct tinywl_toplevel *toplevel) {
+	struct tinywl_server *server = toplevel->server;
+	if (wl_list_empty(&toplevel->mru_link)) {
+		return;
+	}
+	wl_list_remove(&toplevel->mru_link);
+	wl_list_init(&toplevel->mru_link);
+	sched_schedule(server);
+	// Its card goes with the rebuild
+	toplevel->switcher_preview = NULL;
+	if (server->switcher_selected == toplevel) {
+		server->switcher_selected = NULL;
+	}
+	if (server->switcher != NULL) {
+		switcher_build(server);
+	}
+}
+
+// Points a preview node at the client's current buffer, scaled down to fit
+// box (in the node's parent) with no copy. Called again on every commit.
+static void scene_preview_update(struct wlr_scene_buffer *preview,
+		struct tinywl_toplevel *toplevel, struct wlr_box box) {
+	struct wlr_surface *surface = toplevel_surface(toplevel);
+	if (surface == NULL || surface->buffer == NULL ||
+			surface->current.width <= 0 || surface->current.height <= 0) {
+		wlr_scene_buffer_set_buffer(preview, NULL);
+		return;
+	}
+
+	// Crop xdg shadows to the window geometry
+	struct wlr_box bounds = { .width = surface->current.width, .height = surface->current.height };
+	struct wlr_box geometry = toplevel_geometry(toplevel);
+	if (!wlr_box_intersection(&geometry, &geometry, &bounds)) {
+		geometry = bounds;
+	}
+	double scale = (double)surface->buffer->base.width / surface->current.width;
+
+	wlr_scene_buffer_set_buffer(preview, &surface->buffer->base);
+	wlr_scene_buffer_set_source_box(preview, &(struct wlr_fbox){
+		.x = geometry.x * scale,
+		.y = geometry.y * scale,
+		.width = geometry.width * scale,
+		.height = geometry.height * scale,
+	});
+
+	double fit = 1.0;
+	if (fit * geometry.width > box.width) {
+		fit = (double)box.width / geometry.width;
+	}
+	if (fit * geometry.height > box.height) {
+		fit = (double)box.height / geometry.height;
+	}
+	int width = (int)(geometry.width * fit);
+	int height = (int)(geometry.height * fit);
+	wlr_scene_buffer_set_dest_size(preview, width > 0 ? width : 1, height > 0 ? height : 1);
+	wlr_scene_node_set_position(&preview->node,
+		box.x + (box.width - width) / 2, box.y + (box.height - height) / 2);
+}
+
+static void switcher_preview_update(struct tinywl_toplevel *toplevel) {
+	if (toplevel->switcher_preview != NULL) {
+		scene_preview_update(toplevel->switcher_preview, toplevel, (struct wlr_box){
+			.width = TINYWL_SWITCHER_CARD_WIDTH,
+			.height = TINYWL_SWITCHER_CARD_HEIGHT,
+		});
+	}
+}
+
+static void switcher_select(struct tinywl_server *server, struct tinywl_toplevel *toplevel) {
+	server->switcher_selected = toplevel;
+	struct wlr_scene_tree *card = toplevel->switcher_preview->node.parent;
+	wlr_scene_node_set_position(&server->switcher_highlight->node,
+		card->node.x - TINYWL_SWITCHER_GAP / 2, card->node.y - TINYWL_SWITCHER_GAP / 2);
+}
+
+static void switcher_clear(struct tinywl_server *server) {
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->focus_history, mru_link) {
+		toplevel->switcher_preview = NULL;
+	}
+	if (server->switcher != NULL) {
+		wlr_scene_node_destroy(&server->switcher->node);
+	}
+	server->switcher = NULL;
+	server->switcher_highlight = NULL;
+}
+
+// Lays out one card per window in focus order, centred on the output
+// under the cursor. Everything is plain scene nodes, so the overlay shows
+// up in the next frame the scene schedules.
+static void switcher_build(struct tinywl_server *server) {
+	switcher_clear(server);
+	int count = wl_list_length(&server->focus_history);
+	if (count == 0) {
+		server->switcher_selected = NULL;
+		return;
+	}
+
+	struct wlr_box box;
+	struct wlr_output *wlr_output = wlr_output_layout_output_at(server->output_layout,
+		server->cursor->x, server->cursor->y);
+	wlr_output_layout_get_box(server->output_layout, wlr_output, &box);
+	if (wlr_box_empty(&box)) {
+		box = (struct wlr_box){ .width = TINYWL_FALLBACK_WIDTH, .height = TINYWL_FALLBACK_HEIGHT };
+	}
+
+	int columns = count < TINYWL_SWITCHER_COLUMNS ? count : TINYWL_SWITCHER_COLUMNS;
+	int rows = (count + columns - 1) / columns;
+	int width = columns * (TINYWL_SWITCHER_CARD_WIDTH + TINYWL_SWITCHER_GAP) + TINYWL_SWITCHER_GAP;
+	int height = rows * (TINYWL_SWITCHER_CARD_HEIGHT + TINYWL_SWITCHER_GAP) + TINYWL_SWITCHER_GAP;
+
+	server->switcher = wlr_scene_tree_create(server->switcher_layer);
+	wlr_scene_node_set_position(&server->switcher->node,
+		box.x + (box.width - width) / 2, box.y + (box.height - height) / 2);
+	wlr_scene_rect_create(server->switcher, width, height, switcher_background);
+	server->switcher_highlight = wlr_scene_rect_create(server->switcher,
+		TINYWL_SWITCHER_CARD_WIDTH + TINYWL_SWITCHER_GAP,
+		TINYWL_SWITCHER_CARD_HEIGHT + TINYWL_SWITCHER_GAP, switcher_highlight);
+
+	int i = 0;
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->focus_history, mru_link) {
+		struct wlr_scene_tree *card = wlr_scene_tree_create(server->switcher);
+		wlr_scene_node_set_position(&card->node,
+			TINYWL_SWITCHER_GAP + (i % columns) * (TINYWL_SWITCHER_CARD_WIDTH + TINYWL_SWITCHER_GAP),
+			TINYWL_SWITCHER_GAP + (i / columns) * (TINYWL_SWITCHER_CARD_HEIGHT + TINYWL_SWITCHER_GAP));
+		toplevel->switcher_preview = wlr_scene_buffer_create(card, NULL);
+		toplevel->switcher_preview->point_accepts_input = snapshot_accepts_input;
+		switcher_preview_update(toplevel);
+		i++;
+	}
+
+	if (server->switcher_selected == NULL) {
+		server->switcher_selected =
+			wl_container_of(server->focus_history.next, server->switcher_selected, mru_link);
+	}
+	switcher_select(server, server->switcher_selected);
+}
+
+// Alt+Tab opens the switcher on the previously focused window (or the last
+// one with Shift); further presses walk the focus history
+static void switcher_step(struct tinywl_server *server, bool forward) {
+	if (wl_list_empty(&server->focus_history)) {
+		return;
+	}
+	struct wl_list *link;
+	if (server->switcher == NULL) {
+		link = forward ? server->focus_history.next : server->focus_history.prev;
+		struct tinywl_toplevel *first = wl_container_of(link, first, mru_link);
+		struct wlr_surface *focused = server->seat->keyboard_state.focused_surface;
+		if (forward && toplevel_surface(first) == focused && link->next != &server->focus_history) {
+			link = link->next;
+		}
+		server->switcher_selected = wl_container_of(link, server->switcher_selected, mru_link);
+		switcher_build(server);
+		return;
+	}
+
+	link = &server->switcher_selected->mru_link;
+	link = forward ? link->next : link->prev;
+	if (link == &server->focus_history) {
+		link = forward ? link->next : link->prev;
+	}
+	struct tinywl_toplevel *toplevel = wl_container_of(link, toplevel, mru_link);
+	switcher_select(server, toplevel);
+}
+
+static void switcher_close(struct tinywl_server *server, bool commit) {
+	if (server->switcher == NULL) {
+		return;
+	}
+	struct tinywl_toplevel *selected = server->switcher_selected;
+	switcher_clear(server);
+	server->switcher_selected = NULL;
+	if (commit && selected != NULL) {
+		focus_toplevel(selected);
+	}
+}
+
+static void switcher_handle_key(struct tinywl_server *server, xkb_keysym_t sym) {
+	switch (sym) {
+	case XKB_KEY_Tab:
+	case XKB_KEY_F1:
+		switcher_step(server, true);
+		break;
+	case XKB_KEY_ISO_Left_Tab:
+		switcher_step(server, false);
+		break;
+	case XKB_KEY_Return:
+		switcher_close(server, true);
+		break;
+	case XKB_KEY_Escape:
+		switcher_close(server, false);
+		break;
+	}
+}
+
+// -------------------------------------------------------------------------
+// Dock previews: docked windows drawn live into rects the shell reserves
+// -------------------------------------------------------------------------
+// The shell lays out its side cards and sends PREVIEW_RECT for each; the
+// window's own buffer is then shown scaled in the shell's tree, so the
+// shell only draws the card around it and nothing is copied on the CPU.
+// Until a rect arrives (or for shells that never send one) THUMB files
+// still work.
+
+static struct tinywl_toplevel *server_shell(struct tinywl_server *server) {
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->is_shell) {
+			return toplevel;
+		}
+	}
+	return NULL;
+}
+
+// The tree previews go in, and where the shell's (0, 0) is inside it. A
+// Wayland shell's coordinates start at its window geometry, not its surface;
+// an embedded one's at the view.
+static struct wlr_scene_tree *shell_tree(struct tinywl_server *server, int *x, int *y) {
+	*x = *y = 0;
+#if TINYWL_HAS_FLUTTER
+	if (server->flutter.engine != NULL) {
+		return server->flutter.tree;
+	}
+#endif
+	struct tinywl_toplevel *shell = server_shell(server);
+	if (shell == NULL) {
+		return NULL;
+	}
+	struct wlr_box geometry = toplevel_geometry(shell);
+	*x = geometry.x;
+	*y = geometry.y;
+	return shell->scene_tree;
+}
+
+static void dock_preview_update(struct tinywl_toplevel *toplevel) {
+	if (toplevel->dock_preview == NULL) {
+		return;
+	}
+	struct wlr_box box = toplevel->dock_preview_box;
+	int x, y;
+	if (shell_tree(toplevel->server, &x, &y) != NULL) {
+		box.x += x;
+		box.y += y;
+	}
+	scene_preview_update(toplevel->dock_preview, toplevel, box);
+}
+
+static void dock_preview_clear(struct tinywl_toplevel *toplevel) {
+	if (toplevel->dock_preview != NULL) {
+		wlr_scene_node_destroy(&toplevel->dock_preview->node);
+	}
+	toplevel->dock_preview = NULL;
+	toplevel->dock_preview_box = (struct wlr_box){0};
+}
+
+// Previews live in the shell's tree, which goes away with its surface
+static void dock_preview_clear_all(struct tinywl_server *server) {
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		dock_preview_clear(toplevel);
+	}
+}
+
+// An empty rect hands the window back to thumbnails
+static void dock_preview_set(struct tinywl_toplevel *toplevel, struct wlr_box box) {
+	int x, y;
+	struct wlr_scene_tree *tree = shell_tree(toplevel->server, &x, &y);
+	if (wlr_box_empty(&box) || toplevel->docked_side == 0 || tree == NULL || toplevel->is_shell) {
+		dock_preview_clear(toplevel);
+		return;
+	}
+	if (toplevel->dock_preview == NULL) {
+		// Created last, so above the shell's surface; clicks fall through to
+		// the card underneath so it can still be dragged
+		toplevel->dock_preview = wlr_scene_buffer_create(tree, NULL);
+		if (toplevel->dock_preview == NULL) {
+			return;
+		}
+		toplevel->dock_preview->point_accepts_input = snapshot_accepts_input;
+	}
+	toplevel->dock_preview_box = box;
+	dock_preview_update(toplevel);
+}
+
+// Where the preview is on screen, to animate an undock from
+static struct wlr_box dock_preview_layout_box(struct tinywl_toplevel *toplevel) {
+	struct wlr_scene_buffer *preview = toplevel->dock_preview;
+	struct wlr_box box = {0};
+	if (preview == NULL || preview->buffer == NULL) {
+		return box;
+	}
+	wlr_scene_node_coords(&preview->node, &box.x, &box.y);
+	box.width = preview->dst_width;
+	box.height = preview->dst_height;
+	return box;
+}
+
+// -------------------------------------------------------------------------
+// App launcher: LAUNCH requests, matched to the windows they open
+// -------------------------------------------------------------------------
+#define TINYWL_LAUNCH_TIMEOUT_NS (30ull * 1000000000ull)
+
+// Splits a desktop-entry Exec= value into argv inside buf. Field codes are
+// dropped since we never pass files or URLs. Returns the argument count, or
+// -1 when the line relies on shell syntax and must go through /bin/sh.
+static int exec_split(const char *exec, char *buf, size_t size, char **argv, int max_args) {
+	int argc = 0;
+	size_t n = 0;
+	const char *p = exec;
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '\0') break;
+		if (argc == max_args - 1) return -1;
+
+		size_t start = n;
+		bool quoted = false, empty = true;
+		while (*p != '\0' && (quoted || (*p != ' ' && *p != '\t'))) {
+			char c = *p++;
+			if (c == '"') {
+				quoted = !quoted;
+				empty = false;
+				continue;
+			}
+			if (quoted && c == '\\' && *p != '\0' && strchr("\"`$\\", *p) != NULL) {
+				c = *p++;
+			} else if (!quoted && strchr("'\\<>~|&;$*?#()`", c) != NULL) {
+				return -1;
+			} else if (c == '%') {
+				if (*p != '%') {
+					if (*p != '\0') p++;
+					continue;
+				}
+				p++;
+			}
+			if (n + 2 > size) return -1;
+			buf[n++] = c;
+			empty = false;
+		}
+		if (quoted) return -1;
+		if (empty) continue; // a lone %U and friends
+		buf[n++] = '\0';
+		argv[argc++] = buf + start;
+	}
+	argv[argc] = NULL;
+	return argc;
+}
+
+static void launch_expire(struct tinywl_server *server) {
+	uint64_t now = monotonic_ns();
+	struct tinywl_launch *launch, *tmp;
+	wl_list_for_each_safe(launch, tmp, &server->launches, link) {
+		if (now - launch->start_ns > TINYWL_LAUNCH_TIMEOUT_NS) {
+			wlr_log(WLR_DEBUG, "Launch of %s never opened a window", launch->name);
+			wl_list_remove(&launch->link);
+			free(launch);
+		}
+	}
+}
+
+static void launch_write_stats(struct tinywl_server *server) {
+	struct tinywl_buf *json = &server->json;
+	json->len = 0;
+	json->failed = false;
+	buf_append(json, "{\n  \"apps\": [\n");
+	bool first = true;
+	struct tinywl_launch_stats *stats;
+	wl_list_for_each(stats, &server->launch_stats, link) {
+		if (!first) buf_append(json, ",\n");
+		buf_append(json, "    { \"app_id\": ");
+		buf_json_string(json, stats->app_id);
+		buf_printf(json, ", \"launches\": %u, \"last_first_commit_ms\": %u, "
+			"\"last_map_ms\": %u, \"avg_map_ms\": %u, \"max_map_ms\": %u }",
+			stats->launches, stats->last_first_commit_ms, stats->last_map_ms,
+			(unsigned)(stats->total_map_ms / stats->launches), stats->max_map_ms);
+		first = false;
+	}
+	buf_append(json, "\n  ]\n}\n");
+	runtime_publish(server, "launch_stats.json", json);
+}
+
+// Records the latency once the window is both matched to a launch and mapped
+static void launch_finish(struct tinywl_toplevel *toplevel) {
+	struct tinywl_server *server = toplevel->server;
+	if (toplevel->launch_ns == 0 || toplevel->map_ns == 0) return;
+
+	const char *app_id = toplevel_app_id(toplevel, "Unknown");
+	uint32_t commit_ms = toplevel->first_commit_ns > toplevel->launch_ns ?
+		(toplevel->first_commit_ns - toplevel->launch_ns) / 1000000 : 0;
+	uint32_t map_ms = (toplevel->map_ns - toplevel->launch_ns) / 1000000;
+	toplevel->launch_ns = 0;
+	wlr_log(WLR_INFO, "Launch of %s: first commit after %u ms, mapped after %u ms",
+		app_id, commit_ms, map_ms);
+
+	struct tinywl_launch_stats *stats, *found = NULL;
+	wl_list_for_each(stats, &server->launch_stats, link) {
+		if (strncmp(stats->app_id, app_id, sizeof(stats->app_id) - 1) == 0) {
+			found = stats;
+			break;
+		}
+	}
+	if (found == NULL) {
+		found = calloc(1, sizeof(*found));
+		if (found == NULL) return;
+		snprintf(found->app_id, sizeof(found->app_id), "%s", app_id);
+	} else {
+		wl_list_remove(&found->link);
+	}
+	// Most recently launched first
+	wl_list_insert(&server->launch_stats, &found->link);
+	found->launches++;
+	found->last_first_commit_ms = commit_ms;
+	found->last_map_ms = map_ms;
+	found->total_map_ms += map_ms;
+	if (map_ms > found->max_map_ms) found->max_map_ms = map_ms;
+	launch_write_stats(server);
+}
+
+static void launch_claim(struct tinywl_toplevel *toplevel, struct tinywl_launch *launch) {
+	toplevel->launch_ns = launch->start_ns;
+	wl_list_remove(&launch->link);
+	free(launch);
+	launch_finish(toplevel);
+}
+
+static void launch_match_pid(struct tinywl_toplevel *toplevel, pid_t pid) {
+	struct tinywl_server *server = toplevel->server;
+	launch_expire(server);
+	struct tinywl_launch *launch;
+	wl_list_for_each(launch, &server->launches, link) {
+		if (launch->pid == pid) {
+			launch_claim(toplevel, launch);
+			return;
+		}
+	}
+}
+
+static void launch_match_token(struct tinywl_toplevel *toplevel, const char *token) {
+	struct tinywl_server *server = toplevel->server;
+	if (token == NULL || toplevel->launch_ns != 0) return;
+	launch_expire(server);
+	struct tinywl_launch *launch;
+	wl_list_for_each(launch, &server->launches, link) {
+		if (strcmp(launch->token, token) == 0) {
+			launch_claim(toplevel, launch);
+			return;
+		}
+	}
+}
+
+static void launch_app(struct tinywl_server *server, const char *exec) {
+	char buf[1024];
+	char *argv[64];
+	int argc = exec_split(exec, buf, sizeof(buf), argv, 64);
+	if (argc == 0) {
+		wlr_log(WLR_ERROR, "LAUNCH with an empty command");
+		return;
+	}
+
+	struct tinywl_launch *launch = calloc(1, sizeof(*launch));
+	if (launch == NULL) return;
+	struct wlr_xdg_activation_token_v1 *token =
+		wlr_xdg_activation_token_v1_create(server->xdg_activation);
+	if (token != NULL) {
+		snprintf(launch->token, sizeof(launch->token), "%s",
+			wlr_xdg_activation_token_v1_get_name(token));
+	}
+
+	// Our environment, minus what we override for the child
+	size_t env_count = 0;
+	while (environ[env_count] != NULL) env_count++;
+	char **envp = calloc(env_count + 5, sizeof(char *));
+	if (envp == NULL) {
+		free(launch);
+		return;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < env_count; i++) {
+		if (strncmp(environ[i], "XDG_ACTIVATION_TOKEN=", 21) == 0 ||
+				strncmp(environ[i], "DESKTOP_STARTUP_ID=", 19) == 0 ||
+				strncmp(environ[i], "QT_QPA_PLATFORM=", 16) == 0 ||
+				strncmp(environ[i], "GDK_BACKEND=", 12) == 0) {
+			continue;
+		}
+		envp[n++] = environ[i];
+	}
+	char token_env[96], startup_env[96];
+	if (launch->token[0] != '\0') {
+		snprintf(token_env, sizeof(token_env), "XDG_ACTIVATION_TOKEN=%s", launch->token);
+		snprintf(startup_env, sizeof(startup_env), "DESKTOP_STARTUP_ID=%s", launch->token);
+		envp[n++] = token_env;
+		envp[n++] = startup_env;
+	}
+	envp[n++] = "QT_QPA_PLATFORM=wayland";
+	envp[n++] = "GDK_BACKEND=wayland";
+	envp[n] = NULL;
+
+	launch->start_ns = monotonic_ns();
+	if (argc > 0) {
+		launch->pid = spawn_process(server, argv, envp);
+		snprintf(launch->name, sizeof(launch->name), "%s", argv[0]);
+	} else {
+		char *const sh_argv[] = { "/bin/sh", "-c", (char *)exec, NULL };
+		launch->pid = spawn_process(server, sh_argv, envp);
+		snprintf(launch->name, sizeof(launch->name), "%s", exec);
+	}
+	free(envp);
+
+	if (launch->pid < 0) {
+		if (token != NULL) wlr_xdg_activation_token_v1_destroy(token);
+		free(launch);
+		return;
+	}
+	launch_expire(server);
+	wl_list_insert(&server->launches, &launch->link);
+}
+
+static void server_request_activate(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, request_activate);
+	struct wlr_xdg_activation_v1_request_activate_event *event = data;
+
+	struct wlr_xdg_toplevel *xdg_toplevel = wlr_xdg_toplevel_try_from_wlr_surface(event->surface);
+	if (xdg_toplevel == NULL || xdg_toplevel->base->data == NULL) return;
+	struct wlr_scene_tree *tree = xdg_toplevel->base->data;
+	struct tinywl_toplevel *toplevel = tree->node.data;
+	if (toplevel == NULL) return;
+
+	launch_match_token(toplevel, wlr_xdg_activation_token_v1_get_name(event->token));
+	if (event->surface->mapped && toplevel->docked_side == 0) {
+		focus_toplevel(toplevel);
+	}
+}
+
+static void json_window(struct tinywl_buf *json, struct tinywl_toplevel *toplevel, bool thumb_levels) {
+	buf_printf(json, "    { \"id\": \"%p\", \"name\": ", (void*)toplevel);
+	buf_json_string(json, toplevel_app_id(toplevel, "Unknown"));
+	buf_append(json, ", \"title\": ");
+	buf_json_string(json, toplevel_title(toplevel, "Unknown Window"));
+	buf_append(json, toplevel->maximized ? ", \"maximized\": true" : ", \"maximized\": false");
+	if (thumb_levels) {
+		// Sizes a THUMB request can be served at without rescaling, largest first
+		buf_append(json, ", \"thumb_levels\": [");
+		for (int i = 0; i < TINYWL_THUMB_LEVELS && toplevel->thumb_levels[i].width != 0; i++) {
+			buf_printf(json, "%s[%d, %d]", i ? ", " : "",
+				toplevel->thumb_levels[i].width, toplevel->thumb_levels[i].height);
+		}
+		buf_append(json, "]");
+		if (toplevel->dock_preview != NULL) {
+			struct wlr_box *box = &toplevel->dock_preview_box;
+			buf_printf(json, ", \"preview\": [%d, %d, %d, %d]",
+				box->x, box->y, box->width, box->height);
+		}
+	}
+	buf_append(json, " }");
+}
+
+static void json_window_list(struct tinywl_buf *json, struct tinywl_server *server,
+		const char *key, int docked_side, bool last) {
+	buf_printf(json, "  \"%s\": [\n", key);
+	bool first = true;
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		if (toplevel->docked_side != docked_side) continue;
+		if (docked_side == 0 && toplevel->is_shell) continue;
+		if (!first) buf_append(json, ",\n");
+		json_window(json, toplevel, docked_side != 0);
+		first = false;
+	}
+	buf_append(json, last ? "\n  ]\n" : "\n  ],\n");
+}
+
+static void update_workspace_state(struct tinywl_server *server) {
+	struct tinywl_buf *json = &server->json;
+	json->len = 0;
+	json->failed = false;
+	buf_printf(json, "{\n  \"hover\": %d,\n  \"idle\": %s,\n  \"wallpaper\": ", server->last_hover,
+		server->idle ? "true" : "false");
+	if (server->wallpaper_path != NULL) {
+		buf_json_string(json, server->wallpaper_path);
+	} else {
+		buf_append(json, "null");
+	}
+	buf_append(json, ",\n");
+	json_window_list(json, server, "active", 0, false);
+	json_window_list(json, server, "docked_left", 1, false);
+	json_window_list(json, server, "docked_right", 2, true);
+	buf_append(json, "}\n");
+
+	// Most calls change nothing the shell can see; don't make it re-parse
+	struct tinywl_buf *published = &server->state_published;
+	if (!json->failed && json->len == published->len &&
+			memcmp(json->data, published->data, json->len) == 0) {
+		return;
+	}
+#if TINYWL_HAS_FLUTTER
+	flutter_send_state(server, json);
+#endif
+	// Kept when embedded too: the benches and scripts find windows by it, and
+	// it is only written when the state changes, never on a timer
+	if (runtime_publish(server, "workspace_state.json", json)) {
+		// Swap rather than copy: the old snapshot becomes the next scratch buffer
+		struct tinywl_buf tmp = *published;
+		*published = *json;
+		*json = tmp;
+	}
+}
+
+// -------------------------------------------------------------------------
+// Session snapshot: docked/maximized windows survive a compositor restart
+// -------------------------------------------------------------------------
+static void mkdir_parents(char *path) {
+	for (char *p = path + 1; *p; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(path, 0700);
+			*p = '/';
+		}
+	}
+	mkdir(path, 0700);
+}
+
+static void session_init(struct tinywl_server *server, const char *socket) {
+	server->session_fd = -1;
+
+	char dir[256];
+	const char *state_home = getenv("XDG_STATE_HOME");
+	const char *home = getenv("HOME");
+	if (state_home && state_home[0] == '/') {
+		snprintf(dir, sizeof(dir), "%s/tinywl", state_home);
+	} else if (home && home[0] == '/') {
+		snprintf(dir, sizeof(dir), "%s/.local/state/tinywl", home);
+	} else {
+		snprintf(dir, sizeof(dir), "/tmp/tinywl-%d", (int)getuid());
+	}
+	mkdir_parents(dir);
+
+	char path[320];
+	// One file per socket name, so a restarted instance finds its own session
+	snprintf(path, sizeof(path), "%s/session-%s", dir, socket);
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to open session file %s", path);
+		return;
+	}
+
+	size_t size = sizeof(struct tinywl_session_header) +
+		TINYWL_SESSION_SLOTS * sizeof(struct tinywl_session_record);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+		// Unknown size: start over with a zero-filled file of the right length
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+			wlr_log_errno(WLR_ERROR, "Failed to size session file %s", path);
+			close(fd);
+			return;
+		}
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		wlr_log_errno(WLR_ERROR, "Failed to map session file %s", path);
+		close(fd);
+		return;
+	}
+
+	struct tinywl_session_header *header = map;
+	if (header->magic != TINYWL_SESSION_MAGIC || header->version != TINYWL_SESSION_VERSION ||
+			header->record_size != sizeof(struct tinywl_session_record) ||
+			header->slots != TINYWL_SESSION_SLOTS) {
+		memset(map, 0, size);
+		header->magic = TINYWL_SESSION_MAGIC;
+		header->version = TINYWL_SESSION_VERSION;
+		header->record_size = sizeof(struct tinywl_session_record);
+		header->slots = TINYWL_SESSION_SLOTS;
+	}
+
+	server->session_fd = fd;
+	server->session_map = header;
+	server->session_records = (struct tinywl_session_record *)(header + 1);
+
+	for (int i = 0; i < TINYWL_SESSION_SLOTS; i++) {
+		struct tinywl_session_record *rec = &server->session_records[i];
+		if (!rec->in_use) continue;
+		rec->app_id[sizeof(rec->app_id) - 1] = '\0';
+		rec->title[sizeof(rec->title) - 1] = '\0';
+		server->session_pending |= 1ull << i;
+	}
+	wlr_log(WLR_INFO, "Session file %s: %d window(s) to restore",
+		path, __builtin_popcountll(server->session_pending));
+}
+
+static void session_finish(struct tinywl_server *server) {
+	if (server->session_map == NULL) return;
+	munmap(server->session_map, sizeof(struct tinywl_session_header) +
+		TINYWL_SESSION_SLOTS * sizeof(struct tinywl_session_record));
+	close(server->session_fd);
+	server->session_map = NULL;
+	server->session_records = NULL;
+	server->session_fd = -1;
+}
+
+static int session_alloc_slot(struct tinywl_server *server) {
+	uint64_t busy = server->session_pending | server->session_claimed;
+	for (int i = 0; i < TINYWL_SESSION_SLOTS; i++) {
+		if (!(busy & (1ull << i))) return i;
+	}
+	// Full: give up the oldest unclaimed record from the previous run
+	for (int i = 0; i < TINYWL_SESSION_SLOTS; i++) {
+		if (server->session_pending & (1ull << i)) {
+			server->session_pending &= ~(1ull << i);
+			server->session_records[i].in_use = 0;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void session_release_toplevel(struct tinywl_toplevel *toplevel) {
+	struct tinywl_server *server = toplevel->server;
+	if (toplevel->session_slot < 0) return;
+	if (!server->session_closing) {
+		server->session_records[toplevel->session_slot].in_use = 0;
+	}
+	server->session_claimed &= ~(1ull << toplevel->session_slot);
+	toplevel->session_slot = -1;
+}
+
+static void session_update_toplevel(struct tinywl_toplevel *toplevel) {
+	struct tinywl_server *server = toplevel->server;
+	if (server->session_records == NULL) return;
+
+	const char *app_id = toplevel_app_id(toplevel, "");
+	const char *title = toplevel_title(toplevel, "");
+	if (toplevel->is_shell) return;
+
+	// Only non-default layouts are worth restoring
+	if (toplevel->docked_side == 0 && !toplevel->maximized) {
+		session_release_toplevel(toplevel);
+		return;
+	}
+
+	if (toplevel->session_slot < 0) {
+		int slot = session_alloc_slot(server);
+		if (slot < 0) return;
+		toplevel->session_slot = slot;
+		server->session_claimed |= 1ull << slot;
+	}
+
+	struct tinywl_session_record rec = {0};
+	rec.in_use = 1;
+	rec.docked_side = toplevel->docked_side;
+	rec.maximized = toplevel->maximized;
+	rec.saved_x = toplevel->saved_x;
+	rec.saved_y = toplevel->saved_y;
+	rec.saved_width = toplevel->saved_geometry.width;
+	rec.saved_height = toplevel->saved_geometry.height;
+	snprintf(rec.app_id, sizeof(rec.app_id), "%s", app_id);
+	snprintf(rec.title, sizeof(rec.title), "%s", title);
+
+	struct tinywl_session_record *dst = &server->session_records[toplevel->session_slot];
+	if (memcmp(dst, &rec, sizeof(rec)) == 0) return;
+
+	// Invalidate, rewrite the body, then publish: a crash mid-update loses the
+	// record instead of restoring a torn one.
+	dst->in_use = 0;
+	size_t body = offsetof(struct tinywl_session_record, docked_side);
+	memcpy((char *)dst + body, (char *)&rec + body, sizeof(rec) - body);
+	__atomic_store_n(&dst->in_use, 1, __ATOMIC_RELEASE);
+}
+
+static bool session_restore_toplevel(struct tinywl_toplevel *toplevel) {
+	struct tinywl_server *server = toplevel->server;
+	if (server->session_pending == 0) return false;
+
+	const char *app_id = toplevel_app_id(toplevel, "");
+	const char *title = toplevel_title(toplevel, "");
+
+	for (int i = 0; i < TINYWL_SESSION_SLOTS; i++) {
+		if (!(server->session_pending & (1ull << i))) continue;
+		struct tinywl_session_record *rec = &server->session_records[i];
+		if (strncmp(rec->app_id, app_id, sizeof(rec->app_id) - 1) != 0 ||
+				strncmp(rec->title, title, sizeof(rec->title) - 1) != 0) {
+			continue;
+		}
+
+		server->session_pending &= ~(1ull << i);
+		server->session_claimed |= 1ull << i;
+		toplevel->session_slot = i;
+		toplevel->session_restored = true;
+		toplevel->docked_side = rec->docked_side;
+		toplevel->maximized = rec->maximized != 0;
+		toplevel->saved_x = rec->saved_x;
+		toplevel->saved_y = rec->saved_y;
+		toplevel->saved_geometry.width = rec->saved_width > 0 ? rec->saved_width : TINYWL_WINDOW_WIDTH;
+		toplevel->saved_geometry.height = rec->saved_height > 0 ? rec->saved_height : TINYWL_WINDOW_HEIGHT;
+		return true;
+	}
+	return false;
+}
+
+// -------------------------------------------------------------------------
+// Memory accounting: MEMORY_REPORT writes memory.json
+// -------------------------------------------------------------------------
+#define TINYWL_MEMORY_FORMATS 16
+
+struct tinywl_memory_tally {
+	int nodes[3]; // by enum wlr_scene_node_type
+	int buffers;
+	size_t buffer_bytes;
+	struct {
+		uint32_t format; // DRM fourcc, 0 when the buffer no longer says
+		int buffers;
+		size_t bytes;
+	} formats[TINYWL_MEMORY_FORMATS];
+	int n_formats;
+};
+
+// Bytes behind a buffer, through whichever access path it supports. Planes
+// are counted at full height, so subsampled dmabufs come out slightly high.
+static size_t buffer_footprint(struct wlr_buffer *buffer, uint32_t *format) {
+	struct wlr_dmabuf_attributes dmabuf;
+	if (wlr_buffer_get_dmabuf(buffer, &dmabuf)) {
+		size_t bytes = 0;
+		for (int i = 0; i < dmabuf.n_planes; i++) {
+			bytes += (size_t)dmabuf.stride[i] * dmabuf.height;
+		}
+		*format = dmabuf.format;
+		return bytes;
+	}
+	void *data;
+	size_t stride;
+	if (wlr_buffer_begin_data_ptr_access(buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &data, format, &stride)) {
+		wlr_buffer_end_data_ptr_access(buffer);
+		return stride * buffer->height;
+	}
+	// shm contents already uploaded and the client's pool released
+	*format = 0;
+	return (size_t)buffer->width * buffer->height * 4;
+}
+
+static void memory_tally_buffer(struct tinywl_memory_tally *tally, struct wlr_buffer *buffer) {
+	uint32_t format = 0;
+	size_t bytes = buffer_footprint(buffer, &format);
+	tally->buffers++;
+	tally->buffer_bytes += bytes;
+
+	int i = 0;
+	while (i < tally->n_formats && tally->formats[i].format != format) i++;
+	if (i == TINYWL_MEMORY_FORMATS) return;
+	if (i == tally->n_formats) {
+		tally->formats[i].format = format;
+		tally->n_formats++;
+	}
+	tally->formats[i].buffers++;
+	tally->formats[i].bytes += bytes;
+}
+
+static void memory_tally_node(struct tinywl_memory_tally *tally, struct wlr_scene_node *node) {
+	tally->nodes[node->type]++;
+	if (node->type == WLR_SCENE_NODE_TREE) {
+		struct wlr_scene_tree *tree = wlr_scene_tree_from_node(node);
+		struct wlr_scene_node *child;
+		wl_list_for_each(child, &tree->children, link) {
+			memory_tally_node(tally, child);
+		}
+	} else if (node->type == WLR_SCENE_NODE_BUFFER) {
+		struct wlr_scene_buffer *scene_buffer = wlr_scene_buffer_from_node(node);
+		if (scene_buffer->buffer != NULL) {
+			memory_tally_buffer(tally, scene_buffer->buffer);
+		}
+	}
+}
+
+static void memory_print_tally(struct tinywl_buf *json, const struct tinywl_memory_tally *tally) {
+	buf_printf(json, "\"trees\": %d, \"rects\": %d, \"buffers\": %d, \"buffer_bytes\": %zu, \"formats\": [",
+		tally->nodes[WLR_SCENE_NODE_TREE], tally->nodes[WLR_SCENE_NODE_RECT],
+		tally->buffers, tally->buffer_bytes);
+	for (int i = 0; i < tally->n_formats; i++) {
+		uint32_t format = tally->formats[i].format;
+		char fourcc[8] = "unknown";
+		if (format != 0) {
+			snprintf(fourcc, sizeof(fourcc), "%c%c%c%c", format & 0xff,
+				(format >> 8) & 0xff, (format >> 16) & 0xff, (format >> 24) & 0xff);
+		}
+		buf_printf(json, "%s{ \"format\": ", i ? ", " : "");
+		buf_json_string(json, fourcc);
+		buf_printf(json, ", \"buffers\": %d, \"bytes\": %zu }",
+			tally->formats[i].buffers, tally->formats[i].bytes);
+	}
+	buf_append(json, "]");
+}
+
+// Render targets the allocator handed an output
+static size_t swapchain_footprint(struct wlr_swapchain *swapchain, int *buffers) {
+	size_t bytes = 0;
+	if (swapchain == NULL) return 0;
+	for (int i = 0; i < WLR_SWAPCHAIN_CAP; i++) {
+		if (swapchain->slots[i].buffer == NULL) continue;
+		uint32_t format;
+		bytes += buffer_footprint(swapchain->slots[i].buffer, &format);
+		(*buffers)++;
+	}
+	return bytes;
+}
+
+static size_t toplevel_thumb_bytes(struct tinywl_toplevel *toplevel) {
+	struct tinywl_thumb_job *job = toplevel->thumb_job;
+	size_t bytes = job ? job->src_size : 0;
+	for (int i = 0; i < TINYWL_THUMB_LEVELS; i++) {
+		if (toplevel->thumb_levels[i].pixels != NULL) {
+			bytes += (size_t)toplevel->thumb_levels[i].width * toplevel->thumb_levels[i].height * 4;
+		}
+		if (job != NULL && job->busy && job->levels[i].pixels != NULL) {
+			bytes += (size_t)job->levels[i].width * job->levels[i].height * 4;
+		}
+	}
+	return bytes;
+}
+
+static void write_memory_report(struct tinywl_server *server) {
+	struct tinywl_buf *json = &server->json;
+	json->len = 0;
+	json->failed = false;
+	buf_append(json, "{\n  \"toplevels\": [\n");
+	bool first = true;
+	struct tinywl_toplevel *toplevel;
+	wl_list_for_each(toplevel, &server->toplevels, link) {
+		struct tinywl_memory_tally tally = {0};
+		memory_tally_node(&tally, &toplevel->scene_tree->node);
+		if (!first) buf_append(json, ",\n");
+		buf_printf(json, "    { \"id\": \"%p\", \"name\": ", (void*)toplevel);
+		buf_json_string(json, toplevel_app_id(toplevel, "Unknown"));
+		buf_printf(json, ", \"shell\": %s, \"x11\": %s, \"docked\": %d, "
+			"\"popups\": %d, \"thumbnail_bytes\": %zu, ",
+			toplevel->is_shell ? "true" : "false", toplevel->xdg_toplevel ? "false" : "true",
+			toplevel->docked_side, wl_list_length(&toplevel->popups), toplevel_thumb_bytes(toplevel));
+		memory_print_tally(json, &tally);
+		buf_append(json, " }");
+		first = false;
+	}
+	buf_append(json, "\n  ],\n");
+
+	struct tinywl_memory_tally layers = {0};
+	struct tinywl_layer_surface *layer;
+	wl_list_for_each(layer, &server->layer_surfaces, link) {
+		memory_tally_node(&layers, &layer->scene->tree->node);
+	}
+	buf_printf(json, "  \"layer_surfaces\": { \"count\": %d, ", wl_list_length(&server->layer_surfaces));
+	memory_print_tally(json, &layers);
+	buf_append(json, " },\n");
+
+	buf_append(json, "  \"outputs\": [\n");
+	size_t swapchain_bytes = 0;
+	first = true;
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		int buffers = 0, cursor_buffers = 0;
+		size_t bytes = swapchain_footprint(output->wlr_output->swapchain, &buffers);
+		size_t cursor_bytes = swapchain_footprint(output->wlr_output->cursor_swapchain, &cursor_buffers);
+		swapchain_bytes += bytes + cursor_bytes;
+		if (!first) buf_append(json, ",\n");
+		buf_append(json, "    { \"name\": ");
+		buf_json_string(json, output->wlr_output->name);
+		buf_printf(json, ", \"buffers\": %d, \"bytes\": %zu, "
+			"\"cursor_buffers\": %d, \"cursor_bytes\": %zu }",
+			buffers, bytes, cursor_buffers, cursor_bytes);
+		first = false;
+	}
+	buf_append(json, "\n  ],\n");
+
+	// Walking from the root also picks up nodes no window owns
+	struct tinywl_memory_tally scene = {0};
+	memory_tally_node(&scene, &server->scene->tree.node);
+	buf_printf(json, "  \"totals\": { \"thumbnail_bytes\": %zu, \"thumbnail_budget\": %u, "
+		"\"swapchain_bytes\": %zu, \"wallpaper_bytes\": %zu, \"popups\": %d, ",
+		server->thumb_bytes, TINYWL_THUMB_BUDGET, swapchain_bytes, wallpaper_bytes(server), server->popups);
+	memory_print_tally(json, &scene);
+	buf_append(json, " }\n}\n");
+	runtime_publish(server, "memory.json", json);
+}
+
+// -------------------------------------------------------------------------
+// Input latency: input to presented frame, LATENCY_REPORT writes latency.json
+// -------------------------------------------------------------------------
+static const char *const input_kind_names[TINYWL_INPUT_COUNT] = {
+	[TINYWL_INPUT_MOTION] = "motion",
+	[TINYWL_INPUT_BUTTON] = "button",
+	[TINYWL_INPUT_KEY] = "key",
+	[TINYWL_INPUT_DOCK] = "dock",
+};
+
+// Only the oldest input per kind is timed until a frame picks it up, so a
+// burst of motion counts from its first event
+static void latency_mark_input(struct tinywl_server *server, enum tinywl_input_kind kind) {
+	if (server->input_pending_ns[kind] == 0) {
+		server->input_pending_ns[kind] = monotonic_ns();
+	}
+}
+
+static void latency_frame_committed(struct tinywl_output *output) {
+	struct tinywl_server *server = output->server;
+	for (int kind = 0; kind < TINYWL_INPUT_COUNT; kind++) {
+		if (server->input_pending_ns[kind] != 0 && output->input_committed_ns[kind] == 0) {
+			output->input_committed_ns[kind] = server->input_pending_ns[kind];
+			server->input_pending_ns[kind] = 0;
+		}
+	}
+}
+
+static void latency_frame_presented(struct tinywl_output *output, struct wlr_output_event_present *event) {
+	struct tinywl_server *server = output->server;
+	uint64_t when_ns = (uint64_t)event->when.tv_sec * 1000000000ull + event->when.tv_nsec;
+	for (int kind = 0; kind < TINYWL_INPUT_COUNT; kind++) {
+		uint64_t input_ns = output->input_committed_ns[kind];
+		if (input_ns == 0) continue;
+		output->input_committed_ns[kind] = 0;
+		// A dropped frame says nothing about latency; the input is counted lost
+		if (!event->presented || when_ns < input_ns) continue;
+
+		latency_sample(&server->latency[kind], (when_ns - input_ns) / 1000);
+	}
+}
+
+static void latency_sample(struct tinywl_latency *latency, uint64_t us) {
+	latency->samples_us[latency->count % TINYWL_LATENCY_SAMPLES] =
+		us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+	latency->count++;
+}
+
+static int compare_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Each report covers the samples since the previous one
+static void json_latency(struct tinywl_buf *json, const char *name, struct tinywl_latency *latency) {
+	uint32_t n = latency->count < TINYWL_LATENCY_SAMPLES ? latency->count : TINYWL_LATENCY_SAMPLES;
+	uint32_t sorted[TINYWL_LATENCY_SAMPLES];
+	memcpy(sorted, latency->samples_us, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), compare_u32);
+
+	buf_printf(json, "  \"%s\": { \"samples\": %u", name, latency->count);
+	if (n > 0) {
+		buf_printf(json, ", \"p50_us\": %u, \"p90_us\": %u, \"p99_us\": %u, \"max_us\": %u",
+			sorted[n * 50 / 100], sorted[n * 90 / 100], sorted[n * 99 / 100], sorted[n - 1]);
+	}
+	buf_append(json, " },\n");
+	latency->count = 0;
+}
+
+static void write_latency_report(struct tinywl_server *server) {
+	struct tinywl_buf *json = &server->json;
+	json->len = 0;
+	json->failed = false;
+	buf_append(json, "{\n");
+	for (int kind = 0; kind < TINYWL_INPUT_COUNT; kind++) {
+		json_latency(json, input_kind_names[kind], &server->latency[kind]);
+	}
+	// How long damaged frames took to build and commit, and how many never
+	// made it to the screen
+	json_latency(json, "frame", &server->frame_times);
+	buf_printf(json, "  \"frames_skipped\": %u\n", server->frames_skipped);
+	server->frames_skipped = 0;
+	buf_append(json, "}\n");
+	runtime_publish(server, "latency.json", json);
+}
+
+// -------------------------------------------------------------------------
+// Recording (-R): input, commits and IPC, for bench/replay to play back
+// -------------------------------------------------------------------------
+// Events go through stdio's buffer. The first event after a flush arms a
+// one-shot 100 ms timer that flushes it, so recording costs a memcpy per
+// event and at most a write() every 100 ms, and nothing while nothing
+// happens. The format is in recording.h.
+
+// At most 100 ms of events are lost if we crash
+static int handle_record_flush(void *data) {
+	struct tinywl_server *server = data;
+	server->record_flush_pending = false;
+	if (server->record != NULL) {
+		fflush(server->record);
+	}
+	return 0;
+}
+
+// f was opened while parsing options, so a bad path stops us before
+// anything is started; the header waits until the outputs are up
+static void record_start(struct tinywl_server *server, FILE *f, const char *path) {
+	server->record = f;
+	setvbuf(server->record, NULL, _IOFBF, 64 * 1024);
+	struct wlr_box box;
+	wlr_output_layout_get_box(server->output_layout, NULL, &box);
+	struct tinywl_rec_header header = {
+		.magic = TINYWL_REC_MAGIC,
+		.version = TINYWL_REC_VERSION,
+		.layout_x = box.x,
+		.layout_y = box.y,
+		.layout_width = box.width,
+		.layout_height = box.height,
+	};
+	fwrite(&header, sizeof(header), 1, server->record);
+	server->record_last_ns = monotonic_ns();
+	server->record_flush_timer = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server->wl_display), handle_record_flush, server);
+	wlr_log(WLR_INFO, "Recording to %s", path);
+}
+
+static void record_finish(struct tinywl_server *server) {
+	if (server->record_flush_timer != NULL) {
+		wl_event_source_remove(server->record_flush_timer);
+		server->record_flush_timer = NULL;
+	}
+	if (server->record != NULL) {
+		fclose(server->record);
+		server->record = NULL;
+	}
+}
+
+// text, if any, follows the payload without its terminator
+static void record_event(struct tinywl_server *server, enum tinywl_rec_type type,
+		const void *payload, size_t size, const char *text) {
+	FILE *f = server->record;
+	if (f == NULL) {
+		return;
+	}
+	size_t text_len = text != NULL ? strnlen(text, UINT16_MAX - size) : 0;
+	uint64_t delta_us = (monotonic_ns() - server->record_last_ns) / 1000;
+	// Advance by whole microseconds so the remainder isn't lost
+	server->record_last_ns += delta_us * 1000;
+	struct tinywl_rec_event event = {
+		.delta_us = delta_us > UINT32_MAX ? UINT32_MAX : (uint32_t)delta_us,
+		.type = type,
+		.size = (uint16_t)(size + text_len),
+	};
+	fwrite(&event, sizeof(event), 1, f);
+	fwrite(payload, size, 1, f);
+	if (text_len > 0) {
+		fwrite(text, text_len, 1, f);
+	}
+	if (ferror(f)) {
+		wlr_log(WLR_ERROR, "Failed to write the recording, stopping it");
+		record_finish(server);
+	} else if (!server->record_flush_pending && server->record_flush_timer != NULL) {
+		server->record_flush_pending = true;
+		wl_event_source_timer_update(server->record_flush_timer, 100);
+	}
+}
+
+static void record_motion(struct tinywl_server *server) {
+	record_event(server, TINYWL_REC_MOTION, &(struct tinywl_rec_motion){
+		.x = (int32_t)(server->cursor->x * TINYWL_REC_FIXED),
+		.y = (int32_t)(server->cursor->y * TINYWL_REC_FIXED),
+	}, sizeof(struct tinywl_rec_motion), NULL);
+}
+
+static void record_window(struct tinywl_toplevel *toplevel, enum tinywl_rec_type type) {
+	struct tinywl_rec_window window = {
+		.id = (uint64_t)(uintptr_t)toplevel,
+		.flags = (toplevel->is_shell ? TINYWL_REC_WINDOW_SHELL : 0) |
+			(toplevel->xdg_toplevel == NULL ? TINYWL_REC_WINDOW_X11 : 0),
+	};
+	record_event(toplevel->server, type, &window, sizeof(window),
+		type == TINYWL_REC_MAP ? toplevel_app_id(toplevel, "") : NULL);
+}
+
+static void record_commit(struct tinywl_toplevel *toplevel) {
+	struct wlr_surface *surface = toplevel_surface(toplevel);
+	if (toplevel->server->record == NULL || surface == NULL) {
+		return;
+	}
+	struct tinywl_rec_commit commit = {
+		.id = (uint64_t)(uintptr_t)toplevel,
+		.width = surface->current.buffer_width,
+		.height = surface->current.buffer_height,
+	};
+	if (pixman_region32_not_empty(&surface->buffer_damage)) {
+		pixman_box32_t *extents = pixman_region32_extents(&surface->buffer_damage);
+		commit.damage_x = extents->x1;
+		commit.damage_y = extents->y1;
+		commit.damage_width = extents->x2 - extents->x1;
+		commit.damage_height = extents->y2 - extents->y1;
+	}
+	record_event(toplevel->server, TINYWL_REC_COMMIT, &commit, sizeof(commit), NULL);
+}
+
+// One command line, from the dock_actions queue or the embedded shell's channel
+static void ipc_dispatch(struct tinywl_server *server, char *line) {
+	char action[32] = "";
+	void *id = NULL;
+	int rest = 0;
+	if (line[0] != '\0') {
+		server->hud_ipc_commands++;
+		record_event(server, TINYWL_REC_IPC, "", 0, line);
+	}
+	if (sscanf(line, "%31s %n", action, &rest) == 1 && strcmp(action, "LAUNCH") == 0) {
+		// The rest of the line is a desktop-entry Exec= value
+		launch_app(server, line + rest);
+	} else if (strcmp(action, "WALLPAPER") == 0 && line[rest] != '\0') {
+		wallpaper_job_start(server, line + rest);
+	} else if (strcmp(line, "MEMORY_REPORT") == 0) {
+		write_memory_report(server);
+	} else if (strcmp(line, "LATENCY_REPORT") == 0) {
+		write_latency_report(server);
+	} else if (strcmp(line, "HUD") == 0) {
+		hud_set_enabled(server, !server->hud_enabled);
+	} else if (strcmp(line, "DAMAGE_DEBUG") == 0) {
+		damage_debug_toggle(server);
+	} else if (strcmp(action, "THUMB") == 0) {
+		int width = 0, height = 0;
+		if (sscanf(line, "%31s %p %dx%d", action, &id, &width, &height) == 4) {
+			struct tinywl_toplevel *toplevel;
+			wl_list_for_each(toplevel, &server->toplevels, link) {
+				if ((void*)toplevel == id) {
+					thumb_subscribe(toplevel, width, height);
+					break;
+				}
+			}
+		}
+	} else if (strcmp(action, "PREVIEW_RECT") == 0) {
+		struct wlr_box box = {0};
+		if (sscanf(line, "%31s %p %d %d %d %d", action, &id,
+				&box.x, &box.y, &box.width, &box.height) == 6) {
+			struct tinywl_toplevel *toplevel;
+			wl_list_for_each(toplevel, &server->toplevels, link) {
+				if ((void*)toplevel == id) {
+					dock_preview_set(toplevel, box);
+					update_workspace_state(server);
+					break;
+				}
+			}
+		}
+	} else if (sscanf(line, "%31s %p", action, &id) == 2) {
+		
+		struct wlr_box box;
+		wlr_output_layout_get_box(server->output_layout, NULL, &box);
+		int out_w = box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH;
+		int out_h = box.height > 0 ? box.height : TINYWL_FALLBACK_HEIGHT;
+		struct wlr_box usable;
+		server_usable_box(server, &usable);
+
+		transaction_begin(server);
+		struct tinywl_toplevel *toplevel;
+		wl_list_for_each(toplevel, &server->toplevels, link) {
+			if ((void*)toplevel == id) {
+				if (strcmp(action, "DOCK_LEFT") == 0) {
+					toplevel_dock(toplevel, 1, out_w, out_h);
+				} else if (strcmp(action, "DOCK_RIGHT") == 0) {
+					toplevel_dock(toplevel, 2, out_w, out_h);
+				} else if (strcmp(action, "UNDOCK") == 0) {
+					struct wlr_box from = dock_preview_layout_box(toplevel);
+					if (wlr_box_empty(&from)) {
+						from = dock_card_box(toplevel->docked_side, out_w);
+					}
+					dock_preview_clear(toplevel);
+					struct wlr_box to = server_window_box(server);
+					if (toplevel->maximized) {
+						to = usable;
+					}
+					toplevel->docked_side = 0;
+					toplevel_set_size(toplevel, to.width, to.height);
+					toplevel_set_position(toplevel, to.x, to.y);
+					wlr_scene_node_raise_to_top(&toplevel->scene_tree->node);
+					if (from.width > 0) {
+						animation_start(toplevel, from, to, 0.0f, 1.0f,
+							TINYWL_ANIM_UNDOCK_NS, TINYWL_EASE_OUT_CUBIC);
+					}
+					focus_toplevel(toplevel);
+					toplevel_update_scale(toplevel);
+                            toplevel_schedule_configure(toplevel);
+				} else if (strcmp(action, "MAXIMIZE") == 0) {
+					if (!toplevel->maximized) {
+						struct wlr_box from = toplevel_box(toplevel);
+						toplevel->saved_x = toplevel->scene_tree->node.x;
+						toplevel->saved_y = toplevel->scene_tree->node.y;
+						toplevel->saved_geometry.width = toplevel_geometry(toplevel).width;
+						if (toplevel->saved_geometry.width == 0) toplevel->saved_geometry.width = TINYWL_WINDOW_WIDTH;
+						toplevel->saved_geometry.height = toplevel_geometry(toplevel).height;
+						if (toplevel->saved_geometry.height == 0) toplevel->saved_geometry.height = TINYWL_WINDOW_HEIGHT;
+
+						toplevel_set_size(toplevel, usable.width, usable.height);
+						toplevel_set_position(toplevel, usable.x, usable.y);
+						toplevel_set_maximized(toplevel, true);
+						toplevel->maximized = true;
+						wlr_scene_node_raise_to_top(&toplevel->scene_tree->node);
+						animation_start(toplevel, from, usable, 1.0f, 1.0f,
+							TINYWL_ANIM_MAXIMIZE_NS, TINYWL_EASE_IN_OUT_CUBIC);
+						focus_toplevel(toplevel);
+                                toplevel_schedule_configure(toplevel);
+					}
+				} else if (strcmp(action, "RESTORE") == 0) {
+					if (toplevel->maximized) {
+						struct wlr_box from = toplevel_box(toplevel);
+						struct wlr_box to = {
+							.x = toplevel->saved_x,
+							.y = toplevel->saved_y,
+							.width = toplevel->saved_geometry.width,
+							.height = toplevel->saved_geometry.height,
+						};
+						toplevel_set_size(toplevel, toplevel->saved_geometry.width, toplevel->saved_geometry.height);
+						toplevel_set_position(toplevel, toplevel->saved_x, toplevel->saved_y);
+						toplevel_set_maximized(toplevel, false);
+						toplevel->maximized = false;
+						wlr_scene_node_raise_to_top(&toplevel->scene_tree->node);
+						animation_start(toplevel, from, to, 1.0f, 1.0f,
+							TINYWL_ANIM_MAXIMIZE_NS, TINYWL_EASE_IN_OUT_CUBIC);
+						focus_toplevel(toplevel);
+                                toplevel_schedule_configure(toplevel);
+					}
+				} else if (strcmp(action, "CLOSE") == 0) {
+					toplevel_close(toplevel);
+				}
+				session_update_toplevel(toplevel);
+				update_workspace_state(server);
+				break;
+			}
+		}
+		transaction_commit(server);
+	}
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Every sender writes each command to a file of its own under a dot name
+// and renames it into dock_actions/ whole, so nothing is read half-written
+// and no command can replace another. Names sort by send time; each tick
+// runs everything queued, in that order, one line at a time.
+static void ipc_drain(struct tinywl_server *server) {
+	int fd = openat(server->runtime_fd, TINYWL_IPC_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dir == NULL) {
+		if (fd >= 0) close(fd);
+		return;
+	}
+	struct wl_array names;
+	wl_array_init(&names);
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		// Also skips senders' files still being written
+		if (entry->d_name[0] == '.') continue;
+		char **name = wl_array_add(&names, sizeof(*name));
+		if (name == NULL) break;
+		*name = strdup(entry->d_name);
+		if (*name == NULL) names.size -= sizeof(*name);
+	}
+	size_t count = names.size / sizeof(char *);
+	char **sorted = names.data;
+	if (count > 0) {
+		qsort(sorted, count, sizeof(*sorted), compare_names);
+	}
+
+	char *line = NULL;
+	size_t cap = 0;
+	for (size_t i = 0; i < count; i++) {
+		int command_fd = openat(dirfd(dir), sorted[i], O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		FILE *f = command_fd >= 0 ? fdopen(command_fd, "r") : NULL;
+		if (f == NULL && command_fd >= 0) close(command_fd);
+		// Gone first, so a command that fails is not run again every tick
+		unlinkat(dirfd(dir), sorted[i], 0);
+		free(sorted[i]);
+		while (f != NULL && getline(&line, &cap, f) > 0) {
+			line[strcspn(line, "\n")] = '\0';
+			if (line[0] != '\0') {
+				ipc_dispatch(server, line);
+			}
+		}
+		if (f != NULL) fclose(f);
+	}
+	free(line);
+	wl_array_release(&names);
+	closedir(dir);
+}
+
+static int handle_dock_ipc(void *data) {
+	struct tinywl_server *server = data;
+	ipc_drain(server);
+	startup_check_shell_ready(server);
+	wl_event_source_timer_update(server->dock_ipc_timer,
+		server->idle ? TINYWL_IDLE_IPC_INTERVAL_MS : 100);
+	return 0;
+}
+
+#if TINYWL_HAS_FLUTTER
+static int handle_ipc_watch(int fd, uint32_t mask, void *data) {
+	struct tinywl_server *server = data;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		// Drain; whatever arrived is run below, in order
+	}
+	ipc_drain(server);
+	return 0;
+}
+
+// Embedded, the shell's commands come over the platform channel and only
+// file clients (bench/, scripts) use the queue, so it is watched instead of
+// polled. Senders rename each command in, hence IN_MOVED_TO.
+static bool ipc_watch_init(struct tinywl_server *server) {
+	char path[sizeof(server->runtime_dir) + sizeof("/" TINYWL_IPC_DIR)];
+	snprintf(path, sizeof(path), "%s/%s", server->runtime_dir, TINYWL_IPC_DIR);
+	server->ipc_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (server->ipc_watch_fd < 0) return false;
+	if (inotify_add_watch(server->ipc_watch_fd, path, IN_MOVED_TO) < 0) {
+		close(server->ipc_watch_fd);
+		server->ipc_watch_fd = -1;
+		return false;
+	}
+	server->ipc_watch_source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), server->ipc_watch_fd,
+		WL_EVENT_READABLE, handle_ipc_watch, server);
+	// Anything queued before the watch existed
+	ipc_drain(server);
+	return true;
+}
+#endif
+
+static void ipc_watch_finish(struct tinywl_server *server) {
+	if (server->ipc_watch_source) {
+		wl_event_source_remove(server->ipc_watch_source);
+		server->ipc_watch_source = NULL;
+	}
+	if (server->ipc_watch_fd >= 0) {
+		close(server->ipc_watch_fd);
+		server->ipc_watch_fd = -1;
+	}
+}
+
+#if TINYWL_HAS_FLUTTER
+// -------------------------------------------------------------------------
+// Embedded shell (-E): the Flutter engine hosted in-process
+// -------------------------------------------------------------------------
+// Instead of a GTK client talking Wayland and polling files, the shell's
+// Dart code runs on tinywl's own event loop through the embedder API. The
+// software renderer hands over each frame, which is copied into a buffer on
+// a scene node between the bottom layer and the windows. State goes out on
+// the tinywl/state channel whenever workspace_state.json would change;
+// commands come back on tinywl/action, one line each as in dock_actions/.
+// Only the pointer is routed to it; keys stay with windows.
+static void flutter_buffer_destroy(struct wlr_buffer *wlr_buffer) {
+	struct tinywl_flutter_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
+	free(buffer->data);
+	free(buffer);
+}
+
+static bool flutter_buffer_begin_data_ptr_access(struct wlr_buffer *wlr_buffer, uint32_t flags,
+		void **data, uint32_t *format, size_t *stride) {
+	struct tinywl_flutter_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
+	if (flags & WLR_BUFFER_DATA_PTR_ACCESS_WRITE) {
+		return false;
+	}
+	*data = buffer->data;
+	*format = DRM_FORMAT_ARGB8888; // Skia's N32, premultiplied
+	*stride = (size_t)wlr_buffer->width * 4;
+	return true;
+}
+
+static void flutter_buffer_end_data_ptr_access(struct wlr_buffer *wlr_buffer) {
+	// Nothing to do: the pixels stay put
+}
+
+static const struct wlr_buffer_impl flutter_buffer_impl = {
+	.destroy = flutter_buffer_destroy,
+	.begin_data_ptr_access = flutter_buffer_begin_data_ptr_access,
+	.end_data_ptr_access = flutter_buffer_end_data_ptr_access,
+};
+
+// A buffer the scene no longer holds, reused when the size still fits;
+// the renderer may keep the other one until the next frame is up
+static struct tinywl_flutter_buffer *flutter_buffer_get(struct tinywl_flutter *flutter,
+		int width, int height) {
+	int slot = 0;
+	for (int i = TINYWL_FLUTTER_BUFFERS - 1; i >= 0; i--) {
+		struct tinywl_flutter_buffer *buffer = flutter->buffers[i];
+		if (buffer == NULL || buffer->base.n_locks == 0) {
+			if (buffer != NULL && buffer->base.width == width && buffer->base.height == height) {
+				return buffer;
+			}
+			slot = i;
+		}
+	}
+	if (flutter->buffers[slot] != NULL) {
+		wlr_buffer_drop(&flutter->buffers[slot]->base);
+		flutter->buffers[slot] = NULL;
+	}
+
+	struct tinywl_flutter_buffer *buffer = calloc(1, sizeof(*buffer));
+	if (buffer == NULL) return NULL;
+	buffer->data = malloc((size_t)width * height * 4);
+	if (buffer->data == NULL) {
+		free(buffer);
+		return NULL;
+	}
+	wlr_buffer_init(&buffer->base, &flutter_buffer_impl, width, height);
+	flutter->buffers[slot] = buffer;
+	return buffer;
+}
+
+// Runs on our thread: the render task runner is the platform one. The
+// allocation is only valid during the call, so it is copied; comparing
+// rows against the frame on screen on the way limits the damage to the
+// band that changed.
+static bool flutter_present(void *user_data, const void *allocation, size_t row_bytes, size_t height) {
+	struct tinywl_server *server = user_data;
+	struct tinywl_flutter *flutter = &server->flutter;
+	// Software surfaces are tightly packed
+	int width = (int)(row_bytes / 4);
+	struct wlr_buffer *current = flutter->view->buffer;
+	struct tinywl_flutter_buffer *buffer = flutter_buffer_get(flutter, width, (int)height);
+	if (buffer == NULL) return false;
+
+	struct tinywl_flutter_buffer *previous = NULL;
+	if (current != NULL && current != &buffer->base &&
+			current->width == width && current->height == (int)height) {
+		previous = wl_container_of(current, previous, base);
+	}
+	int first = previous ? -1 : 0, last = previous ? -1 : (int)height - 1;
+	for (size_t y = 0; y < height; y++) {
+		const uint8_t *src = (const uint8_t *)allocation + y * row_bytes;
+		uint8_t *dst = (uint8_t *)buffer->data + y * row_bytes;
+		if (previous != NULL && memcmp(src, (uint8_t *)previous->data + y * row_bytes, row_bytes) != 0) {
+			if (first < 0) first = (int)y;
+			last = (int)y;
+		}
+		memcpy(dst, src, row_bytes);
+	}
+
+	pixman_region32_t damage;
+	pixman_region32_init(&damage);
+	if (first >= 0) {
+		pixman_region32_init_rect(&damage, 0, first, width, last - first + 1);
+	}
+	wlr_scene_buffer_set_buffer_with_damage(flutter->view, &buffer->base, &damage);
+	pixman_region32_fini(&damage);
+	wlr_scene_buffer_set_dest_size(flutter->view, flutter->box.width, flutter->box.height);
+
+	startup_mark(server, TINYWL_PHASE_SHELL_FIRST_FRAME);
+	return true;
+}
+
+static bool flutter_runs_task_on_current_thread(void *user_data) {
+	struct tinywl_server *server = user_data;
+	return pthread_equal(pthread_self(), server->flutter.thread);
+}
+
+// May be called from any of the engine's threads
+static void flutter_post_task(FlutterTask task, uint64_t target_time_nanos, void *user_data) {
+	struct tinywl_server *server = user_data;
+	struct tinywl_flutter *flutter = &server->flutter;
+	pthread_mutex_lock(&flutter->lock);
+	if (flutter->task_count == flutter->task_cap) {
+		size_t cap = flutter->task_cap ? flutter->task_cap * 2 : 16;
+		struct tinywl_flutter_task *tasks = realloc(flutter->tasks, cap * sizeof(*tasks));
+		if (tasks == NULL) {
+			pthread_mutex_unlock(&flutter->lock);
+			wlr_log(WLR_ERROR, "Dropped a Flutter task: out of memory");
+			return;
+		}
+		flutter->tasks = tasks;
+		flutter->task_cap = cap;
+	}
+	flutter->tasks[flutter->task_count++] = (struct tinywl_flutter_task){
+		.task = task,
+		.target_ns = target_time_nanos,
+	};
+	pthread_mutex_unlock(&flutter->lock);
+	uint64_t one = 1;
+	if (write(flutter->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		wlr_log_errno(WLR_ERROR, "Failed to wake the event loop for Flutter");
+	}
+}
+
+// Runs what is due in posting order, then sleeps until the next one
+static void flutter_run_tasks(struct tinywl_server *server) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	for (;;) {
+		uint64_t now = FlutterEngineGetCurrentTime();
+		uint64_t next = 0;
+		bool found = false;
+		struct tinywl_flutter_task due;
+		pthread_mutex_lock(&flutter->lock);
+		for (size_t i = 0; i < flutter->task_count; i++) {
+			if (flutter->tasks[i].target_ns <= now) {
+				due = flutter->tasks[i];
+				memmove(&flutter->tasks[i], &flutter->tasks[i + 1],
+					(flutter->task_count - i - 1) * sizeof(*flutter->tasks));
+				flutter->task_count--;
+				found = true;
+				break;
+			}
+			if (next == 0 || flutter->tasks[i].target_ns < next) {
+				next = flutter->tasks[i].target_ns;
+			}
+		}
+		pthread_mutex_unlock(&flutter->lock);
+
+		if (found) {
+			FlutterEngineRunTask(flutter->engine, &due.task);
+			continue;
+		}
+		if (next != 0) {
+			uint64_t ms = (next - now + 999999) / 1000000;
+			wl_event_source_timer_update(flutter->timer, ms > 0 ? (int)ms : 1);
+		}
+		return;
+	}
+}
+
+static int handle_flutter_wake(int fd, uint32_t mask, void *data) {
+	struct tinywl_server *server = data;
+	uint64_t count;
+	while (read(fd, &count, sizeof(count)) > 0) {
+		// Drain; one wakeup runs everything queued
+	}
+	flutter_run_tasks(server);
+	return 0;
+}
+
+static int handle_flutter_timer(void *data) {
+	flutter_run_tasks(data);
+	return 0;
+}
+
+static void flutter_platform_message(const FlutterPlatformMessage *message, void *user_data) {
+	struct tinywl_server *server = user_data;
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (strcmp(message->channel, "tinywl/action") == 0) {
+		char line[1024];
+		size_t len = message->message_size < sizeof(line) - 1 ? message->message_size : sizeof(line) - 1;
+		memcpy(line, message->message, len);
+		line[len] = '\0';
+		line[strcspn(line, "\n")] = '\0';
+		if (strcmp(line, "STATE") == 0) {
+			// The shell just started listening: give it what it missed
+			flutter_send_state(server, &server->state_published);
+		} else {
+			ipc_dispatch(server, line);
+		}
+	}
+	// Anything else is for a plugin we don't have; an empty reply says so
+	if (message->response_handle != NULL) {
+		FlutterEngineSendPlatformMessageResponse(flutter->engine, message->response_handle, NULL, 0);
+	}
+}
+
+static void flutter_send_state(struct tinywl_server *server, struct tinywl_buf *json) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (flutter->engine == NULL || json->len == 0) {
+		return;
+	}
+	FlutterPlatformMessage message = {
+		.struct_size = sizeof(message),
+		.channel = "tinywl/state",
+		.message = (const uint8_t *)json->data,
+		.message_size = json->len,
+	};
+	FlutterEngineSendPlatformMessage(flutter->engine, &message);
+}
+
+// The shell covers the whole layout, at the scale of the output it starts on
+static void flutter_arrange(struct tinywl_server *server) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (flutter->engine == NULL) {
+		return;
+	}
+	struct wlr_box box;
+	wlr_output_layout_get_box(server->output_layout, NULL, &box);
+	if (wlr_box_empty(&box)) {
+		box = (struct wlr_box){ .width = TINYWL_FALLBACK_WIDTH, .height = TINYWL_FALLBACK_HEIGHT };
+	}
+	struct wlr_output *wlr_output = wlr_output_layout_output_at(server->output_layout, box.x, box.y);
+	float scale = wlr_output != NULL ? wlr_output->scale : 1.0f;
+	if (wlr_box_equal(&box, &flutter->box) && scale == flutter->scale) {
+		return;
+	}
+	flutter->box = box;
+	flutter->scale = scale;
+	wlr_scene_node_set_position(&flutter->tree->node, box.x, box.y);
+	wlr_scene_buffer_set_dest_size(flutter->view, box.width, box.height);
+
+	FlutterWindowMetricsEvent metrics = {
+		.struct_size = sizeof(metrics),
+		.width = (size_t)(box.width * scale),
+		.height = (size_t)(box.height * scale),
+		.pixel_ratio = scale,
+	};
+	FlutterEngineSendWindowMetricsEvent(flutter->engine, &metrics);
+}
+
+// Whether pointer input at the cursor belongs to the shell: it's what the
+// cursor is over, or a button pressed on it is still held (so drags work)
+static bool flutter_owns_pointer(struct tinywl_server *server) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (flutter->engine == NULL) {
+		return false;
+	}
+	if (flutter->buttons != 0) {
+		return true;
+	}
+	double sx, sy;
+	struct wlr_scene_node *node = server_node_at(server, server->cursor->x, server->cursor->y, &sx, &sy);
+	return node == &flutter->view->node;
+}
+
+static void flutter_pointer_event(struct tinywl_server *server, FlutterPointerPhase phase,
+		FlutterPointerSignalKind signal, double scroll_x, double scroll_y) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (phase != kRemove && !flutter->pointer_added) {
+		flutter->pointer_added = true;
+		flutter_pointer_event(server, kAdd, kFlutterPointerSignalKindNone, 0, 0);
+	}
+	FlutterPointerEvent event = {
+		.struct_size = sizeof(event),
+		.phase = phase,
+		.timestamp = FlutterEngineGetCurrentTime() / 1000,
+		.x = (server->cursor->x - flutter->box.x) * flutter->scale,
+		.y = (server->cursor->y - flutter->box.y) * flutter->scale,
+		.signal_kind = signal,
+		.scroll_delta_x = scroll_x * flutter->scale,
+		.scroll_delta_y = scroll_y * flutter->scale,
+		.device_kind = kFlutterPointerDeviceKindMouse,
+		.buttons = flutter->buttons,
+	};
+	FlutterEngineSendPointerEvent(flutter->engine, &event, 1);
+}
+
+// From process_cursor_motion; returns whether the shell took it
+static bool flutter_pointer_motion(struct tinywl_server *server) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (!flutter_owns_pointer(server)) {
+		if (flutter->pointer_added) {
+			flutter->pointer_added = false;
+			flutter_pointer_event(server, kRemove, kFlutterPointerSignalKindNone, 0, 0);
+		}
+		return false;
+	}
+	flutter_pointer_event(server, flutter->buttons ? kMove : kHover,
+		kFlutterPointerSignalKindNone, 0, 0);
+	return true;
+}
+
+static bool flutter_pointer_button(struct tinywl_server *server, uint32_t button,
+		enum wl_pointer_button_state state) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (!flutter_owns_pointer(server)) {
+		return false;
+	}
+	int64_t bit;
+	switch (button) {
+	case BTN_LEFT:
+		bit = kFlutterPointerButtonMousePrimary;
+		break;
+	case BTN_RIGHT:
+		bit = kFlutterPointerButtonMouseSecondary;
+		break;
+	case BTN_MIDDLE:
+		bit = kFlutterPointerButtonMouseMiddle;
+		break;
+	default:
+		return true;
+	}
+	int64_t before = flutter->buttons;
+	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
+		flutter->buttons |= bit;
+	} else {
+		flutter->buttons &= ~bit;
+	}
+	if (flutter->buttons == before) {
+		return true;
+	}
+	FlutterPointerPhase phase = kMove;
+	if (before == 0) {
+		phase = kDown;
+	} else if (flutter->buttons == 0) {
+		phase = kUp;
+	}
+	flutter_pointer_event(server, phase, kFlutterPointerSignalKindNone, 0, 0);
+	return true;
+}
+
+static bool flutter_pointer_axis(struct tinywl_server *server, struct wlr_pointer_axis_event *event) {
+	if (!flutter_owns_pointer(server)) {
+		return false;
+	}
+	bool vertical = event->orientation == WL_POINTER_AXIS_VERTICAL_SCROLL;
+	flutter_pointer_event(server, server->flutter.buttons ? kMove : kHover,
+		kFlutterPointerSignalKindScroll, vertical ? 0 : event->delta, vertical ? event->delta : 0);
+	return true;
+}
+
+static bool flutter_start(struct tinywl_server *server) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+	flutter->thread = pthread_self();
+	pthread_mutex_init(&flutter->lock, NULL);
+	flutter->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (flutter->wake_fd < 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to create the Flutter wakeup eventfd");
+		return false;
+	}
+	flutter->wake_source = wl_event_loop_add_fd(loop, flutter->wake_fd, WL_EVENT_READABLE,
+		handle_flutter_wake, server);
+	flutter->timer = wl_event_loop_add_timer(loop, handle_flutter_timer, server);
+
+	// Between the bottom layer and the windows, like a desktop
+	flutter->tree = wlr_scene_tree_create(&server->scene->tree);
+	wlr_scene_node_place_above(&flutter->tree->node,
+		&server->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM]->node);
+	flutter->view = wlr_scene_buffer_create(flutter->tree, NULL);
+
+	// The layout of `flutter build linux`'s bundle
+	char assets[PATH_MAX], icu[PATH_MAX], elf[PATH_MAX];
+	snprintf(assets, sizeof(assets), "%s/data/flutter_assets", flutter->bundle);
+	snprintf(icu, sizeof(icu), "%s/data/icudtl.dat", flutter->bundle);
+	snprintf(elf, sizeof(elf), "%s/lib/libapp.so", flutter->bundle);
+
+	FlutterRendererConfig renderer = {
+		.type = kSoftware,
+		.software = {
+			.struct_size = sizeof(FlutterSoftwareRendererConfig),
+			.surface_present_callback = flutter_present,
+		},
+	};
+	// Platform and raster work both run here, so frames reach the scene
+	// without crossing threads
+	FlutterTaskRunnerDescription runner = {
+		.struct_size = sizeof(runner),
+		.user_data = server,
+		.runs_task_on_current_thread_callback = flutter_runs_task_on_current_thread,
+		.post_task_callback = flutter_post_task,
+		.identifier = 1,
+	};
+	FlutterCustomTaskRunners runners = {
+		.struct_size = sizeof(runners),
+		.platform_task_runner = &runner,
+		.render_task_runner = &runner,
+	};
+	static const char *entrypoint_argv[] = { "--embedded" };
+	FlutterProjectArgs args = {
+		.struct_size = sizeof(args),
+		.assets_path = assets,
+		.icu_data_path = icu,
+		.platform_message_callback = flutter_platform_message,
+		.custom_task_runners = &runners,
+		.dart_entrypoint_argc = 1,
+		.dart_entrypoint_argv = entrypoint_argv,
+	};
+	if (FlutterEngineRunsAOTCompiledDartCode()) {
+		FlutterEngineAOTDataSource source = {
+			.type = kFlutterEngineAOTDataSourceTypeElfPath,
+			.elf_path = elf,
+		};
+		if (FlutterEngineCreateAOTData(&source, &flutter->aot_data) != kSuccess) {
+			wlr_log(WLR_ERROR, "Failed to load the shell's compiled Dart from %s", elf);
+			return false;
+		}
+		args.aot_data = flutter->aot_data;
+	}
+
+	FlutterEngineResult result = FlutterEngineRun(FLUTTER_ENGINE_VERSION, &renderer, &args,
+		server, &flutter->engine);
+	if (result != kSuccess) {
+		wlr_log(WLR_ERROR, "Failed to start the embedded shell from %s (%d)", flutter->bundle, result);
+		flutter->engine = NULL;
+		return false;
+	}
+	flutter_arrange(server);
+	return true;
+}
+
+static void flutter_finish(struct tinywl_server *server) {
+	struct tinywl_flutter *flutter = &server->flutter;
+	if (flutter->engine != NULL) {
+		FlutterEngineShutdown(flutter->engine);
+		flutter->engine = NULL;
+	}
+	if (flutter->aot_data != NULL) {
+		FlutterEngineCollectAOTData(flutter->aot_data);
+		flutter->aot_data = NULL;
+	}
+	if (flutter->wake_source != NULL) {
+		wl_event_source_remove(flutter->wake_source);
+	}
+	if (flutter->timer != NULL) {
+		wl_event_source_remove(flutter->timer);
+	}
+	if (flutter->wake_fd > 0) {
+		close(flutter->wake_fd);
+		pthread_mutex_destroy(&flutter->lock);
+	}
+	for (int i = 0; i < TINYWL_FLUTTER_BUFFERS; i++) {
+		if (flutter->buffers[i] != NULL) {
+			wlr_buffer_drop(&flutter->buffers[i]->base);
+		}
+	}
+	free(flutter->tasks);
+	free(flutter->bundle);
+}
+#endif
+
+// -------------------------------------------------------------------------
+// Thumbnails: a small pyramid per docked window, served at requested sizes
+// -------------------------------------------------------------------------
+// Level 0 is the window halved until it fits TINYWL_THUMB_MAX_EDGE; each
+// further level halves the previous one, so one pass over the client buffer
+// feeds every size.
+static void thumb_layout(struct tinywl_toplevel *toplevel, int src_width, int src_height) {
+	int shift = 0;
+	while ((src_width >> shift) > TINYWL_THUMB_MAX_EDGE || (src_height >> shift) > TINYWL_THUMB_MAX_EDGE) {
+		shift++;
+	}
+	for (int i = 0; i < TINYWL_THUMB_LEVELS; i++) {
+		struct tinywl_thumb_level *level = &toplevel->thumb_levels[i];
+		int width = src_width >> (shift + i);
+		int height = src_height >> (shift + i);
+		if (i > 0 && (width < TINYWL_THUMB_MIN_EDGE || height < TINYWL_THUMB_MIN_EDGE)) {
+			width = height = 0;
+		}
+		if (level->width == width && level->height == height) continue;
+		if (level->pixels != NULL) {
+			toplevel->server->thumb_bytes -= (size_t)level->width * level->height * 4;
+			free(level->pixels);
+			level->pixels = NULL;
+		}
+		level->width = width;
+		level->height = height;
+	}
+	toplevel->thumb_shift = shift;
+}
+
+// Nearest level by area, in log space, so a request between two levels
+// gets whichever is closer rather than always the bigger one
+static int thumb_pick_level(struct tinywl_toplevel *toplevel, int width, int height) {
+	int best = 0;
+	double best_score = -1;
+	for (int i = 0; i < TINYWL_THUMB_LEVELS; i++) {
+		struct tinywl_thumb_level *level = &toplevel->thumb_levels[i];
+		if (level->width == 0) break;
+		double ratio = ((double)level->width * level->height) / ((double)width * height);
+		double score = ratio >= 1 ? ratio : 1 / ratio;
+		if (best_score < 0 || score < best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+// Box filter: every destination pixel averages a factor x factor block
+static void thumb_downscale(const uint8_t *src, size_t stride, int factor,
+		uint32_t *dst, int dst_width, int dst_height) {
+	int shift = __builtin_ctz(factor) * 2;
+	for (int y = 0; y < dst_height; y++) {
+		for (int x = 0; x < dst_width; x++) {
+			uint32_t sum[4] = {0};
+			for (int dy = 0; dy < factor; dy++) {
+				const uint8_t *p = src + (size_t)(y * factor + dy) * stride + (size_t)x * factor * 4;
+				for (int dx = 0; dx < factor; dx++, p += 4) {
+					sum[0] += p[0];
+					sum[1] += p[1];
+					sum[2] += p[2];
+					sum[3] += p[3];
+				}
+			}
+			dst[y * dst_width + x] = (sum[0] >> shift) | (sum[1] >> shift) << 8 |
+				(sum[2] >> shift) << 16 | (sum[3] >> shift) << 24;
+		}
+	}
+}
+
+// Drop least recently served levels until we are back under budget. Levels
+// nobody subscribes to go first.
+static void thumb_enforce_budget(struct tinywl_server *server) {
+	for (int pass = 0; pass < 2 && server->thumb_bytes > TINYWL_THUMB_BUDGET; pass++) {
+		while (server->thumb_bytes > TINYWL_THUMB_BUDGET) {
+			struct tinywl_thumb_level *victim = NULL;
+			struct tinywl_toplevel *toplevel;
+			wl_list_for_each(toplevel, &server->toplevels, link) {
+				for (int i = 0; i < TINYWL_THUMB_LEVELS; i++) {
+					struct tinywl_thumb_level *level = &toplevel->thumb_levels[i];
+					if (level->pixels == NULL) continue;
+					if (pass == 0 && (toplevel->thumb_wanted & (1u << i))) continue;
+					if (victim == NULL || level->last_used < victim->last_used) {
+						victim = level;
+					}
+				}
+			}
+			if (victim == NULL) break;
+			server->thumb_bytes -= (size_t)victim->width * victim->height * 4;
+			free(victim->pixels);
+			victim->pixels = NULL;
+		}
+	}
+}
+
+static void thumb_request_name(const void *id, const struct tinywl_thumb_request *request,
+		const char *ext, char *buf, size_t size) {
+	snprintf(buf, size, "thumb_%p_%dx%d.%s", id, request->width, request->height, ext);
+}
+
+// File layout: uint32 width, uint32 height, then width * height BGRA pixels.
+// Only plain syscalls, so workers use it as well.
+static void thumb_write(int runtime_fd, const void *id, const struct tinywl_thumb_request *request,
+		const struct tinywl_thumb_level *level) {
+	char tmp_filename[96];
+	char filename[96];
+	thumb_request_name(id, request, "tmp", tmp_filename, sizeof(tmp_filename));
+	thumb_request_name(id, request, "rgba", filename, sizeof(filename));
+	int fd = openat(runtime_fd, tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) return;
+	uint32_t header[2] = { level->width, level->height };
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof(header) },
+		{ .iov_base = level->pixels, .iov_len = (size_t)level->width * level->height * 4 },
+	};
+	bool ok = writev(fd, iov, 2) == (ssize_t)(iov[0].iov_len + iov[1].iov_len);
+	close(fd);
+	if (ok) {
+		renameat(runtime_fd, tmp_filename, runtime_fd, filename);
+	} else {
+		unlinkat(runtime_fd, tmp_filename, 0);
+	}
+}
+
+static void thumb_serve(struct tinywl_toplevel *toplevel, struct tinywl_thumb_request *request) {
+	struct tinywl_thumb_level *level = &toplevel->thumb_levels[request->level];
+	if (level->pixels == NULL) return;
+	thumb_write(toplevel->server->runtime_fd, toplevel, request, level);
+	level->last_used = monotonic_ns();
+}
+
+static void thumb_resolve_requests(struct tinywl_toplevel *toplevel) {
+	toplevel->thumb_wanted = 0;
+	for (int i = 0; i < TINYWL_THUMB_REQUESTS; i++) {
+		struct tinywl_thumb_request *request = &toplevel->thumb_requests[i];
+		if (request->width == 0) continue;
+		request->level = thumb_pick_level(toplevel, request->width, request->height);
+		toplevel->thumb_wanted |= 1u << request->level;
+	}
+}
+
+// -------------------------------------------------------------------------
+// Thumbnail workers: downscaling and publishing off the event loop
+// -------------------------------------------------------------------------
+static bool spsc_push(struct tinywl_spsc *queue, void *item) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail - head == TINYWL_QUEUE_SIZE) return false;
+	queue->slots[tail & (TINYWL_QUEUE_SIZE - 1)] = item;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static void *spsc_pop(struct tinywl_spsc *queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if (head == tail) return NULL;
+	void *item = queue->slots[head & (TINYWL_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return item;
+}
+
+// Worker side: touches nothing but the job itself and the runtime directory
+static void thumb_job_run(struct tinywl_thumb_job *job) {
+	const uint8_t *src = job->src;
+	size_t src_stride = (size_t)job->src_width * 4;
+	int factor = 1 << job->shift;
+	for (int i = 0; i <= job->deepest; i++) {
+		struct tinywl_thumb_level *level = &job->levels[i];
+		thumb_downscale(src, src_stride, factor, level->pixels, level->width, level->height);
+		src = (const uint8_t *)level->pixels;
+		src_stride = (size_t)level->width * 4;
+		factor = 2;
+	}
+	for (int i = 0; i < TINYWL_THUMB_REQUESTS; i++) {
+		struct tinywl_thumb_request *request = &job->requests[i];
+		if (request->width != 0) {
+			thumb_write(job->runtime_fd, job->id, request, &job->levels[request->level]);
+		}
+	}
+}
+
+static void *thumb_worker_run(void *data) {
+	struct tinywl_thumb_worker *worker = data;
+	while (!atomic_load(&worker->stop)) {
+		uint64_t count;
+		if (read(worker->wake_fd, &count, sizeof(count)) < 0 && errno != EINTR) break;
+		struct tinywl_thumb_job *job;
+		while ((job = spsc_pop(&worker->jobs)) != NULL) {
+			thumb_job_run(job);
+			// Cannot fail: the main thread never has more than
+			// TINYWL_QUEUE_SIZE jobs out with one worker
+			spsc_push(&worker->done, job);
+			uint64_t one = 1;
+			if (write(worker->done_fd, &one, sizeof(one)) < 0) {
+				// Counter saturated, so the event loop is awake anyway
+			}
+		}
+	}
+	return NULL;
+}
+
+static void update_thumbnail(struct tinywl_toplevel *toplevel);
+
+static void thumb_job_free(struct tinywl_thumb_job *job) {
+	pixman_region32_fini(&job->damage);
+	free(job->src);
+	free(job);
+}
+
+// Main thread: take the levels back, or drop them if the window let go of
+// its thumbnails while the job was out
+static void thumb_job_finish(struct tinywl_server *server, struct tinywl_thumb_job *job) {
+	struct tinywl_toplevel *toplevel = job->toplevel;
+	job->busy = false;
+	if (toplevel == NULL || job->cancelled) {
+		for (int i = 0; i <= job->deepest; i++) {
+			struct tinywl_thumb_level *level = &job->levels[i];
+			if (level->pixels == NULL) continue;
+			server->thumb_bytes -= (size_t)level->width * level->height * 4;
+			free(level->pixels);
+			level->pixels = NULL;
+		}
+		// The worker may have written these after thumb_release removed them
+		for (int i = 0; i < TINYWL_THUMB_REQUESTS; i++) {
+			if (job->requests[i].width == 0) continue;
+			char filename[96];
+			thumb_request_name(job->id, &job->requests[i], "rgba", filename, sizeof(filename));
+			unlinkat(server->runtime_fd, filename, 0);
+		}
+		job->cancelled = false;
+		if (toplevel == NULL) {
+			thumb_job_free(job);
+			return;
+		}
+	} else {
+		uint64_t now = monotonic_ns();
+		for (int i = 0; i <= job->deepest; i++) {
+			toplevel->thumb_levels[i].pixels = job->levels[i].pixels;
+			toplevel->thumb_levels[i].last_used = now;
+			job->levels[i].pixels = NULL;
+		}
+	}
+	thumb_enforce_budget(server);
+	if (toplevel->thumb_dirty) {
+		toplevel->thumb_dirty = false;
+		update_thumbnail(toplevel);
+	}
+}
+
+static int handle_thumb_done(int fd, uint32_t mask, void *data) {
+	struct tinywl_server *server = data;
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		wlr_log_errno(WLR_ERROR, "Failed to read thumbnail completions");
+	}
+	for (int i = 0; i < server->n_thumb_workers; i++) {
+		struct tinywl_thumb_worker *worker = &server->thumb_workers[i];
+		struct tinywl_thumb_job *job;
+		while ((job = spsc_pop(&worker->done)) != NULL) {
+			worker->outstanding--;
+			server->hud_thumb_jobs++;
+			thumb_job_finish(server, job);
+		}
+	}
+	return 0;
+}
+
+static void thumb_job_submit(struct tinywl_server *server, struct tinywl_thumb_job *job) {
+	job->busy = true;
+	for (int n = 0; n < server->n_thumb_workers; n++) {
+		struct tinywl_thumb_worker *worker = &server->thumb_workers[server->thumb_next_worker];
+		server->thumb_next_worker = (server->thumb_next_worker + 1) % server->n_thumb_workers;
+		if (worker->outstanding == TINYWL_QUEUE_SIZE) continue;
+		worker->outstanding++;
+		spsc_push(&worker->jobs, job);
+		uint64_t one = 1;
+		if (write(worker->wake_fd, &one, sizeof(one)) < 0) {
+			wlr_log_errno(WLR_ERROR, "Failed to wake thumbnail worker");
+		}
+		return;
+	}
+	// No workers, or every queue is full: do it here
+	thumb_job_run(job);
+	thumb_job_finish(server, job);
+}
+
+static void thumb_workers_init(struct tinywl_server *server) {
+	server->thumb_done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (server->thumb_done_fd < 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to create thumbnail eventfd, thumbnails stay on the main thread");
+		return;
+	}
+	server->thumb_done_source = wl_event_loop_add_fd(wl_display_get_event_loop(server->wl_display),
+		server->thumb_done_fd, WL_EVENT_READABLE, handle_thumb_done, server);
+
+	// Signals belong to the event loop, never to a worker
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < TINYWL_THUMB_WORKERS; i++) {
+		struct tinywl_thumb_worker *worker = &server->thumb_workers[server->n_thumb_workers];
+		worker->done_fd = server->thumb_done_fd;
+		worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (worker->wake_fd < 0) break;
+		if (pthread_create(&worker->thread, NULL, thumb_worker_run, worker) != 0) {
+			close(worker->wake_fd);
+			break;
+		}
+		server->n_thumb_workers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void thumb_workers_finish(struct tinywl_server *server) {
+	for (int i = 0; i < server->n_thumb_workers; i++) {
+		struct tinywl_thumb_worker *worker = &server->thumb_workers[i];
+		atomic_store(&worker->stop, true);
+		uint64_t one = 1;
+		if (write(worker->wake_fd, &one, sizeof(one)) < 0) {
+			wlr_log_errno(WLR_ERROR, "Failed to stop thumbnail worker");
+		}
+		pthread_join(worker->thread, NULL);
+		close(worker->wake_fd);
 	}
-	fprintf(f, "\n  ]\n}\n");
-	fclose(f);
+	if (server->thumb_done_fd >= 0) {
+		// Collect what the workers finished, freeing orphaned jobs
+		handle_thumb_done(server->thumb_done_fd, WL_EVENT_READABLE, server);
+		wl_event_source_remove(server->thumb_done_source);
+		close(server->thumb_done_fd);
+	}
+	server->n_thumb_workers = 0;
+}
 
-	// Atomic rename to ensure exact consistency
-	rename("/tmp/workspace_state.tmp", "/tmp/workspace_state.json");
+// Every commit, docked or not, adds its buffer damage to what the job's copy
+// is missing, so the next refresh only copies what changed
+static void thumb_damage_add(struct tinywl_toplevel *toplevel) {
+	struct tinywl_thumb_job *job = toplevel->thumb_job;
+	struct wlr_surface *surface = toplevel_surface(toplevel);
+	if (job == NULL || !job->src_valid || surface == NULL) return;
+	pixman_region32_union(&job->damage, &job->damage, &surface->buffer_damage);
+	if (pixman_region32_n_rects(&job->damage) > TINYWL_THUMB_DAMAGE_RECTS) {
+		pixman_box32_t extents = *pixman_region32_extents(&job->damage);
+		pixman_region32_fini(&job->damage);
+		pixman_region32_init_rect(&job->damage, extents.x1, extents.y1,
+			extents.x2 - extents.x1, extents.y2 - extents.y1);
+	}
 }
 
-static int handle_dock_ipc(void *data) {
-	struct tinywl_server *server = data;
-	
-	// ATOMIC READ: If the file exists, move it immediately so nothing else writes to it while we process
-	if (access("/tmp/dock_action.txt", F_OK) == 0) {
-		rename("/tmp/dock_action.txt", "/tmp/dock_action_processing.txt");
-		FILE *f = fopen("/tmp/dock_action_processing.txt", "r");
-		
-		if (f) {
-			char action[32];
-			void *id = NULL;
-			if (fscanf(f, "%31s %p", action, &id) == 2) {
-				
-				struct wlr_box box;
-				wlr_output_layout_get_box(server->output_layout, NULL, &box);
-				int out_w = box.width > 0 ? box.width : 1920;
-				int out_h = box.height > 0 ? box.height : 1080;
-
-				struct tinywl_toplevel *toplevel;
-				wl_list_for_each(toplevel, &server->toplevels, link) {
-					if ((void*)toplevel == id) {
-						if (strcmp(action, "DOCK_LEFT") == 0) {
-							toplevel->docked_side = 1;
-							wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 1280, 720);
-							wlr_scene_node_set_position(&toplevel->scene_tree->node, out_w - 1, out_h - 1); 
-							wlr_scene_node_lower_to_bottom(&toplevel->scene_tree->node);
-							wlr_xdg_toplevel_set_activated(toplevel->xdg_toplevel, false);
-                            wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
-						} else if (strcmp(action, "DOCK_RIGHT") == 0) {
-							toplevel->docked_side = 2;
-							wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 1280, 720);
-							wlr_scene_node_set_position(&toplevel->scene_tree->node, out_w - 1, out_h - 1);
-							wlr_scene_node_lower_to_bottom(&toplevel->scene_tree->node);
-							wlr_xdg_toplevel_set_activated(toplevel->xdg_toplevel, false);
-                            wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
-						} else if (strcmp(action, "UNDOCK") == 0) {
-							toplevel->docked_side = 0;
-							if (toplevel->maximized) {
-								wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, out_w, out_h);
-								wlr_scene_node_set_position(&toplevel->scene_tree->node, 0, 0);
-							} else {
-								wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 800, 600);
-								wlr_scene_node_set_position(&toplevel->scene_tree->node, 560, 240); 
-							}
-							wlr_scene_node_raise_to_top(&toplevel->scene_tree->node);
-							focus_toplevel(toplevel);
-                            wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
-						} else if (strcmp(action, "MAXIMIZE") == 0) {
-							if (!toplevel->maximized) {
-								toplevel->saved_x = toplevel->scene_tree->node.x;
-								toplevel->saved_y = toplevel->scene_tree->node.y;
-								toplevel->saved_geometry.width = toplevel->xdg_toplevel->base->geometry.width;
-								if (toplevel->saved_geometry.width == 0) toplevel->saved_geometry.width = 800;
-								toplevel->saved_geometry.height = toplevel->xdg_toplevel->base->geometry.height;
-								if (toplevel->saved_geometry.height == 0) toplevel->saved_geometry.height = 600;
-
-								wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, out_w, out_h);
-								wlr_scene_node_set_position(&toplevel->scene_tree->node, 0, 0);
-								wlr_xdg_toplevel_set_maximized(toplevel->xdg_toplevel, true);
-								toplevel->maximized = true;
-								wlr_scene_node_raise_to_top(&toplevel->scene_tree->node);
-								focus_toplevel(toplevel);
-                                wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
-							}
-						} else if (strcmp(action, "RESTORE") == 0) {
-							if (toplevel->maximized) {
-								wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, toplevel->saved_geometry.width, toplevel->saved_geometry.height);
-								wlr_scene_node_set_position(&toplevel->scene_tree->node, toplevel->saved_x, toplevel->saved_y);
-								wlr_xdg_toplevel_set_maximized(toplevel->xdg_toplevel, false);
-								toplevel->maximized = false;
-								wlr_scene_node_raise_to_top(&toplevel->scene_tree->node);
-								focus_toplevel(toplevel);
-                                wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
-							}
-						} else if (strcmp(action, "CLOSE") == 0) {
-							wlr_xdg_toplevel_send_close(toplevel->xdg_toplevel);
-						}
-						update_workspace_state(server);
-						break;
-					}
-				}
+// Brings job->src up to date with the client buffer: only the damaged spans
+// when the size is unchanged, all of it otherwise
+static bool thumb_copy_src(struct tinywl_thumb_job *job, const uint8_t *data, size_t stride,
+		int width, int height) {
+	size_t row = (size_t)width * 4;
+	size_t size = row * height;
+	if (stride < row) {
+		return false;
+	}
+	if (job->src_valid && job->src_width == width && job->src_height == height) {
+		int n_rects;
+		const pixman_box32_t *rects = pixman_region32_rectangles(&job->damage, &n_rects);
+		for (int i = 0; i < n_rects; i++) {
+			int x1 = rects[i].x1 > 0 ? rects[i].x1 : 0;
+			int y1 = rects[i].y1 > 0 ? rects[i].y1 : 0;
+			int x2 = rects[i].x2 < width ? rects[i].x2 : width;
+			int y2 = rects[i].y2 < height ? rects[i].y2 : height;
+			for (int y = y1; y < y2 && x1 < x2; y++) {
+				memcpy(job->src + y * row + x1 * 4, data + y * stride + x1 * 4, (size_t)(x2 - x1) * 4);
+			}
+		}
+	} else {
+		if (job->src_size < size) {
+			uint8_t *src = realloc(job->src, size);
+			if (src == NULL) {
+				return false;
 			}
-			fclose(f);
+			job->src = src;
+			job->src_size = size;
+		}
+		for (int y = 0; y < height; y++) {
+			memcpy(job->src + y * row, data + y * stride, row);
 		}
-		remove("/tmp/dock_action_processing.txt");
 	}
-	wl_event_source_timer_update(server->dock_ipc_timer, 100);
-	return 0;
+	pixman_region32_clear(&job->damage);
+	job->src_valid = true;
+	job->src_width = width;
+	job->src_height = height;
+	return true;
 }
 
+// The main thread only brings its copy of the client buffer up to date and
+// hands it off. wl_shm buffers can only be read safely from this thread,
+// hence the copy rather than passing the buffer itself; after the first
+// frame only the damaged spans are copied.
 static void update_thumbnail(struct tinywl_toplevel *toplevel) {
-	if (toplevel->docked_side == 0) return;
+	struct tinywl_server *server = toplevel->server;
+	if (toplevel->docked_side == 0 || server->idle) return;
 
-	struct wlr_surface *surface = toplevel->xdg_toplevel->base->surface;
+	struct tinywl_thumb_job *job = toplevel->thumb_job;
+	if (job != NULL && job->busy) {
+		// Redone from the newest buffer when the job in flight comes back
+		toplevel->thumb_dirty = true;
+		return;
+	}
+
+	struct wlr_surface *surface = toplevel_surface(toplevel);
 	if (!surface || !surface->buffer) return;
 
 	struct wlr_buffer *buffer = &surface->buffer->base;
-	
+	thumb_layout(toplevel, buffer->width, buffer->height);
+	thumb_resolve_requests(toplevel);
+	if (toplevel->thumb_wanted == 0) return;
+	int deepest = 31 - __builtin_clz(toplevel->thumb_wanted);
+
+	if (job == NULL) {
+		job = calloc(1, sizeof(*job));
+		if (job == NULL) return;
+		job->toplevel = toplevel;
+		pixman_region32_init(&job->damage);
+		toplevel->thumb_job = job;
+	}
+	for (int i = 0; i <= deepest; i++) {
+		struct tinywl_thumb_level *level = &toplevel->thumb_levels[i];
+		if (level->pixels == NULL) {
+			level->pixels = malloc((size_t)level->width * level->height * 4);
+			if (level->pixels == NULL) return;
+			server->thumb_bytes += (size_t)level->width * level->height * 4;
+		}
+	}
+
 	void *data;
 	uint32_t format;
 	size_t stride;
+	if (!wlr_buffer_begin_data_ptr_access(buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &data, &format, &stride)) {
+		return;
+	}
+	bool copied = thumb_copy_src(job, data, stride, buffer->width, buffer->height);
+	wlr_buffer_end_data_ptr_access(buffer);
+	if (!copied) return;
 
-	if (wlr_buffer_begin_data_ptr_access(buffer, WLR_BUFFER_DATA_PTR_ACCESS_READ, &data, &format, &stride)) {
-		int src_width = buffer->width;
-		int src_height = buffer->height;
-		int dst_width = 290;
-		int dst_height = 200;
-        
-		if (stride >= src_width * 4) {
-			char tmp_filename[64];
-			char filename[64];
-			snprintf(tmp_filename, sizeof(tmp_filename), "/tmp/thumb_%p.tmp", (void*)toplevel);
-			snprintf(filename, sizeof(filename), "/tmp/thumb_%p.rgba", (void*)toplevel);
-            
-			FILE *f = fopen(tmp_filename, "wb");
-			if (f) {
-				uint8_t *src8 = (uint8_t *)data;
-				uint32_t *dst32 = malloc(dst_width * dst_height * 4);
-                
-				if (dst32) {
-					for (int y = 0; y < dst_height; y++) {
-						int src_y = y * src_height / dst_height;
-						uint32_t *dst_row = dst32 + (y * dst_width);
-						
-						uint8_t *src_row = src8 + (src_y * stride); 
-						
-						for (int x = 0; x < dst_width; x++) {
-							int src_x = x * src_width / dst_width;
-							dst_row[x] = *(uint32_t*)(src_row + (src_x * 4)); 
-						}
-					}
-					fwrite(dst32, 1, dst_width * dst_height * 4, f);
-					free(dst32);
-				}
-				fclose(f);
-				
-				rename(tmp_filename, filename); 
-			}
+	job->runtime_fd = server->runtime_fd;
+	job->id = toplevel;
+	job->shift = toplevel->thumb_shift;
+	job->deepest = deepest;
+	// The levels being rebuilt are on loan to the job until it finishes
+	for (int i = 0; i <= deepest; i++) {
+		job->levels[i] = toplevel->thumb_levels[i];
+		toplevel->thumb_levels[i].pixels = NULL;
+	}
+	memcpy(job->requests, toplevel->thumb_requests, sizeof(job->requests));
+	thumb_job_submit(server, job);
+}
+
+// THUMB <id> <w>x<h>: keep thumb_<id>_<w>x<h>.rgba filled from the nearest
+// level. A size of 0x0 cancels every request for the window.
+static void thumb_subscribe(struct tinywl_toplevel *toplevel, int width, int height) {
+	if (width <= 0 || height <= 0) {
+		for (int i = 0; i < TINYWL_THUMB_REQUESTS; i++) {
+			struct tinywl_thumb_request *request = &toplevel->thumb_requests[i];
+			if (request->width == 0) continue;
+			char filename[96];
+			thumb_request_name(toplevel, request, "rgba", filename, sizeof(filename));
+			unlinkat(toplevel->server->runtime_fd, filename, 0);
+			request->width = request->height = 0;
 		}
-		wlr_buffer_end_data_ptr_access(buffer);
+		toplevel->thumb_wanted = 0;
+		return;
+	}
+
+	struct tinywl_thumb_request *slot = NULL;
+	for (int i = 0; i < TINYWL_THUMB_REQUESTS; i++) {
+		struct tinywl_thumb_request *request = &toplevel->thumb_requests[i];
+		if (request->width == width && request->height == height) {
+			slot = request;
+			break;
+		}
+		if (slot == NULL && request->width == 0) {
+			slot = request;
+		}
+	}
+	if (slot == NULL) {
+		// Full: the oldest request makes room
+		slot = &toplevel->thumb_requests[0];
+		char filename[96];
+		thumb_request_name(toplevel, slot, "rgba", filename, sizeof(filename));
+		unlinkat(toplevel->server->runtime_fd, filename, 0);
+		memmove(&toplevel->thumb_requests[0], &toplevel->thumb_requests[1],
+			sizeof(toplevel->thumb_requests) - sizeof(toplevel->thumb_requests[0]));
+		slot = &toplevel->thumb_requests[TINYWL_THUMB_REQUESTS - 1];
+	}
+	slot->width = width;
+	slot->height = height;
+	if (toplevel->thumb_job != NULL && toplevel->thumb_job->busy) {
+		toplevel->thumb_dirty = true;
+	}
+	thumb_resolve_requests(toplevel);
+	// Answer straight away if that level is already built
+	thumb_serve(toplevel, slot);
+}
+
+static void thumb_release(struct tinywl_toplevel *toplevel) {
+	if (toplevel->thumb_job != NULL && toplevel->thumb_job->busy) {
+		toplevel->thumb_job->cancelled = true;
+	}
+	toplevel->thumb_dirty = false;
+	thumb_subscribe(toplevel, 0, 0);
+	for (int i = 0; i < TINYWL_THUMB_LEVELS; i++) {
+		struct tinywl_thumb_level *level = &toplevel->thumb_levels[i];
+		if (level->pixels != NULL) {
+			toplevel->server->thumb_bytes -= (size_t)level->width * level->height * 4;
+			free(level->pixels);
+		}
+		level->pixels = NULL;
+		level->width = level->height = 0;
+	}
+}
+
+// A job still out when its window is destroyed frees itself on return
+static void thumb_destroy(struct tinywl_toplevel *toplevel) {
+	thumb_release(toplevel);
+	struct tinywl_thumb_job *job = toplevel->thumb_job;
+	if (job == NULL) return;
+	if (job->busy) {
+		job->toplevel = NULL;
+	} else {
+		thumb_job_free(job);
 	}
+	toplevel->thumb_job = NULL;
 }
 
 // -------------------------------------------------------------------------
@@ -730,80 +5985,147 @@ static void update_thumbnail(struct tinywl_toplevel *toplevel) {
 // -------------------------------------------------------------------------
 static void xdg_toplevel_commit(struct wl_listener *listener, void *data) {
 	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, commit);
+	startup_mark(toplevel->server, TINYWL_PHASE_FIRST_COMMIT);
+	toplevel->commits++;
+	record_commit(toplevel);
+	thumb_damage_add(toplevel);
+	if (toplevel->first_commit_ns == 0) {
+		toplevel->first_commit_ns = monotonic_ns();
+	}
 	
 	if (toplevel->xdg_toplevel->base->initial_commit) {
-		// If this is the FIRST app ever launched (the list is empty right now because mapping happens after)
-		// OR it specifically requested to be fullscreen:
-		if (wl_list_empty(&toplevel->server->toplevels) || toplevel->xdg_toplevel->requested.fullscreen) {
+		// The workspace shell itself, or anything that asked to be fullscreen:
+		if (toplevel->is_shell || toplevel->xdg_toplevel->requested.fullscreen) {
 			struct wlr_box box;
 			wlr_output_layout_get_box(toplevel->server->output_layout, NULL, &box);
-			wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, box.width > 0 ? box.width : 1920, box.height > 0 ? box.height : 1080);
-			wlr_xdg_toplevel_set_fullscreen(toplevel->xdg_toplevel, true);
+			toplevel_set_size(toplevel, box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH, box.height > 0 ? box.height : TINYWL_FALLBACK_HEIGHT);
+			toplevel_set_fullscreen(toplevel, true);
+		} else if (session_restore_toplevel(toplevel)) {
+			// Seen in a previous session: configure straight into the saved
+			// layout so the first buffer the client draws is already final.
+			if (toplevel->docked_side != 0) {
+				toplevel_set_size(toplevel, TINYWL_DOCKED_WIDTH, TINYWL_DOCKED_HEIGHT);
+				toplevel_set_activated(toplevel, false);
+			} else {
+				struct wlr_box usable;
+				server_usable_box(toplevel->server, &usable);
+				toplevel_set_size(toplevel, usable.width, usable.height);
+			}
+			if (toplevel->maximized) {
+				toplevel_set_maximized(toplevel, true);
+			}
 		} else if (toplevel->xdg_toplevel->requested.maximized) {
-			struct wlr_box box;
-			wlr_output_layout_get_box(toplevel->server->output_layout, NULL, &box);
-			wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, box.width > 0 ? box.width : 1920, box.height > 0 ? box.height : 1080);
-			wlr_xdg_toplevel_set_maximized(toplevel->xdg_toplevel, true);
+			struct wlr_box usable;
+			server_usable_box(toplevel->server, &usable);
+			toplevel_set_size(toplevel, usable.width, usable.height);
+			toplevel_set_maximized(toplevel, true);
 		} else {
 			// Leave size to 0,0 so standard windows pick their own size
-			wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 0, 0);
+			toplevel_set_size(toplevel, 0, 0);
 		}
 	}
     
 	if (toplevel->docked_side != 0) {
 		update_thumbnail(toplevel);
+		dock_preview_update(toplevel);
+		toplevel_update_scale(toplevel);
 	}
+	switcher_preview_update(toplevel);
+	transaction_toplevel_commit(toplevel);
 }
 
 // -------------------------------------------------------------------------
 // CRITICAL FIX: The map function logic
 // -------------------------------------------------------------------------
-static void xdg_toplevel_map(struct wl_listener *listener, void *data) {
-	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, map);
+static void toplevel_map(struct tinywl_toplevel *toplevel) {
+	startup_mark(toplevel->server, TINYWL_PHASE_FIRST_MAP);
+	toplevel->map_ns = monotonic_ns();
+	launch_finish(toplevel);
+	record_window(toplevel, TINYWL_REC_MAP);
 	
 	// Add it to the list of windows
 	wl_list_insert(&toplevel->server->toplevels, &toplevel->link);
+	sched_schedule(toplevel->server);
+
+	if (toplevel->session_restored) {
+		// The initial configure already carried the saved size, so just place it
+		toplevel->session_restored = false;
+		struct wlr_box box;
+		wlr_output_layout_get_box(toplevel->server->output_layout, NULL, &box);
+		int out_w = box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH;
+		int out_h = box.height > 0 ? box.height : TINYWL_FALLBACK_HEIGHT;
+
+		if (toplevel->docked_side != 0) {
+			toplevel_set_position(toplevel, out_w - 1, out_h - 1);
+			wlr_scene_node_lower_to_bottom(&toplevel->scene_tree->node);
+		} else {
+			struct wlr_box usable;
+			server_usable_box(toplevel->server, &usable);
+			toplevel_set_position(toplevel, usable.x, usable.y);
+			focus_toplevel(toplevel);
+		}
+		update_workspace_state(toplevel->server);
+		return;
+	}
 	toplevel->docked_side = 0; 
 
-	// Is this our workspace app (first in the list) OR is it a fullscreen app?
-	if (wl_list_length(&toplevel->server->toplevels) == 1 || toplevel->xdg_toplevel->requested.fullscreen) {
+	// Is this our workspace app OR is it a fullscreen app?
+	if (toplevel->is_shell || toplevel_wants_fullscreen(toplevel)) {
 		struct wlr_box box;
 		wlr_output_layout_get_box(toplevel->server->output_layout, NULL, &box);
-		int out_w = box.width > 0 ? box.width : 1920;
-		int out_h = box.height > 0 ? box.height : 1080;
+		int out_w = box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH;
+		int out_h = box.height > 0 ? box.height : TINYWL_FALLBACK_HEIGHT;
 
-		wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, out_w, out_h);
-		wlr_xdg_toplevel_set_fullscreen(toplevel->xdg_toplevel, true); 
-		wlr_scene_node_set_position(&toplevel->scene_tree->node, 0, 0);
+		toplevel_set_size(toplevel, out_w, out_h);
+		toplevel_set_fullscreen(toplevel, true); 
+		toplevel_set_position(toplevel, 0, 0);
 	} else {
 		// Standard window layout
-		wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, 800, 600);
-		wlr_scene_node_set_position(&toplevel->scene_tree->node, 560, 240); 
+		struct wlr_box box = server_window_box(toplevel->server);
+		toplevel_set_size(toplevel, box.width, box.height);
+		toplevel_set_position(toplevel, box.x, box.y);
 	}
 
-	wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
+	toplevel_schedule_configure(toplevel);
 	focus_toplevel(toplevel);
 	update_workspace_state(toplevel->server);
 }
 
-static void xdg_toplevel_unmap(struct wl_listener *listener, void *data) {
-	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, unmap);
+static void xdg_toplevel_map(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, map);
+	toplevel_map(toplevel);
+}
+
+static void toplevel_unmap(struct tinywl_toplevel *toplevel) {
 	if (toplevel == toplevel->server->grabbed_toplevel) {
 		reset_cursor_mode(toplevel->server);
 	}
     
-	if (toplevel->docked_side != 0) {
-		char filename[64];
-		snprintf(filename, sizeof(filename), "/tmp/thumb_%p.rgba", (void*)toplevel);
-		remove(filename);
+	record_window(toplevel, TINYWL_REC_UNMAP);
+	animation_finish(toplevel);
+	thumb_release(toplevel);
+	session_release_toplevel(toplevel);
+	focus_history_remove(toplevel);
+	transaction_remove(toplevel);
+	if (toplevel->is_shell) {
+		dock_preview_clear_all(toplevel->server);
+	} else {
+		dock_preview_clear(toplevel);
 	}
     
 	wl_list_remove(&toplevel->link);
 	update_workspace_state(toplevel->server);
 }
 
+static void xdg_toplevel_unmap(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, unmap);
+	toplevel_unmap(toplevel);
+}
+
 static void xdg_toplevel_destroy(struct wl_listener *listener, void *data) {
 	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, destroy);
+	thumb_destroy(toplevel);
+	session_release_toplevel(toplevel);
 	wl_list_remove(&toplevel->map.link);
 	wl_list_remove(&toplevel->unmap.link);
 	wl_list_remove(&toplevel->commit.link);
@@ -812,6 +6134,12 @@ static void xdg_toplevel_destroy(struct wl_listener *listener, void *data) {
 	wl_list_remove(&toplevel->request_resize.link);
 	wl_list_remove(&toplevel->request_maximize.link);
 	wl_list_remove(&toplevel->request_fullscreen.link);
+	struct tinywl_popup *popup, *tmp;
+	wl_list_for_each_safe(popup, tmp, &toplevel->popups, link) {
+		wl_list_remove(&popup->link);
+		wl_list_init(&popup->link);
+		popup->toplevel = NULL;
+	}
 	free(toplevel);
 }
 
@@ -824,15 +6152,15 @@ static void begin_interactive(struct tinywl_toplevel *toplevel, enum tinywl_curs
 		server->grab_x = server->cursor->x - toplevel->scene_tree->node.x;
 		server->grab_y = server->cursor->y - toplevel->scene_tree->node.y;
 	} else {
-		struct wlr_box *geo_box = &toplevel->xdg_toplevel->base->geometry;
-		double border_x = (toplevel->scene_tree->node.x + geo_box->x) +
-			((edges & WLR_EDGE_RIGHT) ? geo_box->width : 0);
-		double border_y = (toplevel->scene_tree->node.y + geo_box->y) +
-			((edges & WLR_EDGE_BOTTOM) ? geo_box->height : 0);
+		struct wlr_box geo_box = toplevel_geometry(toplevel);
+		double border_x = (toplevel->scene_tree->node.x + geo_box.x) +
+			((edges & WLR_EDGE_RIGHT) ? geo_box.width : 0);
+		double border_y = (toplevel->scene_tree->node.y + geo_box.y) +
+			((edges & WLR_EDGE_BOTTOM) ? geo_box.height : 0);
 		server->grab_x = server->cursor->x - border_x;
 		server->grab_y = server->cursor->y - border_y;
 
-		server->grab_geobox = *geo_box;
+		server->grab_geobox = geo_box;
 		server->grab_geobox.x += toplevel->scene_tree->node.x;
 		server->grab_geobox.y += toplevel->scene_tree->node.y;
 		server->resize_edges = edges;
@@ -842,9 +6170,8 @@ static void begin_interactive(struct tinywl_toplevel *toplevel, enum tinywl_curs
 static void xdg_toplevel_request_move(struct wl_listener *listener, void *data) {
 	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_move);
 	
-	// Check if this is our workspace background (the first window in the list)
-	struct tinywl_toplevel *first_toplevel = wl_container_of(toplevel->server->toplevels.prev, first_toplevel, link);
-	if (toplevel == first_toplevel || toplevel->xdg_toplevel->current.fullscreen) {
+	// Our workspace background never moves
+	if (toplevel->is_shell || toplevel_is_fullscreen(toplevel)) {
 		return; 
 	}
 	
@@ -855,80 +6182,100 @@ static void xdg_toplevel_request_resize(struct wl_listener *listener, void *data
 	struct wlr_xdg_toplevel_resize_event *event = data;
 	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_resize);
 	
-	struct tinywl_toplevel *first_toplevel = wl_container_of(toplevel->server->toplevels.prev, first_toplevel, link);
-	if (toplevel == first_toplevel || toplevel->xdg_toplevel->current.fullscreen) {
+	if (toplevel->is_shell || toplevel_is_fullscreen(toplevel)) {
 		return; 
 	}
 	
 	begin_interactive(toplevel, TINYWL_CURSOR_RESIZE, event->edges);
 }
 
-static void xdg_toplevel_request_maximize(struct wl_listener *listener, void *data) {
-	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_maximize);
-	
-	bool maximize = toplevel->xdg_toplevel->requested.maximized;
+static void toplevel_request_maximize(struct tinywl_toplevel *toplevel, bool maximize) {
 	if (maximize == toplevel->maximized) return;
 
 	if (maximize) {
-		struct wlr_box box;
-		wlr_output_layout_get_box(toplevel->server->output_layout, NULL, &box);
-		int out_w = box.width > 0 ? box.width : 1920;
-		int out_h = box.height > 0 ? box.height : 1080;
+		struct wlr_box usable;
+		server_usable_box(toplevel->server, &usable);
 
 		toplevel->saved_x = toplevel->scene_tree->node.x;
 		toplevel->saved_y = toplevel->scene_tree->node.y;
-		toplevel->saved_geometry.width = toplevel->xdg_toplevel->base->geometry.width;
-		if (toplevel->saved_geometry.width == 0) toplevel->saved_geometry.width = 800;
-		toplevel->saved_geometry.height = toplevel->xdg_toplevel->base->geometry.height;
-		if (toplevel->saved_geometry.height == 0) toplevel->saved_geometry.height = 600;
-
-		wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, out_w, out_h);
-		wlr_scene_node_set_position(&toplevel->scene_tree->node, 0, 0);
-		wlr_xdg_toplevel_set_maximized(toplevel->xdg_toplevel, true);
+		toplevel->saved_geometry.width = toplevel_geometry(toplevel).width;
+		if (toplevel->saved_geometry.width == 0) toplevel->saved_geometry.width = TINYWL_WINDOW_WIDTH;
+		toplevel->saved_geometry.height = toplevel_geometry(toplevel).height;
+		if (toplevel->saved_geometry.height == 0) toplevel->saved_geometry.height = TINYWL_WINDOW_HEIGHT;
+
+		toplevel_set_size(toplevel, usable.width, usable.height);
+		toplevel_set_position(toplevel, usable.x, usable.y);
+		toplevel_set_maximized(toplevel, true);
 		toplevel->maximized = true;
 	} else {
-		wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, toplevel->saved_geometry.width, toplevel->saved_geometry.height);
-		wlr_scene_node_set_position(&toplevel->scene_tree->node, toplevel->saved_x, toplevel->saved_y);
-		wlr_xdg_toplevel_set_maximized(toplevel->xdg_toplevel, false);
+		toplevel_set_size(toplevel, toplevel->saved_geometry.width, toplevel->saved_geometry.height);
+		toplevel_set_position(toplevel, toplevel->saved_x, toplevel->saved_y);
+		toplevel_set_maximized(toplevel, false);
 		toplevel->maximized = false;
 	}
     
-	if (toplevel->xdg_toplevel->base->initialized) {
-		wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
-	}
+	toplevel_schedule_configure(toplevel);
+	session_update_toplevel(toplevel);
 	update_workspace_state(toplevel->server);
 }
 
-static void xdg_toplevel_request_fullscreen(struct wl_listener *listener, void *data) {
-	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_fullscreen);
-	
-	bool fullscreen = toplevel->xdg_toplevel->requested.fullscreen;
+static void xdg_toplevel_request_maximize(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_maximize);
+	toplevel_request_maximize(toplevel, toplevel->xdg_toplevel->requested.maximized);
+}
+
+static void toplevel_request_fullscreen(struct tinywl_toplevel *toplevel, bool fullscreen) {
 	if (fullscreen) {
 		struct wlr_box box;
 		wlr_output_layout_get_box(toplevel->server->output_layout, NULL, &box);
-		int out_w = box.width > 0 ? box.width : 1920;
-		int out_h = box.height > 0 ? box.height : 1080;
+		int out_w = box.width > 0 ? box.width : TINYWL_FALLBACK_WIDTH;
+		int out_h = box.height > 0 ? box.height : TINYWL_FALLBACK_HEIGHT;
 
 		toplevel->saved_x = toplevel->scene_tree->node.x;
 		toplevel->saved_y = toplevel->scene_tree->node.y;
-		toplevel->saved_geometry.width = toplevel->xdg_toplevel->base->geometry.width;
-		toplevel->saved_geometry.height = toplevel->xdg_toplevel->base->geometry.height;
+		toplevel->saved_geometry.width = toplevel_geometry(toplevel).width;
+		toplevel->saved_geometry.height = toplevel_geometry(toplevel).height;
 
-		wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, out_w, out_h);
-		wlr_scene_node_set_position(&toplevel->scene_tree->node, 0, 0);
-		wlr_xdg_toplevel_set_fullscreen(toplevel->xdg_toplevel, true);
+		toplevel_set_size(toplevel, out_w, out_h);
+		toplevel_set_position(toplevel, 0, 0);
+		toplevel_set_fullscreen(toplevel, true);
 	} else {
-		int width = toplevel->saved_geometry.width > 0 ? toplevel->saved_geometry.width : 800;
-		int height = toplevel->saved_geometry.height > 0 ? toplevel->saved_geometry.height : 600;
+		int width = toplevel->saved_geometry.width > 0 ? toplevel->saved_geometry.width : TINYWL_WINDOW_WIDTH;
+		int height = toplevel->saved_geometry.height > 0 ? toplevel->saved_geometry.height : TINYWL_WINDOW_HEIGHT;
 
-		wlr_xdg_toplevel_set_size(toplevel->xdg_toplevel, width, height);
-		wlr_scene_node_set_position(&toplevel->scene_tree->node, toplevel->saved_x, toplevel->saved_y);
-		wlr_xdg_toplevel_set_fullscreen(toplevel->xdg_toplevel, false);
+		toplevel_set_size(toplevel, width, height);
+		toplevel_set_position(toplevel, toplevel->saved_x, toplevel->saved_y);
+		toplevel_set_fullscreen(toplevel, false);
 	}
     
-	if (toplevel->xdg_toplevel->base->initialized) {
-		wlr_xdg_surface_schedule_configure(toplevel->xdg_toplevel->base);
+	toplevel_schedule_configure(toplevel);
+}
+
+static void xdg_toplevel_request_fullscreen(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_fullscreen);
+	toplevel_request_fullscreen(toplevel, toplevel->xdg_toplevel->requested.fullscreen);
+}
+
+// The shell is the process we started with -s. Without one, fall back to the
+// old convention that the first window to appear is the workspace.
+static bool client_is_shell(struct tinywl_server *server, struct wl_client *client) {
+#if TINYWL_HAS_FLUTTER
+	// The embedded shell has no client; nobody else gets to stand in for it
+	if (server->flutter.engine != NULL) {
+		return false;
+	}
+#endif
+	if (server->shell_pid < 0) {
+		return false;
+	}
+	if (server->shell_pid == 0) {
+		return wl_list_empty(&server->toplevels);
 	}
+	pid_t pid;
+	uid_t uid;
+	gid_t gid;
+	wl_client_get_credentials(client, &pid, &uid, &gid);
+	return pid == server->shell_pid;
 }
 
 static void server_new_xdg_toplevel(struct wl_listener *listener, void *data) {
@@ -938,7 +6285,13 @@ static void server_new_xdg_toplevel(struct wl_listener *listener, void *data) {
 	struct tinywl_toplevel *toplevel = calloc(1, sizeof(*toplevel));
 	toplevel->server = server;
 	toplevel->xdg_toplevel = xdg_toplevel;
-	toplevel->scene_tree = wlr_scene_xdg_surface_create(&toplevel->server->scene->tree, xdg_toplevel->base);
+	toplevel->session_slot = -1;
+	wl_list_init(&toplevel->popups);
+	wl_list_init(&toplevel->mru_link);
+	wl_list_init(&toplevel->txn_link);
+	struct wl_client *client = wl_resource_get_client(xdg_toplevel->resource);
+	toplevel->is_shell = client_is_shell(server, client);
+	toplevel->scene_tree = wlr_scene_xdg_surface_create(server->toplevel_layer, xdg_toplevel->base);
 	toplevel->scene_tree->node.data = toplevel;
 	xdg_toplevel->base->data = toplevel->scene_tree;
 
@@ -959,6 +6312,13 @@ static void server_new_xdg_toplevel(struct wl_listener *listener, void *data) {
 	wl_signal_add(&xdg_toplevel->events.request_maximize, &toplevel->request_maximize);
 	toplevel->request_fullscreen.notify = xdg_toplevel_request_fullscreen;
 	wl_signal_add(&xdg_toplevel->events.request_fullscreen, &toplevel->request_fullscreen);
+
+	uid_t uid;
+	gid_t gid;
+	wl_client_get_credentials(client, &toplevel->pid, &uid, &gid);
+	if (!toplevel->is_shell) {
+		launch_match_pid(toplevel, toplevel->pid);
+	}
 }
 
 static void xdg_popup_commit(struct wl_listener *listener, void *data) {
@@ -970,20 +6330,46 @@ static void xdg_popup_commit(struct wl_listener *listener, void *data) {
 
 static void xdg_popup_destroy(struct wl_listener *listener, void *data) {
 	struct tinywl_popup *popup = wl_container_of(listener, popup, destroy);
+	popup->server->popups--;
+	wl_list_remove(&popup->link);
 	wl_list_remove(&popup->commit.link);
 	wl_list_remove(&popup->destroy.link);
 	free(popup);
 }
 
 static void server_new_xdg_popup(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, new_xdg_popup);
 	struct wlr_xdg_popup *xdg_popup = data;
 	struct tinywl_popup *popup = calloc(1, sizeof(*popup));
+	popup->server = server;
 	popup->xdg_popup = xdg_popup;
+	server->popups++;
+
+	// Layer-surface popups are created without a parent and get their scene
+	// node from layer_surface_new_popup once the client assigns one
+	struct wlr_xdg_surface *parent = xdg_popup->parent ?
+		wlr_xdg_surface_try_from_wlr_surface(xdg_popup->parent) : NULL;
+	if (parent != NULL) {
+		struct wlr_scene_tree *parent_tree = parent->data;
+		xdg_popup->base->data = wlr_scene_xdg_surface_create(parent_tree, xdg_popup->base);
+	}
 
-	struct wlr_xdg_surface *parent = wlr_xdg_surface_try_from_wlr_surface(xdg_popup->parent);
-	assert(parent != NULL);
-	struct wlr_scene_tree *parent_tree = parent->data;
-	xdg_popup->base->data = wlr_scene_xdg_surface_create(parent_tree, xdg_popup->base);
+	// Charge the popup to the window at the root of its popup chain
+	struct wlr_xdg_surface *root = parent;
+	while (root != NULL && root->role == WLR_XDG_SURFACE_ROLE_POPUP) {
+		root = root->popup->parent ? wlr_xdg_surface_try_from_wlr_surface(root->popup->parent) : NULL;
+	}
+	wl_list_init(&popup->link);
+	if (root != NULL && root->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
+		struct tinywl_toplevel *toplevel;
+		wl_list_for_each(toplevel, &server->toplevels, link) {
+			if (toplevel->xdg_toplevel == root->toplevel) {
+				popup->toplevel = toplevel;
+				wl_list_insert(&toplevel->popups, &popup->link);
+				break;
+			}
+		}
+	}
 
 	popup->commit.notify = xdg_popup_commit;
 	wl_signal_add(&xdg_popup->base->surface->events.commit, &popup->commit);
@@ -991,22 +6377,344 @@ static void server_new_xdg_popup(struct wl_listener *listener, void *data) {
 	wl_signal_add(&xdg_popup->events.destroy, &popup->destroy);
 }
 
+#if WLR_HAS_XWAYLAND
+// -------------------------------------------------------------------------
+// Xwayland: X11 windows join the same toplevel list as xdg-shell ones
+// -------------------------------------------------------------------------
+static void xwayland_surface_map(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, map);
+	struct wlr_xwayland_surface *xsurface = toplevel->xwayland_surface;
+	struct tinywl_server *server = toplevel->server;
+
+	toplevel->surface_tree = wlr_scene_subsurface_tree_create(toplevel->scene_tree, xsurface->surface);
+
+	if (xsurface->override_redirect) {
+		// Menus and tooltips place themselves and stay out of window management
+		toplevel->scene_tree->node.data = NULL;
+		wlr_scene_node_reparent(&toplevel->scene_tree->node, server->layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP]);
+		wlr_scene_node_set_position(&toplevel->scene_tree->node, xsurface->x, xsurface->y);
+		if (wlr_xwayland_surface_override_redirect_wants_focus(xsurface)) {
+			struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(server->seat);
+			if (keyboard != NULL) {
+				wlr_seat_keyboard_notify_enter(server->seat, xsurface->surface,
+					keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+			}
+		}
+		return;
+	}
+
+	// All X11 clients share Xwayland's connection, and _NET_WM_PID is only
+	// what the client claims. Good enough to time a launch, not to renice
+	// or move a process, so pid stays 0 and X11 windows are not scheduled.
+	launch_match_token(toplevel, xsurface->startup_id);
+	if (toplevel->launch_ns == 0 && xsurface->pid > 0) {
+		launch_match_pid(toplevel, xsurface->pid);
+	}
+
+	// No initial configure to carry a restored layout, so size it here
+	if (session_restore_toplevel(toplevel)) {
+		if (toplevel->docked_side != 0) {
+			toplevel_set_size(toplevel, TINYWL_DOCKED_WIDTH, TINYWL_DOCKED_HEIGHT);
+		} else {
+			struct wlr_box usable;
+			server_usable_box(server, &usable);
+			toplevel_set_size(toplevel, usable.width, usable.height);
+		}
+		toplevel_set_maximized(toplevel, toplevel->maximized);
+	}
+	toplevel_map(toplevel);
+}
+
+static void xwayland_surface_unmap(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, unmap);
+	if (!toplevel->xwayland_surface->override_redirect) {
+		toplevel_unmap(toplevel);
+	}
+	wlr_scene_node_destroy(&toplevel->surface_tree->node);
+	toplevel->surface_tree = NULL;
+}
+
+static void xwayland_surface_commit(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, commit);
+	toplevel->commits++;
+	record_commit(toplevel);
+	thumb_damage_add(toplevel);
+	if (toplevel->first_commit_ns == 0) {
+		toplevel->first_commit_ns = monotonic_ns();
+	}
+	if (toplevel->docked_side != 0) {
+		update_thumbnail(toplevel);
+		dock_preview_update(toplevel);
+	}
+	switcher_preview_update(toplevel);
+}
+
+static void xwayland_surface_associate(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, associate);
+	struct wlr_surface *surface = toplevel->xwayland_surface->surface;
+
+	toplevel->map.notify = xwayland_surface_map;
+	wl_signal_add(&surface->events.map, &toplevel->map);
+	toplevel->unmap.notify = xwayland_surface_unmap;
+	wl_signal_add(&surface->events.unmap, &toplevel->unmap);
+	toplevel->commit.notify = xwayland_surface_commit;
+	wl_signal_add(&surface->events.commit, &toplevel->commit);
+}
+
+static void xwayland_surface_dissociate(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, dissociate);
+	wl_list_remove(&toplevel->map.link);
+	wl_list_remove(&toplevel->unmap.link);
+	wl_list_remove(&toplevel->commit.link);
+}
+
+static void xwayland_surface_request_configure(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_configure);
+	struct wlr_xwayland_surface_configure_event *event = data;
+	struct wlr_xwayland_surface *xsurface = toplevel->xwayland_surface;
+
+	if (xsurface->surface == NULL || !xsurface->surface->mapped || xsurface->override_redirect) {
+		// Not ours to manage yet: grant whatever it asks for
+		wlr_xwayland_surface_configure(xsurface, event->x, event->y, event->width, event->height);
+		return;
+	}
+	if (toplevel->docked_side != 0 || toplevel->maximized || toplevel_is_fullscreen(toplevel)) {
+		// Re-send the current geometry so the client is not left waiting
+		wlr_xwayland_surface_configure(xsurface, toplevel->scene_tree->node.x,
+			toplevel->scene_tree->node.y, xsurface->width, xsurface->height);
+		return;
+	}
+	toplevel_set_size(toplevel, event->width, event->height);
+}
+
+static void xwayland_surface_set_geometry(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, set_geometry);
+	struct wlr_xwayland_surface *xsurface = toplevel->xwayland_surface;
+	// Override-redirect windows move themselves
+	if (xsurface->override_redirect && toplevel->surface_tree != NULL) {
+		wlr_scene_node_set_position(&toplevel->scene_tree->node, xsurface->x, xsurface->y);
+	}
+}
+
+static void xwayland_surface_request_activate(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_activate);
+	if (toplevel->surface_tree != NULL && !toplevel->xwayland_surface->override_redirect) {
+		focus_toplevel(toplevel);
+	}
+}
+
+static void xwayland_surface_request_resize(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_resize);
+	struct wlr_xwayland_resize_event *event = data;
+	if (toplevel->surface_tree == NULL || toplevel_is_fullscreen(toplevel)) {
+		return;
+	}
+	begin_interactive(toplevel, TINYWL_CURSOR_RESIZE, event->edges);
+}
+
+static void xwayland_surface_request_move(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_move);
+	if (toplevel->surface_tree == NULL || toplevel_is_fullscreen(toplevel)) {
+		return;
+	}
+	begin_interactive(toplevel, TINYWL_CURSOR_MOVE, 0);
+}
+
+static void xwayland_surface_request_maximize(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_maximize);
+	struct wlr_xwayland_surface *xsurface = toplevel->xwayland_surface;
+	toplevel_request_maximize(toplevel, xsurface->maximized_horz && xsurface->maximized_vert);
+}
+
+static void xwayland_surface_request_fullscreen(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, request_fullscreen);
+	toplevel_request_fullscreen(toplevel, toplevel->xwayland_surface->fullscreen);
+}
+
+static void xwayland_surface_destroy(struct wl_listener *listener, void *data) {
+	struct tinywl_toplevel *toplevel = wl_container_of(listener, toplevel, destroy);
+	thumb_destroy(toplevel);
+	session_release_toplevel(toplevel);
+	wl_list_remove(&toplevel->associate.link);
+	wl_list_remove(&toplevel->dissociate.link);
+	wl_list_remove(&toplevel->destroy.link);
+	wl_list_remove(&toplevel->request_configure.link);
+	wl_list_remove(&toplevel->request_activate.link);
+	wl_list_remove(&toplevel->set_geometry.link);
+	wl_list_remove(&toplevel->request_move.link);
+	wl_list_remove(&toplevel->request_resize.link);
+	wl_list_remove(&toplevel->request_maximize.link);
+	wl_list_remove(&toplevel->request_fullscreen.link);
+	wlr_scene_node_destroy(&toplevel->scene_tree->node);
+	free(toplevel);
+}
+
+static void server_new_xwayland_surface(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, new_xwayland_surface);
+	struct wlr_xwayland_surface *xsurface = data;
+
+	struct tinywl_toplevel *toplevel = calloc(1, sizeof(*toplevel));
+	toplevel->server = server;
+	toplevel->xwayland_surface = xsurface;
+	toplevel->session_slot = -1;
+	wl_list_init(&toplevel->popups);
+	wl_list_init(&toplevel->mru_link);
+	wl_list_init(&toplevel->txn_link);
+	toplevel->scene_tree = wlr_scene_tree_create(server->toplevel_layer);
+	toplevel->scene_tree->node.data = toplevel;
+	xsurface->data = toplevel;
+
+	toplevel->associate.notify = xwayland_surface_associate;
+	wl_signal_add(&xsurface->events.associate, &toplevel->associate);
+	toplevel->dissociate.notify = xwayland_surface_dissociate;
+	wl_signal_add(&xsurface->events.dissociate, &toplevel->dissociate);
+	toplevel->destroy.notify = xwayland_surface_destroy;
+	wl_signal_add(&xsurface->events.destroy, &toplevel->destroy);
+	toplevel->request_configure.notify = xwayland_surface_request_configure;
+	wl_signal_add(&xsurface->events.request_configure, &toplevel->request_configure);
+	toplevel->request_activate.notify = xwayland_surface_request_activate;
+	wl_signal_add(&xsurface->events.request_activate, &toplevel->request_activate);
+	toplevel->set_geometry.notify = xwayland_surface_set_geometry;
+	wl_signal_add(&xsurface->events.set_geometry, &toplevel->set_geometry);
+	toplevel->request_move.notify = xwayland_surface_request_move;
+	wl_signal_add(&xsurface->events.request_move, &toplevel->request_move);
+	toplevel->request_resize.notify = xwayland_surface_request_resize;
+	wl_signal_add(&xsurface->events.request_resize, &toplevel->request_resize);
+	toplevel->request_maximize.notify = xwayland_surface_request_maximize;
+	wl_signal_add(&xsurface->events.request_maximize, &toplevel->request_maximize);
+	toplevel->request_fullscreen.notify = xwayland_surface_request_fullscreen;
+	wl_signal_add(&xsurface->events.request_fullscreen, &toplevel->request_fullscreen);
+}
+
+static void server_xwayland_ready(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server = wl_container_of(listener, server, xwayland_ready);
+	wlr_xwayland_set_seat(server->xwayland, server->seat);
+	wlr_log(WLR_INFO, "Xwayland is up on DISPLAY=%s", server->xwayland->display_name);
+}
+#endif
+
+static void print_usage(FILE *f, const char *argv0) {
+	fprintf(f, "Usage: %s [-s startup command] [-n startup command is not the shell] [-r readiness fd] "
+		"[-i idle timeout seconds, 0 = never] [-d power off outputs when idle] "
+		"[-w wallpaper image] [-S output scale] [-E embedded shell bundle] "
+		"[-R record to file]\n", argv0);
+}
+
 int main(int argc, char *argv[]) {
+	struct tinywl_server server = {0};
+	server.startup[TINYWL_PHASE_PROCESS_START] = monotonic_ns();
+	server.runtime_fd = -1;
+	server.ready_fd = -1;
+	server.startup_watch_fd = -1;
+	server.ipc_watch_fd = -1;
+	server.thumb_done_fd = -1;
+	server.wallpaper_done_fd = -1;
+	server.sched_cgroup_fd = -1;
+	server.idle_timeout_ms = TINYWL_IDLE_TIMEOUT_MS;
+
 	wlr_log_init(WLR_DEBUG, NULL);
 	char *startup_cmd = NULL;
+	bool startup_is_shell = true;
+	const char *record_path = NULL;
 	int c;
-	while ((c = getopt(argc, argv, "s:h")) != -1) {
+	while ((c = getopt(argc, argv, "s:nr:i:dw:S:E:R:h")) != -1) {
 		switch (c) {
 		case 's':
 			startup_cmd = optarg;
 			break;
+		case 'n':
+			// e.g. a benchmark client, whose windows must be treated like any app's
+			startup_is_shell = false;
+			break;
+		case 'r': {
+			char *end;
+			errno = 0;
+			long fd = strtol(optarg, &end, 10);
+			// Only a descriptor we were actually handed, open right now
+			if (errno != 0 || end == optarg || *end != '\0' || fd < 0 || fd > INT_MAX ||
+					fcntl((int)fd, F_GETFD) < 0) {
+				fprintf(stderr, "-r wants an open file descriptor\n");
+				print_usage(stderr, argv[0]);
+				return 1;
+			}
+			server.ready_fd = (int)fd;
+			fcntl(server.ready_fd, F_SETFD, FD_CLOEXEC);
+			break;
+		}
+		case 'i': {
+			char *end;
+			errno = 0;
+			long seconds = strtol(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != '\0' ||
+					seconds < 0 || seconds > INT_MAX / 1000) {
+				fprintf(stderr, "-i wants whole seconds from 0 to %d\n", INT_MAX / 1000);
+				print_usage(stderr, argv[0]);
+				return 1;
+			}
+			server.idle_timeout_ms = (int)seconds * 1000;
+			break;
+		}
+		case 'd':
+			server.idle_outputs_off = true;
+			break;
+		case 'w':
+			free(server.wallpaper_path);
+			server.wallpaper_path = strdup(optarg);
+			break;
+		case 'S': {
+			char *end;
+			errno = 0;
+			float scale = strtof(optarg, &end);
+			// Written this way round so NaN fails too
+			if (errno != 0 || end == optarg || *end != '\0' ||
+					!(scale >= TINYWL_SCALE_MIN && scale <= TINYWL_SCALE_MAX)) {
+				fprintf(stderr, "-S wants a scale from %.1f to %.1f\n", TINYWL_SCALE_MIN, TINYWL_SCALE_MAX);
+				print_usage(stderr, argv[0]);
+				return 1;
+			}
+			server.output_scale = scale;
+			break;
+		}
+		case 'R':
+			record_path = optarg;
+			break;
+		case 'E':
+#if TINYWL_HAS_FLUTTER
+			free(server.flutter.bundle);
+			server.flutter.bundle = strdup(optarg);
+			break;
+#else
+			fprintf(stderr, "-E needs tinywl built with FLUTTER_ENGINE set\n");
+			return 1;
+#endif
 		default:
-			printf("Usage: %s [-s startup command]\n", argv[0]);
+			print_usage(stdout, argv[0]);
 			return 0;
 		}
 	}
+	FILE *record_file = NULL;
+	if (record_path != NULL) {
+		// Every key typed goes in, passwords included: ours alone, and never
+		// written through a link someone else planted
+		int record_fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+		record_file = record_fd >= 0 ? fdopen(record_fd, "w") : NULL;
+		if (record_file == NULL) {
+			fprintf(stderr, "Failed to open recording %s: %s\n", record_path, strerror(errno));
+			if (record_fd >= 0) close(record_fd);
+			return 1;
+		}
+	}
+	// With a shell, "ready" means its first frame is up; otherwise our own
+	server.startup_ready_phase = startup_cmd && startup_is_shell ?
+		TINYWL_PHASE_SHELL_FIRST_FRAME : TINYWL_PHASE_FIRST_OUTPUT_COMMIT;
+#if TINYWL_HAS_FLUTTER
+	if (server.flutter.bundle != NULL) {
+		// The shell is the embedded one: -s only starts an ordinary app
+		startup_is_shell = false;
+		server.startup_ready_phase = TINYWL_PHASE_SHELL_FIRST_FRAME;
+	}
+#endif
 
-	struct tinywl_server server = {0};
 	server.wl_display = wl_display_create();
 	server.backend = wlr_backend_autocreate(wl_display_get_event_loop(server.wl_display), NULL);
 	if (server.backend == NULL) {
@@ -1028,11 +6736,17 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	wlr_compositor_create(server.wl_display, 5, server.renderer);
+	server.compositor = wlr_compositor_create(server.wl_display, 5, server.renderer);
 	wlr_subcompositor_create(server.wl_display);
 	wlr_data_device_manager_create(server.wl_display);
+	// The scene sends each surface the scale of its outputs; with these,
+	// clients draw at exactly that scale instead of rounding up to 2x
+	wlr_fractional_scale_manager_v1_create(server.wl_display, 1);
+	wlr_viewporter_create(server.wl_display);
 
 	server.output_layout = wlr_output_layout_create(server.wl_display);
+	// Logical output sizes for clients that lay out by them
+	wlr_xdg_output_manager_v1_create(server.wl_display, server.output_layout);
 	
 	server.layout_change.notify = server_layout_change;
 	wl_signal_add(&server.output_layout->events.change, &server.layout_change);
@@ -1043,14 +6757,51 @@ int main(int argc, char *argv[]) {
 
 	server.scene = wlr_scene_create();
 	server.scene_layout = wlr_scene_attach_output_layout(server.scene, server.output_layout);
+	server.wallpaper_layer = wlr_scene_tree_create(&server.scene->tree);
+	wl_list_init(&server.wallpapers);
+	server.layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND] = wlr_scene_tree_create(&server.scene->tree);
+	server.layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM] = wlr_scene_tree_create(&server.scene->tree);
+	server.toplevel_layer = wlr_scene_tree_create(&server.scene->tree);
+	server.animation_layer = wlr_scene_tree_create(&server.scene->tree);
+	wl_list_init(&server.animations);
+	wl_list_init(&server.transaction);
+	server.layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP] = wlr_scene_tree_create(&server.scene->tree);
+	server.layers[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY] = wlr_scene_tree_create(&server.scene->tree);
+	server.switcher_layer = wlr_scene_tree_create(&server.scene->tree);
+	server.hud_layer = wlr_scene_tree_create(&server.scene->tree);
 
 	wl_list_init(&server.toplevels);
+	wl_list_init(&server.focus_history);
+	wl_list_init(&server.sched_procs);
 	server.xdg_shell = wlr_xdg_shell_create(server.wl_display, 3);
 	server.new_xdg_toplevel.notify = server_new_xdg_toplevel;
 	wl_signal_add(&server.xdg_shell->events.new_toplevel, &server.new_xdg_toplevel);
 	server.new_xdg_popup.notify = server_new_xdg_popup;
 	wl_signal_add(&server.xdg_shell->events.new_popup, &server.new_xdg_popup);
 
+	wl_list_init(&server.layer_surfaces);
+	server.layer_shell = wlr_layer_shell_v1_create(server.wl_display, 4);
+	server.new_layer_surface.notify = server_new_layer_surface;
+	wl_signal_add(&server.layer_shell->events.new_surface, &server.new_layer_surface);
+
+#if WLR_HAS_XWAYLAND
+	// Lazy: the X11 socket exists from the start, but Xwayland itself is only
+	// launched when the first X11 client connects to it
+	server.xwayland = wlr_xwayland_create(server.wl_display, server.compositor, true);
+	if (server.xwayland != NULL) {
+		server.xwayland_ready.notify = server_xwayland_ready;
+		wl_signal_add(&server.xwayland->events.ready, &server.xwayland_ready);
+		server.new_xwayland_surface.notify = server_new_xwayland_surface;
+		wl_signal_add(&server.xwayland->events.new_surface, &server.new_xwayland_surface);
+		setenv("DISPLAY", server.xwayland->display_name, true);
+	} else {
+		wlr_log(WLR_ERROR, "Failed to set up Xwayland, X11 apps will not run");
+		unsetenv("DISPLAY");
+	}
+#else
+	unsetenv("DISPLAY");
+#endif
+
 	server.cursor = wlr_cursor_create();
 	wlr_cursor_attach_output_layout(server.cursor, server.output_layout);
 	server.cursor_mgr = wlr_xcursor_manager_create(NULL, 24);
@@ -1082,30 +6833,115 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	if (!wlr_backend_start(server.backend)) {
+	if (!runtime_dir_init(&server, socket)) {
 		wlr_backend_destroy(server.backend);
 		wl_display_destroy(server.wl_display);
 		return 1;
 	}
 
-	server.dock_ipc_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.wl_display), handle_dock_ipc, &server);
-	wl_event_source_timer_update(server.dock_ipc_timer, 100);
+	wl_list_init(&server.launches);
+	wl_list_init(&server.launch_stats);
+	wl_array_init(&server.children);
+	server.sigchld_source = wl_event_loop_add_signal(wl_display_get_event_loop(server.wl_display),
+		SIGCHLD, handle_sigchld, &server);
+	server.xdg_activation = wlr_xdg_activation_v1_create(server.wl_display);
+	server.request_activate.notify = server_request_activate;
+	wl_signal_add(&server.xdg_activation->events.request_activate, &server.request_activate);
+
+	server.idle_notifier = wlr_idle_notifier_v1_create(server.wl_display);
+	server.virtual_pointer = wlr_virtual_pointer_manager_v1_create(server.wl_display);
+	server.new_virtual_pointer.notify = server_new_virtual_pointer;
+	wl_signal_add(&server.virtual_pointer->events.new_virtual_pointer, &server.new_virtual_pointer);
+	server.virtual_keyboard = wlr_virtual_keyboard_manager_v1_create(server.wl_display);
+	server.new_virtual_keyboard.notify = server_new_virtual_keyboard;
+	wl_signal_add(&server.virtual_keyboard->events.new_virtual_keyboard, &server.new_virtual_keyboard);
 
-	system("rm -f /tmp/thumb_*.rgba /tmp/thumb_*.tmp /tmp/dock_action.txt /tmp/dock_action_processing.txt"); 
+	server.idle_inhibit = wlr_idle_inhibit_v1_create(server.wl_display);
+	server.new_idle_inhibitor.notify = server_new_idle_inhibitor;
+	wl_signal_add(&server.idle_inhibit->events.new_inhibitor, &server.new_idle_inhibitor);
+
+	server.client_created.notify = server_client_created;
+	wl_display_add_client_created_listener(server.wl_display, &server.client_created);
+
+	session_init(&server, socket);
 	update_workspace_state(&server); 
+	sched_init(&server);
 
+	// Start the shell before the backend so its process startup overlaps
+	// with output bring-up. It cannot talk to us until wl_display_run().
 	setenv("WAYLAND_DISPLAY", socket, true);
-	if (startup_cmd) {
-		if (fork() == 0) {
-			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, (void *)NULL);
-		}
+	if (startup_cmd && startup_is_shell) {
+		startup_watch_init(&server);
+		server.shell_pid = spawn_command(&server, startup_cmd);
+	} else if (startup_cmd) {
+		spawn_command(&server, startup_cmd);
+		server.shell_pid = -1;
+	}
+
+	if (!wlr_backend_start(server.backend)) {
+		wlr_backend_destroy(server.backend);
+		wl_display_destroy(server.wl_display);
+		return 1;
+	}
+	startup_mark(&server, TINYWL_PHASE_BACKEND_START);
+	// After the backend, so the header has the output layout
+	if (record_file != NULL) {
+		record_start(&server, record_file, record_path);
+	}
+#if TINYWL_HAS_FLUTTER
+	// After the backend, so the first metrics already know the outputs
+	if (server.flutter.bundle != NULL && !flutter_start(&server)) {
+		wlr_log(WLR_ERROR, "Running without the embedded shell");
+		server.startup_ready_phase = startup_cmd && startup_is_shell ?
+			TINYWL_PHASE_SHELL_FIRST_FRAME : TINYWL_PHASE_FIRST_OUTPUT_COMMIT;
+	}
+#endif
+
+	server.dock_ipc_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.wl_display), handle_dock_ipc, &server);
+	bool ipc_watched = false;
+#if TINYWL_HAS_FLUTTER
+	// The embedded shell needs no file polled for it; the readiness check
+	// the timer also makes only matters for a -s shell, which there isn't
+	ipc_watched = server.flutter.engine != NULL && ipc_watch_init(&server);
+#endif
+	if (!ipc_watched) {
+		wl_event_source_timer_update(server.dock_ipc_timer, 100);
+	}
+	thumb_workers_init(&server);
+	wl_event_loop_add_idle(wl_display_get_event_loop(server.wl_display), handle_wallpaper_load, &server);
+
+	server.idle_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.wl_display), handle_idle_timer, &server);
+	server.idle_frame_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.wl_display), handle_idle_frame_timer, &server);
+	server.transaction_timer = wl_event_loop_add_timer(wl_display_get_event_loop(server.wl_display),
+		handle_transaction_timeout, &server);
+	server.last_activity_ns = monotonic_ns();
+	if (server.idle_timeout_ms > 0) {
+		wl_event_source_timer_update(server.idle_timer, server.idle_timeout_ms);
 	}
+
 	wlr_log(WLR_INFO, "Running Wayland compositor on WAYLAND_DISPLAY=%s", socket);
 	wl_display_run(server.wl_display);
 
+	// Clients going away on shutdown must not erase their saved layout
+	server.session_closing = true;
 	wl_display_destroy_clients(server.wl_display);
+#if TINYWL_HAS_FLUTTER
+	flutter_finish(&server);
+#endif
+	record_finish(&server);
+	thumb_workers_finish(&server);
+	wallpaper_finish(&server);
+	sched_finish(&server);
+#if WLR_HAS_XWAYLAND
+	if (server.xwayland != NULL) {
+		wl_list_remove(&server.xwayland_ready.link);
+		wl_list_remove(&server.new_xwayland_surface.link);
+		wlr_xwayland_destroy(server.xwayland);
+	}
+#endif
 	wl_list_remove(&server.new_xdg_toplevel.link);
 	wl_list_remove(&server.new_xdg_popup.link);
+	wl_list_remove(&server.new_layer_surface.link);
 	wl_list_remove(&server.cursor_motion.link);
 	wl_list_remove(&server.cursor_motion_absolute.link);
 	wl_list_remove(&server.cursor_button.link);
@@ -1116,13 +6952,54 @@ int main(int argc, char *argv[]) {
 	wl_list_remove(&server.request_set_selection.link);
 	wl_list_remove(&server.new_output.link);
 	wl_list_remove(&server.layout_change.link); 
+	wl_list_remove(&server.client_created.link);
+	wl_list_remove(&server.request_activate.link);
+	wl_list_remove(&server.new_idle_inhibitor.link);
+	wl_list_remove(&server.new_virtual_pointer.link);
+	wl_list_remove(&server.new_virtual_keyboard.link);
+	wl_event_source_remove(server.idle_timer);
+	if (server.hud_timer != NULL) {
+		wl_event_source_remove(server.hud_timer);
+		server.hud_timer = NULL;
+	}
+	wl_event_source_remove(server.idle_frame_timer);
+	wl_event_source_remove(server.transaction_timer);
+	startup_watch_finish(&server);
+	ipc_watch_finish(&server);
+	wl_event_source_remove(server.sigchld_source);
+	struct tinywl_launch *launch, *launch_tmp;
+	wl_list_for_each_safe(launch, launch_tmp, &server.launches, link) {
+		free(launch);
+	}
+	struct tinywl_launch_stats *stats, *stats_tmp;
+	wl_list_for_each_safe(stats, stats_tmp, &server.launch_stats, link) {
+		free(stats);
+	}
+	wl_array_release(&server.children);
+	free(server.json.data);
+	free(server.state_published.data);
 
+	// Outputs outlive the scene; drop their nodes in it first
+	hud_set_enabled(&server, false);
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server.outputs, link) {
+		if (output->wallpaper != NULL) {
+			wlr_scene_node_destroy(&output->wallpaper->node);
+			output->wallpaper = NULL;
+		}
+	}
 	wlr_scene_node_destroy(&server.scene->tree.node);
+	if (server.wallpaper_source != NULL) {
+		g_object_unref(server.wallpaper_source);
+	}
+	free(server.wallpaper_path);
 	wlr_xcursor_manager_destroy(server.cursor_mgr);
 	wlr_cursor_destroy(server.cursor);
 	wlr_allocator_destroy(server.allocator);
 	wlr_renderer_destroy(server.renderer);
 	wlr_backend_destroy(server.backend);
 	wl_display_destroy(server.wl_display);
+	session_finish(&server);
+	runtime_dir_finish(&server);
 	return 0;
 }
\ No newline at end of file
@@ -7,12 +7,16 @@ FLUTTER_HUD="/home/yamada/CODE/The-Workspaces/the_workspaces/build/linux/x64/rel
 export GDK_BACKEND=wayland
 
 # 3. Launch the compositor IN THE BACKGROUND
-./compositor/tinywl -s "$FLUTTER_HUD" &
+# It writes "READY" to fd 3 once the Flutter shell has drawn its first frame
+READY_FIFO=$(mktemp -u "${XDG_RUNTIME_DIR:-/tmp}/tinywl-ready.XXXXXX")
+mkfifo "$READY_FIFO"
+# --shell: start undecorated and fullscreen instead of as a normal window
+./compositor/tinywl -s "$FLUTTER_HUD --shell" -r 3 3>"$READY_FIFO" &
 TINYWL_PID=$!
 
-# 4. Wait for the wlroots window to initialize and gain focus
-# (Increased slightly to 2 seconds to ensure the window is fully mapped before we send the command)
-sleep 0.1
+# 4. Wait for the readiness signal (returns early if tinywl exits first)
+read -r _ < "$READY_FIFO"
+rm -f "$READY_FIFO"
 
 # 5. Tell KDE Plasma 6 to toggle fullscreen on the currently active window
 if command -v qdbus6 &> /dev/null; then
@@ -0,0 +1,72 @@
+import 'dart:convert';
+import 'dart:io';
+import 'package:flutter/foundation.dart';
+import 'package:flutter/services.dart';
+
+// File-based IPC with the tinywl compositor. Each compositor instance owns a
+// private directory (named after its Wayland socket) and advertises it to the
+// processes it starts through TINYWL_RUNTIME_DIR.
+class CompositorIpc {
+  static final String runtimeDir =
+      Platform.environment['TINYWL_RUNTIME_DIR'] ?? '/tmp';
+
+  static String get statePath => '$runtimeDir/workspace_state.json';
+
+  // Written once the compositor has a pyramid level for a THUMB request:
+  // an 8-byte header (width, height as little-endian uint32) then BGRA pixels.
+  static String thumbnailPath(String windowId, int width, int height) =>
+      '$runtimeDir/thumb_${windowId}_${width}x$height.rgba';
+
+  // Docked windows are drawn by the compositor into rects reserved with
+  // PREVIEW_RECT; THE_WORKSPACES_THUMBNAILS=1 falls back to THUMB files.
+  static final bool livePreviews =
+      Platform.environment['THE_WORKSPACES_THUMBNAILS'] != '1';
+
+  // Started by tinywl -E: the engine runs inside the compositor, which
+  // pushes workspace_state.json on tinywl/state and takes commands on
+  // tinywl/action instead of the files.
+  static bool embedded = false;
+  static const _actions =
+      BasicMessageChannel<String>('tinywl/action', StringCodec());
+  static const _states =
+      BasicMessageChannel<String>('tinywl/state', StringCodec());
+
+  // The decoded state, updated as the compositor sends it (embedded only)
+  static final ValueNotifier<Map<String, dynamic>?> state = ValueNotifier(null);
+
+  static void startEmbedded() {
+    embedded = true;
+    _states.setMessageHandler((message) async {
+      try {
+        if (message != null) state.value = jsonDecode(message);
+      } catch (e) {
+        debugPrint('Bad state from the compositor: $e');
+      }
+      return null;
+    });
+    // Anything published before we listened is resent
+    _actions.send('STATE');
+  }
+
+  static int _sequence = 0;
+
+  // One file per command in dock_actions/, written under a dot name then
+  // renamed, so the compositor never reads a partial command and no command
+  // replaces another. Names sort by send time, the order they are run in.
+  static void sendAction(String action, String id) {
+    if (embedded) {
+      _actions.send('$action $id');
+      return;
+    }
+    try {
+      final name =
+          '${DateTime.now().microsecondsSinceEpoch.toString().padLeft(20, '0')}'
+          '-$pid-${(_sequence++).toString().padLeft(10, '0')}';
+      final tmpFile = File('$runtimeDir/dock_actions/.$name');
+      tmpFile.writeAsStringSync('$action $id\n');
+      tmpFile.renameSync('$runtimeDir/dock_actions/$name');
+    } catch (e) {
+      debugPrint('Failed to send dock action: $e');
+    }
+  }
+}
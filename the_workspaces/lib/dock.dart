@@ -5,6 +5,7 @@ import 'package:flutter/material.dart';
 import 'package:flutter/gestures.dart';
 import 'package:flutter_svg/flutter_svg.dart';
 import 'app_info.dart';
+import 'compositor_ipc.dart';
 
 class DockPanel extends StatefulWidget {
   const DockPanel({super.key});
@@ -37,6 +38,7 @@ class _DockPanelState extends State<DockPanel> {
   @override
   void dispose() {
     _timer?.cancel();
+    CompositorIpc.state.removeListener(_onEmbeddedState);
     _scrollController.dispose();
     super.dispose();
   }
@@ -81,30 +83,19 @@ class _DockPanelState extends State<DockPanel> {
 
   // --- IPC: Watch the C Compositor for active windows ---
   void _startWatchingCompositor() {
+    if (CompositorIpc.embedded) {
+      CompositorIpc.state.addListener(_onEmbeddedState);
+      _onEmbeddedState();
+      return;
+    }
     _timer = Timer.periodic(const Duration(milliseconds: 250), (_) async {
       try {
-        final file = File('/tmp/workspace_state.json');
+        final file = File(CompositorIpc.statePath);
         if (await file.exists()) {
           final content = await file.readAsString();
           if (content.isEmpty) return;
 
-          final decoded = jsonDecode(content);
-          final List<dynamic> activeData = decoded['active'] ?? [];
-
-          List<Map<String, String>> newWindows = activeData
-              .map(
-                (e) => {
-                  'id': e['id'].toString(),
-                  'name': e['name'].toString(),
-                  'title': e['title'].toString(),
-                  'maximized': (e['maximized'] ?? false).toString(),
-                },
-              )
-              .toList();
-
-          if (newWindows.toString() != activeWindows.toString()) {
-            setState(() => activeWindows = newWindows);
-          }
+          _applyState(jsonDecode(content));
         }
       } catch (e) {
         // Suppress read errors
@@ -112,18 +103,33 @@ class _DockPanelState extends State<DockPanel> {
     });
   }
 
+  void _onEmbeddedState() {
+    final decoded = CompositorIpc.state.value;
+    if (decoded != null) _applyState(decoded);
+  }
+
+  void _applyState(dynamic decoded) {
+    final List<dynamic> activeData = decoded['active'] ?? [];
+
+    List<Map<String, String>> newWindows = activeData
+        .map(
+          (e) => {
+            'id': e['id'].toString(),
+            'name': e['name'].toString(),
+            'title': e['title'].toString(),
+            'maximized': (e['maximized'] ?? false).toString(),
+          },
+        )
+        .toList();
+
+    if (newWindows.toString() != activeWindows.toString()) {
+      setState(() => activeWindows = newWindows);
+    }
+  }
+
   // --- Trigger IPC action back to Compositor ATOMICALLY ---
   void _sendDockAction(String action, String id) {
-    try {
-      // Write to temp file then rename to avoid race conditions with C reader
-      final tmpFile = File(
-        '/tmp/dock_action_${DateTime.now().millisecondsSinceEpoch}.tmp',
-      );
-      tmpFile.writeAsStringSync('$action $id\n');
-      tmpFile.renameSync('/tmp/dock_action.txt');
-    } catch (e) {
-      debugPrint('Failed to send dock action: $e');
-    }
+    CompositorIpc.sendAction(action, id);
   }
 
   // --- Load Installed Apps ---
@@ -292,17 +298,10 @@ class _DockPanelState extends State<DockPanel> {
     return _iconCache[iconName]!;
   }
 
+  // The compositor spawns the app itself so it can match the launch to the
+  // window that appears and time it.
   void _launchApp(String execCommand) {
-    Process.start(
-      'sh',
-      ['-c', execCommand],
-      environment: {
-        'DISPLAY': '',
-        'QT_QPA_PLATFORM': 'wayland',
-        'GDK_BACKEND': 'wayland',
-      },
-      includeParentEnvironment: true,
-    );
+    CompositorIpc.sendAction('LAUNCH', execCommand);
   }
 
   @override
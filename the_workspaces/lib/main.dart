@@ -3,28 +3,41 @@ import 'package:flutter/material.dart';
 import 'package:flutter/services.dart';
 import 'package:window_manager/window_manager.dart';
 
+import 'compositor_ipc.dart';
 import 'side_container.dart';
 import 'dock.dart';
 
-void main() async {
+void main(List<String> args) async {
   WidgetsFlutterBinding.ensureInitialized();
+
+  // Embedded in tinywl there is no toplevel window to manage
+  if (args.contains('--embedded')) {
+    CompositorIpc.startEmbedded();
+    runApp(const TheWorkspaceLauncher());
+    return;
+  }
   await windowManager.ensureInitialized();
 
-  WindowOptions windowOptions = const WindowOptions(
-    center: true,
-    backgroundColor: Colors.transparent,
-    skipTaskbar: true,
-    titleBarStyle: TitleBarStyle.hidden,
-    fullScreen: true,
-  );
+  // In shell mode the runner already created the window undecorated and
+  // fullscreen; reconfiguring it here would cost a relayout.
+  final bool shellMode = Platform.environment['THE_WORKSPACES_SHELL'] == '1';
+  if (!shellMode) {
+    WindowOptions windowOptions = const WindowOptions(
+      center: true,
+      backgroundColor: Colors.transparent,
+      skipTaskbar: true,
+      titleBarStyle: TitleBarStyle.hidden,
+      fullScreen: true,
+    );
 
-  windowManager.waitUntilReadyToShow(windowOptions, () async {
-    await windowManager.setFullScreen(
-      true,
-    ); // Explicitly request Wayland Fullscreen
-    await windowManager.show();
-    await windowManager.focus();
-  });
+    windowManager.waitUntilReadyToShow(windowOptions, () async {
+      await windowManager.setFullScreen(
+        true,
+      ); // Explicitly request Wayland Fullscreen
+      await windowManager.show();
+      await windowManager.focus();
+    });
+  }
 
   runApp(const TheWorkspaceLauncher());
 }
@@ -43,58 +56,19 @@ class TheWorkspaceLauncher extends StatelessWidget {
   }
 }
 
-class WorkspaceDashboard extends StatefulWidget {
+// The compositor draws the wallpaper underneath us, so the dashboard stays
+// transparent apart from a tint and only repaints what it draws itself.
+class WorkspaceDashboard extends StatelessWidget {
   const WorkspaceDashboard({super.key});
 
-  @override
-  State<WorkspaceDashboard> createState() => _WorkspaceDashboardState();
-}
-
-class _WorkspaceDashboardState extends State<WorkspaceDashboard> {
-  String? systemWallpaperPath;
-
-  @override
-  void initState() {
-    super.initState();
-    _fetchKdeWallpaper();
-  }
-
-  Future<void> _fetchKdeWallpaper() async {
-    if (!Platform.isLinux) return;
-    try {
-      final home = Platform.environment['HOME'];
-      final file = File(
-        '$home/.config/plasma-org.kde.plasma.desktop-appletsrc',
-      );
-      if (await file.exists()) {
-        final lines = await file.readAsLines();
-        for (var line in lines.reversed) {
-          line = line.trim();
-          if (line.startsWith('Image=file://')) {
-            setState(() {
-              systemWallpaperPath = line.substring(13);
-            });
-            return;
-          } else if (line.startsWith('Image=/')) {
-            setState(() {
-              systemWallpaperPath = line.substring(6);
-            });
-            return;
-          }
-        }
-      }
-    } catch (e) {
-      debugPrint('Could not fetch KDE wallpaper: $e');
-    }
-  }
-
   @override
   Widget build(BuildContext context) {
     return Focus(
       autofocus: true,
       onKeyEvent: (node, event) {
         if (event is KeyDownEvent &&
-            event.logicalKey == LogicalKeyboardKey.escape) {
+            event.logicalKey == LogicalKeyboardKey.escape &&
+            !CompositorIpc.embedded) {
           windowManager.close();
           return KeyEventResult.handled;
         }
@@ -103,15 +77,7 @@ class _WorkspaceDashboardState extends State<WorkspaceDashboard> {
       child: Scaffold(
         backgroundColor: Colors.transparent,
         body: Container(
-          decoration: BoxDecoration(
-            color: const Color(0xFF1E1E2E).withOpacity(0.5),
-            image: systemWallpaperPath != null
-                ? DecorationImage(
-                    image: FileImage(File(systemWallpaperPath!)),
-                    fit: BoxFit.cover,
-                  )
-                : null,
-          ),
+          color: const Color(0xFF1E1E2E).withOpacity(0.5),
           child: const Stack(
             children: [
               SidePanel(
@@ -1,8 +1,10 @@
 import 'dart:io';
 import 'dart:convert';
 import 'dart:async';
+import 'dart:typed_data';
 import 'dart:ui' as ui;
 import 'package:flutter/material.dart';
+import 'compositor_ipc.dart';
 
 class SidePanel extends StatefulWidget {
   final Alignment alignment;
@@ -17,6 +19,7 @@ class SidePanel extends StatefulWidget {
 class _SidePanelState extends State<SidePanel> {
   bool isHovered = false;
   bool isWindowHovering = false; // From Compositor IPC
+  bool isIdle = false; // Compositor saw no input for a while
   List<Map<String, String>> containedWindows = [];
   Timer? _timer;
 
@@ -29,45 +32,26 @@ class _SidePanelState extends State<SidePanel> {
   @override
   void dispose() {
     _timer?.cancel();
+    CompositorIpc.state.removeListener(_onEmbeddedState);
     super.dispose();
   }
 
   // Polls the central Workspace JSON state (Fast 50ms polling for smooth hover)
   void _startWatchingCompositorState() {
-    bool isLeft = widget.alignment == Alignment.centerLeft;
-    int myHoverID = isLeft ? 1 : 2;
-
+    // Embedded, every change is pushed to us: no polling at all
+    if (CompositorIpc.embedded) {
+      CompositorIpc.state.addListener(_onEmbeddedState);
+      _onEmbeddedState();
+      return;
+    }
     _timer = Timer.periodic(const Duration(milliseconds: 50), (_) async {
       try {
-        final file = File('/tmp/workspace_state.json');
+        final file = File(CompositorIpc.statePath);
         if (await file.exists()) {
           final content = await file.readAsString();
           if (content.isEmpty) return; // Prevent parsing empty file mid-write
 
-          final decoded = jsonDecode(content);
-
-          // 1. Check if compositor is dragging a window over our edge
-          bool currentlyHovering = (decoded['hover'] == myHoverID);
-          if (currentlyHovering != isWindowHovering) {
-            setState(() => isWindowHovering = currentlyHovering);
-          }
-
-          // 2. Parse docked windows for this side
-          final List<dynamic> dockedData =
-              decoded[isLeft ? 'docked_left' : 'docked_right'] ?? [];
-          List<Map<String, String>> newWindows = dockedData
-              .map(
-                (e) => {
-                  'id': e['id'].toString(),
-                  'name': e['name'].toString(),
-                  'title': e['title'].toString(),
-                },
-              )
-              .toList();
-
-          if (newWindows.toString() != containedWindows.toString()) {
-            setState(() => containedWindows = newWindows);
-          }
+          _applyState(jsonDecode(content));
         }
       } catch (e) {
         // Suppress read/parse errors during C file writes safely
@@ -75,18 +59,48 @@ class _SidePanelState extends State<SidePanel> {
     });
   }
 
+  void _onEmbeddedState() {
+    final decoded = CompositorIpc.state.value;
+    if (decoded != null) _applyState(decoded);
+  }
+
+  void _applyState(dynamic decoded) {
+    bool isLeft = widget.alignment == Alignment.centerLeft;
+    int myHoverID = isLeft ? 1 : 2;
+
+    // 1. Check if compositor is dragging a window over our edge
+    bool currentlyHovering = (decoded['hover'] == myHoverID);
+    if (currentlyHovering != isWindowHovering) {
+      setState(() => isWindowHovering = currentlyHovering);
+    }
+    final bool idle = decoded['idle'] == true;
+    if (idle != isIdle) {
+      setState(() => isIdle = idle);
+    }
+
+    // 2. Parse docked windows for this side
+    final List<dynamic> dockedData =
+        decoded[isLeft ? 'docked_left' : 'docked_right'] ?? [];
+    List<Map<String, String>> newWindows = dockedData
+        .map(
+          (e) => {
+            'id': e['id'].toString(),
+            'name': e['name'].toString(),
+            'title': e['title'].toString(),
+            // The rect the compositor is drawing this window into
+            'preview': (e['preview'] as List?)?.join(' ') ?? '',
+          },
+        )
+        .toList();
+
+    if (newWindows.toString() != containedWindows.toString()) {
+      setState(() => containedWindows = newWindows);
+    }
+  }
+
   // Request to Undock OR to handle drags originating from the Flutter Dock UI
   void _sendDockAction(String action, String id) {
-    try {
-      // Atomic file writing
-      final tmpFile = File(
-        '/tmp/dock_action_${DateTime.now().millisecondsSinceEpoch}.tmp',
-      );
-      tmpFile.writeAsStringSync('$action $id\n');
-      tmpFile.renameSync('/tmp/dock_action.txt');
-    } catch (e) {
-      debugPrint('Failed to send dock action: $e');
-    }
+    CompositorIpc.sendAction(action, id);
   }
 
   @override
@@ -216,12 +230,42 @@ class _SidePanelState extends State<SidePanel> {
   }
 
   Widget _buildListItem(Map win) {
+    return Padding(
+      padding: const EdgeInsets.only(bottom: 20.0),
+      child: Draggable<Map>(
+        data: win,
+        feedback: Material(
+          color:
+              Colors.transparent, // Prevents yellow text artifacts during drag
+          child: Opacity(
+            opacity: 0.85,
+            child: _buildCard(win, live: false), // Show the card floating under the cursor
+          ),
+        ),
+        childWhenDragging: Opacity(
+          opacity: 0.3, // Leave a faded ghost in the list while dragging
+          child: _buildCard(win, live: false),
+        ),
+        onDragEnd: (details) {
+          // If the card is dropped anywhere in the center workspace (not accepted by a target)
+          if (!details.wasAccepted) {
+            _sendDockAction('UNDOCK', win['id']!);
+          }
+        },
+        child: _buildCard(win, live: true), // Standard appearance when resting
+      ),
+    );
+  }
+
+  // Only the resting card reserves a rect for the compositor to draw into;
+  // its preview can't follow a drag or fade with the ghost
+  Widget _buildCard(Map win, {required bool live}) {
     String title = win['title'] ?? '';
     String className = win['name'] ?? 'Unknown App';
     String displayText = title.isEmpty ? className : title;
 
     // Define the visual card
-    Widget card = Container(
+    return Container(
       width: 290,
       height: 250, // 200px for video + 50px for footer
       decoration: BoxDecoration(
@@ -246,7 +290,14 @@ class _SidePanelState extends State<SidePanel> {
               borderRadius: const BorderRadius.vertical(
                 top: Radius.circular(12),
               ),
-              child: WindowThumbnail(windowId: win['id']!),
+              child: !live
+                  ? const _PreviewPlaceholder()
+                  : CompositorIpc.livePreviews
+                  ? WindowPreview(
+                      windowId: win['id']!,
+                      confirmedRect: win['preview'] ?? '',
+                    )
+                  : WindowThumbnail(windowId: win['id']!, paused: isIdle),
             ),
           ),
 
@@ -287,41 +338,151 @@ class _SidePanelState extends State<SidePanel> {
         ],
       ),
     );
+  }
+}
 
-    // Make the entire card Draggable to undock
-    return Padding(
-      padding: const EdgeInsets.only(bottom: 20.0),
-      child: Draggable<Map>(
-        data: win,
-        feedback: Material(
-          color:
-              Colors.transparent, // Prevents yellow text artifacts during drag
-          child: Opacity(
-            opacity: 0.85,
-            child: card, // Show the card floating under the cursor
-          ),
-        ),
-        childWhenDragging: Opacity(
-          opacity: 0.3, // Leave a faded ghost in the list while dragging
-          child: card,
-        ),
-        onDragEnd: (details) {
-          // If the card is dropped anywhere in the center workspace (not accepted by a target)
-          if (!details.wasAccepted) {
-            _sendDockAction('UNDOCK', win['id']!);
-          }
-        },
-        child: card, // Standard appearance when resting
+class _PreviewPlaceholder extends StatelessWidget {
+  const _PreviewPlaceholder();
+
+  @override
+  Widget build(BuildContext context) {
+    return Container(
+      color: Colors.black45,
+      child: const Center(
+        child: CircularProgressIndicator(color: Colors.white24, strokeWidth: 2),
       ),
     );
   }
 }
 
+// --- Live preview drawn by the compositor itself ---
+// Reserves this widget's rect with PREVIEW_RECT; the compositor shows the
+// window's own buffer scaled into it, above the shell, at the client's frame
+// rate and with no pixels passing through here.
+class WindowPreview extends StatefulWidget {
+  final String windowId;
+  // "x y w h" the compositor reports in workspace_state.json, or empty
+  final String confirmedRect;
+
+  const WindowPreview({
+    super.key,
+    required this.windowId,
+    required this.confirmedRect,
+  });
+
+  @override
+  State<WindowPreview> createState() => _WindowPreviewState();
+}
+
+class _WindowPreviewState extends State<WindowPreview> {
+  Timer? _timer;
+  String _sentRect = '';
+  String _lastRect = '';
+  int _stableTicks = 0;
+  bool _settling = false;
+
+  @override
+  void initState() {
+    super.initState();
+    // The side panel slides open and cards shift as others undock, so the
+    // rect is re-read rather than taken once
+    if (CompositorIpc.embedded) {
+      // Embedded, the rect is only re-read for a few frames after something
+      // changed: a new state from the compositor or a rebuild
+      CompositorIpc.state.addListener(_settle);
+      _settle();
+      return;
+    }
+    _timer = Timer.periodic(const Duration(milliseconds: 50), (_) => _sync());
+  }
+
+  // Re-reads the rect every frame until it has been sent or confirmed
+  void _settle() {
+    _stableTicks = 0;
+    if (_settling) return;
+    _settling = true;
+    WidgetsBinding.instance.addPostFrameCallback(_onFrame);
+    WidgetsBinding.instance.scheduleFrame();
+  }
+
+  void _onFrame(Duration _) {
+    if (!mounted || _sync()) {
+      _settling = false;
+      return;
+    }
+    WidgetsBinding.instance.addPostFrameCallback(_onFrame);
+    WidgetsBinding.instance.scheduleFrame();
+  }
+
+  // True once there is nothing left to send
+  bool _sync() {
+    final box = context.findRenderObject() as RenderBox?;
+    if (box == null || !box.attached || !box.hasSize) return false;
+    final origin = box.localToGlobal(Offset.zero);
+    final rect =
+        '${origin.dx.round()} ${origin.dy.round()} '
+        '${box.size.width.round()} ${box.size.height.round()}';
+    if (rect == widget.confirmedRect) return true;
+    // Wait for the slide to settle rather than chase it
+    if (rect != _lastRect) {
+      _lastRect = rect;
+      _stableTicks = 0;
+      return false;
+    }
+    if (++_stableTicks < 3) return false;
+    // Queued commands are never lost, so once is enough
+    if (rect == _sentRect) return true;
+    _sentRect = rect;
+    CompositorIpc.sendAction('PREVIEW_RECT', '${widget.windowId} $rect');
+    return true;
+  }
+
+  @override
+  void didUpdateWidget(WindowPreview oldWidget) {
+    super.didUpdateWidget(oldWidget);
+    // The compositor dropped or moved the preview since (say, the shell's
+    // surface was recreated): ask again
+    if (widget.confirmedRect != oldWidget.confirmedRect &&
+        widget.confirmedRect != _sentRect) {
+      _sentRect = '';
+    }
+    if (CompositorIpc.embedded) _settle();
+  }
+
+  @override
+  void dispose() {
+    _timer?.cancel();
+    CompositorIpc.state.removeListener(_settle);
+    // Best effort: the compositor also drops the preview on undock
+    CompositorIpc.sendAction('PREVIEW_RECT', '${widget.windowId} 0 0 0 0');
+    super.dispose();
+  }
+
+  @override
+  Widget build(BuildContext context) {
+    // Letterboxing around the compositor's preview once it is there
+    if (widget.confirmedRect.isNotEmpty) {
+      return Container(color: Colors.black);
+    }
+    return const _PreviewPlaceholder();
+  }
+}
+
 // --- Live polling of the C Compositor's buffer ---
 class WindowThumbnail extends StatefulWidget {
   final String windowId;
+  final int width;
+  final int height;
+  // The compositor stops refreshing thumbnails while idle, so stop reading them
+  final bool paused;
 
-  const WindowThumbnail({super.key, required this.windowId});
+  const WindowThumbnail({
+    super.key,
+    required this.windowId,
+    this.width = 290,
+    this.height = 200,
+    this.paused = false,
+  });
 
   @override
   State<WindowThumbnail> createState() => _WindowThumbnailState();
@@ -330,27 +491,50 @@ class WindowThumbnail extends StatefulWidget {
 class _WindowThumbnailState extends State<WindowThumbnail> {
   ui.Image? _image;
   Timer? _timer;
+  int _ticksSinceRequest = 0;
 
   @override
   void initState() {
     super.initState();
+    _requestSize();
     _startPolling();
   }
 
+  // Ask the compositor to serve this window at our size; it picks the
+  // nearest level of its thumbnail pyramid
+  void _requestSize() {
+    _ticksSinceRequest = 0;
+    CompositorIpc.sendAction(
+      'THUMB',
+      '${widget.windowId} ${widget.width}x${widget.height}',
+    );
+  }
+
   void _startPolling() {
     // Poll at ~30 FPS (every 33ms)
     _timer = Timer.periodic(const Duration(milliseconds: 33), (_) async {
+      if (widget.paused) return;
       try {
-        final file = File('/tmp/thumb_${widget.windowId}.rgba');
+        final file = File(
+          CompositorIpc.thumbnailPath(
+            widget.windowId,
+            widget.width,
+            widget.height,
+          ),
+        );
         if (await file.exists()) {
           final bytes = await file.readAsBytes();
+          if (bytes.length < 8) return;
+          final header = ByteData.sublistView(bytes, 0, 8);
+          final width = header.getUint32(0, Endian.little);
+          final height = header.getUint32(4, Endian.little);
 
-          // Ensure file isn't mid-write (290 * 200 pixels * 4 bytes per pixel)
-          if (bytes.length == 290 * 200 * 4) {
+          // Ensure file isn't mid-write (header + width * height * 4 bytes)
+          if (bytes.length == 8 + width * height * 4) {
             ui.decodeImageFromPixels(
-              bytes,
-              290,
-              200,
+              Uint8List.sublistView(bytes, 8),
+              width,
+              height,
               ui
                   .PixelFormat
                   .bgra8888, // Standard Wayland DRM Little-Endian format
@@ -363,6 +547,10 @@ class _WindowThumbnailState extends State<WindowThumbnail> {
               },
             );
           }
+        } else if (++_ticksSinceRequest >= 30) {
+          // Another action can overwrite ours before the compositor reads
+          // it, so keep asking until the file shows up
+          _requestSize();
         }
       } catch (e) {
         // Suppress read lock errors while C is writing
@@ -380,21 +568,13 @@ class _WindowThumbnailState extends State<WindowThumbnail> {
   @override
   Widget build(BuildContext context) {
     if (_image == null) {
-      return Container(
-        color: Colors.black45,
-        child: const Center(
-          child: CircularProgressIndicator(
-            color: Colors.white24,
-            strokeWidth: 2,
-          ),
-        ),
-      );
+      return const _PreviewPlaceholder();
     }
 
     return RawImage(
       image: _image,
-      width: 290,
-      height: 200,
+      width: widget.width.toDouble(),
+      height: widget.height.toDouble(),
       fit: BoxFit.cover,
       filterQuality: FilterQuality.high,
     );
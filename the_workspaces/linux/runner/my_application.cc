@@ -10,21 +10,38 @@
 struct _MyApplication {
   GtkApplication parent_instance;
   char** dart_entrypoint_arguments;
+  // Running as the desktop shell under tinywl (--shell or
+  // THE_WORKSPACES_SHELL=1): no decorations, fullscreen from the first frame.
+  gboolean shell_mode;
 };
 
 G_DEFINE_TYPE(MyApplication, my_application, GTK_TYPE_APPLICATION)
 
+// Tells tinywl the shell is on screen. The file holds the CLOCK_MONOTONIC
+// time in ns so the compositor can place it on its startup timeline.
+static void report_first_frame_to_compositor() {
+  const gchar* runtime_dir = g_getenv("TINYWL_RUNTIME_DIR");
+  if (runtime_dir == nullptr) {
+    return;
+  }
+  g_autofree gchar* path =
+      g_build_filename(runtime_dir, "shell_ready", nullptr);
+  g_autofree gchar* contents = g_strdup_printf(
+      "%" G_GINT64_FORMAT "\n", g_get_monotonic_time() * 1000);
+  g_autoptr(GError) error = nullptr;
+  if (!g_file_set_contents(path, contents, -1, &error)) {
+    g_warning("Failed to report first frame: %s", error->message);
+  }
+}
+
 // Called when first Flutter frame received.
 static void first_frame_cb(MyApplication* self, FlView* view) {
   gtk_widget_show(gtk_widget_get_toplevel(GTK_WIDGET(view)));
+  report_first_frame_to_compositor();
 }
 
-// Implements GApplication::activate.
-static void my_application_activate(GApplication* application) {
-  MyApplication* self = MY_APPLICATION(application);
-  GtkWindow* window =
-      GTK_WINDOW(gtk_application_window_new(GTK_APPLICATION(application)));
-
+// Regular application window with a title bar.
+static void configure_desktop_window(GtkWindow* window) {
   // Use a header bar when running in GNOME as this is the common style used
   // by applications and is the setup most users will be using (e.g. Ubuntu
   // desktop).
@@ -53,6 +70,45 @@ static void my_application_activate(GApplication* application) {
   }
 
   gtk_window_set_default_size(window, 1280, 720);
+}
+
+// Undecorated, transparent window that is already fullscreen at the output
+// size when it is first mapped, so Flutter's first frame is the final one.
+static void configure_shell_window(GtkWindow* window) {
+  gtk_window_set_title(window, "the_workspaces");
+  gtk_window_set_decorated(window, FALSE);
+
+  GdkScreen* screen = gtk_window_get_screen(window);
+  GdkVisual* visual = gdk_screen_get_rgba_visual(screen);
+  if (visual != nullptr) {
+    gtk_widget_set_visual(GTK_WIDGET(window), visual);
+  }
+  gtk_widget_set_app_paintable(GTK_WIDGET(window), TRUE);
+
+  GdkRectangle geometry = {0, 0, 1280, 720};
+  GdkDisplay* display = gdk_screen_get_display(screen);
+  GdkMonitor* monitor = gdk_display_get_primary_monitor(display);
+  if (monitor == nullptr && gdk_display_get_n_monitors(display) > 0) {
+    monitor = gdk_display_get_monitor(display, 0);
+  }
+  if (monitor != nullptr) {
+    gdk_monitor_get_geometry(monitor, &geometry);
+  }
+  gtk_window_set_default_size(window, geometry.width, geometry.height);
+  gtk_window_fullscreen(window);
+}
+
+// Implements GApplication::activate.
+static void my_application_activate(GApplication* application) {
+  MyApplication* self = MY_APPLICATION(application);
+  GtkWindow* window =
+      GTK_WINDOW(gtk_application_window_new(GTK_APPLICATION(application)));
+
+  if (self->shell_mode) {
+    configure_shell_window(window);
+  } else {
+    configure_desktop_window(window);
+  }
 
   g_autoptr(FlDartProject) project = fl_dart_project_new();
   fl_dart_project_set_dart_entrypoint_arguments(
@@ -61,8 +117,8 @@ static void my_application_activate(GApplication* application) {
   FlView* view = fl_view_new(project);
   GdkRGBA background_color;
   // Background defaults to black, override it here if necessary, e.g. #00000000
-  // for transparent.
-  gdk_rgba_parse(&background_color, "#000000");
+  // for transparent. The shell is transparent so the compositor shows through.
+  gdk_rgba_parse(&background_color, self->shell_mode ? "#00000000" : "#000000");
   fl_view_set_background_color(view, &background_color);
   gtk_widget_show(GTK_WIDGET(view));
   gtk_container_add(GTK_CONTAINER(window), GTK_WIDGET(view));
@@ -83,8 +139,24 @@ static gboolean my_application_local_command_line(GApplication* application,
                                                   gchar*** arguments,
                                                   int* exit_status) {
   MyApplication* self = MY_APPLICATION(application);
-  // Strip out the first argument as it is the binary name.
-  self->dart_entrypoint_arguments = g_strdupv(*arguments + 1);
+  // Strip out the first argument as it is the binary name, and keep
+  // --shell for ourselves.
+  self->shell_mode = g_strcmp0(g_getenv("THE_WORKSPACES_SHELL"), "1") == 0;
+  GPtrArray* dart_args = g_ptr_array_new();
+  for (gchar** arg = *arguments + 1; *arg != nullptr; arg++) {
+    if (g_strcmp0(*arg, "--shell") == 0) {
+      self->shell_mode = TRUE;
+    } else {
+      g_ptr_array_add(dart_args, g_strdup(*arg));
+    }
+  }
+  g_ptr_array_add(dart_args, nullptr);
+  self->dart_entrypoint_arguments =
+      reinterpret_cast<char**>(g_ptr_array_free(dart_args, FALSE));
+  // Let the Dart side know it doesn't need to set up the window itself.
+  if (self->shell_mode) {
+    g_setenv("THE_WORKSPACES_SHELL", "1", TRUE);
+  }
 
   g_autoptr(GError) error = nullptr;
   if (!g_application_register(application, nullptr, &error)) {